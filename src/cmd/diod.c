@@ -62,7 +62,7 @@ static void          _service_run (srvmode_t mode, int rfdno, int wfdno);
 #define NR_OPEN         1048576 /* works on RHEL 5 x86_64 arch */
 #endif
 
-static const char *options = "fr:w:d:l:t:e:Eo:u:SL:nHpc:NU:sv";
+static const char *options = "fr:w:d:l:t:R:e:Eo:u:SL:nHpc:NU:sv";
 
 static const struct option longopts[] = {
     {"foreground",         no_argument,        0, 'f'},
@@ -71,6 +71,7 @@ static const struct option longopts[] = {
     {"debug",              required_argument,  0, 'd'},
     {"listen",             required_argument,  0, 'l'},
     {"nwthreads",          required_argument,  0, 't'},
+    {"nrthreads",          required_argument,  0, 'R'},
     {"export",             required_argument,  0, 'e'},
     {"export-all",         no_argument,        0, 'E'},
     {"export-opts",        required_argument,  0, 'o'},
@@ -98,6 +99,7 @@ usage()
 "   -w,--wfdno              service connected client on write file descriptor\n"
 "   -l,--listen IP:PORT     set interface to listen on (multiple -l allowed)\n"
 "   -t,--nwthreads INT      set number of I/O worker threads to spawn\n"
+"   -R,--nrthreads INT      multiplex connections over INT reactor threads\n"
 "   -e,--export PATH        export PATH (multiple -e allowed)\n"
 "   -E,--export-all         export all mounted file systems\n"
 "   -o,--export-opts        set global export options (comma-seperated)\n"
@@ -202,6 +204,9 @@ main(int argc, char **argv)
             case 't':   /* --nwthreads INT */
                 diod_conf_set_nwthreads (strtoul (optarg, NULL, 10));
                 break;
+            case 'R':   /* --nrthreads INT */
+                diod_conf_set_nrthreads (strtoul (optarg, NULL, 10));
+                break;
             case 'c':   /* --config-file PATH */
                 break;
             case 'e':   /* --export PATH */
@@ -568,6 +573,7 @@ _service_run (srvmode_t mode, int rfdno, int wfdno)
 {
     List l = diod_conf_get_listen ();
     int nwthreads = diod_conf_get_nwthreads ();
+    int nrthreads = diod_conf_get_nrthreads ();
     int flags = diod_conf_get_debuglevel ();
     int n;
 
@@ -673,8 +679,21 @@ _service_run (srvmode_t mode, int rfdno, int wfdno)
     //flags |= SRV_FLAGS_FLUSHSIG;      /* XXX temporarily off */
     if (!diod_conf_get_userdb ())
         flags |= SRV_FLAGS_NOUSERDB;
+    if (diod_conf_get_io_uring ())
+        flags |= SRV_FLAGS_IO_URING;
+    if (diod_conf_get_shm_transport ())
+        flags |= SRV_FLAGS_SHM;
     if (!(ss.srv = np_srv_create (nwthreads, flags))) /* starts threads */
         errn_exit (np_rerror (), "np_srv_create");
+    if (np_srv_set_wthreads (ss.srv, 0, diod_conf_get_nwthreads_max (),
+                             diod_conf_get_nwthreads_export (), 0) < 0)
+        errn_exit (np_rerror (), "np_srv_set_wthreads");
+    np_srv_set_credit (ss.srv, diod_conf_get_maxreqs_conn (),
+                       (u64)diod_conf_get_maxmem_conn () << 20,
+                       diod_conf_get_maxreqs (),
+                       (u64)diod_conf_get_maxmem () << 20);
+    if (nrthreads > 0 && np_reactor_create (ss.srv, nrthreads) < 0)
+        errn_exit (np_rerror (), "np_reactor_create");
     if (diod_init (ss.srv) < 0)
         errn_exit (np_rerror (), "diod_init");
 
@@ -1029,7 +1029,7 @@ done:
     return ret;
 }
 
-static const char *options = "+a:s:m:u:pt";
+static const char *options = "+a:s:m:u:ptS";
 
 static const struct option longopts[] = {
     {"aname",   required_argument,      0, 'a'},
@@ -1038,6 +1038,7 @@ static const struct option longopts[] = {
     {"uid",     required_argument,      0, 'u'},
     {"privport",no_argument,            0, 'p'},
     {"trace",   no_argument,            0, 't'},
+    {"shm",     no_argument,            0, 'S'},
     {0, 0, 0, 0},
 };
 
@@ -1157,6 +1158,7 @@ usage (void)
 "   -u,--uid              authenticate as uid (default is your euid)\n"
 "   -p,--privport         connect from a privileged port (root user only)\n"
 "   -t,--trace            trace 9P protocol on stderr\n"
+"   -S,--shm              use shared memory with a server on a Unix socket\n"
 "Subcommands:\n",
     prog);
     for (int i = 0; i < sizeof (subcmds) / sizeof (subcmds[0]); i++) {
@@ -1208,6 +1210,9 @@ main (int argc, char *argv[])
             case 't':   /* --trace */
                 npc_flags |= NPC_TRACE;
                 break;
+            case 'S':   /* --shm */
+                npc_flags |= NPC_SHM;
+                break;
             default:
                 usage ();
         }
@@ -0,0 +1,561 @@
+/************************************************************\
+ * Copyright 2010 Lawrence Livermore National Security, LLC
+ * (c.f. AUTHORS, NOTICE.LLNS, COPYING)
+ *
+ * This file is part of the diod 9P server project.
+ * For details, see https://github.com/chaos/diod.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+\************************************************************/
+
+/* diod_aio.c - asynchronous file I/O with io_uring
+ *
+ * Each engine thread owns one ring, so submission and completion need no
+ * locking and a worker thread exiting can't cancel I/O it started.
+ * Workers append operations to an engine's queue (round robin across
+ * engines) and wake it by writing an eventfd, which the engine keeps a
+ * read armed on in its ring.  The engine moves queued operations to the
+ * ring, up to AIO_DEPTH in flight, waits for completions, and calls
+ * each operation's callback, which normally responds to a deferred 9P
+ * request (see np_req_defer ()).
+ *
+ * getattr is done with IORING_OP_STATX on the descriptor (AT_EMPTY_PATH),
+ * which needs kernel and libc support for statx.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if HAVE_SYS_SYSMACROS_H
+#include <sys/sysmacros.h>
+#endif
+
+#include "src/libnpfs/npfs.h"
+#include "src/libnpfs/xpthread.h"
+#include "src/libnpfs/uring.h"
+
+#include "diod_log.h"
+#include "diod_aio.h"
+
+#if HAVE_STATX
+/* Tgetattr attributes that a network file system may have to get from the
+ * server.  If none are requested, cached values are good enough.
+ */
+#define GA_SYNC (Gaatime | Gamtime | Gactime | Gasize | Gablocks \
+                 | Gadataversion)
+
+static const struct {
+    u64 ga;
+    unsigned int stx;
+} gamap[] = {
+    { Gamode,           STATX_TYPE | STATX_MODE },
+    { Ganlink,          STATX_NLINK },
+    { Gauid,            STATX_UID },
+    { Gagid,            STATX_GID },
+    { Gardev,           STATX_TYPE },
+    { Gaatime,          STATX_ATIME },
+    { Gamtime,          STATX_MTIME },
+    { Gactime,          STATX_CTIME },
+    { Gaino,            STATX_INO },
+    { Gasize,           STATX_SIZE },
+    { Gablocks,         STATX_BLOCKS },
+    { Gabtime,          STATX_BTIME },
+    { Gadataversion,    STATX_CTIME },
+};
+
+/* The qid always needs the type and inode number.
+ */
+void
+diod_statx_mask (u64 request_mask, unsigned int *mask, int *flags)
+{
+    int i;
+
+    *mask = STATX_TYPE | STATX_INO;
+    for (i = 0; i < sizeof (gamap) / sizeof (gamap[0]); i++) {
+        if ((request_mask & gamap[i].ga))
+            *mask |= gamap[i].stx;
+    }
+    *flags = AT_EMPTY_PATH;
+    if (!(request_mask & GA_SYNC))
+        *flags |= AT_STATX_DONT_SYNC;
+}
+
+/* N.B. data_version is derived from ctime, since Linux does not make the
+ * inode's change attribute available to user space.
+ */
+void
+diod_statx2stat (struct statx *stx, u64 request_mask, struct stat *sb,
+                 struct timespec *btime, u64 *valid)
+{
+    int i;
+
+    memset (sb, 0, sizeof (*sb));
+    sb->st_dev = makedev (stx->stx_dev_major, stx->stx_dev_minor);
+    sb->st_ino = stx->stx_ino;
+    sb->st_mode = stx->stx_mode;
+    sb->st_nlink = stx->stx_nlink;
+    sb->st_uid = stx->stx_uid;
+    sb->st_gid = stx->stx_gid;
+    sb->st_rdev = makedev (stx->stx_rdev_major, stx->stx_rdev_minor);
+    sb->st_size = stx->stx_size;
+    sb->st_blksize = stx->stx_blksize;
+    sb->st_blocks = stx->stx_blocks;
+    sb->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    sb->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    sb->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    sb->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    sb->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    sb->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+    btime->tv_sec = stx->stx_btime.tv_sec;
+    btime->tv_nsec = stx->stx_btime.tv_nsec;
+    *valid = 0;
+    for (i = 0; i < sizeof (gamap) / sizeof (gamap[0]); i++) {
+        if ((stx->stx_mask & gamap[i].stx) == gamap[i].stx)
+            *valid |= gamap[i].ga;
+    }
+    *valid &= request_mask;
+}
+#endif
+
+#if HAVE_NP_URING && defined(IO_URING_OP_SUPPORTED)
+#include <sys/eventfd.h>
+
+#define AIO_DEPTH       256     /* operations in flight per engine */
+
+typedef enum { AIO_READ, AIO_WRITE, AIO_FSYNC, AIO_GETATTR } AioOp;
+
+typedef struct aio_struct *Aio;
+struct aio_struct {
+    AioOp           op;
+    int             fd;
+    void            *buf;
+    size_t          count;
+    off_t           offset;
+    int             datasync;
+    u64             request_mask;
+    struct stat     *sb;
+    struct timespec *btime;
+    u64             *valid;
+#if HAVE_STATX
+    struct statx    stx;
+#endif
+    AioCompletionF  cb;
+    void            *arg;
+    Aio             next;
+};
+
+typedef struct {
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    Aio             head;       /* queued, not yet on the ring */
+    Aio             tail;
+    int             notified;   /* efd written since queue was taken */
+    int             shutdown;
+    int             efd;
+    uint64_t        ebuf;
+    Npuring         ring;
+} Engine;
+
+static Engine *engines = NULL;
+static int nengines = 0;
+static int have_statx = 0;
+static unsigned int next_engine = 0;
+
+static void
+_prep (struct io_uring_sqe *sqe, Aio aio)
+{
+#if HAVE_STATX
+    unsigned int mask;
+    int flags;
+#endif
+
+    switch (aio->op) {
+        case AIO_READ:
+            sqe->opcode = IORING_OP_READ;
+            sqe->len = aio->count;
+            break;
+        case AIO_WRITE:
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->len = aio->count;
+            break;
+        case AIO_FSYNC:
+            sqe->opcode = IORING_OP_FSYNC;
+            if (aio->datasync)
+                sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            break;
+        case AIO_GETATTR:
+#if HAVE_STATX
+            diod_statx_mask (aio->request_mask, &mask, &flags);
+            sqe->opcode = IORING_OP_STATX;
+            sqe->addr = (uintptr_t)"";
+            sqe->len = mask;
+            sqe->statx_flags = flags;
+            sqe->off = (uintptr_t)&aio->stx;
+#endif
+            break;
+    }
+    sqe->fd = aio->fd;
+    if (aio->op == AIO_READ || aio->op == AIO_WRITE) {
+        sqe->addr = (uintptr_t)aio->buf;
+        sqe->off = aio->offset;
+    }
+    sqe->user_data = (uintptr_t)aio;
+}
+
+static void
+_complete (Aio aio, int res)
+{
+#if HAVE_STATX
+    if (aio->op == AIO_GETATTR && res == 0)
+        diod_statx2stat (&aio->stx, aio->request_mask, aio->sb, aio->btime,
+                         aio->valid);
+#endif
+    aio->cb (res, aio->arg);
+    free (aio);
+}
+
+static void *
+_engine_proc (void *a)
+{
+    Engine *e = a;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    Aio aio, bhead = NULL, btail = NULL;
+    int armed = 0, inflight = 0, shutdown, res;
+    sigset_t set;
+
+    /* signals are for the worker threads */
+    sigfillset (&set);
+    pthread_sigmask (SIG_BLOCK, &set, NULL);
+
+    for (;;) {
+        xpthread_mutex_lock (&e->lock);
+        if (e->head) {
+            if (btail)
+                btail->next = e->head;
+            else
+                bhead = e->head;
+            btail = e->tail;
+            e->head = e->tail = NULL;
+        }
+        e->notified = 0;
+        shutdown = e->shutdown;
+        xpthread_mutex_unlock (&e->lock);
+
+        while (bhead && inflight < AIO_DEPTH
+                     && (sqe = np_uring_get_sqe (&e->ring))) {
+            aio = bhead;
+            if (!(bhead = aio->next))
+                btail = NULL;
+            _prep (sqe, aio);
+            inflight++;
+        }
+        if (shutdown && !bhead && inflight == 0 && !armed)
+            break;
+        if (!armed && (sqe = np_uring_get_sqe (&e->ring))) {
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = e->efd;
+            sqe->addr = (uintptr_t)&e->ebuf;
+            sqe->len = sizeof (e->ebuf);
+            sqe->user_data = 0;
+            armed = 1;
+        }
+        /* N.B. EBUSY means completions must be reaped before submitting */
+        if (np_uring_enter (&e->ring, 1) < 0 && np_rerror () != EBUSY
+                                            && np_rerror () != EAGAIN) {
+            errn (np_rerror (), "aio: io_uring_enter");
+            (void)usleep (1000);
+        }
+        while ((cqe = np_uring_peek_cqe (&e->ring))) {
+            aio = (Aio)(uintptr_t)cqe->user_data;
+            res = cqe->res;
+
+            np_uring_cqe_seen (&e->ring);
+            if (!aio) {
+                armed = 0;
+                continue;
+            }
+            inflight--;
+            _complete (aio, res);
+        }
+    }
+    return NULL;
+}
+
+static void
+_engine_wake (Engine *e)
+{
+    uint64_t one = 1;
+
+    /* N.B. can only fail if the counter would overflow, which still wakes */
+    if (write (e->efd, &one, sizeof (one)) < 0)
+        return;
+}
+
+static int
+_submit (Aio aio)
+{
+    Engine *e;
+    int notify;
+
+    e = &engines[__atomic_fetch_add (&next_engine, 1, __ATOMIC_RELAXED)
+                                                            % nengines];
+    aio->next = NULL;
+    xpthread_mutex_lock (&e->lock);
+    if (e->tail)
+        e->tail->next = aio;
+    else
+        e->head = aio;
+    e->tail = aio;
+    notify = !e->notified;
+    e->notified = 1;
+    xpthread_mutex_unlock (&e->lock);
+    if (notify)
+        _engine_wake (e);
+    return 0;
+}
+
+static Aio
+_aio_create (AioOp op, int fd, AioCompletionF cb, void *arg)
+{
+    Aio aio;
+
+    if (nengines == 0) {
+        errno = ENOSYS;
+        return NULL;
+    }
+    if (!(aio = malloc (sizeof (*aio)))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset (aio, 0, sizeof (*aio));
+    aio->op = op;
+    aio->fd = fd;
+    aio->cb = cb;
+    aio->arg = arg;
+    return aio;
+}
+
+int
+diod_aio_read (int fd, void *buf, size_t count, off_t offset,
+               AioCompletionF cb, void *arg)
+{
+    Aio aio;
+
+    if (!(aio = _aio_create (AIO_READ, fd, cb, arg)))
+        return -1;
+    aio->buf = buf;
+    aio->count = count;
+    aio->offset = offset;
+    return _submit (aio);
+}
+
+int
+diod_aio_write (int fd, const void *buf, size_t count, off_t offset,
+                AioCompletionF cb, void *arg)
+{
+    Aio aio;
+
+    if (!(aio = _aio_create (AIO_WRITE, fd, cb, arg)))
+        return -1;
+    aio->buf = (void *)buf;
+    aio->count = count;
+    aio->offset = offset;
+    return _submit (aio);
+}
+
+int
+diod_aio_fsync (int fd, int datasync, AioCompletionF cb, void *arg)
+{
+    Aio aio;
+
+    if (!(aio = _aio_create (AIO_FSYNC, fd, cb, arg)))
+        return -1;
+    aio->datasync = datasync;
+    return _submit (aio);
+}
+
+int
+diod_aio_getattr (int fd, u64 request_mask, struct stat *sb,
+                  struct timespec *btime, u64 *valid,
+                  AioCompletionF cb, void *arg)
+{
+    Aio aio;
+
+    if (!have_statx) {
+        errno = ENOSYS;
+        return -1;
+    }
+    if (!(aio = _aio_create (AIO_GETATTR, fd, cb, arg)))
+        return -1;
+    aio->request_mask = request_mask;
+    aio->sb = sb;
+    aio->btime = btime;
+    aio->valid = valid;
+    return _submit (aio);
+}
+
+int
+diod_aio_enabled (void)
+{
+    return nengines > 0;
+}
+
+static void
+_engine_fini (Engine *e)
+{
+    np_uring_fini (&e->ring);
+    if (e->efd >= 0)
+        (void)close (e->efd);
+    pthread_mutex_destroy (&e->lock);
+}
+
+static int
+_engine_init (Engine *e)
+{
+    memset (e, 0, sizeof (*e));
+    pthread_mutex_init (&e->lock, NULL);
+    e->ring.fd = -1;
+    if ((e->efd = eventfd (0, EFD_CLOEXEC)) < 0) {
+        np_uerror (errno);
+        goto error;
+    }
+    if (np_uring_init (&e->ring, AIO_DEPTH * 2, 0) < 0)
+        goto error;
+    if (!np_uring_probe (&e->ring, IORING_OP_READ)
+            || !np_uring_probe (&e->ring, IORING_OP_WRITE)
+            || !np_uring_probe (&e->ring, IORING_OP_FSYNC)) {
+        np_uerror (ENOSYS);
+        goto error;
+    }
+    return 0;
+error:
+    _engine_fini (e);
+    return -1;
+}
+
+int
+diod_aio_init (int nthreads)
+{
+    int i, err;
+
+    if (nthreads < 1)
+        return 0;
+    NP_ASSERT (nengines == 0);
+    if (!(engines = calloc (nthreads, sizeof (*engines)))) {
+        np_uerror (ENOMEM);
+        return -1;
+    }
+    for (i = 0; i < nthreads; i++) {
+        if (_engine_init (&engines[i]) < 0)
+            goto error;
+        if ((err = pthread_create (&engines[i].thread, NULL, _engine_proc,
+                                   &engines[i]))) {
+            _engine_fini (&engines[i]);
+            np_uerror (err);
+            goto error;
+        }
+        nengines++;
+    }
+#if HAVE_STATX
+    have_statx = np_uring_probe (&engines[0].ring, IORING_OP_STATX);
+#endif
+    return 0;
+error:
+    diod_aio_fini ();
+    return -1;
+}
+
+void
+diod_aio_fini (void)
+{
+    Engine *e;
+    int i;
+
+    for (i = 0; i < nengines; i++) {
+        e = &engines[i];
+        xpthread_mutex_lock (&e->lock);
+        e->shutdown = 1;
+        xpthread_mutex_unlock (&e->lock);
+        _engine_wake (e);
+    }
+    for (i = 0; i < nengines; i++) {
+        e = &engines[i];
+        pthread_join (e->thread, NULL);
+        _engine_fini (e);
+    }
+    free (engines);
+    engines = NULL;
+    nengines = 0;
+    have_statx = 0;
+}
+
+#else
+
+int
+diod_aio_init (int nthreads)
+{
+    if (nthreads < 1)
+        return 0;
+    np_uerror (ENOSYS);
+    return -1;
+}
+
+void
+diod_aio_fini (void)
+{
+}
+
+int
+diod_aio_enabled (void)
+{
+    return 0;
+}
+
+int
+diod_aio_read (int fd, void *buf, size_t count, off_t offset,
+               AioCompletionF cb, void *arg)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int
+diod_aio_write (int fd, const void *buf, size_t count, off_t offset,
+                AioCompletionF cb, void *arg)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int
+diod_aio_fsync (int fd, int datasync, AioCompletionF cb, void *arg)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int
+diod_aio_getattr (int fd, u64 request_mask, struct stat *sb,
+                  struct timespec *btime, u64 *valid,
+                  AioCompletionF cb, void *arg)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
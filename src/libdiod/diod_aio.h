@@ -0,0 +1,59 @@
+/************************************************************\
+ * Copyright 2010 Lawrence Livermore National Security, LLC
+ * (c.f. AUTHORS, NOTICE.LLNS, COPYING)
+ *
+ * This file is part of the diod 9P server project.
+ * For details, see https://github.com/chaos/diod.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+\************************************************************/
+
+#ifndef LIBDIOD_DIOD_AIO_H
+#define LIBDIOD_DIOD_AIO_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "src/libnpfs/npfs.h"
+
+/* Called from an engine thread when the I/O completes, with the result
+ * of the equivalent system call (byte count or 0), or -errno.
+ */
+typedef void (*AioCompletionF)(int res, void *arg);
+
+/* Start/stop 'nthreads' engine threads, each with its own io_uring.
+ * diod_aio_init () fails with ENOSYS if io_uring can't be used, and
+ * diod_aio_fini () waits for queued I/O to complete.
+ */
+int     diod_aio_init (int nthreads);
+void    diod_aio_fini (void);
+int     diod_aio_enabled (void);
+
+/* Queue an I/O on an open file descriptor and return 0.  'cb' is called
+ * exactly once, possibly before these return.  On failure return -1 with
+ * errno set (ENOSYS if the engine is not running or does not support
+ * the operation) and 'cb' is not called.
+ */
+int     diod_aio_read (int fd, void *buf, size_t count, off_t offset,
+                       AioCompletionF cb, void *arg);
+int     diod_aio_write (int fd, const void *buf, size_t count, off_t offset,
+                        AioCompletionF cb, void *arg);
+int     diod_aio_fsync (int fd, int datasync, AioCompletionF cb, void *arg);
+int     diod_aio_getattr (int fd, u64 request_mask, struct stat *sb,
+                          struct timespec *btime, u64 *valid,
+                          AioCompletionF cb, void *arg);
+
+#if HAVE_STATX
+/* Get the statx (2) mask and flags for Tgetattr 'request_mask', and
+ * convert the result, setting 'valid' for the Rgetattr.
+ */
+void    diod_statx_mask (u64 request_mask, unsigned int *mask, int *flags);
+void    diod_statx2stat (struct statx *stx, u64 request_mask,
+                         struct stat *sb, struct timespec *btime, u64 *valid);
+#endif
+
+#endif
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
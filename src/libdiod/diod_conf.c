@@ -56,6 +56,7 @@
 /* ro_mask values to protect attribute from overwrite by config file */
 #define RO_DEBUGLEVEL           0x00000001
 #define RO_NWTHREADS            0x00000002
+#define RO_STATMEMO_USEC        0x00000004
 #define RO_AUTH_REQUIRED        0x00000008
 #define RO_RUNASUID             0x00000010
 #define RO_USERDB               0x00000020
@@ -72,10 +73,36 @@
 #define RO_STATFS_PASSTHRU      0x00010000
 #define RO_AUTH_REQUIRED_CTL    0x00020000
 #define RO_HOSTNAME_LOOKUP      0x00040000
+#define RO_NRTHREADS            0x00080000
+#define RO_NWTHREADS_MAX        0x00100000
+#define RO_NWTHREADS_EXPORT     0x00200000
+#define RO_WEIGHTS              0x00400000
+#define RO_MAXREQS_CONN         0x00800000
+#define RO_MAXMEM_CONN          0x01000000
+#define RO_MAXREQS              0x02000000
+#define RO_MAXMEM               0x04000000
+#define RO_IO_URING             0x08000000
+#define RO_AIO_THREADS          0x10000000
+#define RO_SHM_TRANSPORT        0x20000000
+#define RO_STATCACHE_SIZE       0x40000000
+#define RO_STATCACHE_TTL        0x80000000
 
 typedef struct {
     int          debuglevel;
     int          nwthreads;
+    int          nwthreads_max;
+    int          nwthreads_export;
+    int          nrthreads;
+    int          maxreqs_conn;
+    int          maxmem_conn;
+    int          maxreqs;
+    int          maxmem;
+    int          io_uring;
+    int          aio_threads;
+    int          shm_transport;
+    int          statcache_size;
+    int          statcache_ttl;
+    int          statmemo_usec;
     int          auth_required;
     int          hostname_lookup;
     int          statfs_passthru;
@@ -87,9 +114,10 @@ typedef struct {
     int          exportall;
     char        *exportopts;
     List         exports;
+    List         weights;
     char        *configpath;
     char        *logdest;
-    int          ro_mask;
+    unsigned int ro_mask;
 } Conf;
 
 static Conf config;
@@ -145,6 +173,16 @@ _xcreate_export (char *path)
     return x;
 }
 
+static void
+_destroy_weight (Weight *w)
+{
+    if (w->user)
+        free (w->user);
+    if (w->hosts)
+        hostlist_destroy (w->hosts);
+    free (w);
+}
+
 static void
 _destroy_export (Export *x)
 {
@@ -163,6 +201,19 @@ diod_conf_init (void)
 {
     config.debuglevel = DFLT_DEBUGLEVEL;
     config.nwthreads = DFLT_NWTHREADS;
+    config.nwthreads_max = DFLT_NWTHREADS_MAX;
+    config.nwthreads_export = DFLT_NWTHREADS_EXPORT;
+    config.nrthreads = DFLT_NRTHREADS;
+    config.maxreqs_conn = DFLT_MAXREQS_CONN;
+    config.maxmem_conn = DFLT_MAXMEM_CONN;
+    config.maxreqs = DFLT_MAXREQS;
+    config.maxmem = DFLT_MAXMEM;
+    config.io_uring = DFLT_IO_URING;
+    config.aio_threads = DFLT_AIO_THREADS;
+    config.shm_transport = DFLT_SHM_TRANSPORT;
+    config.statcache_size = DFLT_STATCACHE_SIZE;
+    config.statcache_ttl = DFLT_STATCACHE_TTL;
+    config.statmemo_usec = DFLT_STATMEMO_USEC;
     config.auth_required = DFLT_AUTH_REQUIRED;
     config.hostname_lookup = DFLT_HOSTNAME_LOOKUP;
     config.statfs_passthru = DFLT_STATFS_PASSTHRU;
@@ -175,6 +226,7 @@ diod_conf_init (void)
     config.exports = _xlist_create ((ListDelF)_destroy_export);
     config.exportall = DFLT_EXPORTALL;
     config.exportopts = NULL;
+    config.weights = _xlist_create ((ListDelF)_destroy_weight);
 #if defined(DFLT_CONFIGPATH)
     config.configpath = _xstrdup (DFLT_CONFIGPATH);
 #else
@@ -191,6 +243,8 @@ diod_conf_fini (void)
         list_destroy (config.listen);
     if (config.exports)
         list_destroy (config.exports);
+    if (config.weights)
+        list_destroy (config.weights);
     if (config.configpath)
         free (config.configpath);
     if (config.logdest)
@@ -230,6 +284,7 @@ void diod_conf_set_debuglevel (int i)
 }
 
 /* nwthreads - number of worker threads to spawn in libnpfs
+ *   (the worker pool never shrinks below this)
  */
 int diod_conf_get_nwthreads (void) { return config.nwthreads; }
 int diod_conf_opt_nwthreads (void) { return config.ro_mask & RO_NWTHREADS; }
@@ -239,6 +294,147 @@ void diod_conf_set_nwthreads (int i)
     config.ro_mask |= RO_NWTHREADS;
 }
 
+/* nwthreads_max - limit on worker pool growth (0 = libnpfs default)
+ */
+int diod_conf_get_nwthreads_max (void) { return config.nwthreads_max; }
+int diod_conf_opt_nwthreads_max (void)
+{
+    return config.ro_mask & RO_NWTHREADS_MAX;
+}
+void diod_conf_set_nwthreads_max (int i)
+{
+    config.nwthreads_max = i;
+    config.ro_mask |= RO_NWTHREADS_MAX;
+}
+
+/* nwthreads_export - limit on workers serving one export
+ *   (0 = nwthreads)
+ */
+int diod_conf_get_nwthreads_export (void) { return config.nwthreads_export; }
+int diod_conf_opt_nwthreads_export (void)
+{
+    return config.ro_mask & RO_NWTHREADS_EXPORT;
+}
+void diod_conf_set_nwthreads_export (int i)
+{
+    config.nwthreads_export = i;
+    config.ro_mask |= RO_NWTHREADS_EXPORT;
+}
+
+/* nrthreads - number of reactor threads (0 = thread per connection)
+ */
+int diod_conf_get_nrthreads (void) { return config.nrthreads; }
+int diod_conf_opt_nrthreads (void) { return config.ro_mask & RO_NRTHREADS; }
+void diod_conf_set_nrthreads (int i)
+{
+    config.nrthreads = i;
+    config.ro_mask |= RO_NRTHREADS;
+}
+
+/* maxreqs_conn - limit on outstanding requests per connection (0 = none)
+ */
+int diod_conf_get_maxreqs_conn (void) { return config.maxreqs_conn; }
+int diod_conf_opt_maxreqs_conn (void)
+{
+    return config.ro_mask & RO_MAXREQS_CONN;
+}
+void diod_conf_set_maxreqs_conn (int i)
+{
+    config.maxreqs_conn = i;
+    config.ro_mask |= RO_MAXREQS_CONN;
+}
+
+/* maxmem_conn - limit on MiB of buffered requests per connection (0 = none)
+ */
+int diod_conf_get_maxmem_conn (void) { return config.maxmem_conn; }
+int diod_conf_opt_maxmem_conn (void) { return config.ro_mask & RO_MAXMEM_CONN; }
+void diod_conf_set_maxmem_conn (int i)
+{
+    config.maxmem_conn = i;
+    config.ro_mask |= RO_MAXMEM_CONN;
+}
+
+/* maxreqs - limit on outstanding requests for the server (0 = none)
+ */
+int diod_conf_get_maxreqs (void) { return config.maxreqs; }
+int diod_conf_opt_maxreqs (void) { return config.ro_mask & RO_MAXREQS; }
+void diod_conf_set_maxreqs (int i)
+{
+    config.maxreqs = i;
+    config.ro_mask |= RO_MAXREQS;
+}
+
+/* maxmem - limit on MiB of buffered requests for the server (0 = none)
+ */
+int diod_conf_get_maxmem (void) { return config.maxmem; }
+int diod_conf_opt_maxmem (void) { return config.ro_mask & RO_MAXMEM; }
+void diod_conf_set_maxmem (int i)
+{
+    config.maxmem = i;
+    config.ro_mask |= RO_MAXMEM;
+}
+
+/* io_uring - whether to use io_uring for client sockets
+ */
+int diod_conf_get_io_uring (void) { return config.io_uring; }
+int diod_conf_opt_io_uring (void) { return config.ro_mask & RO_IO_URING; }
+void diod_conf_set_io_uring (int i)
+{
+    config.io_uring = i;
+    config.ro_mask |= RO_IO_URING;
+}
+
+/* aio_threads - number of io_uring threads for file I/O (0 = synchronous)
+ */
+int diod_conf_get_aio_threads (void) { return config.aio_threads; }
+int diod_conf_opt_aio_threads (void) { return config.ro_mask & RO_AIO_THREADS; }
+void diod_conf_set_aio_threads (int i)
+{
+    config.aio_threads = i;
+    config.ro_mask |= RO_AIO_THREADS;
+}
+
+/* shm_transport - whether to offer shared memory rings on Unix sockets
+ */
+int diod_conf_get_shm_transport (void) { return config.shm_transport; }
+int diod_conf_opt_shm_transport (void) { return config.ro_mask & RO_SHM_TRANSPORT; }
+void diod_conf_set_shm_transport (int i)
+{
+    config.shm_transport = i;
+    config.ro_mask |= RO_SHM_TRANSPORT;
+}
+
+/* statcache_size - max attributes cached for statcache exports (0 = none)
+ */
+int diod_conf_get_statcache_size (void) { return config.statcache_size; }
+int diod_conf_opt_statcache_size (void) { return config.ro_mask & RO_STATCACHE_SIZE; }
+void diod_conf_set_statcache_size (int i)
+{
+    config.statcache_size = i;
+    config.ro_mask |= RO_STATCACHE_SIZE;
+}
+
+/* statcache_ttl - milliseconds cached attributes may be used
+ */
+int diod_conf_get_statcache_ttl (void) { return config.statcache_ttl; }
+int diod_conf_opt_statcache_ttl (void) { return config.ro_mask & RO_STATCACHE_TTL; }
+void diod_conf_set_statcache_ttl (int i)
+{
+    config.statcache_ttl = i;
+    config.ro_mask |= RO_STATCACHE_TTL;
+}
+
+/* statmemo_usec - microseconds getattr may use the stat done by the walk
+ * or lopen before it (0 = never)
+ */
+int diod_conf_get_statmemo_usec (void) { return config.statmemo_usec; }
+int diod_conf_opt_statmemo_usec (void) { return config.ro_mask & RO_STATMEMO_USEC; }
+void diod_conf_set_statmemo_usec (int i)
+{
+    config.statmemo_usec = i;
+    config.ro_mask |= RO_STATMEMO_USEC;
+}
+
 /* auth_required - whether to accept unauthenticated attaches
  */
 int diod_conf_get_auth_required (void) { return config.auth_required; }
@@ -355,6 +551,10 @@ _parse_expopt (char *s, int *fp)
             flags |= XFLAGS_SUPPRESS;
         else if (!strcmp (item, "sharefd"))
             flags |= XFLAGS_SHAREFD;
+        else if (!strcmp (item, "statcache"))
+            flags |= XFLAGS_STATCACHE;
+        else if (!strcmp (item, "splice"))
+            flags |= XFLAGS_SPLICE;
         else if (!strcmp (item, "privport"))
             flags |= XFLAGS_PRIVPORT;
         else if (!strcmp (item, "noauth"))
@@ -459,6 +659,50 @@ void diod_conf_set_exportopts(char *opts)
     config.ro_mask |= RO_EXPORTOPTS;
 }
 
+/* weights - list of "user:NAME=N" or "host:HOSTLIST=N" strings giving
+ * a user's or client's share of worker threads relative to others
+ * (default 1).  The first matching entry applies.
+ */
+List diod_conf_get_weights (void) { return config.weights; }
+int diod_conf_opt_weights (void) { return config.ro_mask & RO_WEIGHTS; }
+void diod_conf_clr_weights (void)
+{
+    list_destroy (config.weights);
+    config.weights = _xlist_create ((ListDelF)_destroy_weight);
+    config.ro_mask |= RO_WEIGHTS;
+}
+static Weight *
+_xcreate_weight (char *s)
+{
+    Weight *w;
+    char *cpy, *name, *p;
+
+    if (!(w = malloc (sizeof (*w))))
+        msg_exit ("out of memory");
+    memset (w, 0, sizeof (*w));
+    cpy = _xstrdup (s);
+    if (!(name = strchr (cpy, ':')) || !(p = strrchr (name, '=')))
+        msg_exit ("weights: expected user:NAME=N or host:HOSTLIST=N: %s", s);
+    *name++ = '\0';
+    *p++ = '\0';
+    if ((w->weight = strtoul (p, NULL, 10)) < 1)
+        msg_exit ("weights: weight must be at least 1: %s", s);
+    if (!strcmp (cpy, "user"))
+        w->user = _xstrdup (name);
+    else if (!strcmp (cpy, "host")) {
+        if (!(w->hosts = hostlist_create (name)))
+            msg_exit ("weights: could not parse hostlist: %s", s);
+    } else
+        msg_exit ("weights: expected user:NAME=N or host:HOSTLIST=N: %s", s);
+    free (cpy);
+    return w;
+}
+void diod_conf_add_weights (char *s)
+{
+    _xlist_append (config.weights, _xcreate_weight (s));
+    config.ro_mask |= RO_WEIGHTS;
+}
+
 #if HAVE_CONFIG_FILE
 static int
 _lua_getglobal_int (char *path, lua_State *L, char *key, int *ip)
@@ -636,6 +880,64 @@ diod_conf_init_config_file (char *path) /* FIXME: ENOMEM is fatal */
             config.nwthreads = DFLT_NWTHREADS;
             _lua_getglobal_int (path, L, "nwthreads", &config.nwthreads);
         }
+        if (!(config.ro_mask & RO_NWTHREADS_MAX)) {
+            config.nwthreads_max = DFLT_NWTHREADS_MAX;
+            _lua_getglobal_int (path, L, "nwthreads_max",
+                                &config.nwthreads_max);
+        }
+        if (!(config.ro_mask & RO_NWTHREADS_EXPORT)) {
+            config.nwthreads_export = DFLT_NWTHREADS_EXPORT;
+            _lua_getglobal_int (path, L, "nwthreads_export",
+                                &config.nwthreads_export);
+        }
+        if (!(config.ro_mask & RO_NRTHREADS)) {
+            config.nrthreads = DFLT_NRTHREADS;
+            _lua_getglobal_int (path, L, "nrthreads", &config.nrthreads);
+        }
+        if (!(config.ro_mask & RO_MAXREQS_CONN)) {
+            config.maxreqs_conn = DFLT_MAXREQS_CONN;
+            _lua_getglobal_int (path, L, "maxreqs_conn", &config.maxreqs_conn);
+        }
+        if (!(config.ro_mask & RO_MAXMEM_CONN)) {
+            config.maxmem_conn = DFLT_MAXMEM_CONN;
+            _lua_getglobal_int (path, L, "maxmem_conn", &config.maxmem_conn);
+        }
+        if (!(config.ro_mask & RO_MAXREQS)) {
+            config.maxreqs = DFLT_MAXREQS;
+            _lua_getglobal_int (path, L, "maxreqs", &config.maxreqs);
+        }
+        if (!(config.ro_mask & RO_MAXMEM)) {
+            config.maxmem = DFLT_MAXMEM;
+            _lua_getglobal_int (path, L, "maxmem", &config.maxmem);
+        }
+        if (!(config.ro_mask & RO_IO_URING)) {
+            config.io_uring = DFLT_IO_URING;
+            _lua_getglobal_int (path, L, "io_uring", &config.io_uring);
+        }
+        if (!(config.ro_mask & RO_AIO_THREADS)) {
+            config.aio_threads = DFLT_AIO_THREADS;
+            _lua_getglobal_int (path, L, "aio_threads", &config.aio_threads);
+        }
+        if (!(config.ro_mask & RO_SHM_TRANSPORT)) {
+            config.shm_transport = DFLT_SHM_TRANSPORT;
+            _lua_getglobal_int (path, L, "shm_transport",
+                                &config.shm_transport);
+        }
+        if (!(config.ro_mask & RO_STATCACHE_SIZE)) {
+            config.statcache_size = DFLT_STATCACHE_SIZE;
+            _lua_getglobal_int (path, L, "statcache_size",
+                                &config.statcache_size);
+        }
+        if (!(config.ro_mask & RO_STATCACHE_TTL)) {
+            config.statcache_ttl = DFLT_STATCACHE_TTL;
+            _lua_getglobal_int (path, L, "statcache_ttl",
+                                &config.statcache_ttl);
+        }
+        if (!(config.ro_mask & RO_STATMEMO_USEC)) {
+            config.statmemo_usec = DFLT_STATMEMO_USEC;
+            _lua_getglobal_int (path, L, "statmemo_usec",
+                                &config.statmemo_usec);
+        }
         if (!(config.ro_mask & RO_AUTH_REQUIRED)) {
             config.auth_required = DFLT_AUTH_REQUIRED;
             _lua_getglobal_int (path, L, "auth_required",
@@ -691,6 +993,22 @@ diod_conf_init_config_file (char *path) /* FIXME: ENOMEM is fatal */
             config.exports = _xlist_create ((ListDelF)_destroy_export);
             _lua_getglobal_exports (path, L, &config.exports);
         }
+        if (!(config.ro_mask & RO_WEIGHTS)) {
+            List l = NULL;
+            ListIterator itr;
+            char *s;
+
+            list_destroy (config.weights);
+            config.weights = _xlist_create ((ListDelF)_destroy_weight);
+            if (_lua_getglobal_list_of_strings (path, L, "weights", &l)) {
+                if (!(itr = list_iterator_create (l)))
+                    msg_exit ("out of memory");
+                while ((s = list_next (itr)))
+                    _xlist_append (config.weights, _xcreate_weight (s));
+                list_iterator_destroy (itr);
+                list_destroy (l);
+            }
+        }
         lua_close(L);
     }
 }
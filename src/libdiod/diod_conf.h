@@ -12,9 +12,23 @@
 #define LIBDIOD_DIOD_CONF_H
 
 #include "src/liblsd/list.h"
+#include "src/liblsd/hostlist.h"
 
 #define DFLT_DEBUGLEVEL         0
 #define DFLT_NWTHREADS          16
+#define DFLT_NWTHREADS_MAX      0
+#define DFLT_NWTHREADS_EXPORT   0
+#define DFLT_NRTHREADS          0
+#define DFLT_MAXREQS_CONN       0
+#define DFLT_MAXMEM_CONN        0
+#define DFLT_MAXREQS            0
+#define DFLT_MAXMEM             0
+#define DFLT_IO_URING           0
+#define DFLT_AIO_THREADS        0
+#define DFLT_SHM_TRANSPORT      0
+#define DFLT_STATCACHE_SIZE     4096
+#define DFLT_STATCACHE_TTL      1000
+#define DFLT_STATMEMO_USEC      0
 #define DFLT_MAXMMAP            0
 #define DFLT_AUTH_REQUIRED      1
 #define DFLT_HOSTNAME_LOOKUP    1
@@ -49,6 +63,58 @@ int     diod_conf_get_nwthreads (void);
 int     diod_conf_opt_nwthreads (void);
 void    diod_conf_set_nwthreads (int i);
 
+int     diod_conf_get_nwthreads_max (void);
+int     diod_conf_opt_nwthreads_max (void);
+void    diod_conf_set_nwthreads_max (int i);
+
+int     diod_conf_get_nwthreads_export (void);
+int     diod_conf_opt_nwthreads_export (void);
+void    diod_conf_set_nwthreads_export (int i);
+
+int     diod_conf_get_nrthreads (void);
+int     diod_conf_opt_nrthreads (void);
+void    diod_conf_set_nrthreads (int i);
+
+int     diod_conf_get_maxreqs_conn (void);
+int     diod_conf_opt_maxreqs_conn (void);
+void    diod_conf_set_maxreqs_conn (int i);
+
+int     diod_conf_get_maxmem_conn (void);
+int     diod_conf_opt_maxmem_conn (void);
+void    diod_conf_set_maxmem_conn (int i);
+
+int     diod_conf_get_maxreqs (void);
+int     diod_conf_opt_maxreqs (void);
+void    diod_conf_set_maxreqs (int i);
+
+int     diod_conf_get_maxmem (void);
+int     diod_conf_opt_maxmem (void);
+void    diod_conf_set_maxmem (int i);
+
+int     diod_conf_get_io_uring (void);
+int     diod_conf_opt_io_uring (void);
+void    diod_conf_set_io_uring (int i);
+
+int     diod_conf_get_aio_threads (void);
+int     diod_conf_opt_aio_threads (void);
+void    diod_conf_set_aio_threads (int i);
+
+int     diod_conf_get_shm_transport (void);
+int     diod_conf_opt_shm_transport (void);
+void    diod_conf_set_shm_transport (int i);
+
+int     diod_conf_get_statcache_size (void);
+int     diod_conf_opt_statcache_size (void);
+void    diod_conf_set_statcache_size (int i);
+
+int     diod_conf_get_statcache_ttl (void);
+int     diod_conf_opt_statcache_ttl (void);
+void    diod_conf_set_statcache_ttl (int i);
+
+int     diod_conf_get_statmemo_usec (void);
+int     diod_conf_opt_statmemo_usec (void);
+void    diod_conf_set_statmemo_usec (int i);
+
 int     diod_conf_get_auth_required (void);
 int     diod_conf_opt_auth_required (void);
 void    diod_conf_set_auth_required (int i);
@@ -87,6 +153,8 @@ void    diod_conf_add_listen (char *s);
 #define XFLAGS_SHAREFD      0x04
 #define XFLAGS_PRIVPORT     0x08
 #define XFLAGS_NOAUTH       0x10
+#define XFLAGS_STATCACHE    0x20
+#define XFLAGS_SPLICE       0x40
 
 typedef struct {
     char         *path;
@@ -111,6 +179,17 @@ char   *diod_conf_get_exportopts(void);
 int     diod_conf_opt_exportopts(void);
 void    diod_conf_set_exportopts(char *opts);
 
+typedef struct {
+    char         *user;     /* user name, or NULL */
+    hostlist_t   hosts;     /* client hosts, or NULL */
+    int          weight;
+} Weight;
+
+List    diod_conf_get_weights (void); /* list-o-Weight (caller must NOT free) */
+int     diod_conf_opt_weights (void);
+void    diod_conf_clr_weights (void);
+void    diod_conf_add_weights (char *s);
+
 #endif
 
 /*
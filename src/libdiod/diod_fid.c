@@ -31,6 +31,7 @@
 #include <fcntl.h>
 #include <utime.h>
 #include <stdarg.h>
+#include <time.h>
 
 #include "src/libnpfs/npfs.h"
 #include "src/libnpfs/xpthread.h"
@@ -45,6 +46,7 @@
 #include "diod_fid.h"
 
 /* Allocate local fid struct and attach to fid->aux.
+ * On error, call np_uerror () and return NULL.
  */
 Fid *
 diod_fidalloc (Npfid *fid, Npstr *ns)
@@ -56,11 +58,16 @@ diod_fidalloc (Npfid *fid, Npstr *ns)
         f->flags = 0;
         f->ioctx = NULL;
         f->xattr = NULL;
+        pthread_mutex_init (&f->memo_lock, NULL);
+        f->memo_expires = 0;
         f->path = path_create (fid->conn->srv, ns);
         if (!f->path) {
+            pthread_mutex_destroy (&f->memo_lock);
             free (f);
             f = NULL;
         }
+    } else {
+        np_uerror (ENOMEM);
     }
     fid->aux = f;
 
@@ -80,6 +87,8 @@ diod_fidclone (Npfid *newfid, Npfid *fid)
         nf->flags = f->flags;
         nf->ioctx = NULL;
         nf->xattr = NULL;
+        pthread_mutex_init (&nf->memo_lock, NULL);
+        nf->memo_expires = 0;
         nf->path = path_incref (f->path);
     }
     newfid->aux = nf;
@@ -102,11 +111,61 @@ diod_fiddestroy (Npfid *fid)
             xattr_close (fid);
         if (f->path)
             path_decref (fid->conn->srv, f->path);
+        pthread_mutex_destroy (&f->memo_lock);
         free(f);
         fid->aux = NULL;
     }
 }
 
+static u64
+_now_usec (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+diod_fid_memo_set (Fid *f, struct stat *sb)
+{
+    int usec = diod_conf_get_statmemo_usec ();
+
+    if (usec <= 0)
+        return;
+    xpthread_mutex_lock (&f->memo_lock);
+    memcpy (&f->memo_sb, sb, sizeof (*sb));
+    __atomic_store_n (&f->memo_expires, _now_usec () + usec, __ATOMIC_SEQ_CST);
+    xpthread_mutex_unlock (&f->memo_lock);
+}
+
+/* The memo is used at most once, since the next getattr on the fid may be
+ * to see a change made elsewhere.
+ */
+int
+diod_fid_memo_take (Fid *f, struct stat *sb)
+{
+    u64 expires;
+    int rc = -1;
+
+    if (__atomic_load_n (&f->memo_expires, __ATOMIC_RELAXED) == 0)
+        return -1;
+    xpthread_mutex_lock (&f->memo_lock);
+    expires = __atomic_exchange_n (&f->memo_expires, 0, __ATOMIC_SEQ_CST);
+    if (expires != 0 && _now_usec () < expires) {
+        memcpy (sb, &f->memo_sb, sizeof (*sb));
+        rc = 0;
+    }
+    xpthread_mutex_unlock (&f->memo_lock);
+    return rc;
+}
+
+void
+diod_fid_memo_clear (Fid *f)
+{
+    __atomic_store_n (&f->memo_expires, 0, __ATOMIC_SEQ_CST);
+}
+
 /*
  * vi:tabstop=4 shiftwidth=4 expandtab
  */
@@ -21,18 +21,31 @@
 #define DIOD_FID_FLAGS_MOUNTPT    0x02
 #define DIOD_FID_FLAGS_SHAREFD    0x04
 #define DIOD_FID_FLAGS_XATTR      0x08
+#define DIOD_FID_FLAGS_STATCACHE  0x10
+#define DIOD_FID_FLAGS_SPLICE     0x20
 
 typedef struct {
     Path            path;
     IOCtx           ioctx;
     Xattr           xattr;
     int             flags;
+    pthread_mutex_t memo_lock;    /* protects memo_sb */
+    u64             memo_expires; /* atomic, usec (0 = no memo) */
+    struct stat     memo_sb;
 } Fid;
 
 Fid *diod_fidalloc (Npfid *fid, Npstr *ns);
 Fid *diod_fidclone (Npfid *newfid, Npfid *fid);
 void diod_fiddestroy (Npfid *fid);
 
+/* Remember the stat done by walk or lopen for the getattr that usually
+ * follows, which takes it if it comes within statmemo_usec.  Requests that
+ * change the file clear it.
+ */
+void diod_fid_memo_set (Fid *f, struct stat *sb);
+int  diod_fid_memo_take (Fid *f, struct stat *sb);
+void diod_fid_memo_clear (Fid *f);
+
 #endif
 
 /*
@@ -12,6 +12,7 @@
 #include "config.h"
 #endif
 #include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
@@ -24,6 +25,7 @@
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <pwd.h>
 #include <grp.h>
 #include <dirent.h>
@@ -33,7 +35,6 @@
 
 #include "src/libnpfs/npfs.h"
 #include "src/liblsd/list.h"
-#include "src/liblsd/hash.h"
 #include "src/liblsd/hostlist.h"
 #include "src/libnpfs/xpthread.h"
 
@@ -44,34 +45,79 @@
 #include "diod_xattr.h"
 #include "diod_fid.h"
 #include "diod_ops.h"
+#include "diod_statcache.h"
 
 typedef struct pathpool_struct *PathPool;
 
 struct ioctx_struct {
     pthread_mutex_t lock;
-    int             refcount;
+    int             refcount;   /* protected by path->lock */
     int             fd;
+    dev_t           dev;        /* identity of fd */
+    ino_t           ino;
     DIR             *dir;
     int             lock_type;
     Npqid           qid;
     u32             iounit;
     u32             open_flags;
     Npuser          *user;
+    int             aio_count;  /* asynchronous I/Os in progress */
+    int             aio_close;  /* close when they complete */
     IOCtx           next;
     IOCtx           prev;
 };
 
+typedef struct {
+    IOCtx           ioctx;
+    AioCompletionF  cb;
+    void            *arg;
+} IOCtxAio;
+
+/* A path holds an O_PATH descriptor for the file it names, and a reference
+ * on the path of its parent directory.  Operations can then be made
+ * relative to descriptors rather than resolving 's' from the root.  's' is
+ * the name the path was walked by, which may be stale if a directory above
+ * it has since been renamed.  A path created when paths already hold their
+ * share of descriptors has none, and is resolved by name when used.
+ */
 struct path_struct {
-    pthread_mutex_t lock;
-    int             refcount;
+    pthread_mutex_t lock;       /* protects ioctx list */
+    int             refcount;   /* atomic */
     char            *s;
     int             len;
+    int             fd;         /* O_PATH descriptor, or -1 */
+    dev_t           dev;        /* identity of the file */
+    ino_t           ino;
+    Path            parent;     /* NULL for the root of an export */
+    u32             hash;       /* of s */
+    int             hashed;     /* in ppool (protected by stripe lock) */
+    Path            hnext;      /* ppool bucket chain */
+    Path            hprev;
     IOCtx           ioctx;  /* double-linked list of IOCtx opening this path */
 };
 
-struct pathpool_struct {
+/* Paths are hashed by name into PPOOL_STRIPES stripes, then into a
+ * stripe's buckets, which double when they average more than PPOOL_LOAD
+ * paths.  Walks and clunks of paths in different stripes don't contend.
+ * The descriptors held by paths are limited to 1/PPOOL_FDSHARE of
+ * RLIMIT_NOFILE, so that many fids can't starve open files and sockets.
+ */
+#define PPOOL_STRIPES   16
+#define PPOOL_MINSIZE   16
+#define PPOOL_LOAD      2
+#define PPOOL_FDSHARE   2
+
+typedef struct {
     pthread_mutex_t lock;
-    hash_t          hash;
+    int             size;       /* power of 2 */
+    int             count;
+    Path            *htable;
+} PathStripe;
+
+struct pathpool_struct {
+    PathStripe      stripes[PPOOL_STRIPES];
+    int             nfds;       /* descriptors held by paths (atomic) */
+    int             maxfds;
 };
 
 static void
@@ -101,18 +147,18 @@ _count_ioctx (IOCtx i, int *shared, int *unique)
 {
     for (*unique = *shared = 0; i != NULL; i = i->next) {
         (*unique)++;
-        xpthread_mutex_lock (&i->lock);
         (*shared) += i->refcount;
-        xpthread_mutex_unlock (&i->lock);
     }
 }
 
+/* N.B. An IOCtx is shared only through its path's ioctx list, which
+ * it must leave when the last reference is dropped, so its refcount is
+ * protected by path->lock rather than by its own lock or atomics.
+ */
 static IOCtx
 _ioctx_incref (IOCtx ioctx)
 {
-    xpthread_mutex_lock (&ioctx->lock);
     ioctx->refcount++;
-    xpthread_mutex_unlock (&ioctx->lock);
 
     return ioctx;
 }
@@ -120,13 +166,75 @@ _ioctx_incref (IOCtx ioctx)
 static int
 _ioctx_decref (IOCtx ioctx)
 {
-    int n;
+    NP_ASSERT (ioctx->refcount > 0);
+
+    return --ioctx->refcount;
+}
+
+static int _ioctx_close_destroy (IOCtx ioctx, int seterrno);
+
+/* The last reference to ioctx is gone, but if asynchronous I/O is in
+ * progress, leave the close to _ioctx_aio_done () and return 1.
+ */
+static int
+_ioctx_aio_close (IOCtx ioctx)
+{
+    int busy;
 
     xpthread_mutex_lock (&ioctx->lock);
-    n = --ioctx->refcount;
+    busy = (ioctx->aio_count > 0);
+    if (busy)
+        ioctx->aio_close = 1;
     xpthread_mutex_unlock (&ioctx->lock);
 
-    return n;
+    return busy;
+}
+
+static void
+_ioctx_aio_done (int res, void *arg)
+{
+    IOCtxAio *ia = arg;
+    IOCtx ioctx = ia->ioctx;
+    int close;
+
+    ia->cb (res, ia->arg);
+    free (ia);
+
+    xpthread_mutex_lock (&ioctx->lock);
+    close = (--ioctx->aio_count == 0 && ioctx->aio_close);
+    xpthread_mutex_unlock (&ioctx->lock);
+    if (close)
+        (void)_ioctx_close_destroy (ioctx, 0);
+}
+
+static IOCtxAio *
+_ioctx_aio_start (IOCtx ioctx, AioCompletionF cb, void *arg)
+{
+    IOCtxAio *ia;
+
+    if (!(ia = malloc (sizeof (*ia))))
+        return NULL;
+    ia->ioctx = ioctx;
+    ia->cb = cb;
+    ia->arg = arg;
+    xpthread_mutex_lock (&ioctx->lock);
+    ioctx->aio_count++;
+    xpthread_mutex_unlock (&ioctx->lock);
+
+    return ia;
+}
+
+/* Undo _ioctx_aio_start () if the I/O could not be queued.
+ */
+static void
+_ioctx_aio_abort (IOCtxAio *ia)
+{
+    if (!ia)
+        return;
+    xpthread_mutex_lock (&ia->ioctx->lock);
+    ia->ioctx->aio_count--;
+    xpthread_mutex_unlock (&ia->ioctx->lock);
+    free (ia);
 }
 
 static int
@@ -151,14 +259,16 @@ _ioctx_close_destroy (IOCtx ioctx, int seterrno)
     return rc;
 }
 
+/* Create an ioctx for 'fd', which is closed on failure.
+ */
 static IOCtx
-_ioctx_create_open (Npuser *user, Path path, int flags, u32 mode)
+_ioctx_create (Npuser *user, int fd, int flags, struct stat *sb)
 {
     IOCtx ioctx;
-    struct stat sb;
 
     ioctx = malloc (sizeof (*ioctx));
     if (!ioctx) {
+        (void)close (fd);
         np_uerror (ENOMEM);
         goto error;
     }
@@ -169,22 +279,22 @@ _ioctx_create_open (Npuser *user, Path path, int flags, u32 mode)
     ioctx->open_flags = flags;
     ioctx->user = user;
     np_user_incref (user);
+    ioctx->aio_count = 0;
+    ioctx->aio_close = 0;
     ioctx->prev = ioctx->next = NULL;
-    ioctx->fd = open (path->s, flags, mode);
-    if (ioctx->fd < 0) {
-        np_uerror (errno);
-        goto error;
-    }
-    if (fstat (ioctx->fd, &sb) < 0) {
+    ioctx->fd = fd;
+    if (fstat (ioctx->fd, sb) < 0) {
         np_uerror (errno);
         goto error;
     }
     ioctx->iounit = 0; /* if iounit=0, v9fs will use msize-P9_IOHDRSZ */
-    if (S_ISDIR(sb.st_mode) && !(ioctx->dir = fdopendir (ioctx->fd))) {
+    if (S_ISDIR(sb->st_mode) && !(ioctx->dir = fdopendir (ioctx->fd))) {
         np_uerror (errno);
         goto error;
     }
-    diod_ustat2qid (&sb, &ioctx->qid);
+    ioctx->dev = sb->st_dev;
+    ioctx->ino = sb->st_ino;
+    diod_ustat2qid (sb, &ioctx->qid);
     return ioctx;
 error:
     if (ioctx)
@@ -192,6 +302,21 @@ error:
     return NULL;
 }
 
+static IOCtx
+_ioctx_create_open (Npuser *user, Path path, int flags, u32 mode,
+                    struct stat *sb)
+{
+    char *name;
+    int dirfd = path_at (path, &name);
+    int fd;
+
+    if ((fd = openat (dirfd, name, flags, mode)) < 0) {
+        np_uerror (errno);
+        return NULL;
+    }
+    return _ioctx_create (user, fd, flags, sb);
+}
+
 int
 ioctx_close (Npfid *fid, int seterrno)
 {
@@ -206,7 +331,7 @@ ioctx_close (Npfid *fid, int seterrno)
     if (n == 0)
         _unlink_ioctx (&f->path->ioctx, f->ioctx);
     xpthread_mutex_unlock (&f->path->lock);
-    if (n == 0)
+    if (n == 0 && !_ioctx_aio_close (f->ioctx))
         rc = _ioctx_close_destroy (f->ioctx, seterrno);
     f->ioctx = NULL;
 
@@ -218,6 +343,9 @@ ioctx_open (Npfid *fid, u32 flags, u32 mode)
 {
     Fid *f = fid->aux;
     IOCtx ip = NULL;
+    u64 gen = diod_statcache_gen ();
+    struct stat sb;
+    int created = 0;
 
     NP_ASSERT (f->ioctx == NULL);
 
@@ -236,36 +364,183 @@ ioctx_open (Npfid *fid, u32 flags, u32 mode)
         }
     }
     if (!ip) {
-        if ((ip = _ioctx_create_open (fid->user, f->path, flags, mode)))
+        ip = _ioctx_create_open (fid->user, f->path, flags, mode, &sb);
+        if (ip) {
             _link_ioctx (&f->path->ioctx, ip);
+            created = 1;
+        }
     }
     xpthread_mutex_unlock (&f->path->lock);
     if (!ip)
         goto error;
+    if (created) {
+        if ((f->flags & DIOD_FID_FLAGS_STATCACHE))
+            diod_statcache_put (ip->fd, &sb, gen);
+        diod_fid_memo_set (f, &sb);
+    }
     f->ioctx = ip;
     return 0;
 error:
     return -1;
 }
 
+/* Open fid with 'fd', a descriptor for fid's path that the caller has
+ * already opened (e.g. with O_CREAT).  The descriptor is not shared with
+ * other fids, and is closed on failure.
+ */
+int
+ioctx_open_fd (Npfid *fid, int fd, u32 flags)
+{
+    Fid *f = fid->aux;
+    IOCtx ip;
+    u64 gen = diod_statcache_gen ();
+    struct stat sb;
+
+    NP_ASSERT (f->ioctx == NULL);
+
+    if (!(ip = _ioctx_create (fid->user, fd, flags, &sb)))
+        return -1;
+    xpthread_mutex_lock (&f->path->lock);
+    _link_ioctx (&f->path->ioctx, ip);
+    xpthread_mutex_unlock (&f->path->lock);
+    if ((f->flags & DIOD_FID_FLAGS_STATCACHE))
+        diod_statcache_put (ip->fd, &sb, gen);
+    diod_fid_memo_set (f, &sb);
+    f->ioctx = ip;
+    return 0;
+}
+
 int
 ioctx_pread (IOCtx ioctx, void *buf, size_t count, off_t offset)
 {
     return pread (ioctx->fd, buf, count, offset);
 }
 
+/* Create a Rread with the data spliced rather than copied, if possible.
+ * Returns NULL if the caller should use ioctx_pread () instead.
+ */
+Npfcall *
+ioctx_pread_splice (IOCtx ioctx, Npconn *conn, size_t count, off_t offset)
+{
+    return np_create_rread_splice (conn, ioctx->fd, offset, count);
+}
+
 int
 ioctx_pwrite (IOCtx ioctx, const void *buf, size_t count, off_t offset)
 {
     return pwrite (ioctx->fd, buf, count, offset);
 }
 
+/* Asynchronous versions of ioctx_pread (), ioctx_pwrite (), ioctx_fsync (),
+ * and ioctx_getattr ().  'cb' is called exactly once with the result or
+ * -errno: from a diod_aio.c engine thread, or before returning if the I/O
+ * could not be queued and was done synchronously.  The file stays open
+ * until then, even if ioctx is closed meanwhile.
+ */
+void
+ioctx_pread_async (IOCtx ioctx, void *buf, size_t count, off_t offset,
+                   AioCompletionF cb, void *arg)
+{
+    IOCtxAio *ia;
+    ssize_t n;
+
+    if ((ia = _ioctx_aio_start (ioctx, cb, arg))
+            && diod_aio_read (ioctx->fd, buf, count, offset,
+                              _ioctx_aio_done, ia) == 0)
+        return;
+    _ioctx_aio_abort (ia);
+    n = pread (ioctx->fd, buf, count, offset);
+    cb (n < 0 ? -errno : n, arg);
+}
+
+void
+ioctx_pwrite_async (IOCtx ioctx, const void *buf, size_t count, off_t offset,
+                    AioCompletionF cb, void *arg)
+{
+    IOCtxAio *ia;
+    ssize_t n;
+
+    if ((ia = _ioctx_aio_start (ioctx, cb, arg))
+            && diod_aio_write (ioctx->fd, buf, count, offset,
+                               _ioctx_aio_done, ia) == 0)
+        return;
+    _ioctx_aio_abort (ia);
+    n = pwrite (ioctx->fd, buf, count, offset);
+    cb (n < 0 ? -errno : n, arg);
+}
+
+void
+ioctx_fsync_async (IOCtx ioctx, int datasync, AioCompletionF cb, void *arg)
+{
+    IOCtxAio *ia;
+
+    if ((ia = _ioctx_aio_start (ioctx, cb, arg))
+            && diod_aio_fsync (ioctx->fd, datasync, _ioctx_aio_done, ia) == 0)
+        return;
+    _ioctx_aio_abort (ia);
+    cb (ioctx_fsync (ioctx, datasync) < 0 ? -errno : 0, arg);
+}
+
 int
 ioctx_stat (IOCtx ioctx, struct stat *sb)
 {
     return fstat (ioctx->fd, sb);
 }
 
+#if HAVE_STATX
+/* Stat 'fd' for the attributes in Tgetattr 'request_mask', setting 'valid'
+ * to the ones obtained.
+ */
+static int
+_getattr (int fd, u64 request_mask, struct stat *sb, struct timespec *btime,
+          u64 *valid)
+{
+    struct statx stx;
+    unsigned int mask;
+    int flags;
+
+    diod_statx_mask (request_mask, &mask, &flags);
+    if (statx (fd, "", flags, mask, &stx) < 0)
+        return -1;
+    diod_statx2stat (&stx, request_mask, sb, btime, valid);
+    return 0;
+}
+#else
+static int
+_getattr (int fd, u64 request_mask, struct stat *sb, struct timespec *btime,
+          u64 *valid)
+{
+    if (fstat (fd, sb) < 0)
+        return -1;
+    btime->tv_sec = btime->tv_nsec = 0;
+    *valid = request_mask & (Gabasic | Gadataversion);
+    return 0;
+}
+#endif
+
+int
+ioctx_getattr (IOCtx ioctx, u64 request_mask, struct stat *sb,
+               struct timespec *btime, u64 *valid)
+{
+    return _getattr (ioctx->fd, request_mask, sb, btime, valid);
+}
+
+void
+ioctx_getattr_async (IOCtx ioctx, u64 request_mask, struct stat *sb,
+                     struct timespec *btime, u64 *valid,
+                     AioCompletionF cb, void *arg)
+{
+    IOCtxAio *ia;
+
+    if ((ia = _ioctx_aio_start (ioctx, cb, arg))
+            && diod_aio_getattr (ioctx->fd, request_mask, sb, btime, valid,
+                                 _ioctx_aio_done, ia) == 0)
+        return;
+    _ioctx_aio_abort (ia);
+    cb (_getattr (ioctx->fd, request_mask, sb, btime, valid) < 0 ? -errno : 0,
+        arg);
+}
+
 int
 ioctx_chmod (IOCtx ioctx, u32 mode)
 {
@@ -293,9 +568,9 @@ ioctx_utimensat (IOCtx ioctx, const struct timespec ts[2], int flags)
 
 #else /* HAVE_UTIMENSAT */
 int
-ioctx_utimes (IOCtx ioctx, const utimbuf *times)
+ioctx_utimes (IOCtx ioctx, const struct timeval tv[2])
 {
-    return futimes (ioctx->fd, times);
+    return futimes (ioctx->fd, tv);
 }
 #endif
 
@@ -313,11 +588,10 @@ ioctx_seekdir (IOCtx ioctx, long offset)
         seekdir (ioctx->dir, offset);
 }
 
-/* Modern readdir() is thread-safe, however, if d->off_t is not available,
- * take a lock over readdir() + telldir() so that if there are two threads
+/* Take a lock over readdir() + telldir() so that if there are two threads
  * walking the directory, telldir() returns the offset after this readdir()
- * and not that of a racing thread.  If d->off_t is available, we can avoid
- * taking the lock.
+ * and not that of a racing thread.  The lock also guards the aio fields,
+ * so it is taken whether or not d->d_off is available.
  */
 struct dirent *
 ioctx_readdir(IOCtx ioctx, long *offset)
@@ -328,9 +602,7 @@ ioctx_readdir(IOCtx ioctx, long *offset)
         errno = EINVAL;
         return NULL;
     }
-#ifndef _DIRENT_HAVE_D_OFF
     xpthread_mutex_lock (&ioctx->lock);
-#endif
     if (!(d = readdir (ioctx->dir)))
         goto done;
 #ifndef _DIRENT_HAVE_D_OFF
@@ -338,11 +610,8 @@ ioctx_readdir(IOCtx ioctx, long *offset)
 #else
     *offset = d->d_off;
 #endif
-    xpthread_mutex_unlock (&ioctx->lock);
 done:
-#ifndef _DIRENT_HAVE_D_OFF
     xpthread_mutex_unlock (&ioctx->lock);
-#endif
     return d;
 }
 
@@ -420,14 +689,145 @@ ioctx_qid (IOCtx ioctx)
     return &ioctx->qid;
 }
 
+dev_t
+ioctx_dev (IOCtx ioctx)
+{
+    return ioctx->dev;
+}
+
+ino_t
+ioctx_ino (IOCtx ioctx)
+{
+    return ioctx->ino;
+}
+
 /* N.B. When diod_fidclone() calls path_incref(), the path will not be
- * removed from the pool even though the ppool lock is not held,
+ * removed from the pool even though the stripe lock is not held,
  * because the fid being cloned holds a reference on the path.
  */
 
+/* FNV-1a, then a final mix so that both the stripe (low bits) and
+ * the bucket (the bits above them) are well distributed.
+ */
+static u32
+_path_hash (const char *s, int len)
+{
+    u32 h = 2166136261U;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619U;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+
+    return h;
+}
+
+static inline PathStripe *
+_ppool_stripe (PathPool pp, u32 hash)
+{
+    return &pp->stripes[hash % PPOOL_STRIPES];
+}
+
+static inline Path *
+_ppool_bucket (PathStripe *sp, u32 hash)
+{
+    return &sp->htable[(hash / PPOOL_STRIPES) & (sp->size - 1)];
+}
+
+static Path
+_ppool_lookup (PathStripe *sp, u32 hash, const char *s, int len)
+{
+    Path path;
+
+    /* assert (sp->lock held) */
+    for (path = *_ppool_bucket (sp, hash); path != NULL; path = path->hnext) {
+        if (path->hash == hash && path->len == len
+                               && memcmp (path->s, s, len) == 0)
+            break;
+    }
+
+    return path;
+}
+
+static void
+_ppool_push (Path *head, Path path)
+{
+    path->hnext = *head;
+    path->hprev = NULL;
+    if (*head)
+        (*head)->hprev = path;
+    *head = path;
+}
+
+static void
+_ppool_unlink (PathStripe *sp, Path path)
+{
+    /* assert (sp->lock held) */
+    if (path->hprev)
+        path->hprev->hnext = path->hnext;
+    else
+        *_ppool_bucket (sp, path->hash) = path->hnext;
+    if (path->hnext)
+        path->hnext->hprev = path->hprev;
+    path->hprev = path->hnext = NULL;
+    path->hashed = 0;
+    sp->count--;
+}
+
+/* Double the number of buckets in a stripe.  If memory is short, leave
+ * it as is; chains just get longer.
+ */
+static void
+_ppool_grow (PathStripe *sp)
+{
+    Path *old = sp->htable;
+    int oldsize = sp->size;
+    Path path, next;
+    int i;
+
+    /* assert (sp->lock held) */
+    if (!(sp->htable = calloc (oldsize * 2, sizeof (Path)))) {
+        sp->htable = old;
+        return;
+    }
+    sp->size = oldsize * 2;
+    for (i = 0; i < oldsize; i++) {
+        for (path = old[i]; path != NULL; path = next) {
+            next = path->hnext;
+            _ppool_push (_ppool_bucket (sp, path->hash), path);
+        }
+    }
+    free (old);
+}
+
+static void
+_ppool_link (PathStripe *sp, Path path)
+{
+    /* assert (sp->lock held) */
+    if (sp->count >= sp->size * PPOOL_LOAD)
+        _ppool_grow (sp);
+    _ppool_push (_ppool_bucket (sp, path->hash), path);
+    path->hashed = 1;
+    sp->count++;
+}
+
 static void
-_path_free (Path path)
+_path_free (Npsrv *srv, Path path)
 {
+    PathPool pp = srv->srvaux;
+
+    if (path->fd != -1) {
+        (void)close (path->fd);
+        __atomic_sub_fetch (&pp->nfds, 1, __ATOMIC_RELAXED);
+    }
+    if (path->parent)
+        path_decref (srv, path->parent);
     if (path->s)
         free (path->s);
     pthread_mutex_destroy (&path->lock);
@@ -437,89 +837,228 @@ _path_free (Path path)
 Path
 path_incref (Path path)
 {
-    xpthread_mutex_lock (&path->lock);
-    path->refcount++;
-    xpthread_mutex_unlock (&path->lock);
+    __atomic_add_fetch (&path->refcount, 1, __ATOMIC_RELAXED);
 
     return path;
 }
 
+/* The last reference is only dropped with the stripe lock held, so a
+ * path found in the pool can't be freed while a reference is taken on it.
+ * Other references are dropped without locking.
+ */
 void
 path_decref (Npsrv *srv, Path path)
 {
-    PathPool pp = srv->srvaux;
-    int n;
+    PathStripe *sp = _ppool_stripe (srv->srvaux, path->hash);
+    int n = __atomic_load_n (&path->refcount, __ATOMIC_RELAXED);
 
-    xpthread_mutex_lock (&pp->lock);
-    xpthread_mutex_lock (&path->lock);
-    n = --path->refcount;
-    xpthread_mutex_unlock (&path->lock);
-    if (n == 0)
-        hash_remove (pp->hash, path->s);
-    xpthread_mutex_unlock (&pp->lock);
+    while (n > 1) {
+        if (__atomic_compare_exchange_n (&path->refcount, &n, n - 1, 0,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            return;
+    }
+    xpthread_mutex_lock (&sp->lock);
+    n = __atomic_sub_fetch (&path->refcount, 1, __ATOMIC_ACQ_REL);
+    NP_ASSERT (n >= 0);
+    if (n == 0 && path->hashed)
+        _ppool_unlink (sp, path);
+    xpthread_mutex_unlock (&sp->lock);
     if (n == 0)
-        _path_free (path);
+        _path_free (srv, path);
 }
 
+/* Return a new reference to the pooled path named 's' if it is still
+ * the file identified by 'sb', or NULL.
+ */
 static Path
-_path_alloc (Npsrv *srv, char *s, int len)
+_path_find (Npsrv *srv, char *s, int len, u32 hash, struct stat *sb)
 {
-    PathPool pp = srv->srvaux;
+    PathStripe *sp = _ppool_stripe (srv->srvaux, hash);
     Path path;
 
-    xpthread_mutex_lock (&pp->lock);
-    path = hash_find (pp->hash, s);
-    if (path) {
+    xpthread_mutex_lock (&sp->lock);
+    path = _ppool_lookup (sp, hash, s, len);
+    if (path && path->dev == sb->st_dev && path->ino == sb->st_ino)
         path_incref (path);
+    else
+        path = NULL;
+    xpthread_mutex_unlock (&sp->lock);
+
+    return path;
+}
+
+/* Create a path for 's' from 'fd', an O_PATH descriptor identified by 'sb',
+ * and add it to the pool.  Its directory is 'parent' (if unset, 's' is
+ * absolute), and 's' is that of 'parent' followed by one more component,
+ * as path_at () relies on.  If another thread got there first, use its
+ * path instead.  A pooled path for a file that has since been replaced
+ * under the same name is dropped from the pool, but remains valid for the
+ * fids that still refer to it.  If paths already hold their share of
+ * descriptors, 'fd' is closed and the path is resolved by name when used
+ * (the root of an export always keeps its descriptor).  's' and 'fd' are
+ * consumed.
+ */
+static Path
+_path_alloc (Npsrv *srv, Path parent, char *s, int len, u32 hash, int fd,
+             struct stat *sb)
+{
+    PathPool pp = srv->srvaux;
+    PathStripe *sp = _ppool_stripe (pp, hash);
+    Path path, old;
+
+    if (!(path = malloc (sizeof (*path)))) {
+        np_uerror (ENOMEM);
+        (void)close (fd);
         free (s);
-    } else {
-        NP_ASSERT (errno == 0);
-        if (!(path = malloc (sizeof (*path)))) {
-            free (s);
-            goto error;
-        }
-        path->refcount = 1;
-        pthread_mutex_init (&path->lock, NULL);
-        path->s = s;
-        path->len = len;
-        path->ioctx = NULL;
-        if (!hash_insert (pp->hash, path->s, path)) {
-            NP_ASSERT (errno == ENOMEM);
-            goto error;
+        return NULL;
+    }
+    if (__atomic_add_fetch (&pp->nfds, 1, __ATOMIC_RELAXED) > pp->maxfds
+                                                                && parent) {
+        __atomic_sub_fetch (&pp->nfds, 1, __ATOMIC_RELAXED);
+        (void)close (fd);
+        fd = -1;
+    }
+    path->refcount = 1;
+    pthread_mutex_init (&path->lock, NULL);
+    path->s = s;
+    path->len = len;
+    path->fd = fd;
+    path->dev = sb->st_dev;
+    path->ino = sb->st_ino;
+    path->parent = parent ? path_incref (parent) : NULL;
+    path->hash = hash;
+    path->hashed = 0;
+    path->hnext = path->hprev = NULL;
+    path->ioctx = NULL;
+
+    xpthread_mutex_lock (&sp->lock);
+    if ((old = _ppool_lookup (sp, hash, s, len))) {
+        if (old->dev == path->dev && old->ino == path->ino) {
+            path_incref (old);
+            xpthread_mutex_unlock (&sp->lock);
+            _path_free (srv, path);
+            return old;
         }
+        _ppool_unlink (sp, old);
     }
-    xpthread_mutex_unlock (&pp->lock);
+    _ppool_link (sp, path);
+    xpthread_mutex_unlock (&sp->lock);
+
     return path;
-error:
-    xpthread_mutex_unlock (&pp->lock);
-    if (path)
-        _path_free (path);
-    return NULL;
 }
 
+/* Create a path for the root of an export.  Symbolic links are followed.
+ * On error, call np_uerror () and return NULL.
+ */
 Path
 path_create (Npsrv *srv, Npstr *ns)
 {
+    struct stat sb;
     char *s;
+    int fd;
 
-    if (!(s = np_strdup (ns)))
+    if (!(s = np_strdup (ns))) {
+        np_uerror (ENOMEM);
         return NULL;
-    return _path_alloc (srv, s, ns->len);
+    }
+    if ((fd = open (s, O_PATH | O_CLOEXEC)) < 0 || fstat (fd, &sb) < 0) {
+        np_uerror (errno);
+        if (fd != -1)
+            (void)close (fd);
+        free (s);
+        return NULL;
+    }
+    return _path_alloc (srv, NULL, s, ns->len, _path_hash (s, ns->len), fd,
+                        &sb);
 }
 
+/* Walk from directory 'dir' to its entry 'ns', which is not followed if
+ * it is a symbolic link, and return the entry's path and attributes.
+ * On error, call np_uerror () and return NULL.
+ */
 Path
-path_append (Npsrv *srv, Path opath, Npstr *ns)
+path_walk (Npsrv *srv, Path dir, Npstr *ns, struct stat *sb)
 {
-    char *s;
-    int len = opath->len + 1 + ns->len;
+    Path path;
+    char *s, *name;
+    int len = dir->len + 1 + ns->len;
+    u32 hash;
+    int fd, dirfd;
 
-    if (!(s = malloc (len + 1)))
+    if (!(s = malloc (len + 1))) {
+        np_uerror (ENOMEM);
         return NULL;
-    memcpy (s, opath->s, opath->len);
-    s[opath->len] = '/';
-    memcpy (s + opath->len + 1, ns->str, ns->len);
+    }
+    memcpy (s, dir->s, dir->len);
+    s[dir->len] = '/';
+    memcpy (s + dir->len + 1, ns->str, ns->len);
     s[len] = '\0';
-    return _path_alloc (srv, s, len);
+    name = s + dir->len + 1;
+
+    if ((dirfd = path_getfd (dir)) < 0) {
+        np_uerror (errno);
+        goto error;
+    }
+    if (fstatat (dirfd, name, sb, AT_SYMLINK_NOFOLLOW) < 0) {
+        np_uerror (errno);
+        goto error;
+    }
+    hash = _path_hash (s, len);
+    if ((path = _path_find (srv, s, len, hash, sb))) {
+        path_putfd (dir, dirfd);
+        free (s);
+        return path;
+    }
+    if ((fd = openat (dirfd, name, O_PATH | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+        np_uerror (errno);
+        goto error;
+    }
+    if (fstat (fd, sb) < 0) { /* entry may have changed since fstatat */
+        np_uerror (errno);
+        (void)close (fd);
+        goto error;
+    }
+    path_putfd (dir, dirfd);
+    return _path_alloc (srv, dir, s, len, hash, fd, sb);
+error:
+    if (dirfd >= 0)
+        path_putfd (dir, dirfd);
+    free (s);
+    return NULL;
+}
+
+/* Walk from directory 'dir' through up to 'nwname' entries, as path_walk ()
+ * would one at a time.  The walk stops after an entry that is not a
+ * directory, or that is on a different device than its parent (a mount
+ * point).  Return the path of the last entry walked, with their number in
+ * '*np' and the attributes of each in 'sbs'.  Each path holds a reference
+ * on the one before it, so entries share their parent's path and its
+ * descriptor.  If the first entry can't be walked, call np_uerror () and
+ * return NULL.
+ */
+Path
+path_walkn (Npsrv *srv, Path dir, int nwname, Npstr *wnames,
+            struct stat *sbs, int *np)
+{
+    Path path = dir, npath;
+    dev_t dev = dir->dev;
+    int n;
+
+    for (n = 0; n < nwname; ) {
+        if (!(npath = path_walk (srv, path, &wnames[n], &sbs[n])))
+            break;
+        if (path != dir)
+            path_decref (srv, path); /* npath holds a reference on it */
+        path = npath;
+        n++;
+        if (!S_ISDIR (sbs[n - 1].st_mode) || sbs[n - 1].st_dev != dev)
+            break;
+        dev = sbs[n - 1].st_dev;
+    }
+    if (n == 0)
+        return NULL;
+    *np = n;
+    return path;
 }
 
 char *
@@ -528,21 +1067,156 @@ path_s (Path path)
     return path->s;
 }
 
+/* Return an O_PATH descriptor for path, for use with fstat (), fstatvfs (),
+ * and as the directory argument of the *at () system calls.  If the path
+ * holds none, open one by name, and fail with ESTALE if the name now refers
+ * to another file.  Release it with path_putfd ().  On error, set errno
+ * and return -1.
+ */
+int
+path_getfd (Path path)
+{
+    struct stat sb;
+    char *name;
+    int dirfd, fd;
+
+    if (path->fd != -1)
+        return path->fd;
+    dirfd = path_at (path, &name);
+    if ((fd = openat (dirfd, name, O_PATH | O_NOFOLLOW | O_CLOEXEC)) < 0)
+        return -1;
+    if (fstat (fd, &sb) < 0 || sb.st_dev != path->dev
+                            || sb.st_ino != path->ino) {
+        (void)close (fd);
+        errno = ESTALE;
+        return -1;
+    }
+    return fd;
+}
+
+void
+path_putfd (Path path, int fd)
+{
+    if (fd != path->fd)
+        (void)close (fd);
+}
+
+/* Return the directory descriptor and name to pass to *at () system calls
+ * that operate on path itself, e.g. unlinkat () or fchmodat ().  If the
+ * parent holds no descriptor, that of the nearest directory above it that
+ * does is returned, with the rest of 's' below it as the name.
+ */
+int
+path_at (Path path, char **namep)
+{
+    Path p;
+
+    for (p = path->parent; p != NULL; p = p->parent) {
+        if (p->fd != -1) {
+            *namep = path->s + p->len + 1;
+            return p->fd;
+        }
+    }
+    *namep = path->s;
+    return AT_FDCWD;
+}
+
+/* Format in 'buf' a name for path itself, for system calls that have no
+ * *at () form, e.g. lsetxattr ().  It names the directory of path_at () by
+ * its descriptor under /proc/self/fd, so renames above it don't matter.
+ * On error, set errno and return NULL.
+ */
+char *
+path_procname (Path path, char *buf, int size)
+{
+    char *name;
+    int dirfd = path_at (path, &name);
+    int n;
+
+    if (dirfd == AT_FDCWD)
+        n = snprintf (buf, size, "%s", name);
+    else
+        n = snprintf (buf, size, "/proc/self/fd/%d/%s", dirfd, name);
+    if (n >= size) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    return buf;
+}
+
+Path
+path_parent (Path path)
+{
+    return path->parent;
+}
+
+dev_t
+path_dev (Path path)
+{
+    return path->dev;
+}
+
+ino_t
+path_ino (Path path)
+{
+    return path->ino;
+}
+
+int
+path_getattr (Path path, u64 request_mask, struct stat *sb,
+              struct timespec *btime, u64 *valid)
+{
+    int fd, rc;
+
+    if ((fd = path_getfd (path)) < 0)
+        return -1;
+    rc = _getattr (fd, request_mask, sb, btime, valid);
+    path_putfd (path, fd);
+    return rc;
+}
+
 typedef struct {
     int len;
     char *s;
 } DynStr;
 
-static int
-_get_one_file (Path path, char *s, DynStr *ds)
+static void
+_get_one_file (Path path, DynStr *ds)
 {
     int unique, shared;
 
     xpthread_mutex_lock (&path->lock);
     _count_ioctx (path->ioctx, &shared, &unique);
-    aspf (&ds->s, &ds->len, "%d %d %d %s\n", path->refcount, shared, unique, s);
+    aspf (&ds->s, &ds->len, "%d %d %d %s\n",
+          __atomic_load_n (&path->refcount, __ATOMIC_RELAXED),
+          shared, unique, path->s);
     xpthread_mutex_unlock (&path->lock);
-    return 0;
+}
+
+/* Take a reference on each path in a stripe, then format them without
+ * holding the stripe lock, so a dump doesn't stall walks and clunks.
+ */
+static void
+_ppool_dump_stripe (Npsrv *srv, PathStripe *sp, DynStr *ds)
+{
+    Path *snap, path;
+    int i, n = 0;
+
+    xpthread_mutex_lock (&sp->lock);
+    if (!(snap = malloc (sizeof (Path) * (sp->count + 1)))) {
+        xpthread_mutex_unlock (&sp->lock);
+        return;
+    }
+    for (i = 0; i < sp->size; i++) {
+        for (path = sp->htable[i]; path != NULL; path = path->hnext)
+            snap[n++] = path_incref (path);
+    }
+    xpthread_mutex_unlock (&sp->lock);
+    for (i = 0; i < n; i++) {
+        _get_one_file (snap[i], ds);
+        path_decref (srv, snap[i]);
+    }
+    free (snap);
 }
 
 static char *
@@ -551,10 +1225,10 @@ _ppool_dump (char *name, void *a)
     Npsrv *srv = a;
     PathPool pp = srv->srvaux;
     DynStr ds = { .s = NULL, .len = 0 };
+    int i;
 
-    xpthread_mutex_lock (&pp->lock);
-    hash_for_each (pp->hash, (hash_arg_f)_get_one_file, &ds);
-    xpthread_mutex_unlock (&pp->lock);
+    for (i = 0; i < PPOOL_STRIPES; i++)
+        _ppool_dump_stripe (srv, &pp->stripes[i], &ds);
 
     return ds.s;
 }
@@ -563,14 +1237,16 @@ void
 ppool_fini (Npsrv *srv)
 {
     PathPool pp = srv->srvaux;
+    int i;
 
     if (pp) {
-        if (pp->hash) {
-            /* issue 99: this triggers when shutting down with active clients */
-            /*NP_ASSERT (hash_is_empty (pp->hash));*/
-            hash_destroy (pp->hash);
+        for (i = 0; i < PPOOL_STRIPES; i++) {
+            /* issue 99: paths remain when shutting down with active clients */
+            /*NP_ASSERT (pp->stripes[i].count == 0);*/
+            if (pp->stripes[i].htable)
+                free (pp->stripes[i].htable);
+            pthread_mutex_destroy (&pp->stripes[i].lock);
         }
-        pthread_mutex_destroy (&pp->lock);
         free (pp);
     }
     srv->srvaux = NULL;
@@ -580,19 +1256,30 @@ int
 ppool_init (Npsrv *srv)
 {
     PathPool pp;
+    PathStripe *sp;
+    struct rlimit r;
+    int i;
 
     if (!(pp = malloc (sizeof (*pp))))
         goto error;
-
-    pthread_mutex_init (&pp->lock, NULL);
-    pp->hash = hash_create (1000,
-                            (hash_key_f)hash_key_string,
-                            (hash_cmp_f)strcmp, NULL);
-    if (!pp->hash) {
-        free (pp);
-        goto error;
+    pp->nfds = 0;
+    if (getrlimit (RLIMIT_NOFILE, &r) < 0 || r.rlim_cur == RLIM_INFINITY
+            || r.rlim_cur / PPOOL_FDSHARE > INT_MAX)
+        pp->maxfds = INT_MAX;
+    else
+        pp->maxfds = r.rlim_cur / PPOOL_FDSHARE;
+    for (i = 0; i < PPOOL_STRIPES; i++) {
+        sp = &pp->stripes[i];
+        pthread_mutex_init (&sp->lock, NULL);
+        sp->size = PPOOL_MINSIZE;
+        sp->count = 0;
+        sp->htable = calloc (sp->size, sizeof (Path));
     }
     srv->srvaux = pp;
+    for (i = 0; i < PPOOL_STRIPES; i++) {
+        if (!pp->stripes[i].htable)
+            goto error;
+    }
     if (!np_ctl_addfile (srv->ctlroot, "files", _ppool_dump, srv, 0))
         goto error;
     return 0;
@@ -12,7 +12,10 @@
 #define LIBDIOD_DIOD_IOCTX_H
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include "src/libnpfs/npfs.h"
+#include "diod_aio.h"
 
 typedef struct path_struct *Path;
 typedef struct ioctx_struct *IOCtx;
@@ -21,14 +24,28 @@ int     ppool_init (Npsrv *srv);
 void    ppool_fini (Npsrv *srv);
 
 Path    path_create (Npsrv *srv, Npstr *ns);
-Path    path_append (Npsrv *srv, Path opath, Npstr *ns);
+Path    path_walk (Npsrv *srv, Path dir, Npstr *ns, struct stat *sb);
+Path    path_walkn (Npsrv *srv, Path dir, int nwname, Npstr *wnames,
+                    struct stat *sbs, int *np);
 Path    path_incref (Path path);
 void    path_decref (Npsrv *srv, Path path);
 char    *path_s (Path path);
+int     path_getfd (Path path);
+void    path_putfd (Path path, int fd);
+int     path_at (Path path, char **namep);
+char    *path_procname (Path path, char *buf, int size);
+Path    path_parent (Path path);
+dev_t   path_dev (Path path);
+ino_t   path_ino (Path path);
+int     path_getattr (Path path, u64 request_mask, struct stat *sb,
+                      struct timespec *btime, u64 *valid);
 
 int     ioctx_open (Npfid *fid, u32 flags, u32 mode);
+int     ioctx_open_fd (Npfid *fid, int fd, u32 flags);
 int     ioctx_close (Npfid *fid, int seterrno);
 int     ioctx_pread (IOCtx ioctx, void *buf, size_t count, off_t offset);
+Npfcall *ioctx_pread_splice (IOCtx ioctx, Npconn *conn, size_t count,
+                             off_t offset);
 int     ioctx_pwrite (IOCtx ioctx, const void *buf, size_t count, off_t offset);
 struct dirent *ioctx_readdir(IOCtx ioctx, long *new_offset);
 void    ioctx_rewinddir (IOCtx ioctx);
@@ -38,18 +55,36 @@ int     ioctx_flock (IOCtx ioctx, int operation);
 int     ioctx_testlock (IOCtx ioctx, int operation);
 
 int     ioctx_stat (IOCtx ioctx, struct stat *sb);
+
+/* Stat for Tgetattr 'request_mask', setting 'valid' for the Rgetattr.
+ */
+int     ioctx_getattr (IOCtx ioctx, u64 request_mask, struct stat *sb,
+                       struct timespec *btime, u64 *valid);
+
+void    ioctx_pread_async (IOCtx ioctx, void *buf, size_t count, off_t offset,
+                           AioCompletionF cb, void *arg);
+void    ioctx_pwrite_async (IOCtx ioctx, const void *buf, size_t count,
+                            off_t offset, AioCompletionF cb, void *arg);
+void    ioctx_fsync_async (IOCtx ioctx, int datasync, AioCompletionF cb,
+                           void *arg);
+void    ioctx_getattr_async (IOCtx ioctx, u64 request_mask, struct stat *sb,
+                             struct timespec *btime, u64 *valid,
+                             AioCompletionF cb, void *arg);
+
 int     ioctx_chmod (IOCtx ioctx, u32 mode);
 int     ioctx_chown (IOCtx ioctx, u32 uid, u32 gid);
 int     ioctx_truncate (IOCtx ioctx, u64 size);
 #if HAVE_UTIMENSAT
 int     ioctx_utimensat (IOCtx ioctx, const struct timespec ts[2], int flags);
 #else
-int     ioctx_utimes (IOCtx ioctx, const utimbuf *times);
+int     ioctx_utimes (IOCtx ioctx, const struct timeval tv[2]);
 #endif
 
 
 u32     ioctx_iounit (IOCtx ioctx);
 Npqid   *ioctx_qid (IOCtx ioctx);
+dev_t   ioctx_dev (IOCtx ioctx);
+ino_t   ioctx_ino (IOCtx ioctx);
 
 #endif
 
@@ -103,6 +103,8 @@
 #include "diod_ops.h"
 #include "diod_exp.h"
 #include "diod_ioctx.h"
+#include "diod_aio.h"
+#include "diod_statcache.h"
 #include "diod_xattr.h"
 #include "diod_fid.h"
 
@@ -116,6 +118,8 @@
 Npfcall     *diod_attach (Npfid *fid, Npfid *afid, Npstr *aname);
 int          diod_clone  (Npfid *fid, Npfid *newfid);
 int          diod_walk   (Npfid *fid, Npstr *wname, Npqid *wqid);
+int          diod_walkn  (Npfid *fid, int nwname, Npstr *wnames,
+                          Npqid *wqids);
 Npfcall     *diod_read   (Npfid *fid, u64 offset, u32 count, Npreq *req);
 Npfcall     *diod_write  (Npfid *fid, u64 offset, u32 count, u8 *data,
                           Npreq *req);
@@ -131,11 +135,11 @@ Npfcall     *diod_mknod(Npfid *dfid, Npstr *name, u32 mode, u32 major,
                         u32 minor, u32 gid);
 Npfcall     *diod_rename (Npfid *fid, Npfid *dfid, Npstr *name);
 Npfcall     *diod_readlink(Npfid *fid);
-Npfcall     *diod_getattr(Npfid *fid, u64 request_mask);
+Npfcall     *diod_getattr(Npfid *fid, u64 request_mask, Npreq *req);
 Npfcall     *diod_setattr (Npfid *fid, u32 valid, u32 mode, u32 uid, u32 gid, u64 size,
                         u64 atime_sec, u64 atime_nsec, u64 mtime_sec, u64 mtime_nsec);
 Npfcall     *diod_readdir(Npfid *fid, u64 offset, u32 count, Npreq *req);
-Npfcall     *diod_fsync (Npfid *fid, u32 datasync);
+Npfcall     *diod_fsync (Npfid *fid, u32 datasync, Npreq *req);
 Npfcall     *diod_lock (Npfid *fid, u8 type, u32 flags, u64 start, u64 length,
                         u32 proc_id, Npstr *client_id);
 Npfcall     *diod_getlock (Npfid *fid, u8 type, u64 start, u64 length,
@@ -147,6 +151,7 @@ Npfcall     *diod_xattrcreate (Npfid *fid, Npstr *name, u64 attr_size,
                                u32 flags);
 int          diod_remapuser (Npfid *fid);
 int          diod_exportok (Npfid *fid);
+int          diod_flow_weight (Npconn *conn, Npuser *user);
 int          diod_auth_required (Npstr *uname, u32 n_uname, Npstr *aname);
 char        *diod_get_path (Npfid *fid);
 char        *diod_get_files (char *name, void *a);
@@ -162,6 +167,7 @@ diod_init (Npsrv *srv)
     srv->logmsg = diod_log_buf;
     srv->remapuser = diod_remapuser;
     srv->exportok = diod_exportok;
+    srv->flow_weight = diod_flow_weight;
     srv->auth_required = diod_auth_required;
     srv->auth = diod_auth_functions;
     srv->get_path = diod_get_path;
@@ -169,6 +175,7 @@ diod_init (Npsrv *srv)
     srv->attach = diod_attach;
     srv->clone = diod_clone;
     srv->walk = diod_walk;
+    srv->walkn = diod_walkn;
     srv->read = diod_read;
     srv->write = diod_write;
     srv->clunk = diod_clunk;
@@ -197,6 +204,20 @@ diod_init (Npsrv *srv)
         goto error;
     if (ppool_init (srv) < 0)
         goto error;
+    if (diod_aio_init (diod_conf_get_aio_threads ()) < 0) {
+        if (np_rerror () != ENOSYS)
+            goto error;
+        msg ("io_uring unavailable, using synchronous file I/O");
+    }
+    if (!np_ctl_addfile (srv->ctlroot, "statcache", diod_statcache_ctl_get,
+                         NULL, 0))
+        goto error;
+    if (diod_statcache_init (diod_conf_get_statcache_size (),
+                             diod_conf_get_statcache_ttl ()) < 0) {
+        if (np_rerror () != ENOSYS)
+            goto error;
+        msg ("inotify unavailable, not caching attributes");
+    }
     return 0;
 error:
     diod_fini (srv);
@@ -206,9 +227,132 @@ error:
 void
 diod_fini (Npsrv *srv)
 {
+    diod_statcache_fini ();
+    diod_aio_fini ();
     ppool_fini (srv);
 }
 
+/* With aio_threads > 0, reads, writes, fsyncs, and getattrs on open
+ * files are deferred (see np_req_defer ()) while their I/O is queued
+ * to diod_aio.c, and the response is sent from the completion callback.
+ */
+typedef struct {
+    Npreq       *req;
+    Npfcall     *rc;            /* Tread: Rread being filled */
+    u64         request_mask;   /* Tgetattr */
+    struct stat sb;             /* Tgetattr */
+    struct timespec btime;
+    u64         valid;
+    Path        path;           /* Tgetattr: cache sb for path, or NULL */
+    u64         gen;
+    dev_t       dev;            /* Twrite, Tfsync: file to uncache */
+    ino_t       ino;
+} AioReq;
+
+static AioReq *
+_aioreq_create (Npreq *req)
+{
+    AioReq *ar;
+
+    if (!(ar = malloc (sizeof (*ar)))) {
+        np_uerror (ENOMEM);
+        return NULL;
+    }
+    ar->req = req;
+    ar->rc = NULL;
+    ar->path = NULL;
+    np_req_defer (req);
+    return ar;
+}
+
+static void
+_aioreq_complete (AioReq *ar, Npfcall *rc, int ecode)
+{
+    np_req_complete (ar->req, rc, ecode);
+    free (ar);
+}
+
+/* With the statcache export option, getattr responses may come from
+ * diod_statcache.c.  Attributes are cached by walk, open, and getattr,
+ * and operations that change a file or directory uncache it.
+ */
+static int
+_statcache_get (Fid *f, struct stat *sb)
+{
+    if (f->ioctx)
+        return diod_statcache_get (ioctx_dev (f->ioctx), ioctx_ino (f->ioctx),
+                                   sb);
+    return diod_statcache_get (path_dev (f->path), path_ino (f->path), sb);
+}
+
+/* N.B. The name a path was walked by may now refer to another file.
+ */
+static void
+_statcache_put (Path path, struct stat *sb, u64 gen)
+{
+    int fd;
+
+    if (sb->st_dev != path_dev (path) || sb->st_ino != path_ino (path))
+        return;
+    if ((fd = path_getfd (path)) < 0)
+        return;
+    diod_statcache_put (fd, sb, gen);
+    path_putfd (path, fd);
+}
+
+/* Names a user failed to walk are cached too, per directory and user,
+ * and uncaching the directory forgets them.
+ */
+static int
+_statcache_get_neg (Npfid *fid, Npstr *name)
+{
+    Fid *f = fid->aux;
+
+    return diod_statcache_get_neg (path_dev (f->path), path_ino (f->path),
+                                   name, fid->user->uid);
+}
+
+static void
+_statcache_put_neg (Npfid *fid, Path dir, Npstr *name, u64 gen)
+{
+    int fd;
+
+    if ((fd = path_getfd (dir)) < 0)
+        return;
+    diod_statcache_put_neg (fd, path_dev (dir), path_ino (dir),
+                            name, fid->user->uid, gen);
+    path_putfd (dir, fd);
+}
+
+static void
+_uncache (Path path)
+{
+    diod_statcache_invalidate (path_dev (path), path_ino (path));
+}
+
+/* Also forget the stat memo of a fid whose file was changed through it.
+ */
+static void
+_uncache_fid (Fid *f)
+{
+    diod_fid_memo_clear (f);
+    _uncache (f->path);
+    if (f->ioctx && (ioctx_dev (f->ioctx) != path_dev (f->path)
+                  || ioctx_ino (f->ioctx) != path_ino (f->path)))
+        diod_statcache_invalidate (ioctx_dev (f->ioctx), ioctx_ino (f->ioctx));
+}
+
+/* Uncache the directory a path was walked from, e.g. after removing it.
+ */
+static void
+_uncache_parent (Path path)
+{
+    Path parent = path_parent (path);
+
+    if (parent)
+        _uncache (parent);
+}
+
 /* Create a 9P qid from a file's stat info.
  * N.B. v9fs maps st_ino = qid->path + 2
  */
@@ -277,6 +421,31 @@ diod_exportok (Npfid *fid)
     return 1;
 }
 
+/* Share of worker threads for requests from (conn, user).
+ * N.B. called with the tpool request queue locked - don't block here.
+ */
+int
+diod_flow_weight (Npconn *conn, Npuser *user)
+{
+    ListIterator itr;
+    Weight *w;
+    int weight = 1;
+
+    if (!(itr = list_iterator_create (diod_conf_get_weights ())))
+        return weight;
+    while ((w = list_next (itr))) {
+        if (w->user && user && !strcmp (w->user, user->uname))
+            break;
+        if (w->hosts && hostlist_find (w->hosts,
+                                       np_conn_get_client_id (conn)) != -1)
+            break;
+    }
+    if (w)
+        weight = w->weight;
+    list_iterator_destroy (itr);
+    return weight;
+}
+
 int
 diod_auth_required (Npstr *uname, u32 n_uname, Npstr *aname)
 {
@@ -301,12 +470,12 @@ diod_attach (Npfid *fid, Npfid *afid, Npstr *aname)
     Fid *f = NULL;
     Npqid qid;
     struct stat sb;
+    struct timespec btime;
+    u64 valid;
     int xflags;
 
-    if (!(f = diod_fidalloc (fid, aname))) {
-        np_uerror (ENOMEM);
+    if (!(f = diod_fidalloc (fid, aname)))
         goto error;
-    }
     if (diod_conf_opt_runasuid ()) {
         if (fid->user->uid != diod_conf_get_runasuid ()) {
             np_uerror (EPERM);
@@ -316,9 +485,13 @@ diod_attach (Npfid *fid, Npfid *afid, Npstr *aname)
     if (diod_fetch_xflags (aname, &xflags)) {
         if ((xflags & XFLAGS_SHAREFD))
             f->flags |= DIOD_FID_FLAGS_SHAREFD;
+        if ((xflags & XFLAGS_STATCACHE))
+            f->flags |= DIOD_FID_FLAGS_STATCACHE;
+        if ((xflags & XFLAGS_SPLICE))
+            f->flags |= DIOD_FID_FLAGS_SPLICE;
     }
-    if (stat (path_s (f->path), &sb) < 0) { /* OK to follow symbolic links */
-        np_uerror (errno);
+    if (path_getattr (f->path, Gabasic, &sb, &btime, &valid) < 0) {
+        np_uerror (errno); /* symlinks were followed */
         goto error;
     }
     /* N.B. removed S_ISDIR (sb.st_mode) || return ENOTDIR check.
@@ -362,15 +535,21 @@ error:
  * to be what should be "underneath" the mount.
  */
 static int
-_statmnt (char *path, struct stat *sb)
+_statmnt (Path p, struct stat *sb)
 {
     DIR *dir = NULL;
     struct stat sbp;
     struct dirent *dp;
+    char path[PATH_MAX];
     char *ppath = NULL;
-    int plen = strlen (path) + 4;
+    int plen;
     char *name;
 
+    if (!path_procname (p, path, sizeof (path))) {
+        np_uerror (errno);
+        goto error;
+    }
+    plen = strlen (path) + 4;
     if (stat (path, sb) < 0) {
         np_uerror (errno);
         goto error;
@@ -424,29 +603,34 @@ diod_walk (Npfid *fid, Npstr* wname, Npqid *wqid)
 {
     Npsrv *srv = fid->conn->srv;
     Fid *f = fid->aux;
-    struct stat sb, sb2;
+    struct stat sb;
     Path npath = NULL;
+    u64 gen = diod_statcache_gen ();
 
     if ((f->flags & DIOD_FID_FLAGS_MOUNTPT)) {
         np_uerror (ENOENT);
         goto error_quiet;
     }
-    if (!(npath = path_append (srv, f->path, wname))) {
-        np_uerror (ENOMEM);
-        goto error;
-    }
-    if (lstat (path_s (npath), &sb) < 0) {
-        np_uerror (errno);
+    if ((f->flags & DIOD_FID_FLAGS_STATCACHE)
+                        && _statcache_get_neg (fid, wname) == 0) {
+        np_uerror (ENOENT);
         goto error_quiet;
     }
-    if (stat (path_s (f->path), &sb2) < 0) {
-        np_uerror (errno);
-        goto error;
+    if (!(npath = path_walk (srv, f->path, wname, &sb))) {
+        if (np_rerror () == ENOMEM || np_rerror () == EMFILE)
+            goto error;
+        if (np_rerror () == ENOENT && (f->flags & DIOD_FID_FLAGS_STATCACHE))
+            _statcache_put_neg (fid, f->path, wname, gen);
+        goto error_quiet;
     }
-    if (sb.st_dev != sb2.st_dev) {
-        if (_statmnt (path_s (npath), &sb) < 0)
+    if (sb.st_dev != path_dev (f->path)) {
+        if (_statmnt (npath, &sb) < 0)
             goto error;
         f->flags |= DIOD_FID_FLAGS_MOUNTPT;
+    } else {
+        if ((f->flags & DIOD_FID_FLAGS_STATCACHE))
+            _statcache_put (npath, &sb, gen);
+        diod_fid_memo_set (f, &sb);
     }
     path_decref (srv, f->path);
     f->path = npath;
@@ -462,6 +646,83 @@ error_quiet:
     return 0;
 }
 
+/* Twalk - walk a file path
+ * Called from fcall.c::np_walk () with all wname components at once.
+ * Returns the number of components walked.  On error, call np_uerror ()
+ * and return 0.
+ */
+int
+diod_walkn (Npfid *fid, int nwname, Npstr *wnames, Npqid *wqids)
+{
+    Npsrv *srv = fid->conn->srv;
+    Fid *f = fid->aux;
+    struct stat sb[MAXWELEM];
+    Path npath;
+    dev_t dev;
+    int i, n;
+    u64 gen = diod_statcache_gen ();
+
+    if (nwname == 1)
+        return diod_walk (fid, &wnames[0], &wqids[0]);
+    if ((f->flags & DIOD_FID_FLAGS_MOUNTPT)) {
+        np_uerror (ENOENT);
+        goto error_quiet;
+    }
+    if ((f->flags & DIOD_FID_FLAGS_STATCACHE)
+                        && _statcache_get_neg (fid, &wnames[0]) == 0) {
+        np_uerror (ENOENT);
+        goto error_quiet;
+    }
+    np_uerror (0);
+    if (!(npath = path_walkn (srv, f->path, nwname, wnames, sb, &n))) {
+        if (np_rerror () == ENOMEM || np_rerror () == EMFILE)
+            goto error;
+        if (np_rerror () == ENOENT && (f->flags & DIOD_FID_FLAGS_STATCACHE))
+            _statcache_put_neg (fid, f->path, &wnames[0], gen);
+        goto error_quiet;
+    }
+    dev = n > 1 ? sb[n - 2].st_dev : path_dev (f->path);
+    if (sb[n - 1].st_dev != dev) {
+        if (_statmnt (npath, &sb[n - 1]) < 0) {
+            path_decref (srv, npath);
+            goto error;
+        }
+        f->flags |= DIOD_FID_FLAGS_MOUNTPT;
+    } else if (n < nwname) {
+        /* the walk stopped in directory npath, maybe at a missing name */
+        if ((f->flags & DIOD_FID_FLAGS_STATCACHE)) {
+            _statcache_put (npath, &sb[n - 1], gen);
+            if (np_rerror () == ENOENT)
+                _statcache_put_neg (fid, npath, &wnames[n], gen);
+        }
+    } else {
+        if ((f->flags & DIOD_FID_FLAGS_STATCACHE))
+            _statcache_put (npath, &sb[n - 1], gen);
+        diod_fid_memo_set (f, &sb[n - 1]);
+    }
+    for (i = 0; i < n; i++)
+        diod_ustat2qid (&sb[i], &wqids[i]);
+    path_decref (srv, f->path);
+    f->path = npath;
+    return n;
+error:
+    errn (np_rerror (), "diod_walkn %s@%s:%s/%.*s...",
+          fid->user->uname, np_conn_get_client_id (fid->conn), path_s (f->path),
+          wnames[0].len, wnames[0].str);
+error_quiet:
+    return 0;
+}
+
+static void
+_read_done (int res, void *arg)
+{
+    AioReq *ar = arg;
+
+    if (res >= 0)
+        np_set_rread_count (ar->rc, res);
+    _aioreq_complete (ar, ar->rc, res < 0 ? -res : 0);
+}
+
 /* Tread - read from a file or directory.
  */
 Npfcall*
@@ -469,6 +730,7 @@ diod_read (Npfid *fid, u64 offset, u32 count, Npreq *req)
 {
     Fid *f = fid->aux;
     Npfcall *ret = NULL;
+    AioReq *ar;
     ssize_t n;
 
     if (!f->ioctx && !(f->flags & DIOD_FID_FLAGS_XATTR)) {
@@ -476,6 +738,23 @@ diod_read (Npfid *fid, u64 offset, u32 count, Npreq *req)
         np_uerror (EBADF);
         goto error;
     }
+    if (!(f->flags & DIOD_FID_FLAGS_XATTR) && diod_aio_enabled ()) {
+        if (!(ret = np_alloc_rread (count))) {
+            np_uerror (ENOMEM);
+            goto error;
+        }
+        if (!(ar = _aioreq_create (req)))
+            goto error;
+        ar->rc = ret;
+        ioctx_pread_async (f->ioctx, ret->u.rread.data, count, offset,
+                           _read_done, ar);
+        return NULL;
+    }
+    /* N.B. falls back to a copy for non-socket transports, etc. */
+    if ((f->flags & DIOD_FID_FLAGS_SPLICE)
+            && !(f->flags & DIOD_FID_FLAGS_XATTR)
+            && (ret = ioctx_pread_splice (f->ioctx, fid->conn, count, offset)))
+        return ret;
     if (!(ret = np_alloc_rread (count))) {
         np_uerror (ENOMEM);
         goto error;
@@ -496,17 +775,30 @@ error:
           path_s (f->path));
 error_quiet:
     if (ret)
-        free (ret);
+        np_free_fcall (ret);
     return NULL;
 }
 
 /* Twrite - write to a file.
  */
+static void
+_write_done (int res, void *arg)
+{
+    AioReq *ar = arg;
+    Npfcall *rc = NULL;
+
+    diod_statcache_invalidate (ar->dev, ar->ino);
+    if (res >= 0 && !(rc = np_create_rwrite (res)))
+        res = -ENOMEM;
+    _aioreq_complete (ar, rc, res < 0 ? -res : 0);
+}
+
 Npfcall*
 diod_write (Npfid *fid, u64 offset, u32 count, u8 *data, Npreq *req)
 {
     Fid *f = fid->aux;
     Npfcall *ret;
+    AioReq *ar;
     ssize_t n;
 
     if (!f->ioctx && !(f->flags & DIOD_FID_FLAGS_XATTR)) {
@@ -514,10 +806,21 @@ diod_write (Npfid *fid, u64 offset, u32 count, u8 *data, Npreq *req)
         np_uerror (EBADF);
         goto error;
     }
+    if (!(f->flags & DIOD_FID_FLAGS_XATTR) && diod_aio_enabled ()) {
+        if (!(ar = _aioreq_create (req)))
+            goto error;
+        ar->dev = ioctx_dev (f->ioctx);
+        ar->ino = ioctx_ino (f->ioctx);
+        diod_fid_memo_clear (f);
+        ioctx_pwrite_async (f->ioctx, data, count, offset, _write_done, ar);
+        return NULL;
+    }
     if (f->flags & DIOD_FID_FLAGS_XATTR)
         n = xattr_pwrite (f->xattr, data, count, offset);
-    else
+    else {
         n = ioctx_pwrite (f->ioctx, data, count, offset);
+        _uncache_fid (f);
+    }
     if (n < 0) {
         np_uerror (errno);
         goto error_quiet;
@@ -546,6 +849,7 @@ diod_clunk (Npfid *fid)
     if (f->flags & DIOD_FID_FLAGS_XATTR) {
         if (xattr_close (fid) < 0)
             goto error_quiet;
+        _uncache (f->path); /* xattr set or removed: ctime changed */
     } else if (f->ioctx) {
         if (ioctx_close (fid, 1) < 0)
             goto error_quiet;
@@ -570,11 +874,16 @@ diod_remove (Npfid *fid)
 {
     Fid *f = fid->aux;
     Npfcall *ret;
+    char *name;
+    int dirfd = path_at (f->path, &name);
 
-    if (remove (path_s (f->path)) < 0) {
+    if (unlinkat (dirfd, name, 0) < 0
+            && (errno != EISDIR || unlinkat (dirfd, name, AT_REMOVEDIR) < 0)) {
         np_uerror (errno);
         goto error_quiet;
     }
+    _uncache_fid (f);
+    _uncache_parent (f->path);
     if (!(ret = np_create_rremove ())) {
         np_uerror (ENOMEM);
         goto error;
@@ -597,19 +906,22 @@ diod_statfs (Npfid *fid)
     struct statvfs sb;
     Npfcall *ret;
     u32 type = V9FS_MAGIC;
+    int fd;
 
-    if (statvfs (path_s (f->path), &sb) < 0) {
+    if ((fd = path_getfd (f->path)) < 0 || fstatvfs (fd, &sb) < 0) {
         np_uerror (errno);
         goto error;
     }
     if (diod_conf_get_statfs_passthru ()) {
         struct statfs sb2;
-        if (statfs (path_s (f->path), &sb2) < 0) {
+        if (fstatfs (fd, &sb2) < 0) {
             np_uerror (errno);
             goto error;
         }
         type = sb2.f_type;
     }
+    path_putfd (f->path, fd);
+    fd = -1;
     if (!(ret = np_create_rstatfs(type, sb.f_bsize, sb.f_blocks,
                                   sb.f_bfree, sb.f_bavail, sb.f_files,
                                   sb.f_ffree, sb.f_fsid,
@@ -622,6 +934,8 @@ error:
     errn (np_rerror (), "diod_statfs %s@%s:%s",
           fid->user->uname, np_conn_get_client_id (fid->conn),
           path_s (f->path));
+    if (fd >= 0)
+        path_putfd (f->path, fd);
     return NULL;
 }
 
@@ -698,6 +1012,8 @@ diod_lopen (Npfid *fid, u32 flags)
             goto error;
         goto error_quiet;
     }
+    if ((flags & O_TRUNC))
+        _uncache_fid (f);
     if (!(res = np_create_rlopen (ioctx_qid (f->ioctx),
                                   ioctx_iounit (f->ioctx)))) {
         (void)ioctx_close (fid, 0);
@@ -720,6 +1036,9 @@ diod_lcreate(Npfid *fid, Npstr *name, u32 flags, u32 mode, u32 gid)
     Fid *f = fid->aux;
     Npfcall *ret;
     Path opath = NULL;
+    char *nm = NULL;
+    struct stat sb;
+    int fd, dirfd = -1, created = 1;
 
     flags = _remap_oflags (flags);
 
@@ -735,12 +1054,36 @@ diod_lcreate(Npfid *fid, Npstr *name, u32 flags, u32 mode, u32 gid)
         np_uerror (EINVAL);
         goto error;
     }
-    opath = f->path;
-    if (!(f->path = path_append (srv, opath, name))) {
+    if (!(nm = np_strdup (name))) {
         np_uerror (ENOMEM);
         goto error;
     }
-    if (ioctx_open (fid, flags, mode) < 0) {
+    if ((dirfd = path_getfd (f->path)) < 0) {
+        np_uerror (errno);
+        goto error_quiet;
+    }
+    /* N.B. try O_EXCL first so a file we created can be removed on error */
+    fd = openat (dirfd, nm, flags | O_EXCL, mode);
+    if (fd < 0 && errno == EEXIST && !(flags & O_EXCL)) {
+        created = 0;
+        fd = openat (dirfd, nm, flags, mode);
+    }
+    if (fd < 0) {
+        np_uerror (errno);
+        goto error_quiet;
+    }
+    _uncache_fid (f);
+    opath = f->path;
+    if (!(f->path = path_walk (srv, opath, name, &sb))) {
+        (void)close (fd);
+        if (created)
+            (void)unlinkat (dirfd, nm, 0);
+        goto error;
+    }
+    _uncache (f->path); /* may have been truncated */
+    if (ioctx_open_fd (fid, fd, flags) < 0) {
+        if (created)
+            (void)unlinkat (dirfd, nm, 0);
         if (np_rerror () == ENOMEM)
             goto error;
         goto error_quiet;
@@ -748,11 +1091,14 @@ diod_lcreate(Npfid *fid, Npstr *name, u32 flags, u32 mode, u32 gid)
     if (!((ret = np_create_rlcreate (ioctx_qid (f->ioctx),
                                      ioctx_iounit (f->ioctx))))) {
         (void)ioctx_close (fid, 0);
-        (void)unlink (path_s (f->path));
+        if (created)
+            (void)unlinkat (dirfd, nm, 0);
         np_uerror (ENOMEM);
         goto error;
     }
+    path_putfd (opath, dirfd);
     path_decref (srv, opath);
+    free (nm);
     return ret;
 error:
     errn (np_rerror (), "diod_lcreate %s@%s:%s/%.*s",
@@ -764,21 +1110,25 @@ error_quiet:
             path_decref (srv, f->path);
         f->path = opath;
     }
+    if (dirfd >= 0)
+        path_putfd (f->path, dirfd);
+    if (nm)
+        free (nm);
     return NULL;
 }
 
 Npfcall*
 diod_symlink(Npfid *fid, Npstr *name, Npstr *symtgt, u32 gid)
 {
-    Npsrv *srv = fid->conn->srv;
     Fid *f = fid->aux;
     Npfcall *ret;
     char *target = NULL;
-    Path npath = NULL;
+    char *nm = NULL;
+    int dirfd = -1;
     Npqid qid;
     struct stat sb;
 
-    if (!(npath = path_append (srv, f->path, name))) {
+    if (!(nm = np_strdup (name))) {
         np_uerror (ENOMEM);
         goto error;
     }
@@ -786,18 +1136,24 @@ diod_symlink(Npfid *fid, Npstr *name, Npstr *symtgt, u32 gid)
         np_uerror (ENOMEM);
         goto error;
     }
-    if (symlink (target, path_s (npath)) < 0 || lstat (path_s (npath),
-                                                       &sb) < 0) {
+    if ((dirfd = path_getfd (f->path)) < 0) {
+        np_uerror (errno);
+        goto error_quiet;
+    }
+    if (symlinkat (target, dirfd, nm) < 0
+                || fstatat (dirfd, nm, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
         np_uerror (errno);
         goto error_quiet;
     }
+    _uncache_fid (f);
     diod_ustat2qid (&sb, &qid);
     if (!((ret = np_create_rsymlink (&qid)))) {
-        (void)unlink (path_s (npath));
+        (void)unlinkat (dirfd, nm, 0);
         np_uerror (ENOMEM);
         goto error;
     }
-    path_decref (srv, npath);
+    path_putfd (f->path, dirfd);
+    free (nm);
     free (target);
     return ret;
 error:
@@ -805,8 +1161,10 @@ error:
           fid->user->uname, np_conn_get_client_id (fid->conn),
           path_s (f->path), name->len, name->str);
 error_quiet:
-    if (npath)
-        path_decref (srv, npath);
+    if (dirfd >= 0)
+        path_putfd (f->path, dirfd);
+    if (nm)
+        free (nm);
     if (target)
         free (target);
     return NULL;
@@ -815,37 +1173,45 @@ error_quiet:
 Npfcall*
 diod_mknod(Npfid *fid, Npstr *name, u32 mode, u32 major, u32 minor, u32 gid)
 {
-    Npsrv *srv = fid->conn->srv;
     Npfcall *ret;
     Fid *f = fid->aux;
-    Path npath = NULL;
+    char *nm = NULL;
+    int dirfd = -1;
     Npqid qid;
     struct stat sb;
 
-    if (!(npath = path_append (srv, f->path, name))) {
+    if (!(nm = np_strdup (name))) {
         np_uerror (ENOMEM);
         goto error;
     }
-    if (mknod (path_s (npath), mode, makedev (major, minor)) < 0
-                                        || lstat (path_s (npath), &sb) < 0) {
+    if ((dirfd = path_getfd (f->path)) < 0) {
         np_uerror (errno);
         goto error_quiet;
     }
+    if (mknodat (dirfd, nm, mode, makedev (major, minor)) < 0
+                || fstatat (dirfd, nm, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+        np_uerror (errno);
+        goto error_quiet;
+    }
+    _uncache_fid (f);
     diod_ustat2qid (&sb, &qid);
     if (!((ret = np_create_rmknod (&qid)))) {
-        (void)unlink (path_s (npath));
+        (void)unlinkat (dirfd, nm, 0);
         np_uerror (ENOMEM);
         goto error;
     }
-    path_decref (srv, npath);
+    path_putfd (f->path, dirfd);
+    free (nm);
     return ret;
 error:
     errn (np_rerror (), "diod_mknod %s@%s:%s/%.*s",
           fid->user->uname, np_conn_get_client_id (fid->conn), path_s (f->path),
           name->len, name->str);
 error_quiet:
-    if (npath)
-        path_decref (srv, npath);
+    if (dirfd >= 0)
+        path_putfd (f->path, dirfd);
+    if (nm)
+        free (nm);
     return NULL;
 }
 
@@ -859,33 +1225,52 @@ diod_rename (Npfid *fid, Npfid *dfid, Npstr *name)
     Fid *d = dfid->aux;
     Npfcall *ret;
     Path npath = NULL;
+    char *oname, *nm = NULL;
+    int odirfd = path_at (f->path, &oname);
+    int ndirfd = -1;
+    struct stat sb;
     int renamed = 0;
 
-    if (!(npath = path_append (srv, d->path, name))) {
+    if (!(nm = np_strdup (name))) {
         np_uerror (ENOMEM);
         goto error;
     }
-    if (rename (path_s (f->path), path_s (npath)) < 0) {
+    if ((ndirfd = path_getfd (d->path)) < 0) {
+        np_uerror (errno);
+        goto error_quiet;
+    }
+    if (renameat (odirfd, oname, ndirfd, nm) < 0) {
         np_uerror (errno);
         goto error_quiet;
     }
     renamed = 1;
+    _uncache_fid (f);
+    _uncache_parent (f->path);
+    _uncache_fid (d);
+    if (!(npath = path_walk (srv, d->path, name, &sb)))
+        goto error;
     if (!(ret = np_create_rrename ())) {
         np_uerror (ENOMEM);
         goto error;
     }
     path_decref (srv, f->path);
     f->path = npath;
+    path_putfd (d->path, ndirfd);
+    free (nm);
     return ret;
 error:
     errn (np_rerror (), "diod_rename %s@%s:%s to %s/%.*s",
           fid->user->uname, np_conn_get_client_id (fid->conn), path_s (f->path),
           path_s (d->path), name->len, name->str);
 error_quiet:
-    if (renamed && npath)
-        (void)rename (path_s (npath), path_s (f->path));
+    if (renamed)
+        (void)renameat (ndirfd, nm, odirfd, oname);
+    if (ndirfd >= 0)
+        path_putfd (d->path, ndirfd);
     if (npath)
         path_decref (srv, npath);
+    if (nm)
+        free (nm);
     return NULL;
 }
 
@@ -895,12 +1280,18 @@ diod_readlink(Npfid *fid)
     Fid *f = fid->aux;
     Npfcall *ret;
     char target[PATH_MAX + 1];
-    int n;
+    int n, fd;
 
-    if ((n = readlink (path_s (f->path), target, sizeof(target) - 1)) < 0) {
+    if ((fd = path_getfd (f->path)) < 0) {
         np_uerror (errno);
         goto error_quiet;
     }
+    n = readlinkat (fd, "", target, sizeof(target) - 1);
+    if (n < 0)
+        np_uerror (errno);
+    path_putfd (f->path, fd);
+    if (n < 0)
+        goto error_quiet;
     target[n] = '\0';
     if (!(ret = np_create_rreadlink(target))) {
         np_uerror (ENOMEM);
@@ -915,52 +1306,118 @@ error_quiet:
     return NULL;
 }
 
+
+/* Create Rgetattr with the attributes in 'valid'.  Those from a struct
+ * stat (Gabasic) are always filled in, btime only if 'btime' is set, and
+ * data_version is derived from ctime (see diod_aio.c::diod_statx2stat ()).
+ */
+static Npfcall *
+_create_rgetattr (u64 valid, struct stat *sb, struct timespec *btime)
+{
+    Npqid qid;
+    u64 data_version = 0;
+
+    if ((valid & Gadataversion))
+        data_version = (u64)sb->st_ctim.tv_sec * 1000000000
+                     + sb->st_ctim.tv_nsec;
+    if (!btime)
+        valid &= ~Gabtime;
+    diod_ustat2qid (sb, &qid);
+    return np_create_rgetattr(valid, &qid,
+                              sb->st_mode,
+                              sb->st_uid,
+                              sb->st_gid,
+                              sb->st_nlink,
+                              sb->st_rdev,
+                              sb->st_size,
+                              sb->st_blksize,
+                              sb->st_blocks,
+                              sb->st_atim.tv_sec,
+                              sb->st_atim.tv_nsec,
+                              sb->st_mtim.tv_sec,
+                              sb->st_mtim.tv_nsec,
+                              sb->st_ctim.tv_sec,
+                              sb->st_ctim.tv_nsec,
+                              btime ? btime->tv_sec : 0,
+                              btime ? btime->tv_nsec : 0,
+                              0, data_version);
+}
+
+/* Tgetattr valid mask for attributes from a struct stat.
+ */
+#define GA_STAT (Gabasic | Gadataversion)
+
 static int
-_lstat (Fid *f, struct stat *sb)
+_getattr (Fid *f, u64 request_mask, struct stat *sb, struct timespec *btime,
+          u64 *valid)
 {
-    if (f->ioctx != NULL) {
-        return ioctx_stat(f->ioctx, sb);
-    }
-    return lstat(path_s (f->path), sb);
+    if (f->ioctx != NULL)
+        return ioctx_getattr (f->ioctx, request_mask, sb, btime, valid);
+    return path_getattr (f->path, request_mask, sb, btime, valid);
 }
 
+static void
+_getattr_done (int res, void *arg)
+{
+    AioReq *ar = arg;
+    Npfcall *rc = NULL;
+
+    if (ar->path) {
+        if (res >= 0 && (ar->valid & Gabasic) == Gabasic)
+            _statcache_put (ar->path, &ar->sb, ar->gen);
+        path_decref (ar->req->conn->srv, ar->path);
+    }
+    if (res >= 0 && !(rc = _create_rgetattr (ar->valid & ar->request_mask,
+                                              &ar->sb, &ar->btime)))
+        res = -ENOMEM;
+    _aioreq_complete (ar, rc, res < 0 ? -res : 0);
+}
 
 Npfcall*
-diod_getattr(Npfid *fid, u64 request_mask)
+diod_getattr(Npfid *fid, u64 request_mask, Npreq *req)
 {
     Fid *f = fid->aux;
     Npfcall *ret;
-    Npqid qid;
+    AioReq *ar;
     struct stat sb;
+    struct timespec btime, *bp = NULL;
+    u64 valid = request_mask & GA_STAT;
+    int cache = (f->flags & DIOD_FID_FLAGS_STATCACHE);
+    u64 gen = diod_statcache_gen ();
 
     if ((f->flags & DIOD_FID_FLAGS_MOUNTPT)) {
-        if (_statmnt (path_s (f->path), &sb) < 0) {
+        if (_statmnt (f->path, &sb) < 0) {
             np_uerror (errno);
             goto error_quiet;
         }
+    } else if (diod_fid_memo_take (f, &sb) == 0) {
+        /* stat from the walk or lopen just before */
+    } else if (cache && _statcache_get (f, &sb) == 0) {
+        /* cache hit */
+    } else if (f->ioctx != NULL && diod_aio_enabled ()) {
+        if (!(ar = _aioreq_create (req)))
+            goto error;
+        ar->request_mask = request_mask;
+        if (cache) {
+            ar->path = path_incref (f->path);
+            ar->gen = gen;
+        }
+        ioctx_getattr_async (f->ioctx, cache ? Gaall : request_mask, &ar->sb,
+                             &ar->btime, &ar->valid, _getattr_done, ar);
+        return NULL;
     } else {
-        if (_lstat (f, &sb) < 0) {
+        /* the cache needs all of the attributes, and up to date */
+        if (_getattr (f, cache ? Gaall : request_mask, &sb, &btime,
+                      &valid) < 0) {
             np_uerror (errno);
             goto error_quiet;
         }
+        if (cache && (valid & Gabasic) == Gabasic)
+            _statcache_put (f->path, &sb, gen);
+        valid &= request_mask;
+        bp = &btime;
     }
-    diod_ustat2qid (&sb, &qid);
-    if (!(ret = np_create_rgetattr(request_mask, &qid,
-                                    sb.st_mode,
-                                    sb.st_uid,
-                                    sb.st_gid,
-                                    sb.st_nlink,
-                                    sb.st_rdev,
-                                    sb.st_size,
-                                    sb.st_blksize,
-                                    sb.st_blocks,
-                                    sb.st_atim.tv_sec,
-                                    sb.st_atim.tv_nsec,
-                                    sb.st_mtim.tv_sec,
-                                    sb.st_mtim.tv_nsec,
-                                    sb.st_ctim.tv_sec,
-                                    sb.st_ctim.tv_nsec,
-                                    0, 0, 0, 0))) {
+    if (!(ret = _create_rgetattr (valid, &sb, bp))) {
         np_uerror (ENOMEM);
         goto error;
     }
@@ -976,47 +1433,74 @@ error_quiet:
 static int
 _chmod (Fid *f, u32 mode)
 {
+    char *name;
+    int dirfd;
+
     if (f->ioctx != NULL) {
         return ioctx_chmod (f->ioctx, mode);
     }
-    return chmod (path_s (f->path), mode);
+    dirfd = path_at (f->path, &name);
+    return fchmodat (dirfd, name, mode, 0);
 }
 
 static int
 _lchown (Fid *f, u32 uid, u32 gid)
 {
+    int fd, rc;
+
     if (f->ioctx != NULL) {
         return ioctx_chown (f->ioctx, uid, gid);
     }
-    return lchown (path_s (f->path), uid, gid);
+    if ((fd = path_getfd (f->path)) < 0)
+        return -1;
+    rc = fchownat (fd, "", uid, gid, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+    path_putfd (f->path, fd);
+    return rc;
 }
 
 static int
 _truncate (Fid *f, u64 size)
 {
+    char path[32];
+    int fd, rc;
+
     if (f->ioctx != NULL) {
         return ioctx_truncate (f->ioctx, size);
     }
-    return truncate(path_s (f->path), size);
+    if ((fd = path_getfd (f->path)) < 0)
+        return -1;
+    /* N.B. truncate (2) has no descriptor-relative form for O_PATH */
+    snprintf (path, sizeof (path), "/proc/self/fd/%d", fd);
+    rc = truncate (path, size);
+    path_putfd (f->path, fd);
+    return rc;
 }
 
 #if HAVE_UTIMENSAT
 static int
 _utimensat (Fid *f, const struct timespec ts[2], int flags)
 {
+    char *name;
+    int dirfd;
+
     if (f->ioctx != NULL) {
         return ioctx_utimensat (f->ioctx, ts, flags);
     }
-    return utimensat (-1, path_s (f->path), ts, flags);
+    dirfd = path_at (f->path, &name);
+    return utimensat (dirfd, name, ts, flags);
 }
 #else /* HAVE_UTIMENSAT */
 static int
-_utimens (Fid *f, const struct utimbuf *times)
+_utimes (Fid *f, const struct timeval tv[2])
 {
+    char path[PATH_MAX];
+
     if (f->ioctx != NULL) {
-        return ioctx_utimes(f, times);
+        return ioctx_utimes (f->ioctx, tv);
     }
-    return utimes (path_s (f->path), times);
+    if (!path_procname (f->path, path, sizeof (path)))
+        return -1;
+    return utimes (path, tv);
 }
 #endif
 
@@ -1081,11 +1565,13 @@ diod_setattr (Npfid *fid, u32 valid, u32 mode, u32 uid, u32 gid, u64 size,
 #else /* HAVE_UTIMENSAT */
         struct timeval tv[2], now, *tvp;
         struct stat sb;
+        struct timespec btime;
+        u64 gvalid;
         if ((valid & Saatime) && !(valid & Saatimeset)
          && (valid & Samtime) && !(valid & Samtimeset)) {
             tvp = NULL; /* set both to now */
         } else {
-            if (_lstat(f, &sb) < 0) {
+            if (_getattr (f, Gabasic, &sb, &btime, &gvalid) < 0) {
                 np_uerror (errno);
                 goto error_quiet;
             }
@@ -1129,6 +1615,7 @@ diod_setattr (Npfid *fid, u32 valid, u32 mode, u32 uid, u32 gid, u64 size,
             goto error_quiet;
         }
     }
+    _uncache_fid (f);
     if (!(ret = np_create_rsetattr())) {
         np_uerror (ENOMEM);
         goto error;
@@ -1139,6 +1626,7 @@ error:
           fid->user->uname, np_conn_get_client_id (fid->conn), path_s (f->path),
           valid);
 error_quiet:
+    _uncache_fid (f); /* some attributes may have been set */
     return NULL;
 }
 
@@ -1149,10 +1637,15 @@ _copy_dirent_linux (Fid *f, struct dirent *d, long offset, u8 *buf, u32 buflen)
     u32 ret = 0;
 
     if (d->d_type == DT_UNKNOWN) {
-        char path[PATH_MAX + 1];
         struct stat sb;
-        snprintf (path, sizeof(path), "%s/%s", path_s (f->path), d->d_name);
-        if (lstat (path, &sb) < 0) {
+        int fd, rc;
+        if ((fd = path_getfd (f->path)) < 0) {
+            np_uerror (errno);
+            goto done;
+        }
+        rc = fstatat (fd, d->d_name, &sb, AT_SYMLINK_NOFOLLOW);
+        path_putfd (f->path, fd);
+        if (rc < 0) {
             np_uerror (errno);
             goto done;
         }
@@ -1215,7 +1708,7 @@ diod_readdir(Npfid *fid, u64 offset, u32 count, Npreq *req)
     }
     n = _read_dir_linux (f, ret->u.rreaddir.data, offset, count);
     if (np_rerror ()) {
-        free (ret);
+        np_free_fcall (ret);
         ret = NULL;
     } else
         np_finalize_rreaddir (ret, n);
@@ -1227,21 +1720,44 @@ error:
     return NULL;
 }
 
+static void
+_fsync_done (int res, void *arg)
+{
+    AioReq *ar = arg;
+    Npfcall *rc = NULL;
+
+    diod_statcache_invalidate (ar->dev, ar->ino);
+    if (res >= 0 && !(rc = np_create_rfsync ()))
+        res = -ENOMEM;
+    _aioreq_complete (ar, rc, res < 0 ? -res : 0);
+}
+
 Npfcall*
-diod_fsync (Npfid *fid, u32 datasync)
+diod_fsync (Npfid *fid, u32 datasync, Npreq *req)
 {
     Fid *f = fid->aux;
     Npfcall *ret;
+    AioReq *ar;
 
     if (!f->ioctx) {
         msg ("diod_fsync: fid is not open");
         np_uerror (EBADF);
         goto error;
     }
+    if (diod_aio_enabled ()) {
+        if (!(ar = _aioreq_create (req)))
+            goto error;
+        ar->dev = ioctx_dev (f->ioctx);
+        ar->ino = ioctx_ino (f->ioctx);
+        diod_fid_memo_clear (f);
+        ioctx_fsync_async (f->ioctx, datasync, _fsync_done, ar);
+        return NULL;
+    }
     if (ioctx_fsync (f->ioctx, datasync) < 0) {
         np_uerror (errno);
         goto error_quiet;
     }
+    _uncache_fid (f); /* st_blocks may change as delayed writes land */
     if (!((ret = np_create_rfsync ()))) {
         np_uerror (ENOMEM);
         goto error;
@@ -1353,70 +1869,89 @@ error:
 Npfcall*
 diod_link (Npfid *dfid, Npfid *fid, Npstr *name)
 {
-    Npsrv *srv = fid->conn->srv;
     Fid *f = fid->aux;
     Npfcall *ret;
     Fid *df = dfid->aux;
-    Path npath = NULL;
+    char *oname, *nm = NULL;
+    int odirfd = path_at (f->path, &oname);
+    int dirfd = -1;
 
-    if (!(npath = path_append (srv, df->path, name))) {
+    if (!(nm = np_strdup (name))) {
         np_uerror (ENOMEM);
         goto error;
     }
-    if (link (path_s (f->path), path_s (npath)) < 0) {
+    if ((dirfd = path_getfd (df->path)) < 0) {
         np_uerror (errno);
         goto error_quiet;
     }
+    if (linkat (odirfd, oname, dirfd, nm, 0) < 0) {
+        np_uerror (errno);
+        goto error_quiet;
+    }
+    _uncache_fid (f);
+    _uncache_fid (df);
     if (!((ret = np_create_rlink ()))) {
-        (void)unlink (path_s (npath));
+        (void)unlinkat (dirfd, nm, 0);
         np_uerror (ENOMEM);
         goto error;
     }
-    path_decref (srv, npath);
+    path_putfd (df->path, dirfd);
+    free (nm);
     return ret;
 error:
     errn (np_rerror (), "diod_link %s@%s:%s %s/%.*s",
           fid->user->uname, np_conn_get_client_id (fid->conn), path_s (f->path),
           path_s (df->path), name->len, name->str);
 error_quiet:
-    if (npath)
-        path_decref (srv, npath);
+    if (dirfd >= 0)
+        path_putfd (df->path, dirfd);
+    if (nm)
+        free (nm);
     return NULL;
 }
 
 Npfcall*
 diod_mkdir (Npfid *fid, Npstr *name, u32 mode, u32 gid)
 {
-    Npsrv *srv = fid->conn->srv;
     Fid *f = fid->aux;
     Npfcall *ret;
-    Path npath = NULL;
+    char *nm = NULL;
+    int dirfd = -1;
     Npqid qid;
     struct stat sb;
 
-    if (!(npath = path_append (srv, f->path, name))) {
+    if (!(nm = np_strdup (name))) {
         np_uerror (ENOMEM);
         goto error;
     }
-    if (mkdir (path_s (npath), mode) < 0 || lstat (path_s (npath), &sb) < 0) {
+    if ((dirfd = path_getfd (f->path)) < 0) {
         np_uerror (errno);
         goto error_quiet;
     }
+    if (mkdirat (dirfd, nm, mode) < 0
+                || fstatat (dirfd, nm, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+        np_uerror (errno);
+        goto error_quiet;
+    }
+    _uncache_fid (f);
     diod_ustat2qid (&sb, &qid);
     if (!((ret = np_create_rmkdir (&qid)))) {
-        (void)rmdir(path_s (npath));
+        (void)unlinkat (dirfd, nm, AT_REMOVEDIR);
         np_uerror (ENOMEM);
         goto error;
     }
-    path_decref (srv, npath);
+    path_putfd (f->path, dirfd);
+    free (nm);
     return ret;
 error:
     errn (np_rerror (), "diod_mkdir %s@%s:%s/%.*s",
           fid->user->uname, np_conn_get_client_id (fid->conn), path_s (f->path),
           name->len, name->str);
 error_quiet:
-    if (npath)
-        path_decref (srv, npath);
+    if (dirfd >= 0)
+        path_putfd (f->path, dirfd);
+    if (nm)
+        free (nm);
     return NULL;
 }
 
@@ -1485,42 +2020,57 @@ diod_renameat(Npfid *olddirfid, Npstr *oldname, Npfid *newdirfid, Npstr *newname
 {
     Fid *odf = olddirfid->aux;
     Fid *ndf = newdirfid->aux;
-    Npsrv *srv = olddirfid->conn->srv;
     Npfcall *ret = NULL;
-    Path opath = NULL, npath = NULL;
+    char *onm = NULL, *nnm = NULL;
+    struct stat sb;
+    int odirfd = -1, ndirfd = -1;
+    int moved = -1;
 
-    if (!(opath = path_append (srv, odf->path, oldname))) {
+    if (!(onm = np_strdup (oldname)) || !(nnm = np_strdup (newname))) {
         np_uerror (ENOMEM);
         goto error;
     }
-
-    if (!(npath = path_append (srv, ndf->path, newname))) {
-        np_uerror (ENOMEM);
-        goto error;
+    if ((odirfd = path_getfd (odf->path)) < 0
+                || (ndirfd = path_getfd (ndf->path)) < 0) {
+        np_uerror (errno);
+        goto error_quiet;
     }
+    if (diod_statcache_enabled ()) /* rename changes its ctime */
+        moved = fstatat (odirfd, onm, &sb, AT_SYMLINK_NOFOLLOW);
 
-    if (rename (path_s (opath), path_s (npath)) < 0) {
+    if (renameat (odirfd, onm, ndirfd, nnm) < 0) {
         np_uerror (errno);
         goto error_quiet;
     }
+    _uncache_fid (odf);
+    _uncache_fid (ndf);
+    if (moved == 0)
+        diod_statcache_invalidate (sb.st_dev, sb.st_ino);
 
     if (!(ret = np_create_rrenameat ())) {
         np_uerror (ENOMEM);
         goto error;
     }
 
-    path_decref (srv, npath);
-    path_decref (srv, opath);
+    path_putfd (ndf->path, ndirfd);
+    path_putfd (odf->path, odirfd);
+    free (nnm);
+    free (onm);
     return ret;
 error:
-    errn (np_rerror (), "diod_renameat %s@%s:%s -> %s",
+    errn (np_rerror (), "diod_renameat %s@%s:%s/%.*s -> %s/%.*s",
           olddirfid->user->uname, np_conn_get_client_id (olddirfid->conn),
-          path_s (opath), path_s (npath));
+          path_s (odf->path), oldname->len, oldname->str,
+          path_s (ndf->path), newname->len, newname->str);
 error_quiet:
-    if (npath)
-        path_decref (srv, npath);
-    if (opath)
-        path_decref (srv, opath);
+    if (ndirfd >= 0)
+        path_putfd (ndf->path, ndirfd);
+    if (odirfd >= 0)
+        path_putfd (odf->path, odirfd);
+    if (nnm)
+        free (nnm);
+    if (onm)
+        free (onm);
     return NULL;
 }
 
@@ -1528,51 +2078,54 @@ Npfcall*
 diod_unlinkat(Npfid *dirfid, Npstr *name, u32 flags)
 {
     Fid *df = dirfid->aux;
-    Path rpath = NULL;
+    char *nm = NULL;
     Npfcall *ret = NULL;
-    Npsrv *srv = dirfid->conn->srv;
+    int dirfd = -1;
     struct stat st;
 
-    if (!(rpath = path_append (srv, df->path, name))) {
+    if (!(nm = np_strdup (name))) {
         np_uerror (ENOMEM);
         goto error;
     }
-
-    if (lstat (path_s (rpath), &st) < 0) {
+    if ((dirfd = path_getfd (df->path)) < 0) {
         np_uerror (errno);
         goto error;
     }
 
-    if (S_ISDIR (st.st_mode)) {
-        if (!(flags & Uremovedir)) {
-            np_uerror (EISDIR);
-            goto error_quiet;
-        }
+    if (fstatat (dirfd, nm, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+        np_uerror (errno);
+        goto error;
+    }
 
-        if (rmdir (path_s (rpath)) < 0) {
-            np_uerror (errno);
-            goto error_quiet;
-        }
+    if (S_ISDIR (st.st_mode) && !(flags & Uremovedir)) {
+        np_uerror (EISDIR);
+        goto error_quiet;
     }
-    else if (unlink (path_s (rpath)) < 0) {
+
+    if (unlinkat (dirfd, nm, S_ISDIR (st.st_mode) ? AT_REMOVEDIR : 0) < 0) {
         np_uerror (errno);
         goto error_quiet;
     }
+    _uncache_fid (df);
+    diod_statcache_invalidate (st.st_dev, st.st_ino);
 
     if (!(ret = np_create_runlinkat())) {
         np_uerror (ENOMEM);
         goto error;
     }
 
-    path_decref (srv, rpath);
+    path_putfd (df->path, dirfd);
+    free (nm);
     return ret;
 error:
-    errn (np_rerror (), "diod_unlinkat %s@%s:%s", 
+    errn (np_rerror (), "diod_unlinkat %s@%s:%s/%.*s",
           dirfid->user->uname, np_conn_get_client_id (dirfid->conn),
-          path_s (rpath));
+          path_s (df->path), name->len, name->str);
 error_quiet:
-    if (rpath)
-        path_decref (srv, rpath);
+    if (dirfd >= 0)
+        path_putfd (df->path, dirfd);
+    if (nm)
+        free (nm);
     return NULL;
 }
 
@@ -296,9 +296,32 @@ void
 diod_sock_startfd (Npsrv *srv, int fdin, int fdout, char *client_id, int flags)
 {
     Npconn *conn;
-    Nptrans *trans;
-
-    trans = np_fdtrans_create (fdin, fdout);
+    Nptrans *trans = NULL;
+    struct stat sb;
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof (addr);
+    static int uring_failed = 0;
+    static int shm_failed = 0;
+
+    /* N.B. the shm transport falls back to the socket for other clients */
+    if ((srv->flags & SRV_FLAGS_SHM) && !shm_failed && fdin == fdout
+                && getsockname (fdin, (struct sockaddr *)&addr, &addrlen) == 0
+                && addr.ss_family == AF_UNIX) {
+        if (!(trans = np_shmtrans_create (fdin))) {
+            errn (np_rerror (), "shared memory transport unavailable");
+            shm_failed = 1;
+        }
+    }
+    if ((srv->flags & SRV_FLAGS_IO_URING) && !uring_failed && !trans
+                && fdin == fdout && fstat (fdin, &sb) == 0
+                && S_ISSOCK (sb.st_mode)) {
+        if (!(trans = np_uringtrans_create (fdin))) {
+            errn (np_rerror (), "io_uring unavailable, using read/write");
+            uring_failed = 1;
+        }
+    }
+    if (!trans)
+        trans = np_fdtrans_create (fdin, fdout);
     if (!trans) {
         errn (np_rerror (), "error creating transport for %s", client_id);
         (void)close (fdin);
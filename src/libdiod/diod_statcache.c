@@ -0,0 +1,772 @@
+/************************************************************\
+ * Copyright 2010 Lawrence Livermore National Security, LLC
+ * (c.f. AUTHORS, NOTICE.LLNS, COPYING)
+ *
+ * This file is part of the diod 9P server project.
+ * For details, see https://github.com/chaos/diod.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+\************************************************************/
+
+/* diod_statcache.c - cache file attributes for Tgetattr
+ *
+ * Entries are keyed by (dev, ino) and kept on an LRU list bounded by
+ * 'size'.  Each has an inotify watch on its file, so changes made outside
+ * of diod, by other processes on this host, invalidate it when the notify
+ * thread reads the event.  diod invalidates files it changes itself
+ * directly.  Changes inotify can't see, e.g. made by other NFS clients,
+ * are bounded by 'ttl'.
+ *
+ * An invalidated entry keeps its watch, so refilling it is cheap.  Each
+ * entry records the value of the counter 'gen' when it was last
+ * invalidated or created.  A stat obtained since an earlier value of 'gen'
+ * is cached as is only if its entry's is no later; otherwise the stat
+ * might predate a change, or the watch, so the file is stat'ed again now
+ * that the watch is in place, and that is cached unless the entry was
+ * invalidated meanwhile.  Events for other files don't affect the fill.
+ *
+ * Only regular files and directories are cached, since inotify can't watch
+ * a symlink through its /proc/self/fd link.
+ *
+ * Names that a user failed to walk with ENOENT are cached as negative
+ * entries on their directory's entry, which may have no attributes but
+ * holds the watch.  Invalidating the directory, as diod does when it adds
+ * a name and inotify does for any name added, moved or removed, drops
+ * them.  As with attributes, a failed lookup that might predate a change
+ * to the directory, or its watch, is repeated before it is cached.
+ * Negative entries are kept on a second LRU list, bounded by 'size'.
+ * They only apply to the user that made them, since another user might
+ * not be allowed to search the directory.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <pthread.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "src/libnpfs/npfs.h"
+#include "src/libnpfs/xpthread.h"
+
+#include "diod_log.h"
+#include "diod_statcache.h"
+
+#if HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+
+#define SC_WATCH_MASK   (IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE \
+                         | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF \
+                         | IN_MOVE_SELF)
+#define SC_DIR_MASK     (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+typedef struct sentry_struct *Sentry;
+typedef struct nentry_struct *Nentry;
+
+struct sentry_struct {
+    dev_t           dev;
+    ino_t           ino;
+    int             wd;         /* inotify watch descriptor */
+    int             valid;      /* sb may be used */
+    u64             gen;        /* sc->gen when invalidated or created */
+    u64             expires;    /* ms, or 0 */
+    struct stat     sb;
+    Nentry          neg;        /* negative entries in this directory */
+    Sentry          hnext;      /* by (dev, ino) */
+    Sentry          wnext;      /* by wd */
+    Sentry          lnext;      /* LRU list, most recent first */
+    Sentry          lprev;
+};
+
+struct nentry_struct {
+    Sentry          dir;
+    uid_t           uid;
+    u64             expires;    /* ms, or 0 */
+    u32             hash;
+    Nentry          hnext;      /* by (dir, name) */
+    Nentry          dnext;      /* dir->neg list */
+    Nentry          dprev;
+    Nentry          lnext;      /* negative LRU list */
+    Nentry          lprev;
+    int             len;
+    char            name[];
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    int             size;
+    int             count;
+    int             ttl;
+    int             nbuckets;   /* power of 2 */
+    Sentry          *byino;
+    Sentry          *bywd;
+    Sentry          head;
+    Sentry          tail;
+    Nentry          *byname;
+    int             ncount;
+    Nentry          nhead;
+    Nentry          ntail;
+    u64             gen;        /* atomic */
+    u64             hits;
+    u64             misses;
+    u64             fills;
+    u64             invalidations;
+    u64             evictions;
+    u64             nhits;
+    u64             nfills;
+    int             ifd;
+    int             efd;
+    pthread_t       thread;
+} StatCache;
+
+static StatCache *sc = NULL;
+
+static u64
+_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int
+_ino_bucket (dev_t dev, ino_t ino)
+{
+    u64 h = (u64)ino ^ ((u64)dev * 0x9e3779b97f4a7c15ULL);
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h & (sc->nbuckets - 1);
+}
+
+static u32
+_name_hash (dev_t dev, ino_t ino, Npstr *name)
+{
+    u32 h = 2166136261U ^ (u32)ino ^ (u32)((u64)ino >> 32) ^ (u32)dev;
+    int i;
+
+    for (i = 0; i < name->len; i++) {
+        h ^= (unsigned char)name->str[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static int
+_wd_bucket (int wd)
+{
+    return wd & (sc->nbuckets - 1);
+}
+
+static Sentry
+_lookup (dev_t dev, ino_t ino)
+{
+    Sentry e;
+
+    for (e = sc->byino[_ino_bucket (dev, ino)]; e != NULL; e = e->hnext) {
+        if (e->ino == ino && e->dev == dev)
+            break;
+    }
+    return e;
+}
+
+static Sentry
+_lookup_wd (int wd)
+{
+    Sentry e;
+
+    for (e = sc->bywd[_wd_bucket (wd)]; e != NULL; e = e->wnext) {
+        if (e->wd == wd)
+            break;
+    }
+    return e;
+}
+
+static Nentry
+_nlookup (Sentry dir, Npstr *name, uid_t uid, u32 hash)
+{
+    Nentry n;
+
+    for (n = sc->byname[hash & (sc->nbuckets - 1)]; n != NULL; n = n->hnext) {
+        if (n->hash == hash && n->dir == dir && n->uid == uid
+                && n->len == name->len && !memcmp (n->name, name->str, n->len))
+            break;
+    }
+    return n;
+}
+
+static void
+_nlru_unlink (Nentry n)
+{
+    if (n->lprev)
+        n->lprev->lnext = n->lnext;
+    else
+        sc->nhead = n->lnext;
+    if (n->lnext)
+        n->lnext->lprev = n->lprev;
+    else
+        sc->ntail = n->lprev;
+    n->lnext = n->lprev = NULL;
+}
+
+static void
+_nlru_push (Nentry n)
+{
+    n->lprev = NULL;
+    n->lnext = sc->nhead;
+    if (sc->nhead)
+        sc->nhead->lprev = n;
+    else
+        sc->ntail = n;
+    sc->nhead = n;
+}
+
+static void
+_ninsert (Nentry n)
+{
+    int i = n->hash & (sc->nbuckets - 1);
+
+    n->hnext = sc->byname[i];
+    sc->byname[i] = n;
+    n->dprev = NULL;
+    n->dnext = n->dir->neg;
+    if (n->dnext)
+        n->dnext->dprev = n;
+    n->dir->neg = n;
+    _nlru_push (n);
+    sc->ncount++;
+}
+
+static void
+_nremove (Nentry n)
+{
+    Nentry *np;
+
+    for (np = &sc->byname[n->hash & (sc->nbuckets - 1)]; *np != n;
+                                                        np = &(*np)->hnext)
+        ;
+    *np = n->hnext;
+    if (n->dprev)
+        n->dprev->dnext = n->dnext;
+    else
+        n->dir->neg = n->dnext;
+    if (n->dnext)
+        n->dnext->dprev = n->dprev;
+    _nlru_unlink (n);
+    free (n);
+    sc->ncount--;
+}
+
+static void
+_lru_unlink (Sentry e)
+{
+    if (e->lprev)
+        e->lprev->lnext = e->lnext;
+    else
+        sc->head = e->lnext;
+    if (e->lnext)
+        e->lnext->lprev = e->lprev;
+    else
+        sc->tail = e->lprev;
+    e->lnext = e->lprev = NULL;
+}
+
+static void
+_lru_push (Sentry e)
+{
+    e->lprev = NULL;
+    e->lnext = sc->head;
+    if (sc->head)
+        sc->head->lprev = e;
+    else
+        sc->tail = e;
+    sc->head = e;
+}
+
+static void
+_insert (Sentry e)
+{
+    int i = _ino_bucket (e->dev, e->ino);
+    int j = _wd_bucket (e->wd);
+
+    e->hnext = sc->byino[i];
+    sc->byino[i] = e;
+    e->wnext = sc->bywd[j];
+    sc->bywd[j] = e;
+    _lru_push (e);
+    sc->count++;
+}
+
+/* Remove 'e' and remove its watch if 'rmwatch' (not already gone).
+ */
+static void
+_remove (Sentry e, int rmwatch)
+{
+    Sentry *ep;
+
+    for (ep = &sc->byino[_ino_bucket (e->dev, e->ino)]; *ep != e;
+                                                        ep = &(*ep)->hnext)
+        ;
+    *ep = e->hnext;
+    for (ep = &sc->bywd[_wd_bucket (e->wd)]; *ep != e; ep = &(*ep)->wnext)
+        ;
+    *ep = e->wnext;
+    _lru_unlink (e);
+    while (e->neg)
+        _nremove (e->neg);
+    if (rmwatch)
+        (void)inotify_rm_watch (sc->ifd, e->wd);
+    free (e);
+    sc->count--;
+}
+
+static void
+_invalidate (Sentry e)
+{
+    e->gen = __atomic_add_fetch (&sc->gen, 1, __ATOMIC_SEQ_CST);
+    if (e->valid) {
+        e->valid = 0;
+        sc->invalidations++;
+    }
+    while (e->neg)
+        _nremove (e->neg);
+}
+
+/* Find or create the entry for file (dev, ino) open on 'fd', with a watch
+ * but no attributes if created.
+ */
+static Sentry
+_entry (int fd, dev_t dev, ino_t ino)
+{
+    char path[64];
+    Sentry e;
+    int wd;
+
+    if ((e = _lookup (dev, ino))) {
+        _lru_unlink (e);
+        _lru_push (e);
+        return e;
+    }
+    /* N.B. inotify_add_watch () fails unless the user may read it */
+    snprintf (path, sizeof (path), "/proc/self/fd/%d", fd);
+    if ((wd = inotify_add_watch (sc->ifd, path, SC_WATCH_MASK)) < 0)
+        return NULL;
+    if ((e = _lookup_wd (wd))) { /* fd is not file (dev, ino) */
+        _invalidate (e);
+        return NULL;
+    }
+    if (sc->count == sc->size) {
+        _remove (sc->tail, 1);
+        sc->evictions++;
+    }
+    if (!(e = calloc (1, sizeof (*e)))) {
+        (void)inotify_rm_watch (sc->ifd, wd);
+        return NULL;
+    }
+    e->dev = dev;
+    e->ino = ino;
+    e->wd = wd;
+    e->gen = __atomic_add_fetch (&sc->gen, 1, __ATOMIC_SEQ_CST);
+    _insert (e);
+    return e;
+}
+
+static void
+_event (struct inotify_event *ev)
+{
+    Sentry e;
+
+    if ((ev->mask & IN_Q_OVERFLOW)) {
+        for (e = sc->head; e != NULL; e = e->lnext)
+            _invalidate (e);
+        return;
+    }
+    if (!(e = _lookup_wd (ev->wd)))
+        return;
+    if ((ev->mask & IN_IGNORED))
+        _remove (e, 0);
+    else if (ev->len == 0 || (ev->mask & SC_DIR_MASK))
+        _invalidate (e);
+    /* else a file in a cached directory changed, but not the directory */
+}
+
+static void *
+_notify_proc (void *a)
+{
+    char buf[4096]
+        __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+    struct inotify_event *ev;
+    struct pollfd pfd[2];
+    sigset_t set;
+    ssize_t n;
+    char *p;
+
+    sigfillset (&set);
+    pthread_sigmask (SIG_BLOCK, &set, NULL);
+
+    pfd[0].fd = sc->ifd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = sc->efd;
+    pfd[1].events = POLLIN;
+    for (;;) {
+        if (poll (pfd, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            err ("statcache: poll");
+            break;
+        }
+        if (pfd[1].revents)
+            break;
+        if ((n = read (sc->ifd, buf, sizeof (buf))) <= 0)
+            continue;
+        xpthread_mutex_lock (&sc->lock);
+        for (p = buf; p < buf + n; p += sizeof (*ev) + ev->len) {
+            ev = (struct inotify_event *)p;
+            _event (ev);
+        }
+        xpthread_mutex_unlock (&sc->lock);
+    }
+    return NULL;
+}
+
+int
+diod_statcache_enabled (void)
+{
+    return sc != NULL;
+}
+
+int
+diod_statcache_get (dev_t dev, ino_t ino, struct stat *sb)
+{
+    Sentry e;
+    int rc = -1;
+
+    if (!sc)
+        return -1;
+    xpthread_mutex_lock (&sc->lock);
+    e = _lookup (dev, ino);
+    if (e && e->valid && (e->expires == 0 || _now () < e->expires)) {
+        memcpy (sb, &e->sb, sizeof (*sb));
+        _lru_unlink (e);
+        _lru_push (e);
+        sc->hits++;
+        rc = 0;
+    } else
+        sc->misses++;
+    xpthread_mutex_unlock (&sc->lock);
+    return rc;
+}
+
+u64
+diod_statcache_gen (void)
+{
+    if (!sc)
+        return 0;
+    return __atomic_load_n (&sc->gen, __ATOMIC_SEQ_CST);
+}
+
+static void
+_fill (Sentry e, struct stat *sb)
+{
+    memcpy (&e->sb, sb, sizeof (*sb));
+    e->valid = 1;
+    e->expires = sc->ttl > 0 ? _now () + sc->ttl : 0;
+    sc->fills++;
+}
+
+void
+diod_statcache_put (int fd, struct stat *sb, u64 gen)
+{
+    struct stat sb2;
+    Sentry e;
+    u64 egen;
+
+    if (!sc || !(S_ISREG (sb->st_mode) || S_ISDIR (sb->st_mode)))
+        return;
+    xpthread_mutex_lock (&sc->lock);
+    if (!(e = _entry (fd, sb->st_dev, sb->st_ino)))
+        goto done;
+    if (e->gen <= gen) {
+        _fill (e, sb);
+        goto done;
+    }
+    /* 'sb' may predate a change or the watch: stat again with the watch */
+    egen = e->gen;
+    xpthread_mutex_unlock (&sc->lock);
+    if (fstat (fd, &sb2) < 0 || sb2.st_dev != sb->st_dev
+                            || sb2.st_ino != sb->st_ino)
+        return;
+    xpthread_mutex_lock (&sc->lock);
+    if ((e = _lookup (sb2.st_dev, sb2.st_ino)) && e->gen == egen)
+        _fill (e, &sb2);
+done:
+    xpthread_mutex_unlock (&sc->lock);
+}
+
+int
+diod_statcache_get_neg (dev_t dev, ino_t ino, Npstr *name, uid_t uid)
+{
+    Sentry e;
+    Nentry n;
+    int rc = -1;
+
+    if (!sc)
+        return -1;
+    xpthread_mutex_lock (&sc->lock);
+    if ((e = _lookup (dev, ino)) && e->neg
+            && (n = _nlookup (e, name, uid, _name_hash (dev, ino, name)))) {
+        if (n->expires == 0 || _now () < n->expires) {
+            _nlru_unlink (n);
+            _nlru_push (n);
+            sc->nhits++;
+            rc = 0;
+        } else
+            _nremove (n);
+    }
+    xpthread_mutex_unlock (&sc->lock);
+    return rc;
+}
+
+void
+diod_statcache_put_neg (int fd, dev_t dev, ino_t ino, Npstr *name, uid_t uid,
+                        u64 gen)
+{
+    struct stat sb;
+    char *s;
+    u32 hash;
+    Sentry e;
+    Nentry n;
+    u64 egen;
+    int rc;
+
+    if (!sc)
+        return;
+    xpthread_mutex_lock (&sc->lock);
+    if (!(e = _entry (fd, dev, ino)))
+        goto done;
+    if (e->gen > gen) {
+        /* the lookup may predate a change or the watch: look again */
+        egen = e->gen;
+        xpthread_mutex_unlock (&sc->lock);
+        if (!(s = np_strdup (name)))
+            return;
+        rc = fstatat (fd, s, &sb, AT_SYMLINK_NOFOLLOW) < 0 ? errno : 0;
+        free (s);
+        if (rc != ENOENT)
+            return;
+        xpthread_mutex_lock (&sc->lock);
+        if (!(e = _lookup (dev, ino)) || e->gen != egen)
+            goto done;
+    }
+    hash = _name_hash (dev, ino, name);
+    if (!(n = _nlookup (e, name, uid, hash))) {
+        if (sc->ncount == sc->size)
+            _nremove (sc->ntail);
+        if (!(n = malloc (sizeof (*n) + name->len)))
+            goto done;
+        n->dir = e;
+        n->uid = uid;
+        n->hash = hash;
+        n->len = name->len;
+        memcpy (n->name, name->str, name->len);
+        _ninsert (n);
+    } else {
+        _nlru_unlink (n);
+        _nlru_push (n);
+    }
+    n->expires = sc->ttl > 0 ? _now () + sc->ttl : 0;
+    sc->nfills++;
+done:
+    xpthread_mutex_unlock (&sc->lock);
+}
+
+void
+diod_statcache_invalidate (dev_t dev, ino_t ino)
+{
+    Sentry e;
+
+    if (!sc)
+        return;
+    xpthread_mutex_lock (&sc->lock);
+    if ((e = _lookup (dev, ino)))
+        _invalidate (e);
+    xpthread_mutex_unlock (&sc->lock);
+}
+
+char *
+diod_statcache_ctl_get (char *name, void *a)
+{
+    char *s = NULL;
+    int len = 0;
+
+    if (!sc) {
+        if (aspf (&s, &len, "0 0 0 0 0 0 0 0 0 0 0\n") < 0)
+            np_uerror (ENOMEM);
+        return s;
+    }
+    xpthread_mutex_lock (&sc->lock);
+    if (aspf (&s, &len, "%d %d %d %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64
+              " %"PRIu64" %d %"PRIu64" %"PRIu64"\n", sc->size, sc->count,
+              sc->ttl, sc->hits, sc->misses, sc->fills, sc->invalidations,
+              sc->evictions, sc->ncount, sc->nhits, sc->nfills) < 0)
+        np_uerror (ENOMEM);
+    xpthread_mutex_unlock (&sc->lock);
+    return s;
+}
+
+int
+diod_statcache_init (int size, int ttl)
+{
+    int err;
+
+    if (size < 1)
+        return 0;
+    NP_ASSERT (sc == NULL);
+    if (!(sc = calloc (1, sizeof (*sc)))) {
+        np_uerror (ENOMEM);
+        return -1;
+    }
+    sc->ifd = sc->efd = -1;
+    pthread_mutex_init (&sc->lock, NULL);
+    sc->size = size;
+    sc->ttl = ttl;
+    for (sc->nbuckets = 16; sc->nbuckets < size; sc->nbuckets <<= 1)
+        ;
+    if (!(sc->byino = calloc (sc->nbuckets, sizeof (Sentry)))
+            || !(sc->bywd = calloc (sc->nbuckets, sizeof (Sentry)))
+            || !(sc->byname = calloc (sc->nbuckets, sizeof (Nentry)))) {
+        np_uerror (ENOMEM);
+        goto error;
+    }
+    if ((sc->ifd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC)) < 0
+            || (sc->efd = eventfd (0, EFD_CLOEXEC)) < 0) {
+        np_uerror (errno == EMFILE ? EMFILE : ENOSYS);
+        goto error;
+    }
+    if ((err = pthread_create (&sc->thread, NULL, _notify_proc, NULL))) {
+        np_uerror (err);
+        goto error;
+    }
+    return 0;
+error:
+    if (sc->ifd != -1)
+        close (sc->ifd);
+    if (sc->efd != -1)
+        close (sc->efd);
+    free (sc->byino);
+    free (sc->bywd);
+    free (sc->byname);
+    pthread_mutex_destroy (&sc->lock);
+    free (sc);
+    sc = NULL;
+    return -1;
+}
+
+void
+diod_statcache_fini (void)
+{
+    uint64_t val = 1;
+
+    if (!sc)
+        return;
+    if (write (sc->efd, &val, sizeof (val)) < 0)
+        err ("statcache: write eventfd");
+    pthread_join (sc->thread, NULL);
+    while (sc->head)
+        _remove (sc->head, 0);
+    close (sc->ifd); /* removes watches */
+    close (sc->efd);
+    free (sc->byino);
+    free (sc->bywd);
+    free (sc->byname);
+    pthread_mutex_destroy (&sc->lock);
+    free (sc);
+    sc = NULL;
+}
+
+#else
+
+int
+diod_statcache_init (int size, int ttl)
+{
+    if (size < 1)
+        return 0;
+    np_uerror (ENOSYS);
+    return -1;
+}
+
+void
+diod_statcache_fini (void)
+{
+}
+
+int
+diod_statcache_enabled (void)
+{
+    return 0;
+}
+
+int
+diod_statcache_get (dev_t dev, ino_t ino, struct stat *sb)
+{
+    return -1;
+}
+
+u64
+diod_statcache_gen (void)
+{
+    return 0;
+}
+
+int
+diod_statcache_get_neg (dev_t dev, ino_t ino, Npstr *name, uid_t uid)
+{
+    return -1;
+}
+
+void
+diod_statcache_put_neg (int fd, dev_t dev, ino_t ino, Npstr *name, uid_t uid,
+                        u64 gen)
+{
+}
+
+void
+diod_statcache_put (int fd, struct stat *sb, u64 gen)
+{
+}
+
+void
+diod_statcache_invalidate (dev_t dev, ino_t ino)
+{
+}
+
+char *
+diod_statcache_ctl_get (char *name, void *a)
+{
+    char *s = NULL;
+    int len = 0;
+
+    if (aspf (&s, &len, "0 0 0 0 0 0 0 0 0 0 0\n") < 0)
+        np_uerror (ENOMEM);
+    return s;
+}
+
+#endif
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
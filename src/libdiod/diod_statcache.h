@@ -0,0 +1,65 @@
+/************************************************************\
+ * Copyright 2010 Lawrence Livermore National Security, LLC
+ * (c.f. AUTHORS, NOTICE.LLNS, COPYING)
+ *
+ * This file is part of the diod 9P server project.
+ * For details, see https://github.com/chaos/diod.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+\************************************************************/
+
+#ifndef LIBDIOD_DIOD_STATCACHE_H
+#define LIBDIOD_DIOD_STATCACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "src/libnpfs/npfs.h"
+
+/* Start/stop the cache with room for 'size' files, whose attributes may
+ * be used for 'ttl' milliseconds (0 = until invalidated).  size < 1 leaves
+ * the cache disabled.  diod_statcache_init () fails with ENOSYS if inotify
+ * can't be used.
+ */
+int     diod_statcache_init (int size, int ttl);
+void    diod_statcache_fini (void);
+int     diod_statcache_enabled (void);
+
+/* Look up the attributes of file (dev, ino).  Returns 0 on a hit, or -1.
+ */
+int     diod_statcache_get (dev_t dev, ino_t ino, struct stat *sb);
+
+/* Cache 'sb', obtained by stat of 'fd' after diod_statcache_gen ()
+ * returned 'gen'.  If the file's entry has been invalidated or created
+ * since, 'sb' may be stale, so 'fd' is stat'ed again and that is cached.
+ */
+u64     diod_statcache_gen (void);
+void    diod_statcache_put (int fd, struct stat *sb, u64 gen);
+
+/* Look up 'name' in directory (dev, ino) on behalf of 'uid'.  Returns 0
+ * if it is known not to exist, or -1.
+ */
+int     diod_statcache_get_neg (dev_t dev, ino_t ino, Npstr *name, uid_t uid);
+
+/* Remember that 'uid' failed to find 'name' in directory (dev, ino), open
+ * on 'fd'.  If the directory's entry has been invalidated or created since
+ * 'gen', 'name' is looked up again first.
+ */
+void    diod_statcache_put_neg (int fd, dev_t dev, ino_t ino, Npstr *name,
+                                uid_t uid, u64 gen);
+
+/* Forget the attributes of file (dev, ino) after changing it, and if it
+ * is a directory, any names it was known not to contain.
+ */
+void    diod_statcache_invalidate (dev_t dev, ino_t ino);
+
+/* ctl file: size entries ttl hits misses fills invalidations evictions
+ *           negentries neghits negfills
+ */
+char    *diod_statcache_ctl_get (char *name, void *a);
+
+#endif
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -22,6 +22,7 @@
 #include <inttypes.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <pthread.h>
 #include <errno.h>
 #include <sys/types.h>
@@ -138,13 +139,18 @@ xattr_pread (Xattr x, void *buf, size_t count, off_t offset)
 }
 
 static int
-_lgetxattr (Xattr x, const char *path)
+_lgetxattr (Xattr x, Path p)
 {
 #if !HAVE_SYS_XATTR_H
   return 0;
 #else
+    char path[PATH_MAX];
     ssize_t len;
 
+    if (!path_procname (p, path, sizeof (path))) {
+        np_uerror (errno);
+        return -1;
+    }
     if (x->name)
         len = lgetxattr (path, x->name, NULL, 0);
     else
@@ -179,7 +185,7 @@ xattr_open (Npfid *fid, Npstr *name, u64 *sizep)
     assert (f->xattr == NULL);
 
     f->xattr = _xattr_create (name, 0, XATTR_FLAGS_GET, 0);
-    if (_lgetxattr (f->xattr, path_s (f->path)) < 0)
+    if (_lgetxattr (f->xattr, f->path) < 0)
         goto error;
     *sizep = (u64)f->xattr->len;
     return 0;
@@ -210,18 +216,22 @@ xattr_close (Npfid *fid)
   return 0;
 #else
     Fid *f = fid->aux;
+    char path[PATH_MAX];
     int rc = 0;
 
     if (f->xattr) {
         if ((f->xattr->flags & XATTR_FLAGS_SET)) {
-            if (f->xattr->len > 0) {
-                if (lsetxattr (path_s (f->path), f->xattr->name, f->xattr->buf,
+            if (!path_procname (f->path, path, sizeof (path))) {
+                np_uerror (errno);
+                rc = -1;
+            } else if (f->xattr->len > 0) {
+                if (lsetxattr (path, f->xattr->name, f->xattr->buf,
                                f->xattr->len, f->xattr->setflags) < 0) {
                     np_uerror (errno);
                     rc = -1;
                 }
             } else if (f->xattr->len == 0) {
-                if (lremovexattr (path_s (f->path), f->xattr->name) < 0) {
+                if (lremovexattr (path, f->xattr->name) < 0) {
                     np_uerror (errno);
                     rc = -1;
                 }
@@ -0,0 +1,221 @@
+/************************************************************\
+ * Copyright 2010 Lawrence Livermore National Security, LLC
+ * (c.f. AUTHORS, NOTICE.LLNS, COPYING)
+ *
+ * This file is part of the diod 9P server project.
+ * For details, see https://github.com/chaos/diod.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+\************************************************************/
+
+/* test reads, writes, fsync, and getattr completed by async I/O
+ *
+ * The export's thread pool may run only one request at a time.  A read
+ * queued on an empty FIFO waits in the ring, not in the worker, so other
+ * requests on the export still complete while it is outstanding.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "src/libtest/server.h"
+#include "src/libnpclient/npclient.h"
+#include "src/libnpclient/npcimpl.h"
+#include "src/libtap/tap.h"
+
+#include "diod_aio.h"
+#include "diod_sock.h"
+
+#define TEST_MSIZE 65536
+
+typedef struct {
+    Npcfid *fid;
+    char buf[64];
+    int n;
+} Reader;
+
+static void *read_proc (void *a)
+{
+    Reader *r = a;
+
+    r->n = npc_read (r->fid, r->buf, sizeof (r->buf));
+    return NULL;
+}
+
+static int check_file (char *path, char *buf, int len)
+{
+    char *buf2 = malloc (len);
+    int fd, n = -1;
+
+    if (!buf2)
+        BAIL_OUT ("out of memory");
+    if ((fd = open (path, O_RDONLY)) >= 0) {
+        n = read (fd, buf2, len);
+        close (fd);
+    }
+    n = (n == len && memcmp (buf, buf2, len) == 0) ? 0 : -1;
+    free (buf2);
+    return n;
+}
+
+static int fsync_fid (Npcfid *fid)
+{
+    Npfcall *tc, *rc = NULL;
+    int n = -1;
+
+    if (!(tc = np_create_tfsync (fid->fid, 0)))
+        BAIL_OUT ("out of memory");
+    if (fid->fsys->rpc (fid->fsys, tc, &rc) == 0 && rc->type == Rfsync)
+        n = 0;
+    np_free_fcall (tc);
+    if (rc)
+        np_free_fcall (rc);
+    return n;
+}
+
+/* Tgetattr 'request_mask' on fid, returning the Rgetattr valid mask,
+ * or 0 on failure.
+ */
+static u64 getattr_valid (Npcfid *fid, u64 request_mask, u64 *btime)
+{
+    Npqid qid;
+    u32 mode, uid, gid;
+    u64 valid, nlink, rdev, size, blksize, blocks;
+    u64 atime_sec, atime_nsec, mtime_sec, mtime_nsec, ctime_sec, ctime_nsec;
+    u64 btime_nsec, gen, data_version;
+
+    if (npc_getattr (fid, request_mask, &valid, &qid, &mode, &uid, &gid,
+                     &nlink, &rdev, &size, &blksize, &blocks,
+                     &atime_sec, &atime_nsec, &mtime_sec, &mtime_nsec,
+                     &ctime_sec, &ctime_nsec, btime, &btime_nsec,
+                     &gen, &data_version) < 0)
+        return 0;
+    return valid;
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npsrv *srv;
+    int client_fd, s[2], fd;
+    Npcfid *root, *root2, *f;
+    char tmpdir[] = "/tmp/test-aio.XXXXXX";
+    char path[PATH_MAX], fifo[PATH_MAX];
+    int i, n, len = 4096*100;
+    char *buf = malloc (len);
+    char *buf2 = malloc (len);
+    struct stat sb;
+    u64 bt;
+    Reader r;
+    pthread_t t;
+
+    if (!buf || !buf2)
+        BAIL_OUT ("out of memory");
+    if (diod_aio_init (2) < 0) {
+        if (np_rerror () != ENOSYS)
+            BAIL_OUT ("diod_aio_init: %s", strerror (np_rerror ()));
+        plan (SKIP_ALL, "io_uring is not available");
+        return 0;
+    }
+    plan (NO_PLAN);
+    ok (diod_aio_enabled (), "async I/O is enabled");
+
+    if (!mkdtemp (tmpdir))
+        BAIL_OUT ("mkdtemp: %s", strerror (errno));
+    snprintf (path, sizeof (path), "%s/foo", tmpdir);
+    snprintf (fifo, sizeof (fifo), "%s/fifo", tmpdir);
+
+    /* N.B. diod_init () leaves the running engine alone */
+    srv = test_server_create (tmpdir, 0, &client_fd);
+    if (np_srv_set_wthreads (srv, 1, 4, 1, 0) < 0)
+        BAIL_OUT ("np_srv_set_wthreads: %s", strerror (np_rerror ()));
+
+    root = npc_mount (client_fd, client_fd, TEST_MSIZE, tmpdir, NULL);
+    if (!root)
+        BAIL_OUT ("npc_mount: %s", strerror (np_rerror ()));
+
+    for (n = 0; n < len; n++)
+        buf[n] = n * 7;
+    f = npc_create_bypath (root, "foo", O_RDWR, 0644, getgid ());
+    if (!f)
+        BAIL_OUT ("npc_create_bypath foo: %s", strerror (np_rerror ()));
+    for (n = 0; n < len; n += i) {
+        if ((i = npc_write (f, buf + n, len - n)) <= 0)
+            break;
+    }
+    ok (n == len, "npc_write %d bytes works", len);
+    ok (fsync_fid (f) == 0, "fsync works");
+    ok (check_file (path, buf, len) == 0, "file contains what was written");
+    ok (npc_fstat (f, &sb) == 0 && sb.st_size == len,
+        "getattr on the open fid reports size %d", len);
+    ok (getattr_valid (f, Gamode | Gauid, &bt) == (Gamode | Gauid),
+        "getattr of mode and uid on the open fid reports only them valid");
+    if ((getattr_valid (f, Gaall, &bt) & Gabtime))
+        ok (bt > 0, "getattr on the open fid reports btime");
+    else
+        diag ("%s does not report btime", tmpdir);
+    ok (npc_clunk (f) == 0, "npc_clunk works");
+
+    n = npc_get (root, "foo", buf2, len);
+    ok (n == len && memcmp (buf, buf2, len) == 0,
+        "npc_get reads back %d bytes intact", len);
+
+    /* second client reads from an empty FIFO */
+    if (mkfifo (fifo, 0644) < 0)
+        BAIL_OUT ("mkfifo: %s", strerror (errno));
+    if (socketpair (AF_LOCAL, SOCK_STREAM, 0, s) < 0)
+        BAIL_OUT ("socketpair: %s", strerror (errno));
+    diod_sock_startfd (srv, s[1], s[1], "aio-test-client2", 0);
+    if (!(root2 = npc_mount (s[0], s[0], TEST_MSIZE, tmpdir, NULL)))
+        BAIL_OUT ("npc_mount: %s", strerror (np_rerror ()));
+    if (!(r.fid = npc_open_bypath (root2, "fifo", O_RDWR)))
+        BAIL_OUT ("npc_open_bypath fifo: %s", strerror (np_rerror ()));
+    if ((errno = pthread_create (&t, NULL, read_proc, &r)))
+        BAIL_OUT ("pthread_create: %s", strerror (errno));
+    usleep (100000);
+
+    ok (npc_stat (root, "foo", &sb) == 0 && sb.st_size == len,
+        "requests complete while a read waits on the FIFO");
+
+    if ((fd = open (fifo, O_WRONLY)) < 0)
+        BAIL_OUT ("open %s: %s", fifo, strerror (errno));
+    if (write (fd, "hello", 5) != 5)
+        BAIL_OUT ("write %s: %s", fifo, strerror (errno));
+    close (fd);
+    if ((errno = pthread_join (t, NULL)))
+        BAIL_OUT ("pthread_join: %s", strerror (errno));
+    ok (r.n == 5 && memcmp (r.buf, "hello", 5) == 0,
+        "FIFO read completes when data arrives");
+    ok (npc_clunk (r.fid) == 0, "npc_clunk fifo works");
+    npc_umount (root2);
+
+    ok (npc_remove_bypath (root, "foo") == 0, "npc_remove_bypath foo works");
+    ok (npc_remove_bypath (root, "fifo") == 0, "npc_remove_bypath fifo works");
+    npc_umount (root);
+
+    test_server_destroy (srv); /* calls diod_aio_fini () */
+    ok (!diod_aio_enabled (), "async I/O is disabled after diod_fini");
+
+    rmdir (tmpdir);
+    free (buf);
+    free (buf2);
+
+    done_testing ();
+
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -44,7 +44,7 @@ static void test_config1 (void)
 exports = {\n\
 	\"/g/g1\",\n\
 	\"/g/g2\",\n\
-	{ path=\"/g/g3\", opts=\"ro\", users=\"jim,bob\", hosts=\"foo[1-64]\" },\n\
+	{ path=\"/g/g3\", opts=\"ro,statcache\", users=\"jim,bob\", hosts=\"foo[1-64]\" },\n\
 	\"/g/g5\",\n\
 	{ path=\"/g/g4\", users=\"jim,bob\" },\n\
 	\"/g/g6\",\n\
@@ -61,6 +61,27 @@ exports = {\n\
     is (s, path, "configpath is %s", path);
     ok (diod_conf_get_debuglevel () == DFLT_DEBUGLEVEL, "debuglevel is default");
     ok (diod_conf_get_nwthreads () == DFLT_NWTHREADS, "nwthreads is default");
+    ok (diod_conf_get_nwthreads_max () == DFLT_NWTHREADS_MAX,
+        "nwthreads_max is default");
+    ok (diod_conf_get_nwthreads_export () == DFLT_NWTHREADS_EXPORT,
+        "nwthreads_export is default");
+    ok (diod_conf_get_maxreqs_conn () == DFLT_MAXREQS_CONN,
+        "maxreqs_conn is default");
+    ok (diod_conf_get_maxmem_conn () == DFLT_MAXMEM_CONN,
+        "maxmem_conn is default");
+    ok (diod_conf_get_maxreqs () == DFLT_MAXREQS, "maxreqs is default");
+    ok (diod_conf_get_maxmem () == DFLT_MAXMEM, "maxmem is default");
+    ok (diod_conf_get_io_uring () == DFLT_IO_URING, "io_uring is default");
+    ok (diod_conf_get_aio_threads () == DFLT_AIO_THREADS,
+        "aio_threads is default");
+    ok (diod_conf_get_shm_transport () == DFLT_SHM_TRANSPORT,
+        "shm_transport is default");
+    ok (diod_conf_get_statcache_size () == DFLT_STATCACHE_SIZE,
+        "statcache_size is default");
+    ok (diod_conf_get_statcache_ttl () == DFLT_STATCACHE_TTL,
+        "statcache_ttl is default");
+    ok (diod_conf_get_statmemo_usec () == DFLT_STATMEMO_USEC,
+        "statmemo_usec is default");
     ok (diod_conf_get_auth_required () == DFLT_AUTH_REQUIRED,
         "auth_required is default");
     ok (diod_conf_get_hostname_lookup () == DFLT_HOSTNAME_LOOKUP,
@@ -82,6 +103,8 @@ exports = {\n\
     ok (diod_conf_opt_listen () == 0, "listen is read-write");
     list_iterator_destroy (itr);
 
+    ok (list_count (diod_conf_get_weights ()) == 0, "weights is empty");
+
     Export *item;
     if (!(itr = list_iterator_create (diod_conf_get_exports ())))
         BAIL_OUT ("could not create list iterator for exports");
@@ -99,7 +122,8 @@ exports = {\n\
         "entry 2 was correctly parsed");
     ok ((item = list_next (itr)) != NULL
         && !strcmp (item->path, "/g/g3")
-        && item->opts && !strcmp (item->opts, "ro")
+        && item->opts && !strcmp (item->opts, "ro,statcache")
+        && item->oflags == (XFLAGS_RO | XFLAGS_STATCACHE)
         && item->users && !strcmp (item->users, "jim,bob")
         && item->hosts && !strcmp (item->hosts, "foo[1-64]"),
         "entry 3 was correctly parsed");
@@ -135,11 +159,22 @@ void test_config2 (void)
     char path[] = "/tmp/config.XXXXXX";
     const char *content = "\
 nwthreads = 64\n\
+nwthreads_max = 256\n\
+nwthreads_export = 32\n\
+maxreqs_conn = 64\n\
+maxmem = 512\n\
+io_uring = 1\n\
+aio_threads = 2\n\
+shm_transport = 1\n\
+statcache_size = 100\n\
+statcache_ttl = 0\n\
+statmemo_usec = 0\n\
 auth_required = 1\n\
 allsquash = 1\n\
 listen = { \"1.2.3.4:42\", \"1,2,3,5:43\" }\n\
 logdest = \"/tmp/diod.log\"\n\
 exportall = 1\n\
+weights = { \"user:batch=1\", \"host:login[1-4]=4\" }\n\
 \n\
 exports = { \"/g/g1\" }\n";
 
@@ -155,6 +190,16 @@ exports = { \"/g/g1\" }\n";
     is (s, path, "configpath is %s", path);
     ok (diod_conf_get_debuglevel () == DFLT_DEBUGLEVEL, "debuglevel is default");
     ok (diod_conf_get_nwthreads () == 64, "nwthreads is 64");
+    ok (diod_conf_get_nwthreads_max () == 256, "nwthreads_max is 256");
+    ok (diod_conf_get_nwthreads_export () == 32, "nwthreads_export is 32");
+    ok (diod_conf_get_maxreqs_conn () == 64, "maxreqs_conn is 64");
+    ok (diod_conf_get_maxmem () == 512, "maxmem is 512");
+    ok (diod_conf_get_io_uring () == 1, "io_uring is 1");
+    ok (diod_conf_get_aio_threads () == 2, "aio_threads is 2");
+    ok (diod_conf_get_shm_transport () == 1, "shm_transport is 1");
+    ok (diod_conf_get_statcache_size () == 100, "statcache_size is 100");
+    ok (diod_conf_get_statcache_ttl () == 0, "statcache_ttl is 0");
+    ok (diod_conf_get_statmemo_usec () == 0, "statmemo_usec is 0");
     ok (diod_conf_get_auth_required () != 0, "auth_required is true");
     ok (diod_conf_get_hostname_lookup () == DFLT_HOSTNAME_LOOKUP,
         "hostname_lookup is default");
@@ -179,6 +224,23 @@ exports = { \"/g/g1\" }\n";
     ok (diod_conf_opt_listen () == 0, "listen is read-write");
     list_iterator_destroy (itr);
 
+    Weight *w;
+    if (!(itr = list_iterator_create (diod_conf_get_weights ())))
+        BAIL_OUT ("could not create list iterator for weights");
+    ok ((w = list_next (itr)) != NULL
+        && w->user && !strcmp (w->user, "batch")
+        && !w->hosts
+        && w->weight == 1,
+        "weights entry 1 is user batch weight 1");
+    ok ((w = list_next (itr)) != NULL
+        && !w->user
+        && w->hosts && hostlist_find (w->hosts, "login3") != -1
+        && hostlist_find (w->hosts, "login5") == -1
+        && w->weight == 4
+        && list_next (itr) == NULL,
+        "weights entry 2 is hosts login[1-4] weight 4");
+    list_iterator_destroy (itr);
+
     Export *item;
     if (!(itr = list_iterator_create (diod_conf_get_exports ())))
         BAIL_OUT ("could not create list iterator for exports");
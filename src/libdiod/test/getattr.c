@@ -0,0 +1,139 @@
+/************************************************************\
+ * Copyright 2010 Lawrence Livermore National Security, LLC
+ * (c.f. AUTHORS, NOTICE.LLNS, COPYING)
+ *
+ * This file is part of the diod 9P server project.
+ * For details, see https://github.com/chaos/diod.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+\************************************************************/
+
+/* test that Rgetattr reports the attributes Tgetattr asked for
+ *
+ * statmemo_usec is 0 so each getattr stats the file itself, rather than
+ * returning what the walk before it saw.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "src/libtest/server.h"
+#include "src/libnpclient/npclient.h"
+#include "src/libtap/tap.h"
+
+#include "diod_conf.h"
+
+#define TEST_MSIZE 8192
+
+typedef struct {
+    u64 valid;
+    Npqid qid;
+    u32 mode, uid, gid;
+    u64 nlink, rdev, size, blksize, blocks;
+    u64 atime_sec, atime_nsec, mtime_sec, mtime_nsec, ctime_sec, ctime_nsec;
+    u64 btime_sec, btime_nsec, gen, data_version;
+} Attr;
+
+static int getattr (Npcfid *fid, u64 request_mask, Attr *a)
+{
+    return npc_getattr (fid, request_mask, &a->valid, &a->qid, &a->mode,
+                        &a->uid, &a->gid, &a->nlink, &a->rdev, &a->size,
+                        &a->blksize, &a->blocks,
+                        &a->atime_sec, &a->atime_nsec,
+                        &a->mtime_sec, &a->mtime_nsec,
+                        &a->ctime_sec, &a->ctime_nsec,
+                        &a->btime_sec, &a->btime_nsec,
+                        &a->gen, &a->data_version);
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npsrv *srv;
+    int client_fd;
+    Npcfid *root, *fid;
+    char tmpdir[] = "/tmp/test-getattr.XXXXXX";
+    char path[PATH_MAX];
+    struct stat sb;
+    Attr a;
+    u64 dv;
+
+    plan (NO_PLAN);
+
+    if (!mkdtemp (tmpdir))
+        BAIL_OUT ("mkdtemp: %s", strerror (errno));
+
+    srv = test_server_create (tmpdir, 0, &client_fd);
+    diod_conf_set_statmemo_usec (0);
+
+    root = npc_mount (client_fd, client_fd, TEST_MSIZE, tmpdir, NULL);
+    if (!root)
+        BAIL_OUT ("npc_mount: %s", strerror (np_rerror ()));
+
+    fid = npc_create_bypath (root, "foo", O_RDWR, 0644, getgid ());
+    ok (fid != NULL, "npc_create_bypath foo works");
+    if (!fid)
+        BAIL_OUT ("npc_create_bypath: %s", strerror (np_rerror ()));
+    snprintf (path, sizeof (path), "%s/foo", tmpdir);
+    if (stat (path, &sb) < 0)
+        BAIL_OUT ("stat %s: %s", path, strerror (errno));
+
+    ok (getattr (fid, Gabasic, &a) == 0 && a.valid == Gabasic,
+        "getattr of basic attributes reports them valid");
+    ok (a.qid.path == sb.st_ino && (a.mode & 0777) == 0644 && a.size == 0
+        && a.nlink == 1 && a.uid == sb.st_uid && a.gid == sb.st_gid,
+        "and they are correct");
+
+    ok (getattr (fid, Gamode | Gauid, &a) == 0
+        && a.valid == (Gamode | Gauid) && S_ISREG (a.mode)
+        && (a.mode & 0777) == 0644 && a.uid == sb.st_uid,
+        "getattr of mode and uid reports only them valid");
+
+    ok (getattr (fid, Gaall, &a) == 0
+        && (a.valid & (Gabasic | Gadataversion)) == (Gabasic | Gadataversion),
+        "getattr of all attributes reports basic ones and data_version valid");
+    ok (!(a.valid & Gagen), "gen is not reported valid");
+    if ((a.valid & Gabtime))
+        ok (a.btime_sec > 0 && a.btime_sec <= a.ctime_sec,
+            "btime is plausible");
+    else
+        diag ("%s does not report btime", tmpdir);
+    dv = a.data_version;
+
+    usleep (20000); /* let the clock move past ctime */
+    ok (npc_pwrite (fid, "hello", 5, 0) == 5, "npc_pwrite works");
+    ok (getattr (fid, Gasize | Gadataversion, &a) == 0
+        && a.valid == (Gasize | Gadataversion) && a.size == 5,
+        "getattr of size and data_version works");
+    ok (a.data_version != dv, "data_version changed after write");
+    dv = a.data_version;
+    ok (getattr (fid, Gadataversion, &a) == 0 && a.data_version == dv,
+        "data_version is unchanged without a change to the file");
+
+    ok (npc_clunk (fid) == 0, "npc_clunk works");
+    ok (npc_remove_bypath (root, "foo") == 0, "npc_remove_bypath foo works");
+
+    npc_umount (root);
+
+    test_server_destroy (srv);
+
+    rmdir (tmpdir);
+
+    done_testing ();
+
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,470 @@
+/************************************************************\
+ * Copyright 2010 Lawrence Livermore National Security, LLC
+ * (c.f. AUTHORS, NOTICE.LLNS, COPYING)
+ *
+ * This file is part of the diod 9P server project.
+ * For details, see https://github.com/chaos/diod.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+\************************************************************/
+
+/* test fids that outlive renames and replacement of the files they name
+ *
+ * Paths hold descriptors for the files they were walked to, so a fid
+ * keeps working when a directory above it is renamed on the server, and
+ * a fresh walk to a name that now refers to a different file finds the
+ * new file.  The descriptors paths may hold are capped.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#if HAVE_SYS_XATTR_H
+#include <sys/xattr.h>
+#endif
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "src/libtest/server.h"
+#include "src/libdiod/diod_conf.h"
+#include "src/libnpclient/npclient.h"
+#include "src/libnpclient/npcimpl.h"
+#include "src/libtap/tap.h"
+
+#define TEST_MSIZE 8192
+#define TEST_NPATHS 600 /* enough to grow the path pool */
+#define TEST_FDLIMIT 256 /* RLIMIT_NOFILE for test_fdlimit () */
+
+static void make_file (char *path, char *content)
+{
+    int fd;
+
+    if ((fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        BAIL_OUT ("open %s: %s", path, strerror (errno));
+    if (write (fd, content, strlen (content)) != strlen (content))
+        BAIL_OUT ("write %s: %s", path, strerror (errno));
+    close (fd);
+}
+
+static void join (char *buf, char *dir, char *name)
+{
+    snprintf (buf, PATH_MAX, "%s/%s", dir, name);
+}
+
+/* Walk 'names' from root in one Twalk and return the number of qids in
+ * the Rwalk, or -1 on error.
+ */
+static int walk_count (Npcfid *root, int n, char **names)
+{
+    Npcfid *fid;
+    Npfcall *tc, *rc = NULL;
+    int nwqid = -1;
+
+    if (!(fid = npc_fid_alloc (root->fsys)))
+        BAIL_OUT ("npc_fid_alloc: %s", strerror (np_rerror ()));
+    if (!(tc = np_create_twalk (root->fid, fid->fid, n, names)))
+        BAIL_OUT ("out of memory");
+    if (root->fsys->rpc (root->fsys, tc, &rc) == 0 && rc->type == Rwalk)
+        nwqid = rc->u.rwalk.nwqid;
+    free (tc);
+    if (rc)
+        free (rc);
+    if (nwqid > 0)
+        (void)npc_clunk (fid);
+    else
+        npc_fid_free (fid);
+    return nwqid;
+}
+
+/* Walk a chain of directories deeper than one Twalk can reach, then
+ * check where multi-component walks stop.
+ */
+static void test_walkn (Npcfid *root, char *tmpdir)
+{
+    char path[PATH_MAX], fpath[PATH_MAX], *p;
+    char *file[] = { "d", "d", "f", "x" };
+    char *missing[] = { "d", "nope", "x" };
+    char *missing0[] = { "nope", "d" };
+    Npcfid *fid;
+    struct stat sb;
+    int i, len;
+
+    len = snprintf (path, sizeof (path), "%s", tmpdir);
+    for (i = 0; i < 20; i++) {
+        len += snprintf (path + len, sizeof (path) - len, "/d");
+        if (mkdir (path, 0755) < 0)
+            BAIL_OUT ("mkdir %s: %s", path, strerror (errno));
+    }
+    join (fpath, tmpdir, "d/d/f");
+    make_file (fpath, "f");
+
+    p = path;
+    for (i = 0; i < 20; i++)
+        p += sprintf (p, "%sd", i > 0 ? "/" : "");
+    fid = npc_walk (root, path);
+    ok (fid != NULL && npc_fstat (fid, &sb) == 0 && S_ISDIR (sb.st_mode),
+        "walk of 20 directories works");
+    if (fid)
+        (void)npc_clunk (fid);
+
+    ok (walk_count (root, 4, file) == 3,
+        "multi-component walk stops after a file");
+    ok (walk_count (root, 3, missing) == 1,
+        "multi-component walk stops at a missing entry");
+    ok (walk_count (root, 2, missing0) == -1,
+        "multi-component walk fails if the first entry is missing");
+
+    fid = npc_walk (root, "d/d/f");
+    ok (fid != NULL && npc_fchmod (fid, 0600) == 0
+                    && stat (fpath, &sb) == 0 && (sb.st_mode & 0777) == 0600,
+        "setattr mode works on a fid from a multi-component walk");
+    if (fid)
+        (void)npc_remove (fid);
+    for (i = 20; i > 0; i--) {
+        path[i * 2 - 1] = '\0';
+        if (npc_remove_bypath (root, path) < 0)
+            diag ("remove %s: %s", path, strerror (np_rerror ()));
+    }
+}
+
+/* Hold fids on many files at once, then walk to each again.
+ */
+static void test_many (Npcfid *root, char *tmpdir)
+{
+    static Npcfid *fids[TEST_NPATHS];
+    char path[PATH_MAX], name[32];
+    struct stat sb;
+    int i, errors = 0;
+
+    join (path, tmpdir, "many");
+    if (mkdir (path, 0755) < 0)
+        BAIL_OUT ("mkdir %s: %s", path, strerror (errno));
+    for (i = 0; i < TEST_NPATHS; i++) {
+        snprintf (name, sizeof (name), "many/%d", i);
+        join (path, tmpdir, name);
+        make_file (path, name);
+    }
+    for (i = 0; i < TEST_NPATHS; i++) {
+        snprintf (name, sizeof (name), "many/%d", i);
+        if (!(fids[i] = npc_walk (root, name))) {
+            diag ("npc_walk %s: %s", name, strerror (np_rerror ()));
+            errors++;
+        }
+    }
+    ok (errors == 0, "walked to %d files", TEST_NPATHS);
+    errors = 0;
+    for (i = 0; i < TEST_NPATHS; i++) {
+        snprintf (name, sizeof (name), "many/%d", i);
+        if (npc_stat (root, name, &sb) < 0 || sb.st_size != strlen (name))
+            errors++;
+        if (!fids[i] || npc_fstat (fids[i], &sb) < 0
+                     || sb.st_size != strlen (name))
+            errors++;
+    }
+    ok (errors == 0, "all %d files can be walked again", TEST_NPATHS);
+    errors = 0;
+    for (i = 0; i < TEST_NPATHS; i++) {
+        if (fids[i] && npc_remove (fids[i]) < 0)
+            errors++;
+    }
+    ok (errors == 0, "npc_remove removed %d files", TEST_NPATHS);
+    ok (npc_remove_bypath (root, "many") == 0, "npc_remove_bypath many works");
+}
+
+/* Raise the open file limit as far as allowed and return it.
+ */
+static rlim_t raise_fdlimit (void)
+{
+    struct rlimit r;
+
+    if (getrlimit (RLIMIT_NOFILE, &r) < 0)
+        return 0;
+    if (r.rlim_cur < r.rlim_max) {
+        r.rlim_cur = r.rlim_max;
+        (void)setrlimit (RLIMIT_NOFILE, &r);
+        if (getrlimit (RLIMIT_NOFILE, &r) < 0)
+            return 0;
+    }
+    return r.rlim_cur;
+}
+
+/* With a low open file limit, paths walked once paths hold half of it
+ * have no descriptor, rather than the server running out of descriptors,
+ * and are resolved by name through the nearest directory that has one.
+ */
+static void test_fdlimit (char *tmpdir)
+{
+    static Npcfid *fids[TEST_FDLIMIT];
+    struct rlimit r, saved;
+    char path[PATH_MAX], path2[PATH_MAX], name[32], buf[32];
+    struct stat sb;
+    Npsrv *srv;
+    Npcfid *root, *dir, *fid;
+    int client_fd, i, n;
+
+    join (path, tmpdir, "fdlimit");
+    if (mkdir (path, 0755) < 0)
+        BAIL_OUT ("mkdir %s: %s", path, strerror (errno));
+    for (i = 0; i < TEST_FDLIMIT; i++) {
+        snprintf (name, sizeof (name), "fdlimit/%d", i);
+        join (path, tmpdir, name);
+        make_file (path, name);
+    }
+    if (getrlimit (RLIMIT_NOFILE, &saved) < 0)
+        BAIL_OUT ("getrlimit: %s", strerror (errno));
+    r = saved;
+    r.rlim_cur = TEST_FDLIMIT;
+    if (setrlimit (RLIMIT_NOFILE, &r) < 0)
+        BAIL_OUT ("setrlimit: %s", strerror (errno));
+
+    srv = test_server_create (tmpdir, 0, &client_fd);
+    root = npc_mount (client_fd, client_fd, TEST_MSIZE, tmpdir, NULL);
+    if (!root)
+        BAIL_OUT ("npc_mount: %s", strerror (np_rerror ()));
+    if (!(dir = npc_walk (root, "fdlimit")))
+        BAIL_OUT ("npc_walk fdlimit: %s", strerror (np_rerror ()));
+    for (n = 0; n < TEST_FDLIMIT; n++) {
+        snprintf (name, sizeof (name), "%d", n);
+        if (!(fids[n] = npc_walk (dir, name)))
+            break;
+    }
+    ok (n == TEST_FDLIMIT, "walks work after paths hold half of RLIMIT_NOFILE");
+    diag ("walked %d of %d files", n, TEST_FDLIMIT);
+
+    join (path, tmpdir, "fdlimit");
+    join (path2, tmpdir, "fdlimit2");
+    if (rename (path, path2) < 0)
+        BAIL_OUT ("rename %s: %s", path, strerror (errno));
+    fid = n > 0 ? fids[n - 1] : NULL;
+    ok (fid && npc_fstat (fid, &sb) == 0 && S_ISREG (sb.st_mode),
+        "getattr works on a path without a descriptor after a rename above");
+    ok (fid && npc_open (fid, O_RDONLY) == 0, "npc_open works");
+    snprintf (name, sizeof (name), "fdlimit/%d", n - 1);
+    ok (fid && npc_read (fid, buf, sizeof (buf)) == strlen (name)
+        && memcmp (buf, name, strlen (name)) == 0, "npc_read works");
+    if (rename (path2, path) < 0)
+        BAIL_OUT ("rename %s: %s", path2, strerror (errno));
+    ok ((fid = npc_walk (root, name)) != NULL,
+        "a multi-component walk to a path without a descriptor works");
+    if (fid)
+        (void)npc_clunk (fid);
+
+    for (i = 0; i < n; i++)
+        (void)npc_clunk (fids[i]);
+    (void)npc_clunk (dir);
+    npc_umount (root);
+    test_server_destroy (srv);
+
+    if (setrlimit (RLIMIT_NOFILE, &saved) < 0)
+        BAIL_OUT ("setrlimit: %s", strerror (errno));
+    for (i = 0; i < TEST_FDLIMIT; i++) {
+        snprintf (name, sizeof (name), "fdlimit/%d", i);
+        join (path, tmpdir, name);
+        (void)unlink (path);
+    }
+    join (path, tmpdir, "fdlimit");
+    (void)rmdir (path);
+}
+
+/* Set an xattr through 'f', whose file is now at 'path' on the server.
+ */
+static void test_xattr (Npcfid *f, char *path)
+{
+#if HAVE_SYS_XATTR_H
+    Npcfid *x;
+    char buf[8];
+    int rc = -1;
+
+    skip (lsetxattr (path, "user.diodtest", "y", 1, 0) < 0, 1,
+          "user xattrs are not supported");
+    if ((x = npc_clone (f))) {
+        if (npc_xattrcreate (x, "user.diodtest", 1, 0) == 0
+                                    && npc_write (x, "x", 1) == 1)
+            rc = 0;
+        if (npc_clunk (x) < 0)
+            rc = -1;
+    }
+    ok (rc == 0 && lgetxattr (path, "user.diodtest", buf, sizeof (buf)) == 1
+                && buf[0] == 'x',
+        "xattr set works after the parent was renamed");
+    end_skip;
+#endif
+}
+
+static int mode_of (char *path)
+{
+    struct stat sb;
+
+    if (stat (path, &sb) < 0)
+        BAIL_OUT ("stat %s: %s", path, strerror (errno));
+    return sb.st_mode & 0777;
+}
+
+/* With a long statmemo_usec, the getattr after a walk or open returns what
+ * the walk or open saw, once, unless the fid was used to change the file.
+ */
+static void test_memo (Npcfid *root, char *tmpdir)
+{
+    char path[PATH_MAX];
+    Npcfid *fid;
+    struct stat sb;
+
+    join (path, tmpdir, "memo");
+    make_file (path, "memo");
+    if (chmod (path, 0644) < 0)
+        BAIL_OUT ("chmod %s: %s", path, strerror (errno));
+    diod_conf_set_statmemo_usec (60 * 1000000);
+
+    if (!(fid = npc_walk (root, "memo")))
+        BAIL_OUT ("npc_walk memo: %s", strerror (np_rerror ()));
+    if (chmod (path, 0600) < 0)
+        BAIL_OUT ("chmod %s: %s", path, strerror (errno));
+    ok (npc_fstat (fid, &sb) == 0 && (sb.st_mode & 0777) == 0644,
+        "getattr after walk returns what the walk saw");
+    ok (npc_fstat (fid, &sb) == 0 && (sb.st_mode & 0777) == 0600,
+        "the next getattr sees the change");
+
+    ok (npc_open (fid, O_RDWR) == 0, "npc_open works");
+    if (chmod (path, 0640) < 0)
+        BAIL_OUT ("chmod %s: %s", path, strerror (errno));
+    ok (npc_fstat (fid, &sb) == 0 && (sb.st_mode & 0777) == 0600,
+        "getattr after open returns what the open saw");
+    ok (npc_fstat (fid, &sb) == 0 && (sb.st_mode & 0777) == 0640,
+        "the next getattr sees the change");
+    ok (npc_clunk (fid) == 0, "npc_clunk works");
+
+    if (!(fid = npc_walk (root, "memo")))
+        BAIL_OUT ("npc_walk memo: %s", strerror (np_rerror ()));
+    ok (npc_fchmod (fid, 0604) == 0 && mode_of (path) == 0604
+        && npc_fstat (fid, &sb) == 0 && (sb.st_mode & 0777) == 0604,
+        "getattr after setattr through the fid sees the change");
+    ok (npc_clunk (fid) == 0, "npc_clunk works");
+
+    diod_conf_set_statmemo_usec (0);
+    if (!(fid = npc_walk (root, "memo")))
+        BAIL_OUT ("npc_walk memo: %s", strerror (np_rerror ()));
+    if (chmod (path, 0600) < 0)
+        BAIL_OUT ("chmod %s: %s", path, strerror (errno));
+    ok (npc_fstat (fid, &sb) == 0 && (sb.st_mode & 0777) == 0600,
+        "with statmemo_usec = 0, getattr after walk sees the change");
+    ok (npc_remove (fid) == 0, "npc_remove works");
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npsrv *srv;
+    int client_fd;
+    Npcfid *root, *dir, *f, *f2;
+    char tmpdir[] = "/tmp/test-path.XXXXXX";
+    char path[PATH_MAX], path2[PATH_MAX];
+    char buf[64];
+    struct stat sb, sb2;
+    int n;
+
+    /* N.B. paths may only hold half of RLIMIT_NOFILE (see test_many) */
+    if (raise_fdlimit () < 2 * (TEST_NPATHS + 64)) {
+        plan (SKIP_ALL, "the open file limit is too low");
+        return 0;
+    }
+    plan (NO_PLAN);
+
+    if (!mkdtemp (tmpdir))
+        BAIL_OUT ("mkdtemp: %s", strerror (errno));
+    join (path, tmpdir, "a");
+    if (mkdir (path, 0755) < 0)
+        BAIL_OUT ("mkdir %s: %s", path, strerror (errno));
+    join (path, tmpdir, "a/b");
+    if (mkdir (path, 0755) < 0)
+        BAIL_OUT ("mkdir %s: %s", path, strerror (errno));
+    join (path, tmpdir, "a/b/f");
+    make_file (path, "hello");
+
+    srv = test_server_create (tmpdir, 0, &client_fd);
+
+    root = npc_mount (client_fd, client_fd, TEST_MSIZE, tmpdir, NULL);
+    if (!root)
+        BAIL_OUT ("npc_mount: %s", strerror (np_rerror ()));
+
+    dir = npc_walk (root, "a/b");
+    ok (dir != NULL, "npc_walk a/b works");
+    f = npc_walk (root, "a/b/f");
+    ok (f != NULL, "npc_walk a/b/f works");
+    if (!dir || !f)
+        BAIL_OUT ("npc_walk: %s", strerror (np_rerror ()));
+
+    /* rename a directory above both fids behind the server's back */
+    join (path, tmpdir, "a");
+    join (path2, tmpdir, "c");
+    if (rename (path, path2) < 0)
+        BAIL_OUT ("rename: %s", strerror (errno));
+
+    ok (npc_fstat (f, &sb) == 0 && sb.st_size == 5,
+        "getattr on the file works after its parent was renamed");
+    ok (npc_fchmod (f, 0600) == 0, "setattr mode works");
+    ok (npc_ftruncate (f, 4) == 0, "setattr size works");
+    join (path, tmpdir, "c/b/f");
+    test_xattr (f, path);
+    ok (stat (path, &sb) == 0 && (sb.st_mode & 0777) == 0600
+                              && sb.st_size == 4,
+        "the renamed file was changed");
+    if (!(f2 = npc_walk (dir, "f")))
+        diag ("npc_walk: %s", strerror (np_rerror ()));
+    ok (f2 != NULL, "walk from the directory fid works");
+    if (f2) {
+        ok (npc_open (f2, O_RDONLY) == 0, "npc_open works");
+        n = npc_read (f2, buf, sizeof (buf));
+        ok (n == 4 && memcmp (buf, "hell", 4) == 0, "npc_read works");
+        ok (npc_clunk (f2) == 0, "npc_clunk works");
+    }
+    ok (npc_create (dir, "g", O_RDWR, 0644, getgid ()) == 0,
+        "create in the directory works");
+    join (path, tmpdir, "c/b/g");
+    ok (access (path, F_OK) == 0, "the file was created in the new location");
+    ok (npc_clunk (dir) == 0, "npc_clunk works");
+
+    /* replace the file with a new one of the same name */
+    join (path, tmpdir, "c/b/f");
+    if (unlink (path) < 0)
+        BAIL_OUT ("unlink %s: %s", path, strerror (errno));
+    make_file (path, "goodbye");
+    ok (npc_stat (root, "c/b/f", &sb) == 0 && sb.st_size == 7,
+        "walk to the replaced name finds the new file");
+    ok (npc_fstat (f, &sb2) == 0 && sb2.st_ino != sb.st_ino
+                                 && sb2.st_size == 4,
+        "the old fid still refers to the old file");
+    ok (npc_clunk (f) == 0, "npc_clunk works");
+
+    ok (npc_remove_bypath (root, "c/b/f") == 0, "npc_remove_bypath f works");
+    ok (npc_remove_bypath (root, "c/b/g") == 0, "npc_remove_bypath g works");
+    ok (npc_remove_bypath (root, "c/b") == 0, "npc_remove_bypath b works");
+    ok (npc_remove_bypath (root, "c") == 0, "npc_remove_bypath c works");
+
+    test_walkn (root, tmpdir);
+    test_many (root, tmpdir);
+    test_memo (root, tmpdir);
+
+    npc_umount (root);
+
+    test_server_destroy (srv);
+
+    test_fdlimit (tmpdir);
+
+    rmdir (tmpdir);
+
+    done_testing ();
+
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
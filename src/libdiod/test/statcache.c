@@ -0,0 +1,463 @@
+/************************************************************\
+ * Copyright 2010 Lawrence Livermore National Security, LLC
+ * (c.f. AUTHORS, NOTICE.LLNS, COPYING)
+ *
+ * This file is part of the diod 9P server project.
+ * For details, see https://github.com/chaos/diod.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+\************************************************************/
+
+/* test the attribute cache of an export with the statcache option
+ *
+ * Cached attributes and failed lookups never expire here
+ * (statcache_ttl = 0), so getattr and walk only see a change if it was
+ * invalidated: by diod itself for changes made through 9P, or by an
+ * inotify event for changes made directly.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "src/libnpclient/npclient.h"
+#include "src/libtap/tap.h"
+
+#include "diod_log.h"
+#include "diod_conf.h"
+#include "diod_ops.h"
+#include "diod_sock.h"
+#include "diod_statcache.h"
+
+#define TEST_MSIZE 8192
+#define TEST_SIZE 8
+
+typedef struct {
+    int size, count, ttl;
+    u64 hits, misses, fills, invalidations, evictions;
+    int negentries;
+    u64 neghits, negfills;
+} Stats;
+
+static void get_stats (Stats *st)
+{
+    char *s = diod_statcache_ctl_get ("statcache", NULL);
+
+    if (!s || sscanf (s, "%d %d %d %"SCNu64" %"SCNu64" %"SCNu64" %"SCNu64
+                      " %"SCNu64" %d %"SCNu64" %"SCNu64, &st->size,
+                      &st->count, &st->ttl, &st->hits, &st->misses,
+                      &st->fills, &st->invalidations, &st->evictions,
+                      &st->negentries, &st->neghits, &st->negfills) != 11)
+        BAIL_OUT ("could not parse statcache ctl file");
+    free (s);
+}
+
+static u64 get_hits (void)
+{
+    Stats st;
+
+    get_stats (&st);
+    return st.hits;
+}
+
+static u64 get_neghits (void)
+{
+    Stats st;
+
+    get_stats (&st);
+    return st.neghits;
+}
+
+/* Stat 'name' until 'check' passes, giving the notify thread time to read
+ * the event for a change made behind diod's back.
+ */
+static int stat_until (Npcfid *root, char *name, struct stat *sb,
+                       int (*check)(struct stat *sb, void *arg), void *arg)
+{
+    int i;
+
+    for (i = 0; i < 100; i++) {
+        if (npc_stat (root, name, sb) == 0 && check (sb, arg))
+            return 0;
+        usleep (10000);
+    }
+    return -1;
+}
+
+/* Stat 'name' from 'fid', or 'fid' itself if 'name' is NULL, until it
+ * increments 'counter' by one, and return the result of that stat, or -2.
+ * The notify thread may still have events to read for changes just made,
+ * which invalidate the entries again.
+ */
+static int stat_counted (Npcfid *fid, char *name, struct stat *sb,
+                         u64 (*counter)(void))
+{
+    u64 count;
+    int i, rc;
+
+    for (i = 0; i < 100; i++) {
+        count = counter ();
+        rc = name ? npc_stat (fid, name, sb) : npc_fstat (fid, sb);
+        if (counter () == count + 1)
+            return rc;
+        usleep (10000);
+    }
+    return -2;
+}
+
+static int size_is (struct stat *sb, void *arg)
+{
+    return sb->st_size == *(off_t *)arg;
+}
+
+static int mode_is (struct stat *sb, void *arg)
+{
+    return (sb->st_mode & 0777) == *(mode_t *)arg;
+}
+
+static int nlink_is (struct stat *sb, void *arg)
+{
+    return sb->st_nlink == *(nlink_t *)arg;
+}
+
+static int exists (struct stat *sb, void *arg)
+{
+    return 1;
+}
+
+static int create (Npcfid *root, char *name, char *s)
+{
+    Npcfid *fid;
+    int n;
+
+    if (!(fid = npc_create_bypath (root, name, O_WRONLY, 0644, getgid ())))
+        return -1;
+    n = npc_puts (fid, s);
+    if (npc_clunk (fid) < 0)
+        n = -1;
+    return n;
+}
+
+static void append (char *path, char *s)
+{
+    int fd;
+
+    if ((fd = open (path, O_WRONLY | O_APPEND)) < 0)
+        BAIL_OUT ("open %s: %s", path, strerror (errno));
+    if (write (fd, s, strlen (s)) != strlen (s))
+        BAIL_OUT ("write %s: %s", path, strerror (errno));
+    close (fd);
+}
+
+/* Wait for the notify thread to invalidate file (dev, ino).
+ */
+static int wait_invalid (struct stat *sb)
+{
+    struct stat sb2;
+    int i;
+
+    for (i = 0; i < 100; i++) {
+        if (diod_statcache_get (sb->st_dev, sb->st_ino, &sb2) < 0)
+            return 0;
+        usleep (10000);
+    }
+    return -1;
+}
+
+/* Fill the cache directly: a fill is only refused, and the file stat'ed
+ * again, if that file changed after the caller's stat.
+ */
+static void test_fill (char *tmpdir)
+{
+    char path[PATH_MAX], path2[PATH_MAX];
+    struct stat sb, sb2, sbc;
+    int fd, fd2;
+    u64 gen;
+
+    snprintf (path, sizeof (path), "%s/fill", tmpdir);
+    snprintf (path2, sizeof (path2), "%s/fill2", tmpdir);
+    if ((fd = open (path, O_RDWR | O_CREAT, 0644)) < 0)
+        BAIL_OUT ("open %s: %s", path, strerror (errno));
+    if ((fd2 = open (path2, O_RDWR | O_CREAT, 0644)) < 0)
+        BAIL_OUT ("open %s: %s", path2, strerror (errno));
+    if (fstat (fd, &sb) < 0 || fstat (fd2, &sb2) < 0)
+        BAIL_OUT ("fstat: %s", strerror (errno));
+    diod_statcache_put (fd, &sb, diod_statcache_gen ());
+    diod_statcache_put (fd2, &sb2, diod_statcache_gen ());
+    ok (diod_statcache_get (sb.st_dev, sb.st_ino, &sbc) == 0
+        && diod_statcache_get (sb2.st_dev, sb2.st_ino, &sbc) == 0,
+        "new entries are filled");
+
+    gen = diod_statcache_gen ();
+    if (fstat (fd, &sb) < 0)
+        BAIL_OUT ("fstat: %s", strerror (errno));
+    append (path2, "x");
+    ok (wait_invalid (&sb2) == 0, "a change to fill2 invalidates it");
+    diod_statcache_put (fd, &sb, gen);
+    ok (diod_statcache_get (sb.st_dev, sb.st_ino, &sbc) == 0,
+        "fill is cached although fill2 changed during the stat");
+
+    gen = diod_statcache_gen ();
+    if (fstat (fd, &sb) < 0)
+        BAIL_OUT ("fstat: %s", strerror (errno));
+    append (path, "hello");
+    ok (wait_invalid (&sb) == 0, "a change to fill invalidates it");
+    diod_statcache_put (fd, &sb, gen);
+    ok (diod_statcache_get (sb.st_dev, sb.st_ino, &sbc) == 0
+        && sbc.st_size == 5,
+        "a stat that predates a change to fill is replaced by a new one");
+
+    close (fd);
+    close (fd2);
+    unlink (path);
+    unlink (path2);
+}
+
+/* Cache failed lookups directly: one that might predate a change to the
+ * directory is repeated first.
+ */
+static void test_fill_neg (char *tmpdir)
+{
+    char path[PATH_MAX], name[] = "neg";
+    Npstr ns = { .len = strlen (name), .str = name };
+    struct stat sb;
+    int fd;
+    u64 gen;
+
+    snprintf (path, sizeof (path), "%s/negdir", tmpdir);
+    if (mkdir (path, 0755) < 0)
+        BAIL_OUT ("mkdir %s: %s", path, strerror (errno));
+    if ((fd = open (path, O_RDONLY | O_DIRECTORY)) < 0)
+        BAIL_OUT ("open %s: %s", path, strerror (errno));
+    if (fstat (fd, &sb) < 0)
+        BAIL_OUT ("fstat: %s", strerror (errno));
+
+    gen = diod_statcache_gen ();
+    diod_statcache_put_neg (fd, sb.st_dev, sb.st_ino, &ns, getuid (), gen);
+    ok (diod_statcache_get_neg (sb.st_dev, sb.st_ino, &ns, getuid ()) == 0,
+        "a failed lookup is cached after it is repeated with the watch");
+
+    diod_statcache_put (fd, &sb, diod_statcache_gen ());
+    gen = diod_statcache_gen ();
+    snprintf (path, sizeof (path), "%s/negdir/%s", tmpdir, name);
+    if (mkdir (path, 0755) < 0)
+        BAIL_OUT ("mkdir %s: %s", path, strerror (errno));
+    ok (wait_invalid (&sb) == 0, "a name added to negdir invalidates it");
+    diod_statcache_put_neg (fd, sb.st_dev, sb.st_ino, &ns, getuid (), gen);
+    ok (diod_statcache_get_neg (sb.st_dev, sb.st_ino, &ns, getuid ()) < 0,
+        "a failed lookup that predates the name being added is not cached");
+
+    close (fd);
+    rmdir (path);
+    snprintf (path, sizeof (path), "%s/negdir", tmpdir);
+    rmdir (path);
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npsrv *srv;
+    int s[2];
+    Npcfid *root, *f;
+    char tmpdir[] = "/tmp/test-statcache.XXXXXX";
+    char path[PATH_MAX], name[32];
+    struct stat sb;
+    off_t size;
+    mode_t mode;
+    nlink_t nlink;
+    Stats st;
+    int i;
+
+    if (!mkdtemp (tmpdir))
+        BAIL_OUT ("mkdtemp: %s", strerror (errno));
+
+    diod_log_init ("# ");
+    diod_conf_init ();
+    diod_conf_set_auth_required (0);
+    diod_conf_set_exportopts ("statcache");
+    diod_conf_set_statcache_size (TEST_SIZE);
+    diod_conf_set_statcache_ttl (0);
+    diod_conf_set_statmemo_usec (0); /* so every getattr uses the cache */
+    diod_conf_add_exports (tmpdir);
+    if (!(srv = np_srv_create (16, 0)))
+        BAIL_OUT ("np_srv_create failed");
+    if (diod_init (srv) < 0)
+        BAIL_OUT ("diod_init: %s", strerror (np_rerror ()));
+    if (!diod_statcache_enabled ()) {
+        plan (SKIP_ALL, "inotify is not available");
+        diod_fini (srv);
+        np_srv_destroy (srv);
+        rmdir (tmpdir);
+        return 0;
+    }
+    plan (NO_PLAN);
+    if (socketpair (AF_LOCAL, SOCK_STREAM, 0, s) < 0)
+        BAIL_OUT ("socketpair: %s", strerror (errno));
+    diod_sock_startfd (srv, s[1], s[1], "statcache-test-client", 0);
+
+    root = npc_mount (s[0], s[0], TEST_MSIZE, tmpdir, NULL);
+    if (!root)
+        BAIL_OUT ("npc_mount: %s", strerror (np_rerror ()));
+
+    get_stats (&st);
+    ok (st.size == TEST_SIZE && st.count == 0 && st.ttl == 0,
+        "ctl file shows an empty cache of size %d", TEST_SIZE);
+
+    ok (create (root, "foo", "hello") == 5, "created foo");
+    snprintf (path, sizeof (path), "%s/foo", tmpdir);
+
+    ok (npc_stat (root, "foo", &sb) == 0 && sb.st_size == 5,
+        "npc_stat foo works");
+    ok (stat_counted (root, "foo", &sb, get_hits) == 0 && sb.st_size == 5,
+        "and a getattr of foo is a cache hit");
+
+    /* changes made through diod */
+    ok (npc_chmod (root, "foo", 0600) == 0
+        && npc_stat (root, "foo", &sb) == 0 && (sb.st_mode & 0777) == 0600,
+        "mode changed by setattr is seen");
+    ok (npc_truncate (root, "foo", 2) == 0
+        && npc_stat (root, "foo", &sb) == 0 && sb.st_size == 2,
+        "size changed by setattr is seen");
+
+    f = npc_open_bypath (root, "foo", O_RDWR);
+    ok (f != NULL, "npc_open_bypath foo works");
+    ok (npc_fstat (f, &sb) == 0 && sb.st_size == 2,
+        "getattr on the open fid works");
+    ok (stat_counted (f, NULL, &sb, get_hits) == 0 && sb.st_size == 2,
+        "and is a cache hit");
+    ok (npc_pwrite (f, "world", 5, 2) == 5
+        && npc_fstat (f, &sb) == 0 && sb.st_size == 7,
+        "size changed by write is seen on the open fid");
+    ok (npc_stat (root, "foo", &sb) == 0 && sb.st_size == 7,
+        "and by a fresh walk");
+
+    /* changes made directly */
+    append (path, "!");
+    size = 8;
+    ok (stat_until (root, "foo", &sb, size_is, &size) == 0,
+        "size changed outside diod is seen");
+    ok (npc_fstat (f, &sb) == 0 && sb.st_size == 8,
+        "and on the open fid");
+    ok (npc_clunk (f) == 0, "npc_clunk works");
+    if (chmod (path, 0640) < 0)
+        BAIL_OUT ("chmod %s: %s", path, strerror (errno));
+    mode = 0640;
+    ok (stat_until (root, "foo", &sb, mode_is, &mode) == 0,
+        "mode changed outside diod is seen");
+
+    /* directories */
+    ok (npc_mkdir_bypath (root, "d", 0755) == 0, "npc_mkdir_bypath d works");
+    ok (npc_stat (root, "d", &sb) == 0 && sb.st_nlink == 2,
+        "d has 2 links");
+    ok (npc_mkdir_bypath (root, "d/e", 0755) == 0
+        && npc_stat (root, "d", &sb) == 0 && sb.st_nlink == 3,
+        "d has 3 links after mkdir through diod");
+    snprintf (path, sizeof (path), "%s/d/e2", tmpdir);
+    if (mkdir (path, 0755) < 0)
+        BAIL_OUT ("mkdir %s: %s", path, strerror (errno));
+    nlink = 4;
+    ok (stat_until (root, "d", &sb, nlink_is, &nlink) == 0,
+        "d has 4 links after mkdir outside diod");
+    if (rmdir (path) < 0)
+        BAIL_OUT ("rmdir %s: %s", path, strerror (errno));
+    ok (npc_remove_bypath (root, "d/e") == 0
+        && npc_stat (root, "d", &sb) == 0 && sb.st_nlink == 2,
+        "d has 2 links after rmdir through diod");
+    ok (npc_remove_bypath (root, "d") == 0, "npc_remove_bypath d works");
+
+    /* more files than the cache holds */
+    for (i = 0; i < TEST_SIZE * 2; i++) {
+        snprintf (name, sizeof (name), "f%d", i);
+        if (create (root, name, name) < 0
+                || npc_stat (root, name, &sb) < 0)
+            BAIL_OUT ("%s: %s", name, strerror (np_rerror ()));
+    }
+    get_stats (&st);
+    ok (st.count == TEST_SIZE && st.evictions > 0,
+        "cache holds %d entries after more files were walked", TEST_SIZE);
+    for (i = 0; i < TEST_SIZE * 2; i++) {
+        snprintf (name, sizeof (name), "f%d", i);
+        (void)npc_remove_bypath (root, name);
+    }
+    get_stats (&st);
+    diag ("hits %"PRIu64" misses %"PRIu64" fills %"PRIu64
+          " invalidations %"PRIu64" evictions %"PRIu64,
+          st.hits, st.misses, st.fills, st.invalidations, st.evictions);
+
+    /* failed lookups */
+    ok (npc_stat (root, "nope", &sb) < 0 && np_rerror () == ENOENT,
+        "npc_stat nope fails with ENOENT");
+    ok (stat_counted (root, "nope", &sb, get_neghits) == -1
+        && np_rerror () == ENOENT,
+        "a walk to nope is a negative cache hit");
+    ok (create (root, "nope", "") == 0
+        && npc_stat (root, "nope", &sb) == 0,
+        "nope is found after create through diod");
+    ok (npc_remove_bypath (root, "nope") == 0
+        && npc_stat (root, "nope", &sb) < 0 && np_rerror () == ENOENT,
+        "nope is not found after remove through diod");
+    snprintf (path, sizeof (path), "%s/nope", tmpdir);
+    if (mkdir (path, 0755) < 0)
+        BAIL_OUT ("mkdir %s: %s", path, strerror (errno));
+    ok (stat_until (root, "nope", &sb, exists, NULL) == 0,
+        "nope is found after mkdir outside diod");
+    ok (npc_stat (root, "nope/a", &sb) < 0 && np_rerror () == ENOENT,
+        "npc_stat nope/a fails with ENOENT");
+    f = npc_walk (root, "nope");
+    ok (f != NULL, "npc_walk nope works");
+    ok (f != NULL && stat_counted (f, "a", &sb, get_neghits) == -1
+        && np_rerror () == ENOENT,
+        "a walk to a from nope is a negative cache hit");
+    if (f)
+        (void)npc_clunk (f);
+    ok (npc_mkdir_bypath (root, "nope/a", 0755) == 0
+        && npc_stat (root, "nope/a", &sb) == 0,
+        "nope/a is found after mkdir through diod");
+    ok (npc_remove_bypath (root, "nope/a") == 0
+        && npc_remove_bypath (root, "nope") == 0,
+        "npc_remove_bypath nope/a and nope work");
+
+    for (i = 0; i < TEST_SIZE * 2; i++) {
+        snprintf (name, sizeof (name), "g%d", i);
+        (void)npc_stat (root, name, &sb);
+    }
+    get_stats (&st);
+    ok (st.negentries == TEST_SIZE,
+        "cache holds %d failed lookups after more were made", TEST_SIZE);
+    diag ("negentries %d neghits %"PRIu64" negfills %"PRIu64,
+          st.negentries, st.neghits, st.negfills);
+
+    ok (npc_remove_bypath (root, "foo") == 0, "npc_remove_bypath foo works");
+    npc_umount (root);
+
+    test_fill (tmpdir);
+    test_fill_neg (tmpdir);
+
+    np_srv_wait_conncount (srv, 0);
+    diod_fini (srv);
+    ok (!diod_statcache_enabled (), "cache is disabled after diod_fini");
+    np_srv_destroy (srv);
+    diod_conf_fini ();
+    diod_log_fini ();
+
+    rmdir (tmpdir);
+
+    done_testing ();
+
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
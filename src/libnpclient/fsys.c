@@ -30,11 +30,12 @@
 #include "npcimpl.h"
 
 static int npc_rpc(Npcfsys *fs, Npfcall *tc, Npfcall **rcp);
+static Npcfsys *npc_alloc_fsys(int msize, int flags);
 static void npc_incref_fsys(Npcfsys *fs);
 static void npc_decref_fsys(Npcfsys *fs);
 
-Npcfsys *
-npc_create_fsys(int rfd, int wfd, int msize, int flags)
+static Npcfsys *
+npc_alloc_fsys(int msize, int flags)
 {
 	Npcfsys *fs;
 
@@ -57,9 +58,6 @@ npc_create_fsys(int rfd, int wfd, int msize, int flags)
 	fs->disconnect = NULL;
 	fs->flags = flags;
 
-	fs->trans = np_fdtrans_create(rfd, wfd);
-	if (!fs->trans)
-		goto error;
 	fs->tagpool = npc_create_pool(NOTAG);
 	if (!fs->tagpool)
 		goto error;
@@ -69,13 +67,56 @@ npc_create_fsys(int rfd, int wfd, int msize, int flags)
 	return fs;
 
 error:
-	npc_decref_fsys(fs); /* will close fds if trans successfully created */
-	(void)close (rfd);   /* close here anyway for consistancy */
+	npc_decref_fsys(fs);
+	return NULL;
+}
+
+Npcfsys *
+npc_create_fsys(int rfd, int wfd, int msize, int flags)
+{
+	Npcfsys *fs;
+
+	fs = npc_alloc_fsys(msize, flags);
+	if (!fs)
+		goto error;
+	fs->trans = np_fdtrans_create(rfd, wfd);
+	if (!fs->trans)
+		goto error;
+	return fs;
+
+error:
+	if (fs)
+		npc_decref_fsys(fs);
+	(void)close (rfd);
 	if (rfd != wfd)
 		(void)close (wfd);
 	return NULL;
 }
 
+/* Like npc_create_fsys(), but 'fd' is a Unix domain socket to a server
+ * on the same host, and 9P is sent through shared memory rings set up
+ * over it (see libnpfs/shmtrans.c).
+ */
+Npcfsys *
+npc_create_fsys_shm(int fd, int msize, int flags)
+{
+	Npcfsys *fs;
+
+	fs = npc_alloc_fsys(msize, flags);
+	if (!fs)
+		goto error;
+	fs->trans = np_shmtrans_connect(fd, 0);
+	if (!fs->trans)
+		goto error;
+	return fs;
+
+error:
+	if (fs)
+		npc_decref_fsys(fs);
+	(void)close (fd);
+	return NULL;
+}
+
 static void
 npc_incref_fsys(Npcfsys *fs)
 {
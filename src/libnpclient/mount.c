@@ -42,7 +42,10 @@ npc_start (int rfd, int wfd, int msize, int flags)
 	Npcfsys *fs;
 	Npfcall *tc = NULL, *rc = NULL;
 
-	fs = npc_create_fsys (rfd, wfd, msize, flags);
+	if ((flags & NPC_SHM) && rfd == wfd)
+		fs = npc_create_fsys_shm (rfd, msize, flags);
+	else
+		fs = npc_create_fsys (rfd, wfd, msize, flags);
 	if (!fs)
 		goto done;
 	if (!(tc = np_create_tversion (msize, "9P2000.L"))) {
@@ -63,6 +63,7 @@ struct Npcfsys {
 };
 
 Npcfsys *npc_create_fsys(int rfd, int wfd, int msize, int flags);
+Npcfsys *npc_create_fsys_shm(int fd, int msize, int flags);
 
 Npcpool *npc_create_pool(u32 maxid);
 void npc_destroy_pool(Npcpool *p);
@@ -45,6 +45,7 @@ typedef int (*AuthFun)(Npcfid *afid, u32 uid);
 enum {
 	NPC_MULTI_RPC=1,	/* use 'mtfsys'c' multi-threaded rpc engine */
 	NPC_SHORTREAD_EOF=2,	/* npc_aget, npc_get treat short read as eof */
+	NPC_SHM=4,		/* npc_start uses shared memory rings */
 };
 
 struct utimbuf;
@@ -61,6 +62,8 @@ enum {
 
 /* Given a server already connected on rfd,wfd, send a VERSION request
  * to negotiate 9P2000.L and an msize <= the one provided.
+ * With NPC_SHM, rfd == wfd is a Unix domain socket to a server on the
+ * same host, and 9P is sent through shared memory rings set up over it.
  * Return fsys structure or NULL on error (retrieve with np_rerror ())
  */
 Npcfsys* npc_start (int rfd, int wfd, int msize, int flags);
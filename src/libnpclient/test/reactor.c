@@ -0,0 +1,217 @@
+/************************************************************\
+ * Copyright 2010 Lawrence Livermore National Security, LLC
+ * (c.f. AUTHORS, NOTICE.LLNS, COPYING)
+ *
+ * This file is part of the diod 9P server project.
+ * For details, see https://github.com/chaos/diod.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+\************************************************************/
+
+/* many npfs clients served by the epoll reactor */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdint.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+
+#include "src/libnpfs/npfs.h"
+#include "src/libnpclient/npclient.h"
+#include "src/libtap/tap.h"
+
+#define TEST_MSIZE 8192
+#define TEST_NCLIENTS 2000
+
+static void diag_logger (const char *buf)
+{
+    fputs ("# ", stderr);
+    fputs (buf, stderr);
+    fputc ('\n', stderr);
+}
+
+/* Return the number of threads in this process.
+ */
+static int count_threads (void)
+{
+    FILE *f;
+    char line[256];
+    int n = -1;
+
+    if (!(f = fopen ("/proc/self/status", "r")))
+        return -1;
+    while (fgets (line, sizeof (line), f)) {
+        if (sscanf (line, "Threads: %d", &n) == 1)
+            break;
+    }
+    fclose (f);
+    return n;
+}
+
+/* Raise the open file limit as far as allowed and return how many
+ * clients (two fds each) can be created.
+ */
+static int max_clients (int want)
+{
+    struct rlimit r;
+    int n;
+
+    if (getrlimit (RLIMIT_NOFILE, &r) < 0)
+        return 0;
+    if (r.rlim_cur < r.rlim_max) {
+        r.rlim_cur = r.rlim_max;
+        (void)setrlimit (RLIMIT_NOFILE, &r);
+        if (getrlimit (RLIMIT_NOFILE, &r) < 0)
+            return 0;
+    }
+    n = (r.rlim_cur - 64) / 2;
+    return n < want ? n : want;
+}
+
+/* Create a server connection and return the client end of it.
+ */
+static int connect_client (Npsrv *srv)
+{
+    int s[2];
+    Nptrans *trans;
+
+    if (socketpair (AF_LOCAL, SOCK_STREAM, 0, s) < 0)
+        return -1;
+    if (!(trans = np_fdtrans_create (s[1], s[1]))) {
+        close (s[0]);
+        close (s[1]);
+        return -1;
+    }
+    /* N.B. trans is destroyed in np_conn_create on failure */
+    if (!np_conn_create (srv, trans, "reactor-test-client", 0)) {
+        close (s[0]);
+        return -1;
+    }
+    return s[0];
+}
+
+static Npcfsys *start_client (Npsrv *srv)
+{
+    Npcfsys *fs;
+    int fd;
+
+    if ((fd = connect_client (srv)) < 0)
+        return NULL;
+    if (!(fs = npc_start (fd, fd, TEST_MSIZE, 0)))
+        close (fd);
+    return fs;
+}
+
+/* Send a Tversion one byte at a time to exercise partial frame handling
+ * on the non-blocking socket.
+ */
+static int slow_version (int fd)
+{
+    Npfcall *tc, *rc = NULL;
+    Nptrans *trans;
+    int i, rv = -1;
+
+    if (!(tc = np_create_tversion (TEST_MSIZE, "9P2000.L")))
+        return -1;
+    np_set_tag (tc, 42);
+    for (i = 0; i < tc->size; i++) {
+        if (write (fd, tc->pkt + i, 1) != 1)
+            goto done;
+        usleep (1000);
+    }
+    if (!(trans = np_fdtrans_create (fd, fd)))
+        goto done;
+    if (np_trans_recv (trans, &rc, TEST_MSIZE) == 0 && rc
+                                                   && rc->type == Rversion
+                                                   && rc->tag == 42)
+        rv = 0;
+    np_trans_destroy (trans); /* closes fd */
+    np_free_fcall (rc);
+done:
+    np_free_fcall (tc);
+    return rv;
+}
+
+int main (int argc, char *argv[])
+{
+    Npsrv *srv;
+    Npcfsys **fs;
+    Npcfid *fid;
+    int i, n, nclients, errors;
+    int cfd, threads;
+    char *s;
+
+    nclients = max_clients (argc > 1 ? strtoul (argv[1], NULL, 10)
+                                     : TEST_NCLIENTS);
+    if (nclients < 10)
+        plan (SKIP_ALL, "open file limit is too low");
+    if (!(srv = np_srv_create (4, 0)))
+        BAIL_OUT ("np_srv_create: %s", strerror (np_rerror ()));
+    srv->logmsg = diag_logger;
+    if (np_reactor_create (srv, 2) < 0) {
+        if (np_rerror () == ENOSYS)
+            plan (SKIP_ALL, "reactor is not supported on this platform");
+        BAIL_OUT ("np_reactor_create: %s", strerror (np_rerror ()));
+    }
+
+    plan (NO_PLAN);
+    ok (1, "np_srv_create and np_reactor_create work");
+
+    diag ("using %d clients", nclients);
+    if (!(fs = calloc (nclients, sizeof (fs[0]))))
+        BAIL_OUT ("out of memory");
+
+    errors = 0;
+    for (i = 0; i < nclients; i++) {
+        if (!(fs[i] = start_client (srv)))
+            errors++;
+    }
+    ok (errors == 0, "started %d clients", nclients);
+
+    threads = count_threads ();
+    ok (threads > 0 && threads < 32,
+        "server is not using a thread per connection (%d threads)", threads);
+
+    errors = 0;
+    for (i = 0; i < nclients; i++) {
+        if (!fs[i] || !(fid = npc_attach (fs[i], NULL, "ctl", 0))) {
+            errors++;
+            continue;
+        }
+        if (!(s = npc_aget (fid, "version")) || strlen (s) == 0)
+            errors++;
+        free (s);
+        if (npc_clunk (fid) < 0)
+            errors++;
+    }
+    ok (errors == 0, "every client can attach, read, and clunk");
+
+    cfd = connect_client (srv);
+    ok (cfd >= 0 && slow_version (cfd) == 0,
+        "a request trickled in one byte at a time is received");
+
+    for (i = 0, n = 0; i < nclients; i++) {
+        if (fs[i]) {
+            npc_finish (fs[i]);
+            n++;
+        }
+    }
+    np_srv_wait_conncount (srv, n + 1);
+    ok (1, "all connections were torn down");
+
+    np_srv_destroy (srv);
+    free (fs);
+
+    done_testing ();
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
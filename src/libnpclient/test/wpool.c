@@ -0,0 +1,234 @@
+/************************************************************\
+ * Copyright 2010 Lawrence Livermore National Security, LLC
+ * (c.f. AUTHORS, NOTICE.LLNS, COPYING)
+ *
+ * This file is part of the diod 9P server project.
+ * For details, see https://github.com/chaos/diod.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+\************************************************************/
+
+/* shared elastic worker pool: growth, per-export limit, and shrink */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdint.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+#include "src/libnpfs/npfs.h"
+#include "src/libnpclient/npclient.h"
+#include "src/libtap/tap.h"
+#include "src/libtest/conn.h"
+
+#define TEST_MSIZE 8192
+
+#define TEST_MIN        2
+#define TEST_MAX        6
+#define TEST_EXPORT_MAX 3
+
+#define NCLIENTS_A      5
+#define NCLIENTS_B      3
+
+/* getattr blocks until released, counting concurrent calls per export */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int active[2];
+static int peak[2];
+static int released;
+
+static void diag_logger (const char *buf)
+{
+    fputs ("# ", stderr);
+    fputs (buf, stderr);
+    fputc ('\n', stderr);
+}
+
+static int export_index (Npfid *fid)
+{
+    return strcmp (fid->aname, "/a") == 0 ? 0 : 1;
+}
+
+static Npfcall *test_getattr (Npfid *fid, u64 request_mask, Npreq *req)
+{
+    int i = export_index (fid);
+
+    pthread_mutex_lock (&lock);
+    if (++active[i] > peak[i])
+        peak[i] = active[i];
+    pthread_cond_broadcast (&cond);
+    while (!released)
+        pthread_cond_wait (&cond, &lock);
+    active[i]--;
+    pthread_mutex_unlock (&lock);
+
+    np_uerror (EIO);
+    return NULL;
+}
+
+static Npsrv *srv;
+
+/* Create a server connection and start a client on it.
+ */
+static Npcfsys *start_client (void)
+{
+    int s[2];
+    Nptrans *trans;
+    Npcfsys *fs;
+
+    if (socketpair (AF_LOCAL, SOCK_STREAM, 0, s) < 0)
+        BAIL_OUT ("socketpair: %s", strerror (errno));
+    if (!(trans = np_fdtrans_create (s[1], s[1])))
+        BAIL_OUT ("np_fdtrans_create: %s", strerror (np_rerror ()));
+    /* N.B. trans is destroyed in np_conn_create on failure */
+    if (!np_conn_create (srv, trans, "wpool-test-client", 0))
+        BAIL_OUT ("np_conn_create: %s", strerror (np_rerror ()));
+    if (!(fs = npc_start (s[0], s[0], TEST_MSIZE, 0)))
+        BAIL_OUT ("npc_start: %s", strerror (np_rerror ()));
+    return fs;
+}
+
+/* Each client has its own connection since npclient RPCs are serialized.
+ */
+static void *getattr_thread (void *a)
+{
+    char *aname = a;
+    Npcfsys *fs = start_client ();
+    Npcfid *fid;
+    u64 valid, nlink, rdev, size, blksize, blocks;
+    u64 atime_sec, atime_nsec, mtime_sec, mtime_nsec;
+    u64 ctime_sec, ctime_nsec, btime_sec, btime_nsec, gen, data_version;
+    u32 mode, uid, gid;
+    Npqid qid;
+
+    if (!(fid = npc_attach (fs, NULL, aname, 0)))
+        BAIL_OUT ("npc_attach %s: %s", aname, strerror (np_rerror ()));
+    (void)npc_getattr (fid, Gabasic, &valid, &qid, &mode, &uid, &gid,
+                       &nlink, &rdev, &size, &blksize, &blocks,
+                       &atime_sec, &atime_nsec, &mtime_sec, &mtime_nsec,
+                       &ctime_sec, &ctime_nsec, &btime_sec, &btime_nsec,
+                       &gen, &data_version);
+    (void)npc_clunk (fid);
+    npc_finish (fs);
+    return NULL;
+}
+
+/* Parse the first and second fields of the wthreads ctl file.
+ */
+static int get_wthreads (Npcfid *ctl, int *nwthread, int *nidle)
+{
+    char *s;
+    int n;
+
+    if (!(s = npc_aget (ctl, "wthreads")))
+        return -1;
+    n = sscanf (s, "%d %d", nwthread, nidle);
+    free (s);
+    return n == 2 ? 0 : -1;
+}
+
+/* Wait up to 'secs' seconds for the number of workers to reach 'want'.
+ */
+static int wait_wthreads (Npcfid *ctl, int want, int secs)
+{
+    int i, nwthread, nidle;
+
+    for (i = 0; i < secs * 10; i++) {
+        if (get_wthreads (ctl, &nwthread, &nidle) < 0)
+            return -1;
+        if (nwthread == want)
+            return 0;
+        usleep (100000);
+    }
+    diag ("waited for %d workers, have %d", want, nwthread);
+    return -1;
+}
+
+int main (int argc, char *argv[])
+{
+    Npcfsys *fs;
+    Npcfid *ctl;
+    pthread_t t[NCLIENTS_A + NCLIENTS_B];
+    int i, nwthread, nidle, total;
+
+    plan (NO_PLAN);
+
+    if (!(srv = np_srv_create (TEST_MIN, 0)))
+        BAIL_OUT ("np_srv_create: %s", strerror (np_rerror ()));
+    srv->logmsg = diag_logger;
+    srv->attach = test_attach;
+    srv->getattr = test_getattr;
+    srv->clunk = test_clunk;
+
+    ok (np_srv_set_wthreads (srv, TEST_MAX + 1, TEST_MAX, 0, 0) < 0
+        && np_rerror () == EINVAL,
+        "np_srv_set_wthreads min > max fails with EINVAL");
+    ok (np_srv_set_wthreads (srv, TEST_MIN, TEST_MAX, TEST_EXPORT_MAX, 1) == 0,
+        "np_srv_set_wthreads min=%d max=%d export=%d idle=1s works",
+        TEST_MIN, TEST_MAX, TEST_EXPORT_MAX);
+
+    fs = start_client ();
+    if (!(ctl = npc_attach (fs, NULL, "ctl", 0)))
+        BAIL_OUT ("npc_attach ctl: %s", strerror (np_rerror ()));
+
+    /* N.B. workers may be added if the first requests beat them to idle */
+    ok (get_wthreads (ctl, &nwthread, &nidle) == 0 && nwthread >= TEST_MIN
+                                                 && nwthread <= TEST_MAX,
+        "pool starts with at least %d workers", TEST_MIN);
+
+    for (i = 0; i < NCLIENTS_A + NCLIENTS_B; i++) {
+        if ((errno = pthread_create (&t[i], NULL, getattr_thread,
+                                     i < NCLIENTS_A ? "/a" : "/b")))
+            BAIL_OUT ("pthread_create: %s", strerror (errno));
+    }
+
+    /* Wait for the pool to fill up with blocked requests.
+     */
+    pthread_mutex_lock (&lock);
+    while (active[0] + active[1] < TEST_MAX)
+        pthread_cond_wait (&cond, &lock);
+    pthread_mutex_unlock (&lock);
+    ok (1, "pool grew to run %d blocked requests", TEST_MAX);
+
+    usleep (200000); /* give the pool a chance to overshoot */
+    pthread_mutex_lock (&lock);
+    total = active[0] + active[1];
+    pthread_mutex_unlock (&lock);
+    ok (total == TEST_MAX, "no more than %d requests run at once", TEST_MAX);
+    ok (peak[0] == TEST_EXPORT_MAX && peak[1] == TEST_EXPORT_MAX,
+        "each export is limited to %d workers", TEST_EXPORT_MAX);
+    /* N.B. all workers are busy so a ctl read would wait */
+    pthread_mutex_lock (&srv->wpool->lock);
+    nwthread = srv->wpool->nwthread;
+    pthread_mutex_unlock (&srv->wpool->lock);
+    ok (nwthread == TEST_MAX, "pool has %d workers", TEST_MAX);
+
+    pthread_mutex_lock (&lock);
+    released = 1;
+    pthread_cond_broadcast (&cond);
+    pthread_mutex_unlock (&lock);
+    for (i = 0; i < NCLIENTS_A + NCLIENTS_B; i++)
+        pthread_join (t[i], NULL);
+    ok (1, "requests queued behind the export limit completed");
+
+    ok (wait_wthreads (ctl, TEST_MIN, 10) == 0,
+        "idle pool shrinks back to %d workers", TEST_MIN);
+
+    ok (npc_clunk (ctl) == 0, "clunked ctl fid");
+    npc_finish (fs);
+    np_srv_wait_conncount (srv, 1 + NCLIENTS_A + NCLIENTS_B);
+    np_srv_destroy (srv);
+
+    done_testing ();
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -43,6 +43,9 @@ np_conn_create(Npsrv *srv, Nptrans *trans, char *client_id, int flags)
 	pthread_mutex_init(&conn->lock, NULL);
 	pthread_mutex_init(&conn->wlock, NULL);
 	pthread_cond_init(&conn->refcond, NULL);
+	pthread_cond_init(&conn->sendcond, NULL);
+	pthread_mutex_init(&conn->reqlock, NULL);
+	memset(conn->reqtab, 0, sizeof(conn->reqtab));
 
 	conn->refcount = 0;
 	conn->srv = srv;
@@ -59,13 +62,33 @@ np_conn_create(Npsrv *srv, Nptrans *trans, char *client_id, int flags)
 
 	conn->trans = trans;
 	conn->aux = NULL;
+	conn->reactor = (srv->reactor && trans->pollfd >= 0);
+	conn->nreqs = 0;
+	conn->reqbytes = 0;
+	conn->throttled = 0;
+	conn->parked_next = NULL;
+	conn->resumed_next = NULL;
+	conn->freereqs = NULL;
+	conn->nfreereqs = 0;
+	conn->sendq_first = conn->sendq_last = NULL;
+	conn->sending = 0;
 	np_srv_add_conn(srv, conn);
 
-	err = pthread_create(&conn->rthread, NULL, np_conn_read_proc, conn);
-	if (err != 0) {
-		np_conn_destroy (conn);
-		np_uerror (err);
-		return NULL;
+	if (conn->reactor) {
+		if (np_reactor_add_conn(srv->reactor, conn) < 0) {
+			err = np_rerror ();
+			np_conn_destroy (conn);
+			np_uerror (err);
+			return NULL;
+		}
+	} else {
+		err = pthread_create(&conn->rthread, NULL, np_conn_read_proc,
+				     conn);
+		if (err != 0) {
+			np_conn_destroy (conn);
+			np_uerror (err);
+			return NULL;
+		}
 	}
 
 	return conn;
@@ -89,9 +112,198 @@ np_conn_decref(Npconn *conn)
 	xpthread_mutex_unlock(&conn->lock);
 }
 
+/* Flow control.  Before reading each request, a connection's reader
+ * checks that the connection and the server are under their limits on
+ * outstanding requests and tcall bytes (see np_srv_set_credit).  If not,
+ * the reader stops pulling from the transport, which pushes back on the
+ * client, until responses drain.  A thread reader simply waits; reactor
+ * input is left disarmed and handed back to the reactor by
+ * np_conn_req_done().
+ * N.B. srv->nreqs, srv->reqbytes, and srv->fcwaiters are updated with
+ * sequentially consistent atomics so a reader that adds itself to the
+ * waiters and rechecks can't miss a wakeup.
+ */
+static int
+np_conn_credit_ok(Npconn *conn)
+{
+	Npsrv *srv = conn->srv;
+
+	/* assert: conn->lock held */
+	if (srv->conn_maxreqs > 0 && __atomic_load_n(&conn->nreqs,
+				__ATOMIC_RELAXED) >= srv->conn_maxreqs)
+		return 0;
+	if (srv->conn_maxbytes > 0 && conn->reqbytes >= srv->conn_maxbytes)
+		return 0;
+	return 1;
+}
+
+static int
+np_srv_credit_ok(Npsrv *srv)
+{
+	if (srv->maxreqs > 0 && __atomic_load_n(&srv->nreqs, __ATOMIC_SEQ_CST)
+							>= srv->maxreqs)
+		return 0;
+	if (srv->maxbytes > 0 && __atomic_load_n(&srv->reqbytes,
+					__ATOMIC_SEQ_CST) >= srv->maxbytes)
+		return 0;
+	return 1;
+}
+
+/* Cancellation cleanup for thread readers waiting for credit.
+ */
+static void
+np_conn_credit_unlock(void *a)
+{
+	Npconn *conn = (Npconn *)a;
+
+	xpthread_mutex_unlock(&conn->lock);
+}
+
+static void
+np_srv_credit_unlock(void *a)
+{
+	Npsrv *srv = (Npsrv *)a;
+
+	__atomic_sub_fetch(&srv->fcwaiters, 1, __ATOMIC_SEQ_CST);
+	xpthread_mutex_unlock(&srv->fclock);
+}
+
+/* Wait for credit to read another request.  Reactor connections can't
+ * wait, so return 1 if input should be left paused, else 0.
+ */
+static int
+np_conn_credit(Npconn *conn)
+{
+	Npsrv *srv = conn->srv;
+
+	xpthread_mutex_lock(&conn->lock);
+	if (!np_conn_credit_ok(conn)) {
+		__atomic_add_fetch(&srv->conn_throttles, 1, __ATOMIC_RELAXED);
+		if (conn->reactor) {
+			conn->throttled = 1;
+			xpthread_mutex_unlock(&conn->lock);
+			return 1;
+		}
+		pthread_cleanup_push(np_conn_credit_unlock, conn);
+		while (!np_conn_credit_ok(conn))
+			xpthread_cond_wait(&conn->refcond, &conn->lock);
+		pthread_cleanup_pop(0);
+	}
+	xpthread_mutex_unlock(&conn->lock);
+
+	if (np_srv_credit_ok(srv))
+		return 0;
+	xpthread_mutex_lock(&srv->fclock);
+	__atomic_add_fetch(&srv->fcwaiters, 1, __ATOMIC_SEQ_CST);
+	if (!np_srv_credit_ok(srv)) {
+		srv->srv_throttles++;
+		if (conn->reactor) {
+			conn->parked_next = srv->parked;
+			srv->parked = conn;
+			xpthread_mutex_unlock(&srv->fclock);
+			return 1;
+		}
+		pthread_cleanup_push(np_srv_credit_unlock, srv);
+		while (!np_srv_credit_ok(srv))
+			xpthread_cond_wait(&srv->fccond, &srv->fclock);
+		pthread_cleanup_pop(0);
+	}
+	__atomic_sub_fetch(&srv->fcwaiters, 1, __ATOMIC_SEQ_CST);
+	xpthread_mutex_unlock(&srv->fclock);
+	return 0;
+}
+
+/* Npreq structs are recycled through a short per-connection free list.
+ * A connection's requests are allocated by its reader and freed by
+ * workers, so per-thread lists would only migrate them.  The list is
+ * protected by conn->lock, which request accounting takes anyway.
+ */
+static void
+np_conn_req_free(Npreq *req)
+{
+	pthread_mutex_destroy(&req->lock);
+	free(req);
+}
+
+/* Account for a new request on 'conn' with a tcall of 'bytes'.
+ * Return a recycled Npreq, or NULL if the caller must allocate one.
+ */
+Npreq *
+np_conn_req_add(Npconn *conn, u32 bytes)
+{
+	Npsrv *srv = conn->srv;
+	Npreq *req;
+
+	xpthread_mutex_lock(&conn->lock);
+	conn->refcount++;
+	__atomic_add_fetch(&conn->nreqs, 1, __ATOMIC_RELAXED);
+	conn->reqbytes += bytes;
+	if ((req = conn->freereqs)) {
+		conn->freereqs = req->next;
+		conn->nfreereqs--;
+	}
+	xpthread_mutex_unlock(&conn->lock);
+	__atomic_add_fetch(&srv->nreqs, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&srv->reqbytes, bytes, __ATOMIC_SEQ_CST);
+	return req;
+}
+
+/* Return a request's credit and resume readers that were waiting for it.
+ * 'req', if not NULL, is put on the free list or freed.
+ * N.B. conn may be destroyed once its lock is dropped unless its input
+ * is paused, so only touch it in that case.
+ */
+void
+np_conn_req_done(Npconn *conn, u32 bytes, Npreq *req)
+{
+	Npsrv *srv = conn->srv;
+	Npconn *c;
+	int resume = 0;
+
+	xpthread_mutex_lock(&conn->lock);
+	NP_ASSERT(conn->refcount > 0);
+	conn->refcount--;
+	__atomic_sub_fetch(&conn->nreqs, 1, __ATOMIC_RELAXED);
+	conn->reqbytes -= bytes;
+	if (req && conn->nfreereqs < CONN_REQ_FREEMAX) {
+		req->next = conn->freereqs;
+		conn->freereqs = req;
+		conn->nfreereqs++;
+		req = NULL;
+	}
+	if (conn->throttled && np_conn_credit_ok(conn)) {
+		conn->throttled = 0;
+		resume = 1;
+	}
+	xpthread_cond_signal(&conn->refcond);
+	xpthread_mutex_unlock(&conn->lock);
+	if (req)
+		np_conn_req_free(req);
+	if (resume)
+		np_reactor_resume(srv->reactor, conn);
+
+	__atomic_sub_fetch(&srv->nreqs, 1, __ATOMIC_SEQ_CST);
+	__atomic_sub_fetch(&srv->reqbytes, bytes, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&srv->fcwaiters, __ATOMIC_SEQ_CST) > 0) {
+		xpthread_mutex_lock(&srv->fclock);
+		if (np_srv_credit_ok(srv)) {
+			xpthread_cond_broadcast(&srv->fccond);
+			while ((c = srv->parked)) {
+				srv->parked = c->parked_next;
+				c->parked_next = NULL;
+				__atomic_sub_fetch(&srv->fcwaiters, 1,
+						   __ATOMIC_SEQ_CST);
+				np_reactor_resume(srv->reactor, c);
+			}
+		}
+		xpthread_mutex_unlock(&srv->fclock);
+	}
+}
+
 static void
 np_conn_destroy(Npconn *conn)
 {
+	Npreq *req;
 	int n;
 
 	NP_ASSERT(conn != NULL);
@@ -114,6 +326,12 @@ np_conn_destroy(Npconn *conn)
 	pthread_mutex_destroy(&conn->lock);
 	pthread_mutex_destroy(&conn->wlock);
 	pthread_cond_destroy(&conn->refcond);
+	pthread_cond_destroy(&conn->sendcond);
+	pthread_mutex_destroy(&conn->reqlock);
+	while ((req = conn->freereqs)) {
+		conn->freereqs = req->next;
+		np_conn_req_free(req);
+	}
 
 	np_srv_remove_conn_post(conn->srv);
 	free(conn);
@@ -215,6 +433,57 @@ np_check_allowed (Npfcall *fc)
 	}
 }
 
+/* Hand one incoming message to the server.
+ * Returns 0 on success, or -1 if the connection should be dropped.
+ */
+static int
+np_conn_dispatch(Npconn *conn, Npfcall *fc)
+{
+	Npsrv *srv = conn->srv;
+	Npreq *req;
+
+	_debug_trace (srv, fc);
+
+	/* Reject invalid message types */
+	if (np_check_allowed (fc) != 1) {
+		np_logerr (srv, "unexpected request - "
+			   "dropping connection to '%s'",
+			   conn->client_id);
+		np_free_fcall (fc);
+		return -1;
+	}
+
+	/* Encapsulate fc in a request and hand to srv worker threads.
+	 * In np_req_alloc, req->fid is looked up/initialized.
+	 */
+	req = np_req_alloc(conn, fc);
+	if (!req) {
+		np_logmsg (srv, "out of memory in receive path - "
+			   "dropping connection to '%s'",
+			   conn->client_id);
+		np_free_fcall (fc);
+		return -1;
+	}
+
+	/* Enqueue request for processing by next available worker
+	 * thread, except Tflush which is handled immediately.
+	 */
+	if (fc->type == Tflush) {
+		if (np_flush (req, fc)) {
+			np_req_respond_flush (req);
+			np_req_unref(req);
+		}
+		np_tpool_stats_count (srv->tpool, Tflush, 0, 0);
+	} else if (np_srv_add_req(srv, req) < 0) {
+		np_logmsg (srv, "out of memory in receive path - "
+			   "dropping connection to '%s'",
+			   conn->client_id);
+		np_req_unref(req);
+		return -1;
+	}
+	return 0;
+}
+
 /* Per-connection read thread.
  */
 static void *
@@ -222,14 +491,13 @@ np_conn_read_proc(void *a)
 {
 	Npconn *conn = (Npconn *)a;
 	Npsrv *srv = conn->srv;
-	Npreq *req;
 	Npfcall *fc;
 
 	pthread_detach(pthread_self());
 	pthread_cleanup_push(np_conn_cleanup, a);
 
 	for (;;) {
-
+		(void)np_conn_credit(conn);
 		if (np_trans_recv(conn->trans, &fc, conn->msize) < 0) {
 			np_logerr (srv, "recv error - "
 				   "dropping connection to '%s'",
@@ -238,92 +506,289 @@ np_conn_read_proc(void *a)
 		}
 		if (!fc) /* EOF */
 			break;
-		_debug_trace (srv, fc);
+		if (np_conn_dispatch (conn, fc) < 0)
+			break;
+	}
+	/* Just got EOF on read, or some other fatal error for the
+	 * connection like out of memory.
+	 */
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+/* Called by a reactor thread when the connection's transport is readable.
+ * Read and dispatch up to 'budget' requests, stopping early if the
+ * transport would block.
+ * Returns 0 if the connection should be polled again, 1 if input is paused
+ * by flow control (np_conn_req_done resumes it), 2 if the budget ran out
+ * and more input may be buffered, or -1 on EOF or fatal error, in which
+ * case the caller must call np_conn_close().
+ */
+int
+np_conn_input(Npconn *conn, int budget)
+{
+	Npsrv *srv = conn->srv;
+	Npfcall *fc;
 
-		/* Reject invalid message types */
-		if (np_check_allowed (fc) != 1) {
-			np_logerr (srv, "unexpected request - "
+	for (;;) {
+		if (budget-- == 0)
+			return 2;
+		if (np_conn_credit(conn))
+			return 1;
+		if (np_trans_recv(conn->trans, &fc, conn->msize) < 0) {
+			if (np_rerror () == EAGAIN)
+				return 0;
+			np_logerr (srv, "recv error - "
 				   "dropping connection to '%s'",
 				   conn->client_id);
-			break;
+			return -1;
 		}
+		if (!fc) /* EOF */
+			return -1;
+		if (np_conn_dispatch (conn, fc) < 0)
+			return -1;
+	}
+	/*NOTREACHED*/
+}
 
-		/* Encapsulate fc in a request and hand to srv worker threads.
-		 * In np_req_alloc, req->fid is looked up/initialized.
-		 */
-		req = np_req_alloc(conn, fc);
-		if (!req) {
-			np_logmsg (srv, "out of memory in receive path - "
-				   "dropping connection to '%s'",
-				   conn->client_id);
-			free (fc);
+static void *
+np_conn_close_proc(void *a)
+{
+	pthread_detach(pthread_self());
+	np_conn_cleanup (a);
+	return NULL;
+}
+
+/* Tear down a reactor-driven connection.  Cleanup waits for the
+ * connection's outstanding requests to finish, so it is done in a
+ * short-lived thread rather than blocking the reactor.
+ */
+void
+np_conn_close(Npconn *conn)
+{
+	pthread_t t;
+
+	if (pthread_create(&t, NULL, np_conn_close_proc, conn) != 0)
+		np_conn_cleanup (conn);
+}
+
+/* Outstanding requests are indexed by tag in conn->reqtab from the
+ * time they are queued until their response has been sent (or they are
+ * flushed), so Tflush and teardown only look at this connection's
+ * requests.  The table doesn't hold a reference; the request's tpool
+ * queue or workreqs list does.  A tag that is reused while an earlier
+ * request with that tag is still being worked on is logged, since the
+ * client can't tell the responses apart.  The newest request is first
+ * on its chain, so it is the one a Tflush finds.
+ * N.B. conn->reqlock nests inside tp->reqlock and tp->worklock, and
+ * req->indexed is only changed while holding one of those as well.
+ */
+void
+np_conn_add_req(Npconn *conn, Npreq *req)
+{
+	Npreq **head = &conn->reqtab[req->tag % CONN_REQ_HTABLE_SIZE];
+	Npreq *r;
+	int dup = 0;
+
+	xpthread_mutex_lock(&conn->reqlock);
+	for (r = *head; r != NULL; r = r->tnext) {
+		if (r->tag == req->tag
+		    && !__atomic_load_n(&r->responded, __ATOMIC_ACQUIRE)) {
+			dup = 1;
 			break;
 		}
+	}
+	req->tprev = NULL;
+	req->tnext = *head;
+	if (*head)
+		(*head)->tprev = req;
+	*head = req;
+	req->indexed = 1;
+	xpthread_mutex_unlock(&conn->reqlock);
+
+	if (dup)
+		np_logmsg (conn->srv, "%s: duplicate tag %d",
+			   conn->client_id, req->tag);
+}
 
-		/* Enqueue request for processing by next available worker
-		 * thread, except Tflush which is handled immediately.
-		 */
-		if (fc->type == Tflush) {
-			if (np_flush (req, fc)) {
-				np_req_respond_flush (req);
-				np_req_unref(req);
-			}
-			xpthread_mutex_lock (&srv->lock);
-			srv->tpool->stats.nreqs[Tflush]++;
-			xpthread_mutex_unlock (&srv->lock);
-		} else {
-			xpthread_mutex_lock(&srv->lock);
-			np_srv_add_req(srv, req);
-			xpthread_mutex_unlock(&srv->lock);
-		}
+void
+np_conn_remove_req(Npconn *conn, Npreq *req)
+{
+	xpthread_mutex_lock(&conn->reqlock);
+	if (req->indexed) {
+		if (req->tprev)
+			req->tprev->tnext = req->tnext;
+		else
+			conn->reqtab[req->tag % CONN_REQ_HTABLE_SIZE] =
+								req->tnext;
+		if (req->tnext)
+			req->tnext->tprev = req->tprev;
+		req->tnext = req->tprev = NULL;
+		req->indexed = 0;
 	}
-	/* Just got EOF on read, or some other fatal error for the
-	 * connection like out of memory.
-	 */
-	pthread_cleanup_pop(1);
-	return NULL;
+	xpthread_mutex_unlock(&conn->reqlock);
+}
+
+/* Return the newest outstanding request with 'tag', or NULL.
+ * The caller gets a reference on the request and on its tpool.
+ */
+Npreq *
+np_conn_get_req(Npconn *conn, u16 tag)
+{
+	Npreq *req;
+
+	xpthread_mutex_lock(&conn->reqlock);
+	req = conn->reqtab[tag % CONN_REQ_HTABLE_SIZE];
+	while (req && req->tag != tag)
+		req = req->tnext;
+	if (req) {
+		np_req_ref(req);
+		np_tpool_incref(req->tpool);
+	}
+	xpthread_mutex_unlock(&conn->reqlock);
+	return req;
+}
+
+/* Like np_conn_get_req() but return any request that np_conn_flush()
+ * has not dealt with yet, starting at bucket *ip.
+ */
+static Npreq *
+np_conn_next_req(Npconn *conn, int *ip)
+{
+	Npreq *req = NULL;
+
+	xpthread_mutex_lock(&conn->reqlock);
+	for (; *ip < CONN_REQ_HTABLE_SIZE; (*ip)++) {
+		req = conn->reqtab[*ip];
+		while (req && req->state == REQ_NOREPLY)
+			req = req->tnext;
+		if (req)
+			break;
+	}
+	if (req) {
+		np_req_ref(req);
+		np_tpool_incref(req->tpool);
+	}
+	xpthread_mutex_unlock(&conn->reqlock);
+	return req;
 }
 
+/* Drop queued requests and make in-progress ones not reply, interrupting
+ * them if SRV_FLAGS_FLUSHSIG is set.
+ */
 static void
 np_conn_flush (Npconn *conn)
 {
 	Nptpool *tp;
-	Npreq *creq, *nextreq;
-
-	xpthread_mutex_lock(&conn->srv->lock);
-	for (tp = conn->srv->tpool; tp != NULL; tp = tp->next) {
-		for (creq = tp->reqs_first; creq != NULL; creq = nextreq) {
-			nextreq = creq->next;
-			if (creq->conn != conn)
-				continue;
+	Npreq *creq;
+	int i = 0;
+
+	while ((creq = np_conn_next_req(conn, &i))) {
+		tp = creq->tpool;
+		xpthread_mutex_lock(&tp->reqlock);
+		if (creq->flow) {
 			np_srv_remove_req(tp, creq);
+			np_conn_remove_req(conn, creq);
 			np_req_unref(creq);
+		} else {
+			xpthread_mutex_lock(&tp->worklock);
+			if (creq->indexed) {
+				creq->state = REQ_NOREPLY;
+				if ((conn->srv->flags & SRV_FLAGS_FLUSHSIG)
+							&& creq->wthread)
+					pthread_kill (creq->wthread->thread,
+						      SIGUSR2);
+			}
+			xpthread_mutex_unlock(&tp->worklock);
 		}
-		for (creq = tp->workreqs; creq != NULL; creq = creq->next) {
-			if (creq->conn != conn)
-				continue;
-			creq->state = REQ_NOREPLY;
-			if (conn->srv->flags & SRV_FLAGS_FLUSHSIG)
-				pthread_kill (creq->wthread->thread, SIGUSR2);
+		xpthread_mutex_unlock(&tp->reqlock);
+		np_req_unref(creq);
+		np_tpool_decref(tp);
+	}
+}
+
+/* Send everything on the send queue, in batches of up to SENDQ_BATCH
+ * responses per transport call.  Responses queued by other workers while
+ * a batch is being sent are picked up by the next one.
+ */
+#define SENDQ_BATCH	64
+
+static void
+np_conn_sendq_drain(Npconn *conn)
+{
+	Npsrv *srv = conn->srv;
+	Npfcall *batch[SENDQ_BATCH];
+	int i, n;
+
+	/* assert: conn->wlock held and conn->sending set */
+	while (conn->sendq_first) {
+		for (n = 0; n < SENDQ_BATCH && conn->sendq_first; n++) {
+			batch[n] = conn->sendq_first;
+			conn->sendq_first = batch[n]->next;
 		}
+		if (!conn->sendq_first)
+			conn->sendq_last = NULL;
+		xpthread_mutex_unlock(&conn->wlock);
+
+		if (np_trans_sendv(conn->trans, batch, n) < 0)
+			np_logerr (srv, "send to '%s'", conn->client_id);
+		__atomic_add_fetch(&srv->sendq_batches, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&srv->sendq_fcalls, n, __ATOMIC_RELAXED);
+		if (n > __atomic_load_n(&srv->sendq_maxbatch, __ATOMIC_RELAXED))
+			__atomic_store_n(&srv->sendq_maxbatch, n,
+					 __ATOMIC_RELAXED);
+		for (i = 0; i < n; i++)
+			np_free_fcall(batch[i]);
+
+		xpthread_mutex_lock(&conn->wlock);
 	}
-	xpthread_mutex_unlock(&conn->srv->lock);
 }
 
+/* Queue req->rcall, which now belongs to the connection, for sending.
+ * If no other worker is sending on this connection, this one drains
+ * the queue; otherwise it returns right away and the response goes out
+ * with the other worker's next batch.
+ */
 void
 np_conn_respond(Npreq *req)
 {
-	int n;
 	Npconn *conn = req->conn;
-	Npsrv *srv = conn->srv;
 	Npfcall *rc = req->rcall;
 
-	_debug_trace (srv, rc);
+	req->rcall = NULL;
+	_debug_trace (conn->srv, rc);
+	rc->next = NULL;
+	xpthread_mutex_lock(&conn->wlock);
+	if (conn->sendq_last)
+		conn->sendq_last->next = rc;
+	else
+		conn->sendq_first = rc;
+	conn->sendq_last = rc;
+	if (!conn->sending) {
+		conn->sending = 1;
+		np_conn_sendq_drain(conn);
+		conn->sending = 0;
+		xpthread_cond_broadcast(&conn->sendcond);
+	}
+	xpthread_mutex_unlock(&conn->wlock);
+}
+
+/* Send a response that cannot be queued, e.g. one in a stack buffer,
+ * after any responses queued ahead of it.
+ */
+void
+np_conn_respond_now(Npconn *conn, Npfcall *rc)
+{
+	int n;
+
+	_debug_trace (conn->srv, rc);
 	xpthread_mutex_lock(&conn->wlock);
+	while (conn->sending)
+		xpthread_cond_wait(&conn->sendcond, &conn->wlock);
 	n = np_trans_send(conn->trans, rc);
 	xpthread_mutex_unlock(&conn->wlock);
 	if (n < 0)
-		np_logerr (srv, "send to '%s'", conn->client_id);
+		np_logerr (conn->srv, "send to '%s'", conn->client_id);
 }
 
 char *
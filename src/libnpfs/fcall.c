@@ -252,31 +252,42 @@ error:
 	return rc;
 }
 
+/* Find the request being flushed in the connection's tag index.
+ * If it is still queued, drop it and respond right away.  If it is being
+ * worked on, the Rflush is sent after its response (np_postprocess_flush).
+ * Returns 1 if the caller should respond to the Tflush now.
+ */
 int
 np_flush(Npreq *req, Npfcall *tc)
 {
 	u16 oldtag = tc->u.tflush.oldtag;
+	Npconn *conn = req->conn;
+	Npsrv *srv = conn->srv;
 	Npreq *creq;
-	int ret = 1;
 	Nptpool *tp;
-	Npsrv *srv = req->conn->srv;
+	int ret = 1;
 
-	xpthread_mutex_lock(&req->conn->srv->lock);
-	for (tp = req->conn->srv->tpool; tp != NULL; tp = tp->next) {
-		for(creq = tp->reqs_first; creq != NULL; creq = creq->next) {
-			if (!(creq->conn==req->conn && creq->tag==oldtag))
-				continue;
-			if ((srv->flags & SRV_FLAGS_DEBUG_FLUSH)) {
-				np_logmsg (srv, "flush(early): req type %d",
-					   creq->tcall->type);
-			}
-			np_srv_remove_req(tp, creq);
-			np_req_unref(creq);
-			goto done;
+	if (!(creq = np_conn_get_req(conn, oldtag))) {
+		if ((srv->flags & SRV_FLAGS_DEBUG_FLUSH))
+			np_logmsg (srv, "flush: tag %d not found", oldtag);
+		return 1;
+	}
+	tp = creq->tpool;
+	/* N.B. holding tp->reqlock keeps creq from moving from the queue
+	 * to workreqs while we look.
+	 */
+	xpthread_mutex_lock(&tp->reqlock);
+	if (creq->flow) {
+		if ((srv->flags & SRV_FLAGS_DEBUG_FLUSH)) {
+			np_logmsg (srv, "flush(early): req type %d",
+				   creq->tcall->type);
 		}
-		for(creq = tp->workreqs; creq != NULL; creq = creq->next) {
-			if (!(creq->conn==req->conn && creq->tag==oldtag))
-				continue;
+		np_srv_remove_req(tp, creq);
+		np_conn_remove_req(conn, creq);
+		np_req_unref(creq);
+	} else {
+		xpthread_mutex_lock(&tp->worklock);
+		if (creq->indexed) {
 			if ((srv->flags & SRV_FLAGS_DEBUG_FLUSH)) {
 				np_logmsg (srv, "flush(late): req type %d",
 					   creq->tcall->type);
@@ -285,16 +296,15 @@ np_flush(Npreq *req, Npfcall *tc)
 			if (creq->flushreq)
 				np_req_unref(creq->flushreq);
 			creq->flushreq = req;
-			ret = 0; /* reply is delayed until after req */
-			if (req->conn->srv->flags & SRV_FLAGS_FLUSHSIG)
+			ret = 0; /* reply is delayed until after creq */
+			if ((srv->flags & SRV_FLAGS_FLUSHSIG) && creq->wthread)
 				pthread_kill (creq->wthread->thread, SIGUSR2);
-			goto done;
 		}
+		xpthread_mutex_unlock(&tp->worklock);
 	}
-	if ((srv->flags & SRV_FLAGS_DEBUG_FLUSH))
-		np_logmsg (srv, "flush: tag %d not found", oldtag);
-done:
-	xpthread_mutex_unlock(&req->conn->srv->lock);
+	xpthread_mutex_unlock(&tp->reqlock);
+	np_req_unref(creq);
+	np_tpool_decref(tp);
 	return ret;
 }
 
@@ -353,7 +363,7 @@ np_walk(Npreq *req, Npfcall *tc)
 		}
 		np_user_incref(fid->user);
 		newfid->user = fid->user;
-		np_tpool_incref(fid->tpool);
+		np_tpool_incref_fid(fid->tpool);
 		newfid->tpool = fid->tpool;
 		newfid->type = fid->type;
 		newfid->flags = fid->flags;
@@ -369,24 +379,38 @@ np_walk(Npreq *req, Npfcall *tc)
 		if (np_setfsid (req, newfid->user, -1) < 0)
 			goto done;
 	}
-	for(i = 0; i < tc->u.twalk.nwname;) {
-		if (newfid->type & Qttmp) {
-			if (!np_ctl_walk (newfid, &tc->u.twalk.wnames[i],
-					  &wqids[i]))
-				break;
-		} else {
-			if (!conn->srv->walk) {
-				np_uerror (ENOSYS);
-				break;
-			}
-			if (!(*conn->srv->walk)(newfid, &tc->u.twalk.wnames[i],
+	/* walkn resolves all the wnames in one call, with the same result
+	 * as walk on each in turn: it returns how many were walked, and
+	 * stops after one that is not a directory.
+	 */
+	if (!(newfid->type & Qttmp) && conn->srv->walkn
+				    && tc->u.twalk.nwname > 0) {
+		i = (*conn->srv->walkn)(newfid, tc->u.twalk.nwname,
+					tc->u.twalk.wnames, wqids);
+		if (i > 0)
+			newfid->type = wqids[i - 1].type;
+	} else {
+		for (i = 0; i < tc->u.twalk.nwname;) {
+			if (newfid->type & Qttmp) {
+				if (!np_ctl_walk (newfid,
+						  &tc->u.twalk.wnames[i],
+						  &wqids[i]))
+					break;
+			} else {
+				if (!conn->srv->walk) {
+					np_uerror (ENOSYS);
+					break;
+				}
+				if (!(*conn->srv->walk)(newfid,
+						&tc->u.twalk.wnames[i],
 						&wqids[i]))
+					break;
+			}
+			newfid->type = wqids[i].type;
+			i++;
+			if (i<(tc->u.twalk.nwname) && !(newfid->type & Qtdir))
 				break;
 		}
-		newfid->type = wqids[i].type;
-		i++;
-		if (i<(tc->u.twalk.nwname) && !(newfid->type & Qtdir))
-			break;
 	}
 
 	if (i == 0 && tc->u.twalk.nwname != 0)
@@ -430,7 +454,7 @@ np_read(Npreq *req, Npfcall *tc)
 			if (n >= 0)
 				np_set_rread_count(rc, n);
 			else {
-				free(rc);
+				np_free_fcall(rc);
 				rc = NULL;
 			}
 		} else
@@ -838,7 +862,7 @@ np_getattr(Npreq *req, Npfcall *tc)
 			goto done;
 		}
 		rc = (*req->conn->srv->getattr)(fid,
-						tc->u.tgetattr.request_mask);
+						tc->u.tgetattr.request_mask, req);
 	}
 done:
 	return rc;
@@ -924,7 +948,7 @@ np_xattrwalk(Npreq *req, Npfcall *tc)
 	 */
 	np_user_incref(fid->user);
 	attrfid->user = fid->user;
-	np_tpool_incref(fid->tpool);
+	np_tpool_incref_fid(fid->tpool);
 	attrfid->tpool = fid->tpool;
 	attrfid->type = fid->type;
 	attrfid->flags = fid->flags;
@@ -1044,7 +1068,8 @@ np_fsync(Npreq *req, Npfcall *tc)
 			np_uerror (ENOSYS);
 			goto done;
 		}
-		rc = (*req->conn->srv->fsync)(fid, tc->u.tfsync.datasync);
+		rc = (*req->conn->srv->fsync)(fid, tc->u.tfsync.datasync,
+					      req);
 	}
 done:
 	return rc;
@@ -0,0 +1,310 @@
+/*************************************************************\
+ * Copyright (C) 2010 by Lawrence Livermore National Security, LLC.
+ *
+ * This file is part of npfs, a framework for 9P synthetic file systems.
+ * For details see https://sourceforge.net/projects/npfs.
+ *
+ * SPDX-License-Identifier: MIT
+ *************************************************************/
+
+/* fcallpool.c - recycle Npfcall buffers through power-of-two size classes
+ *
+ * Frames are allocated at the size actually needed (rounded up to the
+ * class size) rather than at msize, so a small metadata request no longer
+ * costs a msize-sized (typically 1M, above the mmap threshold) allocation.
+ * Freed buffers are kept on a per-class free list for reuse.
+ *
+ * The pool is process-wide with one lock per class.  T-messages are
+ * allocated by a connection's reader and freed by a worker, and R-messages
+ * the other way around, so per-thread lists would only migrate buffers.
+ *
+ * Each pooled buffer is an individual malloc block, so code that releases
+ * an Npfcall with free() instead of np_free_fcall() remains correct; the
+ * buffer just isn't recycled.
+ *
+ * A second set of classes holds buffers laid out so that the packet's
+ * payload, after a header of known length, starts on a page boundary.
+ * These are used to receive large Twrites so the data can be written
+ * out from where it landed (e.g. to a file opened with O_DIRECT).
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "npfs.h"
+#include "xpthread.h"
+#include "npfsimpl.h"
+
+#define FCALLPOOL_MINSHIFT	10	/* smallest class: 1K */
+#define FCALLPOOL_MAXSHIFT	20	/* largest class: 1M */
+#define FCALLPOOL_NCLASS	(FCALLPOOL_MAXSHIFT - FCALLPOOL_MINSHIFT + 1)
+
+/* Each class caches up to FCALLPOOL_MAXBYTES worth of buffers,
+ * but no fewer than FCALLPOOL_MINCOUNT buffers.
+ */
+#define FCALLPOOL_MAXBYTES	(8*1024*1024)
+#define FCALLPOOL_MINCOUNT	16
+
+typedef struct Fcallclass Fcallclass;
+
+struct Fcallclass {
+	pthread_mutex_t	lock;
+	Npfcall		*free;
+	int		count;
+	int		maxcount;
+	u64		hits;
+	u64		misses;
+};
+
+/* fc->pool is the class index, offset by FCALLPOOL_NCLASS for
+ * aligned classes.
+ */
+static Fcallclass fcallpool[2 * FCALLPOOL_NCLASS] = {
+	[0 ... 2 * FCALLPOOL_NCLASS - 1] = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	},
+};
+
+static inline Fcallclass *
+_aligned_class (int i)
+{
+	return &fcallpool[FCALLPOOL_NCLASS + i];
+}
+
+static long
+_pagesize (void)
+{
+	static long pagesize = 0;
+
+	if (pagesize == 0 && (pagesize = sysconf (_SC_PAGESIZE)) <= 0)
+		pagesize = 4096;
+	return pagesize;
+}
+
+static inline u32
+_class_size (int i)
+{
+	return 1 << (i + FCALLPOOL_MINSHIFT);
+}
+
+/* Return the smallest class that can hold 'size' bytes of packet,
+ * or -1 if the packet is too large to be pooled.
+ */
+static int
+_size_to_class (u32 size)
+{
+	int i;
+
+	for (i = 0; i < FCALLPOOL_NCLASS; i++) {
+		if (size <= _class_size (i))
+			return i;
+	}
+	return -1;
+}
+
+/* While on the free list, fc->pkt is unused so the packet area holds
+ * the link to the next free buffer.
+ */
+static inline Npfcall *
+_get_next (Npfcall *fc)
+{
+	Npfcall *next;
+
+	memcpy (&next, fc->pkt, sizeof (next));
+	return next;
+}
+
+static inline void
+_set_next (Npfcall *fc, Npfcall *next)
+{
+	memcpy (fc->pkt, &next, sizeof (next));
+}
+
+Npfcall *
+np_alloc_fcall(int size)
+{
+	Npfcall *fc = NULL;
+	Fcallclass *cp;
+	int i;
+
+	if (size < 0) {
+		np_uerror (EINVAL);
+		return NULL;
+	}
+	i = _size_to_class (size);
+	if (i >= 0) {
+		cp = &fcallpool[i];
+		xpthread_mutex_lock (&cp->lock);
+		if ((fc = cp->free)) {
+			cp->free = _get_next (fc);
+			cp->count--;
+			cp->hits++;
+		} else
+			cp->misses++;
+		xpthread_mutex_unlock (&cp->lock);
+		if (!fc)
+			fc = malloc (sizeof (*fc) + _class_size (i));
+	} else
+		fc = malloc (sizeof (*fc) + size);
+	if (!fc) {
+		np_uerror (ENOMEM);
+		return NULL;
+	}
+	fc->pkt = (u8 *)fc + sizeof (*fc);
+	fc->size = size;
+	fc->pool = i;
+	fc->pipe = NULL;
+
+	return fc;
+}
+
+/* Allocate a fcall for a 'size' byte packet whose payload, after 'hdrlen'
+ * bytes, is page aligned.  The buffer holds a page for the Npfcall and
+ * header, followed by the payload.
+ */
+Npfcall *
+np_alloc_fcall_aligned(int size, int hdrlen)
+{
+	long pagesize = _pagesize ();
+	Npfcall *fc = NULL;
+	Fcallclass *cp;
+	void *p;
+	int i;
+
+	if (size < hdrlen || hdrlen < 0) {
+		np_uerror (EINVAL);
+		return NULL;
+	}
+	/* N.B. the free list link is stored just past the Npfcall */
+	if (sizeof (*fc) + sizeof (fc) + hdrlen > pagesize)
+		return np_alloc_fcall (size);
+	i = _size_to_class (size - hdrlen);
+	if (i >= 0) {
+		cp = _aligned_class (i);
+		xpthread_mutex_lock (&cp->lock);
+		if ((fc = cp->free)) {
+			cp->free = _get_next (fc);
+			cp->count--;
+			cp->hits++;
+		} else
+			cp->misses++;
+		xpthread_mutex_unlock (&cp->lock);
+		if (!fc && posix_memalign (&p, pagesize,
+					   pagesize + _class_size (i)) == 0)
+			fc = p;
+	} else if (posix_memalign (&p, pagesize, pagesize + size - hdrlen) == 0)
+		fc = p;
+	if (!fc) {
+		np_uerror (ENOMEM);
+		return NULL;
+	}
+	fc->pkt = (u8 *)fc + pagesize - hdrlen;
+	fc->size = size;
+	fc->pool = i >= 0 ? FCALLPOOL_NCLASS + i : -1;
+	fc->pipe = NULL;
+
+	return fc;
+}
+
+void
+np_free_fcall(Npfcall *fc)
+{
+	Fcallclass *cp;
+	u32 csize;
+
+	if (!fc)
+		return;
+	if (fc->pipe) {
+		np_pipe_put (fc->pipe);
+		fc->pipe = NULL;
+	}
+	if (fc->pool < 0 || fc->pool >= 2 * FCALLPOOL_NCLASS) {
+		free (fc);
+		return;
+	}
+	cp = &fcallpool[fc->pool];
+	csize = _class_size (fc->pool % FCALLPOOL_NCLASS);
+	fc->pkt = (u8 *)fc + sizeof (*fc);
+	xpthread_mutex_lock (&cp->lock);
+	if (cp->maxcount == 0) {
+		cp->maxcount = FCALLPOOL_MAXBYTES / csize;
+		if (cp->maxcount < FCALLPOOL_MINCOUNT)
+			cp->maxcount = FCALLPOOL_MINCOUNT;
+	}
+	if (cp->count < cp->maxcount) {
+		_set_next (fc, cp->free);
+		cp->free = fc;
+		cp->count++;
+		fc = NULL;
+	}
+	xpthread_mutex_unlock (&cp->lock);
+	if (fc)
+		free (fc);
+}
+
+/* Release all cached buffers.
+ */
+void
+np_fcallpool_flush (void)
+{
+	Fcallclass *cp;
+	Npfcall *fc, *next;
+	int i;
+
+	for (i = 0; i < 2 * FCALLPOOL_NCLASS; i++) {
+		cp = &fcallpool[i];
+		xpthread_mutex_lock (&cp->lock);
+		fc = cp->free;
+		cp->free = NULL;
+		cp->count = 0;
+		xpthread_mutex_unlock (&cp->lock);
+		for (; fc != NULL; fc = next) {
+			next = _get_next (fc);
+			free (fc);
+		}
+	}
+}
+
+/* ctl "fcallpool" file: one line per size class:
+ *   size cached hits misses
+ * followed by the aligned classes, with "aligned" appended.
+ */
+char *
+np_fcallpool_ctl_get (char *name, void *a)
+{
+	Fcallclass *cp;
+	char *s = NULL;
+	int i, len = 0;
+	int count;
+	u64 hits, misses;
+
+	for (i = 0; i < 2 * FCALLPOOL_NCLASS; i++) {
+		cp = &fcallpool[i];
+		xpthread_mutex_lock (&cp->lock);
+		count = cp->count;
+		hits = cp->hits;
+		misses = cp->misses;
+		xpthread_mutex_unlock (&cp->lock);
+		if (aspf (&s, &len, "%"PRIu32" %d %"PRIu64" %"PRIu64"%s\n",
+			  _class_size (i % FCALLPOOL_NCLASS), count, hits,
+			  misses, i < FCALLPOOL_NCLASS ? "" : " aligned") < 0) {
+			np_uerror (ENOMEM);
+			goto error;
+		}
+	}
+	return s;
+error:
+	if (s)
+		free (s);
+	return NULL;
+}
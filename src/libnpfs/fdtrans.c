@@ -18,21 +18,40 @@
 #include <stdarg.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include "npfs.h"
 #include "npfsimpl.h"
 
 typedef struct Fdtrans Fdtrans;
 
+/* Size of the receive staging buffer.  Small requests are read into it
+ * in bulk and copied out to a right-sized fcall; the tail of a large
+ * request is read directly into its fcall.
+ */
+#define FDTRANS_BUFSIZE	16384
+
+/* Maximum number of responses gathered into one writev().
+ */
+#define FDTRANS_MAXIOV	64
+
 struct Fdtrans {
 	Nptrans*	trans;
 	int 		fdin;
 	int		fdout;
-	Npfcall		*fc;
+	u8		*buf;
+	int		buf_off; /* start of unconsumed bytes in buf */
+	int		buf_len; /* end of unconsumed bytes in buf */
+	Npfcall		*fc;	 /* partially received request, if any */
 	int		fc_len;  /* used bytes in fc */
 };
 
 static int np_fdtrans_recv(Npfcall **fcp, u32 msize, void *a);
 static int np_fdtrans_send(Npfcall *fc, void *a);
+static int np_fdtrans_sendv(Npfcall **fcs, int n, void *a);
 static void np_fdtrans_destroy(void *a);
 
 Nptrans *
@@ -40,24 +59,46 @@ np_fdtrans_create(int fdin, int fdout)
 {
 	Nptrans *npt;
 	Fdtrans *fdt;
+	struct stat sb;
 
 	fdt = malloc(sizeof(*fdt));
 	if (!fdt) {
 		np_uerror(ENOMEM);
 		return NULL;
 	}
+	if (!(fdt->buf = malloc(FDTRANS_BUFSIZE))) {
+		free(fdt);
+		np_uerror(ENOMEM);
+		return NULL;
+	}
 
 	fdt->fdin = fdin;
 	fdt->fdout = fdout;
+	fdt->buf_off = 0;
+	fdt->buf_len = 0;
 	fdt->fc = NULL;
 	fdt->fc_len = 0;
 	npt = np_trans_create(fdt, np_fdtrans_recv,
 				   np_fdtrans_send,
 				   np_fdtrans_destroy);
 	if (!npt) {
+		free(fdt->buf);
 		free(fdt);
 		return NULL;
 	}
+	npt->sendv = np_fdtrans_sendv;
+
+	/* Sockets may be multiplexed by the reactor (see reactor.c),
+	 * which makes them non-blocking.
+	 */
+	if (fdin == fdout && fstat(fdin, &sb) == 0 && S_ISSOCK(sb.st_mode))
+		npt->pollfd = fdin;
+#ifdef HAVE_SPLICE
+	/* Rread payloads may be spliced into sockets (see splice.c).
+	 */
+	if (fstat(fdout, &sb) == 0 && S_ISSOCK(sb.st_mode))
+		npt->splice = 1;
+#endif
 
 	fdt->trans = npt;
 	return npt;
@@ -73,83 +114,116 @@ np_fdtrans_destroy(void *a)
 		(void)close(fdt->fdin);
 	if (fdt->fdout >= 0 && fdt->fdout != fdt->fdin)
 		(void)close(fdt->fdout);
+	free(fdt->buf);
 	if (fdt->fc)
-		free(fdt->fc);
+		np_free_fcall(fdt->fc);
 
 	free(fdt);
 }
 
+/* Read up to len bytes, retrying on EINTR.
+ * Returns bytes read, 0 on EOF, or -1 on error.
+ */
+static int
+_read (int fd, u8 *buf, int len)
+{
+	int n;
+
+	do {
+		n = read(fd, buf, len);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0)
+		np_uerror(errno);
+	return n;
+}
+
 /* This function must perform request framing, and return with one request
- * or an EOF/error.  If we read some extra bytes after a full request,
- * store the extra in fdt->fc and start reading into that next time instead
- * of allocating a fresh buffer.
+ * or an EOF/error.  Bytes are read in bulk into the staging buffer, so
+ * several small pipelined requests can be picked up with one read.
+ * Once the size of the next request is known, a fcall of that size is
+ * taken from the fcallpool and the request is copied into it; whatever
+ * part of a large request has not been staged yet is read directly into
+ * the fcall.  A large Twrite gets a fcall with a page aligned payload.
+ * If the fd is non-blocking and a full request is not yet available,
+ * return -1 with EAGAIN, keeping any partial request for the next call.
  * N.B. msize starts out at max for the server and can shrink if client
- * negotiates a smaller one with Tversion.  It cannot grow, therefore
- * the allocated size of cached 'fc' from a preveious call will always be
- * >= the msize of the current call.  See fcall.c::np_version().
+ * negotiates a smaller one with Tversion.  See fcall.c::np_version().
  */
 static int
 np_fdtrans_recv(Npfcall **fcp, u32 msize, void *a)
 {
 	Fdtrans *fdt = (Fdtrans *)a;
-	Npfcall *fc;
+	Npfcall *fc = NULL;
 	u32 size;
 	int n, len;
 
 	if (fdt->fc) {
 		fc = fdt->fc;
-		fdt->fc = NULL;
 		len = fdt->fc_len;
-		size = np_peek_size(fc->pkt, len); /* 0 if len < 4 */
-		if (size > msize) {
-			np_uerror(EPROTO);
-			goto error;
+		size = fc->size;
+		fdt->fc = NULL;
+		goto readrest;
+	}
+	/* N.B. stage size[4] and type[1] */
+	while (fdt->buf_len - fdt->buf_off < 5) {
+		if (fdt->buf_off > 0) {
+			len = fdt->buf_len - fdt->buf_off;
+			memmove(fdt->buf, fdt->buf + fdt->buf_off, len);
+			fdt->buf_off = 0;
+			fdt->buf_len = len;
 		}
-	} else {
-		if (!(fc = np_alloc_fcall(msize))) {
-			np_uerror (ENOMEM);
+		n = _read(fdt->fdin, fdt->buf + fdt->buf_len,
+			  FDTRANS_BUFSIZE - fdt->buf_len);
+		if (n < 0)
 			goto error;
-		}
-		len = 0;
-		size = 0;
+		if (n == 0)
+			goto eof;
+		fdt->buf_len += n;
 	}
-	while (size == 0 || len < size) {
-		n = read(fdt->fdin, fc->pkt + len, msize - len);
-		if (n < 0 && errno == EINTR)
-			continue;
+	size = np_peek_size(fdt->buf + fdt->buf_off, 4);
+	if (size > msize || size < 7) {
+		np_uerror(EPROTO);
+		goto error;
+	}
+	if (size >= TWRITE_HDRSIZE + TWRITE_ALIGN_MIN
+			&& fdt->buf[fdt->buf_off + 4] == Twrite)
+		fc = np_alloc_fcall_aligned(size, TWRITE_HDRSIZE);
+	else
+		fc = np_alloc_fcall(size);
+	if (!fc)
+		goto error;
+	len = fdt->buf_len - fdt->buf_off;
+	if (len > size)
+		len = size;
+	memcpy(fc->pkt, fdt->buf + fdt->buf_off, len);
+	fdt->buf_off += len;
+	if (fdt->buf_off == fdt->buf_len)
+		fdt->buf_off = fdt->buf_len = 0;
+readrest:
+	while (len < size) {
+		n = _read(fdt->fdin, fc->pkt + len, size - len);
 		if (n < 0) {
-			np_uerror(errno);
+			if (np_rerror() == EAGAIN) {
+				fdt->fc = fc;
+				fdt->fc_len = len;
+				return -1;
+			}
 			goto error;
 		}
 		if (n == 0)
 			goto eof;
 		len += n;
-		if (size == 0) {
-			size = np_peek_size(fc->pkt, len);
-			if (size > msize) {
-				np_uerror(EPROTO);
-				goto error;
-			}
-		}
 	}
-	if (len > size) {
-		if (!(fdt->fc = np_alloc_fcall (msize))) {
-			np_uerror(ENOMEM);
-			goto error;
-		}
-		fdt->fc_len = len - size;
-		memcpy (fdt->fc->pkt, fc->pkt + size, fdt->fc_len);
-	}
-	fc->size = size;
 	*fcp = fc;
 	return 0;
 eof:
-	free(fc);
+	if (fc)
+		np_free_fcall(fc);
 	*fcp = NULL;
 	return 0;
 error:
 	if (fc)
-		free (fc);
+		np_free_fcall(fc);
 	return -1;
 }
 
@@ -162,10 +236,18 @@ np_fdtrans_send(Npfcall *fc, void *a)
 	int len = 0;
 	int n;
 
+	if (fc->pipe)
+		return np_fdtrans_sendv(&fc, 1, a);
 	while (len < size) {
 		n = write(fdt->fdout, data + len, size - len);
 		if (n < 0 && errno == EINTR)
 			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			struct pollfd pfd = { .fd = fdt->fdout, .events = POLLOUT };
+
+			(void)poll(&pfd, 1, -1);
+			continue;
+		}
 		if (n < 0) {
 			np_uerror(errno);
 			goto error;
@@ -176,3 +258,108 @@ np_fdtrans_send(Npfcall *fc, void *a)
 error:
 	return -1;
 }
+
+/* Write all of iov, waiting if the fd is non-blocking and full.
+ * Returns bytes written or -1 on error.
+ */
+static int
+_writev (int fd, struct iovec *v, int niov)
+{
+	int len, total = 0;
+	ssize_t n;
+
+	while (niov > 0) {
+		n = writev(fd, v, niov);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+
+			(void)poll(&pfd, 1, -1);
+			continue;
+		}
+		if (n < 0) {
+			np_uerror(errno);
+			return -1;
+		}
+		total += n;
+		/* skip what was written, possibly ending mid-iovec */
+		while (niov > 0 && n >= v->iov_len) {
+			n -= v->iov_len;
+			v++;
+			niov--;
+		}
+		if (niov > 0) {
+			len = n;
+			v->iov_base = (u8 *)v->iov_base + len;
+			v->iov_len -= len;
+		}
+	}
+	return total;
+}
+
+/* Move the payload of a spliced Rread from its pipe to fd.
+ * Returns bytes written or -1 on error.
+ */
+static int
+_splice_out (Nppipe *p, int fd)
+{
+#ifdef HAVE_SPLICE
+	int total = 0;
+	ssize_t n;
+
+	while (p->len > 0) {
+		n = splice(p->fd[0], NULL, fd, NULL, p->len, SPLICE_F_MOVE);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+
+			(void)poll(&pfd, 1, -1);
+			continue;
+		}
+		if (n <= 0) {
+			np_uerror(n < 0 ? errno : EIO);
+			return -1;
+		}
+		p->len -= n;
+		total += n;
+	}
+	return total;
+#else
+	np_uerror(ENOSYS);
+	return -1;
+#endif
+}
+
+/* Send several responses with as few writev() calls as possible.
+ * The payload of a spliced Rread is moved to the fd after writing
+ * everything up to and including its header.
+ */
+static int
+np_fdtrans_sendv(Npfcall **fcs, int n, void *a)
+{
+	Fdtrans *fdt = (Fdtrans *)a;
+	struct iovec iov[FDTRANS_MAXIOV];
+	int i, len, niov = 0, total = 0;
+
+	for (i = 0; i < n; i++) {
+		iov[niov].iov_base = fcs[i]->pkt;
+		iov[niov].iov_len = fcs[i]->size;
+		if (fcs[i]->pipe)
+			iov[niov].iov_len -= fcs[i]->pipe->len;
+		niov++;
+		if (niov == FDTRANS_MAXIOV || fcs[i]->pipe || i == n - 1) {
+			if ((len = _writev(fdt->fdout, iov, niov)) < 0)
+				return -1;
+			total += len;
+			niov = 0;
+		}
+		if (fcs[i]->pipe) {
+			if ((len = _splice_out(fcs[i]->pipe, fdt->fdout)) < 0)
+				return -1;
+			total += len;
+		}
+	}
+	return total;
+}
@@ -24,10 +24,19 @@
 #include "xpthread.h"
 #include "npfsimpl.h"
 
-/* N.B. lock ordering:
- * 1) pool lock
- * 2) fid lock
+/* Fids are hashed by number into FIDPOOL_STRIPES stripes, then into a
+ * stripe's buckets.  A stripe's bucket array doubles when it averages
+ * more than FIDPOOL_LOAD fids per bucket, so chains stay short however
+ * many fids a client holds (e.g. the kernel client with cache=loose).
+ * Lookups in different stripes don't contend.
+ *
+ * Fid refcounts are atomic.  A reference is only dropped to zero with
+ * the stripe lock held, and the fid is unlinked in the same critical
+ * section, so np_fid_find() can't revive a fid that is being destroyed.
+ * Other references come and go without taking any lock.
  */
+#define FIDPOOL_MINSIZE	16
+#define FIDPOOL_LOAD	2
 
 static Npfid *
 _destroy_fid (Npfid *f)
@@ -40,9 +49,10 @@ _destroy_fid (Npfid *f)
 
 	srv = f->conn->srv;
 	next = f->next;
-	if (f->refcount > 0 && (srv->flags & SRV_FLAGS_DEBUG_FIDPOOL)) {
-		np_logmsg (srv, "_destroy_fid: fid %d has %d refs",
-			   f->fid, f->refcount);
+	if ((srv->flags & SRV_FLAGS_DEBUG_FIDPOOL)
+			&& __atomic_load_n (&f->refcount, __ATOMIC_RELAXED) > 0) {
+		np_logmsg (srv, "_destroy_fid: fid %d has %d refs", f->fid,
+			   __atomic_load_n (&f->refcount, __ATOMIC_RELAXED));
 	}
 	if ((f->type & Qtauth)) {
 		if (srv->auth && srv->auth->clunk)
@@ -56,10 +66,9 @@ _destroy_fid (Npfid *f)
 	if (f->user)
 		np_user_decref(f->user);
 	if (f->tpool)
-		np_tpool_decref(f->tpool);
+		np_tpool_decref_fid(f->tpool);
 	if (f->aname)
 		free (f->aname);
-	pthread_mutex_destroy (&f->lock);
 	f->magic = FID_MAGIC_FREED;
 	free(f);
 
@@ -75,7 +84,6 @@ _create_fid (Npconn *conn, u32 fid)
 		memset (f, 0, sizeof (*f));
 		f->conn = conn;
 		f->fid = fid;
-		pthread_mutex_init (&f->lock, NULL);
 		f->magic = FID_MAGIC;
 	} else
 		np_uerror (ENOMEM);
@@ -83,19 +91,43 @@ _create_fid (Npconn *conn, u32 fid)
 	return f;
 }
 
+static inline Npfidstripe *
+_fid_stripe (Npfidpool *pool, u32 fid)
+{
+	return &pool->stripes[fid % FIDPOOL_STRIPES];
+}
+
+static inline Npfid **
+_fid_bucket (Npfidstripe *sp, u32 fid)
+{
+	return &sp->htable[(fid / FIDPOOL_STRIPES) & (sp->size - 1)];
+}
+
 Npfidpool *
 np_fidpool_create (void)
 {
-	const size_t hsize = FID_HTABLE_SIZE * sizeof(Npfid *);
 	Npfidpool *pool;
+	Npfidstripe *sp;
+	int i;
 
-	if ((pool = malloc (sizeof (*pool) + hsize))) {
-		pthread_mutex_init (&pool->lock, NULL);
-		pool->size = FID_HTABLE_SIZE;
-		pool->htable = (Npfid **)((char *) pool + sizeof (*pool));
-		memset(pool->htable, 0, hsize);
-	} else
+	if (!(pool = malloc (sizeof (*pool)))) {
 		np_uerror (ENOMEM);
+		return NULL;
+	}
+	pool->count = 0;
+	for (i = 0; i < FIDPOOL_STRIPES; i++) {
+		sp = &pool->stripes[i];
+		pthread_mutex_init (&sp->lock, NULL);
+		sp->size = FIDPOOL_MINSIZE;
+		sp->count = 0;
+		if (!(sp->htable = calloc (sp->size, sizeof (Npfid *)))) {
+			while (i-- > 0)
+				free (pool->stripes[i].htable);
+			free (pool);
+			np_uerror (ENOMEM);
+			return NULL;
+		}
+	}
 
 	return pool;
 }
@@ -103,20 +135,25 @@ np_fidpool_create (void)
 int
 np_fidpool_destroy(Npfidpool *pool)
 {
-	int i;
+	Npfidstripe *sp;
+	int i, j;
 	Npfid *f;
 	int unclunked = 0;
 
-	xpthread_mutex_lock(&pool->lock);
-	for(i = 0; i < pool->size; i++) {
-		f = pool->htable[i];
-		while (f != NULL) {
-			f = _destroy_fid (f);
-			unclunked++;
+	for (i = 0; i < FIDPOOL_STRIPES; i++) {
+		sp = &pool->stripes[i];
+		xpthread_mutex_lock(&sp->lock);
+		for (j = 0; j < sp->size; j++) {
+			f = sp->htable[j];
+			while (f != NULL) {
+				f = _destroy_fid (f);
+				unclunked++;
+			}
 		}
+		xpthread_mutex_unlock (&sp->lock);
+		pthread_mutex_destroy (&sp->lock);
+		free (sp->htable);
 	}
-	xpthread_mutex_unlock (&pool->lock);
-	pthread_mutex_destroy (&pool->lock);
 	free(pool);
 
 	return unclunked;
@@ -125,69 +162,41 @@ np_fidpool_destroy(Npfidpool *pool)
 int
 np_fidpool_count(Npfidpool *pool)
 {
-	int i;
-	Npfid *f;
-	int count = 0;
-
-	xpthread_mutex_lock(&pool->lock);
-	for(i = 0; i < pool->size; i++) {
-		for (f = pool->htable[i]; f != NULL; f = f->next) {
-			NP_ASSERT(f->magic == FID_MAGIC);
-			count++;
-		}
-	}
-	xpthread_mutex_unlock(&pool->lock);
-
-	return count;
-}
-
-static void
-_optimize_fid (Npfid **head, Npfid *f)
-{
-	/* assert (pool->lock held) */
-	if (f->next)
-		f->next->prev = f->prev;
-	f->prev->next = f->next;
-	f->prev = NULL;
-	f->next = *head;
-	(*head)->prev = f;
-	*head = f;
+	return __atomic_load_n (&pool->count, __ATOMIC_RELAXED);
 }
 
 static Npfid *
-_lookup_fid (Npfid **head, u32 fid)
+_lookup_fid (Npfidstripe *sp, u32 fid)
 {
 	Npfid *f;
 
-	/* assert (pool->lock held) */
-	for (f = *head; f != NULL; f = f->next) {
-		if (f->fid == fid && !(f->flags & FID_FLAGS_ZOMBIE)) {
-			if (f != *head) /* move to head */
-				_optimize_fid (head, f);
+	/* assert (sp->lock held) */
+	for (f = *_fid_bucket (sp, fid); f != NULL; f = f->next) {
+		if (f->fid == fid && !(f->flags & FID_FLAGS_ZOMBIE))
 			break;
-		}
 	}
 
 	return f;
 }
 
 static void
-_unlink_fid (Npfid **head, Npfid *f)
+_unlink_fid (Npfidpool *pool, Npfidstripe *sp, Npfid *f)
 {
-	/* assert (pool->lock held) */
+	/* assert (sp->lock held) */
 	if (f->prev)
 		f->prev->next = f->next;
 	else
-		*head = f->next;
+		*_fid_bucket (sp, f->fid) = f->next;
 	if (f->next)
 		f->next->prev = f->prev;
 	f->prev = f->next = NULL;
+	sp->count--;
+	__atomic_sub_fetch (&pool->count, 1, __ATOMIC_RELAXED);
 }
 
 static void
-_link_fid (Npfid **head, Npfid *f)
+_push_fid (Npfid **head, Npfid *f)
 {
-	/* assert (pool->lock held) */
 	f->next = *head;
 	f->prev = NULL;
 	if (*head)
@@ -195,19 +204,55 @@ _link_fid (Npfid **head, Npfid *f)
 	*head = f;
 }
 
+/* Double the number of buckets in a stripe.  If memory is short, leave
+ * it as is; chains just get longer.
+ */
+static void
+_grow_stripe (Npfidstripe *sp)
+{
+	Npfid **old = sp->htable;
+	int oldsize = sp->size;
+	Npfid *f, *next;
+	int i;
+
+	/* assert (sp->lock held) */
+	if (!(sp->htable = calloc (oldsize * 2, sizeof (Npfid *)))) {
+		sp->htable = old;
+		return;
+	}
+	sp->size = oldsize * 2;
+	for (i = 0; i < oldsize; i++) {
+		for (f = old[i]; f != NULL; f = next) {
+			next = f->next;
+			_push_fid (_fid_bucket (sp, f->fid), f);
+		}
+	}
+	free (old);
+}
+
+static void
+_link_fid (Npfidpool *pool, Npfidstripe *sp, Npfid *f)
+{
+	/* assert (sp->lock held) */
+	if (sp->count >= sp->size * FIDPOOL_LOAD)
+		_grow_stripe (sp);
+	_push_fid (_fid_bucket (sp, f->fid), f);
+	sp->count++;
+	__atomic_add_fetch (&pool->count, 1, __ATOMIC_RELAXED);
+}
+
 /* Find a fid, then refcount++
  */
 Npfid *
 np_fid_find (Npconn *conn, u32 fid)
 {
-	Npfidpool *pool = conn->fidpool;
-	int hash = fid % pool->size;
+	Npfidstripe *sp = _fid_stripe (conn->fidpool, fid);
 	Npfid *f;
 
-	xpthread_mutex_lock (&pool->lock);
-	if ((f = _lookup_fid (&pool->htable[hash], fid)))
+	xpthread_mutex_lock (&sp->lock);
+	if ((f = _lookup_fid (sp, fid)))
 		np_fid_incref (f);
-	xpthread_mutex_unlock (&pool->lock);
+	xpthread_mutex_unlock (&sp->lock);
 
 	return f;
 }
@@ -219,14 +264,14 @@ np_fid_create (Npconn *conn, u32 fid)
 {
 	Npsrv *srv = conn->srv;
 	Npfidpool *pool = conn->fidpool;
-	int hash = fid % pool->size;
+	Npfidstripe *sp = _fid_stripe (pool, fid);
 	Npfid *f;
 
-	xpthread_mutex_lock(&pool->lock);
-	if ((f = _lookup_fid (&pool->htable[hash], fid))) {
+	xpthread_mutex_lock(&sp->lock);
+	if ((f = _lookup_fid (sp, fid))) {
 		np_logmsg (srv, "np_fid_create: unclunked fid %d (%s): %d refs",
 			   f->fid, srv->get_path ? srv->get_path (f) : "<nil>",
-			   f->refcount);
+			   __atomic_load_n (&f->refcount, __ATOMIC_RELAXED));
 		if ((srv->flags & SRV_FLAGS_LOOSEFID)) {
 			f->flags |= FID_FLAGS_ZOMBIE;
 		} else {
@@ -237,10 +282,10 @@ np_fid_create (Npconn *conn, u32 fid)
 	}
 	if ((f = _create_fid (conn, fid))) {
 		np_fid_incref (f);
-		_link_fid (&pool->htable[hash], f);
+		_link_fid (pool, sp, f);
 	}
 done:
-	xpthread_mutex_unlock(&pool->lock);
+	xpthread_mutex_unlock(&sp->lock);
 
 	return f;
 }
@@ -253,13 +298,28 @@ np_fid_incref (Npfid *f)
 	NP_ASSERT(f != NULL);
 	NP_ASSERT(f->magic == FID_MAGIC);
 
-	xpthread_mutex_lock (&f->lock);
-	f->refcount++;
-	xpthread_mutex_unlock (&f->lock);
+	__atomic_add_fetch (&f->refcount, 1, __ATOMIC_RELAXED);
 
 	return f;
 }
 
+/* refcount--, unless that would drop the last reference.
+ * Returns 1 on success, 0 if the caller must drop it under the stripe lock.
+ */
+static int
+_fid_decref_nonlast (Npfid *f)
+{
+	int n = __atomic_load_n (&f->refcount, __ATOMIC_RELAXED);
+
+	while (n > 1) {
+		if (__atomic_compare_exchange_n (&f->refcount, &n, n - 1, 0,
+						 __ATOMIC_RELEASE,
+						 __ATOMIC_RELAXED))
+			return 1;
+	}
+	return 0;
+}
+
 /* refcount--
  * Destroy when refcount reaches zero.
  */
@@ -267,48 +327,49 @@ void
 np_fid_decref (Npfid **fp)
 {
 	Npfid *f = *fp;
+	Npfidpool *pool;
+	Npfidstripe *sp;
 	int refcount;
 
 	NP_ASSERT(f != NULL);
 	NP_ASSERT(f->magic == FID_MAGIC);
 
-	xpthread_mutex_lock (&f->lock);
-	refcount = --f->refcount;
-	if (refcount == 0)
-		*fp = NULL;
-	xpthread_mutex_unlock (&f->lock);
+	if (_fid_decref_nonlast (f))
+		return;
 
+	pool = f->conn->fidpool;
+	sp = _fid_stripe (pool, f->fid);
+	xpthread_mutex_lock (&sp->lock);
+	refcount = __atomic_sub_fetch (&f->refcount, 1, __ATOMIC_ACQ_REL);
+	NP_ASSERT(refcount >= 0);
 	if (refcount == 0) {
-		Npfidpool *pool = f->conn->fidpool;
-		int hash = f->fid % pool->size;
-
-		xpthread_mutex_lock (&pool->lock);
-		_unlink_fid (&pool->htable[hash], f);
-		xpthread_mutex_unlock (&pool->lock);
+		_unlink_fid (pool, sp, f);
+		*fp = NULL;
+	}
+	xpthread_mutex_unlock (&sp->lock);
 
+	if (refcount == 0)
 		(void) _destroy_fid (f);
-	}
 }
 
 void
 np_fid_decref_bynum (Npconn *conn, u32 fid)
 {
 	Npfidpool *pool = conn->fidpool;
-	int hash = fid % pool->size;
+	Npfidstripe *sp = _fid_stripe (pool, fid);
 	int refcount = 0;
 	Npfid *f;
 
-	xpthread_mutex_lock (&pool->lock);
-	if ((f = _lookup_fid (&pool->htable[hash], fid))) {
-		xpthread_mutex_lock (&f->lock);
-		refcount = --f->refcount;
-		xpthread_mutex_unlock (&f->lock);
-
+	xpthread_mutex_lock (&sp->lock);
+	if ((f = _lookup_fid (sp, fid))) {
+		refcount = __atomic_sub_fetch (&f->refcount, 1,
+					       __ATOMIC_ACQ_REL);
+		NP_ASSERT(refcount >= 0);
 		if (refcount == 0) {
-			_unlink_fid (&pool->htable[hash], f);
+			_unlink_fid (pool, sp, f);
 		}
 	}
-	xpthread_mutex_unlock (&pool->lock);
+	xpthread_mutex_unlock (&sp->lock);
 
 	if (f && refcount == 0)
 		(void) _destroy_fid (f);
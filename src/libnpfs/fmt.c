@@ -579,7 +579,9 @@ np_snprintfcall(char *s, int len, Npfcall *fc)
 	case Rread:
 		spf (s, len, "Rread tag %u count %u", fc->tag,
 			fc->u.rread.count);
-		np_printdata(s, len, fc->u.rread.data, fc->u.rread.count);
+		if (fc->u.rread.data) /* N.B. NULL if spliced */
+			np_printdata(s, len, fc->u.rread.data,
+				     fc->u.rread.count);
 		break;
 	case Twrite:
 		spf (s, len, "Twrite tag %u", fc->tag);
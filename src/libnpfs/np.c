@@ -242,9 +242,8 @@ np_create_common(struct cbuf *bufp, u32 size, u8 id)
 	Npfcall *fc;
 
 	size += sizeof(fc->size) + sizeof(fc->type) + sizeof (fc->tag);
-	if (!(fc = malloc(sizeof(Npfcall) + size)))
+	if (!(fc = np_alloc_fcall(size)))
 		return NULL;
-	fc->pkt = (u8 *) fc + sizeof(*fc);
 	buf_init(bufp, (char *) fc->pkt, size);
 	buf_put_int32(bufp, size, &fc->size);
 	buf_put_int8(bufp, id, &fc->type);
@@ -264,6 +263,8 @@ np_create_common_static(struct cbuf *bufp, u32 size, u8 id,
 
 	fc = buf;
 	fc->pkt = (u8 *) fc + sizeof(*fc);
+	fc->pool = -1;
+	fc->pipe = NULL;
 	buf_init(bufp, (char *) fc->pkt, size);
 	buf_put_int32(bufp, size, &fc->size);
 	buf_put_int8(bufp, id, &fc->type);
@@ -276,7 +277,7 @@ static Npfcall *
 np_post_check(Npfcall *fc, struct cbuf *bufp)
 {
 	if (buf_check_overflow(bufp)) {
-		free (fc);
+		np_free_fcall (fc);
 		return NULL;
 	}
 
@@ -520,6 +521,30 @@ np_create_rread(u32 count, u8* data)
 	return fc;
 }
 
+/* Allocate a Rread header only.  The 'count' bytes of payload are
+ * not in fc->pkt but are sent by the transport (see splice.c).
+ */
+Npfcall *
+np_alloc_rread_header(u32 count)
+{
+	int size = sizeof(u32);
+	struct cbuf buffer;
+	struct cbuf *bufp = &buffer;
+	Npfcall *fc;
+
+	if (!(fc = np_create_common(bufp, size, Rread)))
+		return NULL;
+	buf_put_int32(bufp, count, &fc->u.rread.count);
+	fc->u.rread.data = NULL;
+	if (!(fc = np_post_check(fc, bufp)))
+		return NULL;
+	size = sizeof(u32) + sizeof(u8) + sizeof(u16) + sizeof(u32) + count;
+	buf_init(bufp, (char *) fc->pkt, sizeof(u32));
+	buf_put_int32(bufp, size, &fc->size);
+
+	return fc;
+}
+
 void
 np_set_rread_count(Npfcall *fc, u32 count)
 {
@@ -1353,19 +1378,6 @@ np_peek_size(u8 *buf, int len)
 	return size;
 }
 
-Npfcall *
-np_alloc_fcall(int msize)
-{
-        Npfcall *fc;
-
-        if ((fc = malloc(sizeof(*fc) + msize))) {
-                fc->pkt = (u8*) fc + sizeof(*fc);
-		fc->size = msize;
-	}
-
-        return fc;
-}
-
 int
 np_deserialize(Npfcall *fc)
 {
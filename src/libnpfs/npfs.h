@@ -25,13 +25,21 @@ typedef struct Nptrans Nptrans;
 typedef struct Npconn Npconn;
 typedef struct Npreq Npreq;
 typedef struct Npstats Npstats;
+typedef struct Npstatshard Npstatshard;
 typedef struct Npwthread Npwthread;
 typedef struct Nptpool Nptpool;
+typedef struct Npwpool Npwpool;
+typedef struct Nplane Nplane;
+typedef struct Npflow Npflow;
+typedef struct Npreactor Npreactor;
+typedef struct Nppipe Nppipe;
 typedef struct Npauth Npauth;
 typedef struct Npsrv Npsrv;
 typedef struct Npuser Npuser;
 
-#define FID_HTABLE_SIZE 64
+#define FIDPOOL_STRIPES 16
+#define CONN_REQ_HTABLE_SIZE 256
+#define CONN_REQ_FREEMAX 64
 #define FID_HISTORY_SIZE 128
 #define FID_MAGIC 0x765abcdf
 #define FID_MAGIC_FREED 0xdeadbeef
@@ -44,6 +52,9 @@ struct Npfcall {
 	u8		type;
 	u16		tag;
 	u8*		pkt;
+	int		pool;	/* fcallpool size class (-1 = not pooled) */
+	Npfcall*	next;	/* link on a connection's send queue */
+	Nppipe*		pipe;	/* Rread payload to be spliced (splice.c) */
 	union {
 		struct Nprlerror	rlerror;
 		struct Nptstatfs	tstatfs;
@@ -104,10 +115,9 @@ struct Npfcall {
 
 struct Npfid {
 	int		magic;
-	pthread_mutex_t lock;
 	Npconn*		conn;
 	u32		fid;
-	int		refcount;
+	int		refcount; /* atomic (see fidpool.c) */
 	u8		type;
 	Npuser*		user;
 	Nptpool*	tpool;	/* tpool preference, if any (else NULL) */
@@ -129,15 +139,27 @@ struct Npbuf {
 
 struct Nptrans {
 	void*		aux;
+	int		pollfd;	/* socket the reactor may poll, or -1 */
 	int		(*recv)(Npfcall **, u32, void *);
 	int		(*send)(Npfcall *, void *);
+	int		(*sendv)(Npfcall **, int, void *); /* optional */
+	int		splice;	/* sendv handles fc->pipe payloads */
 	void		(*destroy)(void *);
 };
 
-struct Npfidpool {
+/* The fid table is split into stripes by fid number, each with its own
+ * lock and a hash table that grows with the number of fids.
+ */
+typedef struct {
 	pthread_mutex_t	lock;
-	int		size;
+	int		size;	/* buckets, a power of two */
+	int		count;
 	Npfid**		htable;
+} Npfidstripe;
+
+struct Npfidpool {
+	int		count;	/* atomic */
+	Npfidstripe	stripes[FIDPOOL_STRIPES];
 };
 
 enum {
@@ -160,6 +182,27 @@ struct Npconn {
 	Npfidpool*	fidpool;
 	void*		aux;
 	pthread_t	rthread;
+	int		reactor; /* input is driven by srv->reactor */
+	int		nreqs;	/* outstanding requests (atomic) */
+	u64		reqbytes; /* tcall bytes of outstanding requests */
+	int		throttled; /* reactor input paused on conn limits */
+	Npconn*		parked_next; /* reactor input paused on srv limits */
+	Npconn*		resumed_next; /* on srv->reactor resumed list */
+	Npreq*		freereqs; /* recycled requests (see np_conn_req_add) */
+	int		nfreereqs;
+
+	/* Responses are queued under wlock and sent in batches by
+	 * whichever worker finds the connection idle.
+	 */
+	Npfcall*	sendq_first;
+	Npfcall*	sendq_last;
+	int		sending; /* a worker is draining sendq */
+	pthread_cond_t	sendcond;
+
+	/* Outstanding requests indexed by tag (see np_conn_add_req).
+	 */
+	pthread_mutex_t	reqlock;
+	Npreq*		reqtab[CONN_REQ_HTABLE_SIZE];
 
 	Npconn*		next;	/* list of connections within a server */
 };
@@ -167,8 +210,8 @@ struct Npconn {
 typedef enum { REQ_NORMAL, REQ_NOREPLY } Reqstate;
 
 struct Npreq {
-	pthread_mutex_t	lock;
-	int		refcount;
+	pthread_mutex_t	lock;	/* serializes responses with state */
+	int		refcount; /* atomic */
 	Npconn*		conn;
 	u16		tag;
 	Reqstate	state;
@@ -177,10 +220,22 @@ struct Npreq {
 	Npfcall*	rcall;
 	Npfid*		fid;
 	time_t		birth;
+	int		lane;	/* NP_LANE_* queue the request is on */
+	Npflow*		flow;	/* flow the request is queued on */
+	u64		qtime;	/* time queued (usec, monotonic) */
+	Npreq*		lnext;	/* lane's requests in arrival order */
+	Npreq*		lprev;
 
 	Npreq*		next;	/* list of all outstanding requests */
 	Npreq*		prev;	/* used for requests that are worked on */
 	Npwthread*	wthread;/* for requests that are worked on */
+	Nptpool*	tpool;	/* pool the request is queued/worked on in */
+	int		deferred;/* handler will call np_req_complete() */
+
+	Npreq*		tnext;	/* conn->reqtab chain */
+	Npreq*		tprev;
+	int		indexed;/* on conn->reqtab */
+	int		responded;/* response has been queued */
 };
 
 #define NPSTATS_RWCOUNT_BINS 12
@@ -195,9 +250,15 @@ struct Npstats {
 	u64		wcount[NPSTATS_RWCOUNT_BINS];
 };
 
+/* Per-CPU copy of the request counters, padded to its own cache line(s)
+ * so CPUs updating neighbouring shards don't contend.
+ */
+struct Npstatshard {
+	Npstats		s;
+} __attribute__((aligned(64)));
+
 struct Npwthread {
-	Nptpool*	tpool;
-	int		shutdown;
+	Npwpool*	wpool;
 	pthread_t	thread;
 	u32		fsuid;
 	u32		fsgid;
@@ -205,21 +266,104 @@ struct Npwthread {
 	Npwthread	*next;
 };
 
+/* Each tpool queues short metadata requests and bulk data requests
+ * separately so a burst of large reads and writes can't hold up metadata.
+ */
+#define NP_LANE_META	0
+#define NP_LANE_BULK	1
+#define NP_NLANES	2
+
+/* Within a lane, requests are queued per flow, i.e. per connection and
+ * user, and flows are served by deficit round robin so one client can't
+ * monopolize the workers.  A flow is served up to 'weight' requests per
+ * round (see srv->flow_weight).
+ */
+#define FLOW_HTABLE_SIZE 64
+
+struct Npflow {
+	Npconn*		conn;
+	u32		uid;
+	int		lane;
+	int		weight;
+	int		deficit;
+	Npreq*		reqs_first;
+	Npreq*		reqs_last;
+	Npflow*		next;	/* lane's active flows */
+	Npflow*		prev;
+	Npflow*		hnext;	/* tpool flow hash */
+};
+
+struct Nplane {
+	Npflow*		flows_first;
+	Npflow*		flows_last;
+	int		nflows;
+	int		depth;
+	Npreq*		oldest;	/* all flows' requests in arrival order */
+	Npreq*		newest;
+	u64		nreqs;	/* requests dequeued by workers */
+	u64		wait_usec; /* total queue wait of dequeued requests */
+	u64		wait_max_usec;
+};
+
 struct Nptpool {
 	char*		name;
 	Npsrv*		srv;
-	pthread_mutex_t lock; /* protects refcount */
+	pthread_mutex_t lock; /* protects refcount, nfids */
 	int		refcount;
-	int		nwthread;
-	Npwthread*	wthreads;
-	Npreq*		reqs_first;
-	Npreq*		reqs_last;
+	int		nfids;	/* fids among the references */
+	pthread_mutex_t	reqlock; /* protects request queue */
+	Nplane		lanes[NP_NLANES];
+	int		nqueued;
+	int		meta_credit; /* metadata requests before next bulk */
+	Npflow*		flowtab[FLOW_HTABLE_SIZE];
+	Npflow*		freeflows;
+	int		nactive;/* requests being worked on */
+	int		ready;	/* on wpool ready list */
+	Nptpool*	ready_next;
+	pthread_mutex_t	worklock; /* protects in-flight requests */
 	Npreq*		workreqs;
-	Npstats		stats;
-	pthread_cond_t	reqcond;
+	Npstatshard*	shards;	/* per-CPU request counters */
+	int		nshards;
+	Npstats		stats;	/* shards summed by _ctl_get_tpools */
 	Nptpool		*next;
 };
 
+/* Worker threads are shared by all tpools.  Tpools with queued requests
+ * wait their turn on the ready list and are served round-robin.
+ */
+struct Npwpool {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;	/* idle workers wait here */
+	pthread_cond_t	exitcond;
+	int		min;	/* workers kept when idle */
+	int		max;	/* limit on total workers */
+	int		tpool_max; /* limit on workers serving one tpool */
+	int		meta_weight; /* metadata requests served per bulk */
+	int		bulk_aging; /* msec before bulk request jumps ahead */
+	int		idle_timeout; /* seconds before excess workers exit */
+	int		nwthread;
+	int		nidle;
+	int		idle_lwm; /* fewest idle workers since shrink_time */
+	time_t		shrink_time;
+	int		nexit;	/* idle workers that should exit */
+	int		shutdown;
+	Npwthread*	wthreads;
+	Nptpool*	ready_first;
+	Nptpool*	ready_last;
+	int		nready;
+};
+
+struct Npreactor {
+	Npsrv*		srv;
+	int		epfd;
+	int		wakefd[2];	/* pipe used to stop reactor threads */
+	int		kickfd[2];	/* pipe used to signal resumed conns */
+	pthread_mutex_t	lock;		/* protects resumed list */
+	Npconn*		resumed;	/* conns to service without an event */
+	int		nrthread;
+	pthread_t*	rthreads;
+};
+
 struct Npauth {
 	int	(*startauth)(Npfid *afid, char *aname, Npqid *aqid);
 	int	(*checkauth)(Npfid *fid, Npfid *afid, char *aname);
@@ -245,6 +389,8 @@ enum {
 	SRV_FLAGS_DAC_BYPASS  	=0x00200000,
 	SRV_FLAGS_SETGROUPS	=0x00400000,
 	SRV_FLAGS_LOOSEFID	=0x00800000, /* work around buggy clients */
+	SRV_FLAGS_IO_URING	=0x01000000, /* use uringtrans for sockets */
+	SRV_FLAGS_SHM		=0x02000000, /* offer shmtrans on Unix sockets */
 };
 
 typedef char * (*SynGetF)(char *name, void *arg);
@@ -274,6 +420,7 @@ struct Npsrv {
 	int		(*remapuser)(Npfid *fid);
 	int		(*auth_required)(Npstr *, u32, Npstr *);
 	int		(*exportok)(Npfid *fid);
+	int		(*flow_weight)(Npconn *conn, Npuser *user);
 	char*		(*get_path)(Npfid *fid);
 	Npauth*		auth;
 	int		flags;
@@ -288,6 +435,8 @@ struct Npsrv {
 	Npfcall*	(*attach)(Npfid *fid, Npfid *afid, Npstr *aname);
 	int		(*clone)(Npfid *fid, Npfid *newfid);
 	int		(*walk)(Npfid *fid, Npstr *wname, Npqid *wqid);
+	int		(*walkn)(Npfid *fid, int nwname, Npstr *wnames,
+				 Npqid *wqids);
 	Npfcall*	(*read)(Npfid *fid, u64 offset, u32 count, Npreq *req);
 	Npfcall*	(*write)(Npfid *fid, u64 offset, u32 count, u8 *data, 
 				Npreq *req);
@@ -301,13 +450,13 @@ struct Npsrv {
 	Npfcall*	(*mknod)(Npfid *, Npstr *, u32, u32, u32, u32);
 	Npfcall*	(*rename)(Npfid *, Npfid *, Npstr *);
 	Npfcall*	(*readlink)(Npfid *);
-	Npfcall*	(*getattr)(Npfid *, u64);
+	Npfcall*	(*getattr)(Npfid *, u64, Npreq *);
 	Npfcall*	(*setattr)(Npfid *, u32, u32, u32, u32, u64, u64, u64,
 				   u64, u64);
 	Npfcall*	(*xattrwalk)(Npfid *, Npfid *, Npstr *);
 	Npfcall*	(*xattrcreate)(Npfid *, Npstr *, u64, u32);
 	Npfcall*	(*readdir)(Npfid *, u64, u32, Npreq *);
-	Npfcall*	(*fsync)(Npfid *, u32);
+	Npfcall*	(*fsync)(Npfid *, u32, Npreq *);
 	Npfcall*	(*llock)(Npfid *, u8, u32, u64, u64, u32, Npstr *);
 	Npfcall*	(*getlock)(Npfid *, u8 type, u64, u64, u32, Npstr *);
 	Npfcall*	(*link)(Npfid *, Npfid *, Npstr *);
@@ -322,12 +471,33 @@ struct Npsrv {
 	int		connhistory;
 	Npconn*		conns;
 	Nptpool*	tpool;
-	int		nwthread;
+	Npwpool*	wpool;
+	Npreactor*	reactor;
+
+	/* flow control: limits on outstanding requests and their tcall
+	 * bytes, per connection and in total (0 = unlimited).
+	 */
+	int		conn_maxreqs;
+	u64		conn_maxbytes;
+	int		maxreqs;
+	u64		maxbytes;
+	int		nreqs;
+	u64		reqbytes;
+	pthread_mutex_t	fclock;	/* protects below */
+	pthread_cond_t	fccond;	/* readers wait here for srv credit */
+	int		fcwaiters; /* waiting readers + parked conns */
+	Npconn*		parked;	/* reactor conns waiting for srv credit */
+	u64		conn_throttles;
+	u64		srv_throttles;
+
+	/* send queue stats */
+	u64		sendq_batches; /* calls to the transport */
+	u64		sendq_fcalls;  /* responses sent */
+	u64		sendq_maxbatch;
 };
 
 struct Npuser {
-	pthread_mutex_t	lock;
-	int		refcount;
+	int		refcount; /* atomic */
 	char*		uname;
 	uid_t		uid;
 	gid_t		gid;
@@ -341,6 +511,10 @@ struct Npuser {
 Npsrv *np_srv_create(int nwthread, int flags);
 void np_srv_destroy(Npsrv *srv);
 void np_srv_shutdown(Npsrv *srv);
+int np_srv_set_wthreads(Npsrv *srv, int min, int max, int tpool_max,
+			int idle_timeout);
+void np_srv_set_credit(Npsrv *srv, int conn_maxreqs, u64 conn_maxbytes,
+		       int maxreqs, u64 maxbytes);
 void np_srv_remove_conn_pre(Npsrv *, Npconn *);
 void np_srv_remove_conn_post(Npsrv *);
 int np_srv_add_conn(Npsrv *, Npconn *);
@@ -348,12 +522,16 @@ void np_srv_wait_conncount(Npsrv *srv, int count);
 void np_req_respond(Npreq *req, Npfcall *rc);
 void np_req_respond_error(Npreq *req, int ecode);
 void np_req_respond_flush(Npreq *req);
+void np_req_defer(Npreq *req);
+void np_req_complete(Npreq *req, Npfcall *rc, int ecode);
 void np_logerr(Npsrv *srv, const char *fmt, ...)
 	__attribute__ ((format (printf, 2, 3)));
 void np_logmsg(Npsrv *srv, const char *fmt, ...)
 	__attribute__ ((format (printf, 2, 3)));
 void np_tpool_incref(Nptpool *);
 void np_tpool_decref(Nptpool *);
+void np_tpool_incref_fid(Nptpool *);
+void np_tpool_decref_fid(Nptpool *);
 int np_decode_tpools_str (char *s, Npstats *stats);
 void np_assfail (char *ass, char *file, int line);
 #define NP_ASSERT(exp) if (exp) ; else np_assfail(#exp, __FILE__, __LINE__ )
@@ -384,6 +562,7 @@ Nptrans *np_trans_create(void *aux, int (*recv)(Npfcall **, u32, void *),
 				    void (*destroy)(void *));
 void np_trans_destroy(Nptrans *);
 int np_trans_send(Nptrans *, Npfcall *);
+int np_trans_sendv(Nptrans *, Npfcall **, int);
 int np_trans_recv(Nptrans *, Npfcall **, u32);
 
 /* npstring.c */
@@ -399,9 +578,18 @@ int aspf (char **sp, int *lp, const char *fmt, ...)
 int np_encode_tpools_str (char **s, int *len, Npstats *stats);
 int np_decode_tpools_str (char *s, Npstats *stats);
 
+/* fcallpool.c */
+Npfcall *np_alloc_fcall(int size);
+Npfcall *np_alloc_fcall_aligned(int size, int hdrlen);
+void np_free_fcall(Npfcall *fc);
+void np_fcallpool_flush(void);
+
+/* splice.c */
+Npfcall *np_create_rread_splice(Npconn *conn, int fd, u64 offset, u32 count);
+void np_splice_flush(void);
+
 /* np.c */
 u32 np_peek_size(u8 *buf, int len);
-Npfcall *np_alloc_fcall(int msize);
 int np_deserialize(Npfcall*);
 int np_serialize_p9dirent(Npqid *qid, u64 offset, u8 type, char *name, u8 *buf,
                           int buflen);
@@ -504,9 +692,20 @@ void np_usercache_flush (Npsrv *srv);
 int np_usercache_create (Npsrv *srv);
 void np_usercache_destroy (Npsrv *srv);
 
+/* reactor.c */
+int np_reactor_create(Npsrv *srv, int nrthread);
+void np_reactor_destroy(Npsrv *srv);
+
 /* fdtrans.c */
 Nptrans *np_fdtrans_create(int, int);
 
+/* uringtrans.c */
+Nptrans *np_uringtrans_create(int);
+
+/* shmtrans.c */
+Nptrans *np_shmtrans_create(int);
+Nptrans *np_shmtrans_connect(int, u32);
+
 /* rdmatrans.c */
 struct rdma_cm_id;
 Nptrans *np_rdmatrans_create(struct rdma_cm_id *cmid, int q_depth, int msize);
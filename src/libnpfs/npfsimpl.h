@@ -45,9 +45,48 @@ Npfcall *np_mkdir(Npreq *req, Npfcall *tc);
 Npfcall *np_renameat(Npreq *req, Npfcall *tc);
 Npfcall *np_unlinkat(Npreq *req, Npfcall *tc);
 
+/* fcallpool.c */
+char *np_fcallpool_ctl_get(char *name, void *a);
+
+/* Transports receive Twrite payloads of at least TWRITE_ALIGN_MIN bytes
+ * into a buffer where they start on a page boundary, using
+ * np_alloc_fcall_aligned(size, TWRITE_HDRSIZE).
+ * N.B. size[4] type[1] tag[2] fid[4] offset[8] count[4] precede the data.
+ */
+#define TWRITE_HDRSIZE		23
+#define TWRITE_ALIGN_MIN	4096
+
+/* np.c */
+Npfcall *np_alloc_rread_header(u32 count);
+
+/* splice.c */
+struct Nppipe {
+	int		fd[2];
+	u32		size;	/* capacity */
+	u32		len;	/* bytes in the pipe */
+	Nppipe*		next;
+};
+void np_pipe_put(Nppipe *p);
+char *np_splice_ctl_get(char *name, void *a);
+
+/* conn.c */
+int np_conn_input(Npconn *conn, int budget);
+void np_conn_close(Npconn *conn);
+Npreq *np_conn_req_add(Npconn *conn, u32 bytes);
+void np_conn_req_done(Npconn *conn, u32 bytes, Npreq *req);
+void np_conn_respond_now(Npconn *conn, Npfcall *rc);
+void np_conn_add_req(Npconn *conn, Npreq *req);
+void np_conn_remove_req(Npconn *conn, Npreq *req);
+Npreq *np_conn_get_req(Npconn *conn, u16 tag);
+
+/* reactor.c */
+int np_reactor_add_conn(Npreactor *r, Npconn *conn);
+void np_reactor_resume(Npreactor *r, Npconn *conn);
+
 /* srv.c */
-void np_srv_add_req(Npsrv *srv, Npreq *req);
+int np_srv_add_req(Npsrv *srv, Npreq *req);
 void np_srv_remove_req(Nptpool *tp, Npreq *req);
+void np_tpool_stats_count(Nptpool *tp, u8 type, u64 rbytes, u64 wbytes);
 Npreq *np_req_alloc(Npconn *conn, Npfcall *tc);
 Npreq *np_req_ref(Npreq*);
 void np_req_unref(Npreq*);
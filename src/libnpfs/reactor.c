@@ -0,0 +1,324 @@
+/*************************************************************\
+ * Copyright (C) 2010 by Lawrence Livermore National Security, LLC.
+ *
+ * This file is part of npfs, a framework for 9P synthetic file systems.
+ * For details see https://sourceforge.net/projects/npfs.
+ *
+ * SPDX-License-Identifier: MIT
+ *************************************************************/
+
+/* reactor.c - multiplex connection input over a few epoll threads
+ *
+ * By default each connection has a dedicated reader thread (see
+ * conn.c::np_conn_read_proc).  When a reactor is created, connections on
+ * pollable transports are instead registered with a shared epoll set
+ * and a small fixed pool of reactor threads reads and frames requests
+ * for all of them, handing complete requests to the tpools.
+ *
+ * Each fd is registered EPOLLONESHOT, so only one reactor thread at a
+ * time services a given connection; it reads until the transport would
+ * block, then re-arms the fd.  A connection that still has input after
+ * REACTOR_BUDGET requests is queued to be serviced again after the
+ * connections that are ready now, so one busy client can't monopolize a
+ * reactor thread.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#if HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#include "npfs.h"
+#include "xpthread.h"
+#include "npfsimpl.h"
+
+#if HAVE_SYS_EPOLL_H
+
+#define REACTOR_MAXEVENTS	16
+#define REACTOR_BUDGET		32	/* requests per connection per turn */
+
+/* Re-arm a connection for one more input event.
+ */
+static int
+np_reactor_arm(Npreactor *r, Npconn *conn)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = conn;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_MOD, conn->trans->pollfd, &ev) < 0) {
+		np_uerror (errno);
+		return -1;
+	}
+	return 0;
+}
+
+/* Read requests from a connection, then re-arm it unless flow control
+ * has paused it or it is being torn down.  If it used up its budget, its
+ * transport may hold buffered requests that epoll won't report, so queue
+ * it like a resumed connection instead.
+ */
+static void
+np_reactor_service(Npreactor *r, Npconn *conn)
+{
+	int rc;
+
+	if ((rc = np_conn_input(conn, REACTOR_BUDGET)) == 2) {
+		np_reactor_resume(r, conn);
+		return;
+	}
+	if (rc > 0) /* paused by flow control */
+		return;
+	if (rc == 0 && np_reactor_arm(r, conn) < 0) {
+		np_logerr (r->srv, "epoll_ctl - dropping connection to '%s'",
+			   conn->client_id);
+		rc = -1;
+	}
+	if (rc < 0) {
+		(void)epoll_ctl(r->epfd, EPOLL_CTL_DEL, conn->trans->pollfd,
+				NULL);
+		np_conn_close(conn);
+	}
+}
+
+/* Service connections resumed by flow control or out of budget.  Their
+ * transports may have requests buffered already, so they can't wait for
+ * an event.  Take the list as it stands: connections queued again while
+ * it is serviced wait for the next kick, behind other ready fds.
+ */
+static void
+np_reactor_kicked(Npreactor *r)
+{
+	char buf[64];
+	Npconn *conn, *next;
+
+	while (read(r->kickfd[0], buf, sizeof (buf)) > 0)
+		;
+	xpthread_mutex_lock(&r->lock);
+	conn = r->resumed;
+	r->resumed = NULL;
+	xpthread_mutex_unlock(&r->lock);
+	for (; conn != NULL; conn = next) {
+		next = conn->resumed_next;
+		conn->resumed_next = NULL;
+		np_reactor_service(r, conn);
+	}
+}
+
+static void *
+np_reactor_proc(void *a)
+{
+	Npreactor *r = (Npreactor *)a;
+	struct epoll_event ev[REACTOR_MAXEVENTS];
+	int i, n;
+
+	for (;;) {
+		n = epoll_wait(r->epfd, ev, REACTOR_MAXEVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			np_uerror (errno);
+			np_logerr (r->srv, "epoll_wait");
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			/* wakefd is left readable so every thread sees it */
+			if (ev[i].data.ptr == NULL)
+				return NULL;
+			if (ev[i].data.ptr == r)
+				np_reactor_kicked(r);
+			else
+				np_reactor_service(r, ev[i].data.ptr);
+		}
+	}
+	return NULL;
+}
+
+/* Hand a connection whose input was paused by flow control back to the
+ * reactor threads.
+ */
+void
+np_reactor_resume(Npreactor *r, Npconn *conn)
+{
+	char c = 0;
+
+	xpthread_mutex_lock(&r->lock);
+	conn->resumed_next = r->resumed;
+	r->resumed = conn;
+	xpthread_mutex_unlock(&r->lock);
+	/* N.B. if the pipe is full, it is already readable */
+	if (write(r->kickfd[1], &c, 1) < 0 && errno != EAGAIN)
+		np_logerr (r->srv, "reactor kick");
+}
+
+int
+np_reactor_add_conn(Npreactor *r, Npconn *conn)
+{
+	struct epoll_event ev;
+	int fd = conn->trans->pollfd;
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL)) < 0
+			|| fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		np_uerror (errno);
+		return -1;
+	}
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = conn;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		np_uerror (errno);
+		return -1;
+	}
+	return 0;
+}
+
+/* Start 'nrthread' reactor threads.  Connections created after this
+ * on pollable transports are serviced by the reactor.
+ */
+int
+np_reactor_create(Npsrv *srv, int nrthread)
+{
+	Npreactor *r;
+	struct epoll_event ev;
+	int err;
+
+	NP_ASSERT (srv->reactor == NULL);
+	if (nrthread < 1) {
+		np_uerror (EINVAL);
+		return -1;
+	}
+	if (!(r = malloc (sizeof (*r)))) {
+		np_uerror (ENOMEM);
+		return -1;
+	}
+	memset (r, 0, sizeof (*r));
+	r->srv = srv;
+	r->wakefd[0] = r->wakefd[1] = -1;
+	r->kickfd[0] = r->kickfd[1] = -1;
+	pthread_mutex_init (&r->lock, NULL);
+	if ((r->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		np_uerror (errno);
+		goto error;
+	}
+	if (pipe(r->wakefd) < 0) {
+		np_uerror (errno);
+		goto error;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wakefd[0], &ev) < 0) {
+		np_uerror (errno);
+		goto error;
+	}
+	if (pipe2(r->kickfd, O_NONBLOCK | O_CLOEXEC) < 0) {
+		np_uerror (errno);
+		goto error;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = r;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->kickfd[0], &ev) < 0) {
+		np_uerror (errno);
+		goto error;
+	}
+	if (!(r->rthreads = malloc (nrthread * sizeof (r->rthreads[0])))) {
+		np_uerror (ENOMEM);
+		goto error;
+	}
+	srv->reactor = r;
+	for (r->nrthread = 0; r->nrthread < nrthread; r->nrthread++) {
+		err = pthread_create(&r->rthreads[r->nrthread], NULL,
+				     np_reactor_proc, r);
+		if (err) {
+			np_uerror (err);
+			goto error;
+		}
+	}
+	return 0;
+error:
+	if (srv->reactor)
+		np_reactor_destroy (srv);
+	else {
+		if (r->epfd >= 0)
+			(void)close (r->epfd);
+		if (r->wakefd[0] >= 0)
+			(void)close (r->wakefd[0]);
+		if (r->wakefd[1] >= 0)
+			(void)close (r->wakefd[1]);
+		if (r->kickfd[0] >= 0)
+			(void)close (r->kickfd[0]);
+		if (r->kickfd[1] >= 0)
+			(void)close (r->kickfd[1]);
+		pthread_mutex_destroy (&r->lock);
+		free (r);
+	}
+	return -1;
+}
+
+/* Stop reactor threads.  Call after connections have been shut down.
+ */
+void
+np_reactor_destroy(Npsrv *srv)
+{
+	Npreactor *r = srv->reactor;
+	int i, err;
+	char c = 0;
+
+	if (!r)
+		return;
+	if (r->nrthread > 0 && write(r->wakefd[1], &c, 1) < 0)
+		np_logerr (srv, "reactor wakeup");
+	for (i = 0; i < r->nrthread; i++) {
+		if ((err = pthread_join(r->rthreads[i], NULL))) {
+			np_uerror (err);
+			np_logerr (srv, "reactor: join thread %d", i);
+		}
+	}
+	(void)close (r->epfd);
+	(void)close (r->wakefd[0]);
+	(void)close (r->wakefd[1]);
+	(void)close (r->kickfd[0]);
+	(void)close (r->kickfd[1]);
+	pthread_mutex_destroy (&r->lock);
+	free (r->rthreads);
+	free (r);
+	srv->reactor = NULL;
+}
+
+#else /* !HAVE_SYS_EPOLL_H */
+
+void
+np_reactor_resume(Npreactor *r, Npconn *conn)
+{
+}
+
+int
+np_reactor_add_conn(Npreactor *r, Npconn *conn)
+{
+	np_uerror (ENOSYS);
+	return -1;
+}
+
+int
+np_reactor_create(Npsrv *srv, int nrthread)
+{
+	np_uerror (ENOSYS);
+	return -1;
+}
+
+void
+np_reactor_destroy(Npsrv *srv)
+{
+}
+
+#endif
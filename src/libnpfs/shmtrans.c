@@ -0,0 +1,657 @@
+/*************************************************************\
+ * Copyright (C) 2010 by Lawrence Livermore National Security, LLC.
+ *
+ * This file is part of npfs, a framework for 9P synthetic file systems.
+ * For details see https://sourceforge.net/projects/npfs.
+ *
+ * SPDX-License-Identifier: MIT
+ *************************************************************/
+
+/* shmtrans.c - 9P over shared memory rings, for clients on the same host
+ *
+ * The client creates a sealed memfd holding two single producer, single
+ * consumer byte rings, one per direction, and four eventfds: for each
+ * ring, one the producer rings when the consumer waits for data and one
+ * the consumer rings when the producer waits for space.  It passes them
+ * to the server over a connected Unix domain socket with SCM_RIGHTS,
+ * preceded by a hello message, and the server echoes the hello back.
+ * From then on 9P messages are copied through the rings and the socket
+ * is only watched for hangup.
+ *
+ * Messages are streamed, so a ring may be smaller than msize.  Neither
+ * side makes a system call while the other is keeping up; a side only
+ * sets its waiting flag, rechecks the ring, and sleeps on its eventfd
+ * when the ring is empty (or full).  The server copies requests out of
+ * shared memory before parsing them and checks the client's ring
+ * indices, so a misbehaving client can only break its own connection.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include "npfs.h"
+#include "npfsimpl.h"
+
+#if HAVE_MEMFD_CREATE && defined(F_ADD_SEALS)
+#include <sys/eventfd.h>
+
+typedef struct Shmtrans Shmtrans;
+typedef struct Shmring Shmring;
+typedef struct Shmend Shmend;
+typedef struct Shmhello Shmhello;
+
+#define SHM_MAGIC		"NPSHM01"
+#define SHM_RINGSIZE		(1024*1024)
+#define SHM_RINGSIZE_MIN	4096
+#define SHM_RINGSIZE_MAX	(64*1024*1024)
+
+/* memfd, then data and space eventfds of the request and response rings */
+#define SHM_NFDS		5
+
+/* Sent by the client with the fds, and echoed by the server.
+ * N.B. the first four bytes read as a 9P size are larger than any msize.
+ */
+struct Shmhello {
+	char		magic[8];
+	u32		ringsize;
+	u32		flags;
+};
+
+/* Ring header in shared memory, followed by 'ringsize' bytes of data.
+ * head and tail count bytes written and read, modulo 2^32.
+ */
+struct Shmring {
+	u32		head;		/* written by producer */
+	u8		pad0[60];
+	u32		tail;		/* written by consumer */
+	u8		pad1[60];
+	u32		rwait;		/* consumer is waiting for data */
+	u32		wwait;		/* producer is waiting for space */
+	u8		pad2[56];
+};
+
+/* One side's view of a ring.  'pos' is a private copy of the index this
+ * side advances, so the peer can't move it.
+ */
+struct Shmend {
+	Shmring		*r;
+	u8		*data;
+	u32		size;
+	u32		pos;
+	int		datafd;
+	int		spacefd;
+	int		hangup;
+};
+
+struct Shmtrans {
+	Nptrans		*trans;
+	int		fd;
+	int		server;
+	Nptrans		*fdtrans;	/* client did not ask for rings */
+	void		*map;
+	size_t		maplen;
+	Shmend		rx;
+	Shmend		tx;
+};
+
+static int np_shmtrans_recv(Npfcall **fcp, u32 msize, void *a);
+static int np_shmtrans_send(Npfcall *fc, void *a);
+static int np_shmtrans_sendv(Npfcall **fcs, int n, void *a);
+static void np_shmtrans_destroy(void *a);
+
+static size_t
+_maplen(u32 ringsize)
+{
+	return 2 * (sizeof(Shmring) + ringsize);
+}
+
+static Shmtrans *
+_shmtrans_alloc(int fd, int server)
+{
+	Shmtrans *st;
+
+	if (!(st = malloc(sizeof(*st)))) {
+		np_uerror(ENOMEM);
+		return NULL;
+	}
+	memset(st, 0, sizeof(*st));
+	st->fd = fd;
+	st->server = server;
+	st->map = MAP_FAILED;
+	st->rx.datafd = st->rx.spacefd = -1;
+	st->tx.datafd = st->tx.spacefd = -1;
+	return st;
+}
+
+static void
+_shmtrans_free(Shmtrans *st)
+{
+	if (st->map != MAP_FAILED)
+		(void)munmap(st->map, st->maplen);
+	if (st->rx.datafd >= 0)
+		(void)close(st->rx.datafd);
+	if (st->rx.spacefd >= 0)
+		(void)close(st->rx.spacefd);
+	if (st->tx.datafd >= 0)
+		(void)close(st->tx.datafd);
+	if (st->tx.spacefd >= 0)
+		(void)close(st->tx.spacefd);
+	free(st);
+}
+
+/* Map the rings.  fds[] holds the memfd and the eventfds in hello order,
+ * and is consumed.  The server receives requests on the first ring.
+ */
+static int
+_shmtrans_map(Shmtrans *st, int *fds, u32 ringsize)
+{
+	Shmend *req = st->server ? &st->rx : &st->tx;
+	Shmend *rsp = st->server ? &st->tx : &st->rx;
+	u8 *p;
+
+	st->maplen = _maplen(ringsize);
+	st->map = mmap(NULL, st->maplen, PROT_READ | PROT_WRITE, MAP_SHARED,
+		       fds[0], 0);
+	(void)close(fds[0]);
+	req->datafd = fds[1];
+	req->spacefd = fds[2];
+	rsp->datafd = fds[3];
+	rsp->spacefd = fds[4];
+	if (st->map == MAP_FAILED) {
+		np_uerror(errno);
+		return -1;
+	}
+	p = st->map;
+	req->r = (Shmring *)p;
+	req->data = p + sizeof(Shmring);
+	req->size = ringsize;
+	p += sizeof(Shmring) + ringsize;
+	rsp->r = (Shmring *)p;
+	rsp->data = p + sizeof(Shmring);
+	rsp->size = ringsize;
+	return 0;
+}
+
+static void
+_ring_bell(int fd)
+{
+	u64 one = 1;
+
+	if (write(fd, &one, sizeof(one)) < 0)
+		return; /* EAGAIN: the counter is already nonzero */
+}
+
+/* Announce that this side is about to sleep until *idx moves off 'val',
+ * recheck, then wait on 'efd' or hangup of the socket.
+ * Returns 0 and the caller rechecks the ring; on hangup e->hangup is set.
+ */
+static int
+_ring_wait(Shmtrans *st, Shmend *e, u32 *flag, u32 *idx, u32 val, int efd)
+{
+	struct pollfd pfd[2] = {
+		{ .fd = efd, .events = POLLIN },
+		{ .fd = st->fd, .events = POLLIN },
+	};
+	u64 count;
+	int n;
+
+	__atomic_store_n(flag, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(idx, __ATOMIC_SEQ_CST) == val) {
+		n = poll(pfd, 2, -1);
+		if (n < 0 && errno != EINTR) {
+			np_uerror(errno);
+			__atomic_store_n(flag, 0, __ATOMIC_RELAXED);
+			return -1;
+		}
+		if (n > 0 && (pfd[0].revents & POLLIN)) {
+			if (read(efd, &count, sizeof(count)) < 0)
+				count = 0; /* EAGAIN: raced with a spurious bell */
+		}
+		/* N.B. the peer never writes to the socket after the hello */
+		if (n > 0 && pfd[1].revents)
+			e->hangup = 1;
+	}
+	__atomic_store_n(flag, 0, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* Copy 'len' bytes out of the ring, waiting for them as needed.
+ * Returns 0 on success, -1 on error or if the peer hangs up first.
+ */
+static int
+_ring_read(Shmtrans *st, Shmend *e, u8 *buf, u32 len)
+{
+	u32 avail, off, n, chunk;
+
+	while (len > 0) {
+		avail = __atomic_load_n(&e->r->head, __ATOMIC_ACQUIRE) - e->pos;
+		if (avail > e->size) {
+			np_uerror(EPROTO);
+			return -1;
+		}
+		if (avail == 0) {
+			if (e->hangup) {
+				np_uerror(ECONNRESET);
+				return -1;
+			}
+			if (_ring_wait(st, e, &e->r->rwait, &e->r->head, e->pos,
+				       e->datafd) < 0)
+				return -1;
+			continue;
+		}
+		n = avail < len ? avail : len;
+		off = e->pos & (e->size - 1);
+		chunk = e->size - off < n ? e->size - off : n;
+		memcpy(buf, e->data + off, chunk);
+		memcpy(buf + chunk, e->data, n - chunk);
+		buf += n;
+		len -= n;
+		e->pos += n;
+		__atomic_store_n(&e->r->tail, e->pos, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&e->r->wwait, __ATOMIC_SEQ_CST))
+			_ring_bell(e->spacefd);
+	}
+	return 0;
+}
+
+/* Copy 'len' bytes into the ring, waiting for space as needed.
+ * Returns 0 on success, -1 on error or hangup.
+ */
+static int
+_ring_write(Shmtrans *st, Shmend *e, u8 *buf, u32 len)
+{
+	u32 tail, used, off, n, chunk;
+
+	while (len > 0) {
+		tail = __atomic_load_n(&e->r->tail, __ATOMIC_ACQUIRE);
+		used = e->pos - tail;
+		if (used > e->size) {
+			np_uerror(EPROTO);
+			return -1;
+		}
+		if (used == e->size) {
+			if (e->hangup) {
+				np_uerror(EPIPE);
+				return -1;
+			}
+			if (_ring_wait(st, e, &e->r->wwait, &e->r->tail, tail,
+				       e->spacefd) < 0)
+				return -1;
+			continue;
+		}
+		n = e->size - used < len ? e->size - used : len;
+		off = e->pos & (e->size - 1);
+		chunk = e->size - off < n ? e->size - off : n;
+		memcpy(e->data + off, buf, chunk);
+		memcpy(e->data, buf + chunk, n - chunk);
+		buf += n;
+		len -= n;
+		e->pos += n;
+		__atomic_store_n(&e->r->head, e->pos, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&e->r->rwait, __ATOMIC_SEQ_CST))
+			_ring_bell(e->datafd);
+	}
+	return 0;
+}
+
+static Nptrans *
+_shmtrans_trans(Shmtrans *st)
+{
+	Nptrans *npt;
+
+	npt = np_trans_create(st, np_shmtrans_recv, np_shmtrans_send,
+			      np_shmtrans_destroy);
+	if (!npt)
+		return NULL;
+	npt->sendv = np_shmtrans_sendv;
+	st->trans = npt;
+	return npt;
+}
+
+/* Server end of a connected Unix domain socket.  The transport waits
+ * for the first message from the client: a hello sets up the rings,
+ * and anything else is handed to an fdtrans on the same socket.
+ * Either way the connection has a reader thread, since the socket
+ * must not be made non-blocking by the reactor (pollfd is -1).
+ */
+Nptrans *
+np_shmtrans_create(int fd)
+{
+	Shmtrans *st;
+	Nptrans *npt;
+
+	if (!(st = _shmtrans_alloc(fd, 1)))
+		return NULL;
+	if (!(npt = _shmtrans_trans(st))) {
+		free(st);
+		return NULL;
+	}
+	return npt;
+}
+
+/* Receive the client's hello and fds, map the rings, and echo the hello.
+ */
+static int
+_shmtrans_accept(Shmtrans *st)
+{
+	Shmhello hello;
+	struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+	union {
+		struct cmsghdr cm;
+		char buf[CMSG_SPACE(SHM_NFDS * sizeof(int))];
+	} u;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = u.buf,
+		.msg_controllen = sizeof(u.buf),
+	};
+	struct cmsghdr *cmsg;
+	struct stat sb;
+	int fds[SHM_NFDS];
+	int i, n, len, nfds = 0, seals;
+
+	do {
+		len = recvmsg(st->fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+	} while (len < 0 && errno == EINTR);
+	if (len < 0) {
+		np_uerror(errno);
+		return -1;
+	}
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET
+					|| cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < n; i++) {
+			int fd;
+
+			memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int),
+			       sizeof(int));
+			if (nfds < SHM_NFDS)
+				fds[nfds++] = fd;
+			else
+				(void)close(fd);
+		}
+	}
+	if (nfds != SHM_NFDS || (msg.msg_flags & MSG_CTRUNC)
+			|| len != sizeof(hello)
+			|| memcmp(hello.magic, SHM_MAGIC, sizeof(hello.magic))) {
+		np_uerror(EPROTO);
+		goto error;
+	}
+	/* N.B. the client can't truncate a sealed memfd under the mapping */
+	if (hello.ringsize < SHM_RINGSIZE_MIN
+			|| hello.ringsize > SHM_RINGSIZE_MAX
+			|| (hello.ringsize & (hello.ringsize - 1))
+			|| fstat(fds[0], &sb) < 0
+			|| sb.st_size != _maplen(hello.ringsize)
+			|| (seals = fcntl(fds[0], F_GET_SEALS)) < 0
+			|| !(seals & F_SEAL_SHRINK)) {
+		np_uerror(EPROTO);
+		goto error;
+	}
+	for (i = 1; i < SHM_NFDS; i++) {
+		if (fcntl(fds[i], F_SETFL, O_NONBLOCK) < 0) {
+			np_uerror(errno);
+			goto error;
+		}
+	}
+	if (_shmtrans_map(st, fds, hello.ringsize) < 0)
+		return -1;
+	if (send(st->fd, &hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello)) {
+		np_uerror(errno);
+		return -1;
+	}
+	return 0;
+error:
+	for (i = 0; i < nfds; i++)
+		(void)close(fds[i]);
+	return -1;
+}
+
+/* Decide what the client speaks from the first bytes it sends.
+ * Returns 0 on success, with *eof set if the client went away.
+ */
+static int
+_shmtrans_start(Shmtrans *st, int *eof)
+{
+	char magic[4];
+	int n;
+
+	do {
+		n = recv(st->fd, magic, sizeof(magic), MSG_PEEK | MSG_WAITALL);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		np_uerror(errno);
+		return -1;
+	}
+	if (n < sizeof(magic)) {
+		*eof = 1;
+		return 0;
+	}
+	if (memcmp(magic, SHM_MAGIC, sizeof(magic)) == 0)
+		return _shmtrans_accept(st);
+	if (!(st->fdtrans = np_fdtrans_create(st->fd, st->fd)))
+		return -1;
+	st->trans->splice = st->fdtrans->splice;
+	return 0;
+}
+
+/* Client end.  Set up rings of 'ringsize' bytes (0 for the default)
+ * with the server on the connected Unix domain socket 'fd'.
+ * On failure fd is left open, as with np_fdtrans_create().
+ */
+Nptrans *
+np_shmtrans_connect(int fd, u32 ringsize)
+{
+	Shmtrans *st;
+	Nptrans *npt;
+	Shmhello hello, ack;
+	struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+	union {
+		struct cmsghdr cm;
+		char buf[CMSG_SPACE(SHM_NFDS * sizeof(int))];
+	} u;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = u.buf,
+		.msg_controllen = sizeof(u.buf),
+	};
+	struct cmsghdr *cmsg;
+	int fds[SHM_NFDS];
+	int i, n, nfds = 0;
+
+	if (ringsize == 0)
+		ringsize = SHM_RINGSIZE;
+	if (ringsize < SHM_RINGSIZE_MIN || ringsize > SHM_RINGSIZE_MAX
+					|| (ringsize & (ringsize - 1))) {
+		np_uerror(EINVAL);
+		return NULL;
+	}
+	if (!(st = _shmtrans_alloc(fd, 0)))
+		return NULL;
+	fds[nfds] = memfd_create("npshm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fds[nfds] < 0) {
+		np_uerror(errno);
+		goto error;
+	}
+	nfds++;
+	if (ftruncate(fds[0], _maplen(ringsize)) < 0
+			|| fcntl(fds[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW
+						      | F_SEAL_SEAL) < 0) {
+		np_uerror(errno);
+		goto error;
+	}
+	while (nfds < SHM_NFDS) {
+		if ((fds[nfds] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+			np_uerror(errno);
+			goto error;
+		}
+		nfds++;
+	}
+
+	memset(&hello, 0, sizeof(hello));
+	memcpy(hello.magic, SHM_MAGIC, sizeof(hello.magic));
+	hello.ringsize = ringsize;
+	memset(&u, 0, sizeof(u));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(SHM_NFDS * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, SHM_NFDS * sizeof(int));
+	do {
+		n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+	} while (n < 0 && errno == EINTR);
+	if (n != sizeof(hello)) {
+		np_uerror(n < 0 ? errno : EIO);
+		goto error;
+	}
+	do {
+		n = recv(fd, &ack, sizeof(ack), MSG_WAITALL);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		np_uerror(errno);
+		goto error;
+	}
+	/* N.B. a server without shmtrans drops the connection */
+	if (n != sizeof(ack) || memcmp(&ack, &hello, sizeof(ack)) != 0) {
+		np_uerror(EPROTONOSUPPORT);
+		goto error;
+	}
+	if (_shmtrans_map(st, fds, ringsize) < 0) {
+		nfds = 0;
+		goto error;
+	}
+	if (!(npt = _shmtrans_trans(st)))
+		goto error_mapped;
+	return npt;
+error:
+	for (i = 0; i < nfds; i++)
+		(void)close(fds[i]);
+error_mapped:
+	_shmtrans_free(st);
+	return NULL;
+}
+
+static void
+np_shmtrans_destroy(void *a)
+{
+	Shmtrans *st = (Shmtrans *)a;
+
+	if (st->fdtrans)
+		np_trans_destroy(st->fdtrans); /* closes fd */
+	else if (st->fd >= 0)
+		(void)close(st->fd);
+	_shmtrans_free(st);
+}
+
+/* Return one request, or EOF.  The first call on the server decides
+ * whether the client speaks 9P over the rings or over the socket.
+ */
+static int
+np_shmtrans_recv(Npfcall **fcp, u32 msize, void *a)
+{
+	Shmtrans *st = (Shmtrans *)a;
+	Npfcall *fc;
+	u8 hdr[5];
+	u32 size;
+	int eof = 0;
+
+	if (st->server && !st->fdtrans && st->map == MAP_FAILED) {
+		if (_shmtrans_start(st, &eof) < 0)
+			return -1;
+		if (eof)
+			goto eof;
+	}
+	if (st->fdtrans)
+		return st->fdtrans->recv(fcp, msize, st->fdtrans->aux);
+
+	/* N.B. stage size[4] and type[1] */
+	if (_ring_read(st, &st->rx, hdr, sizeof(hdr)) < 0) {
+		if (st->rx.hangup)
+			goto eof;
+		return -1;
+	}
+	size = np_peek_size(hdr, 4);
+	if (size > msize || size < 7) {
+		np_uerror(EPROTO);
+		return -1;
+	}
+	if (size >= TWRITE_HDRSIZE + TWRITE_ALIGN_MIN && hdr[4] == Twrite)
+		fc = np_alloc_fcall_aligned(size, TWRITE_HDRSIZE);
+	else
+		fc = np_alloc_fcall(size);
+	if (!fc)
+		return -1;
+	memcpy(fc->pkt, hdr, sizeof(hdr));
+	if (_ring_read(st, &st->rx, fc->pkt + sizeof(hdr),
+		       size - sizeof(hdr)) < 0) {
+		np_free_fcall(fc);
+		if (st->rx.hangup)
+			goto eof;
+		return -1;
+	}
+	*fcp = fc;
+	return 0;
+eof:
+	*fcp = NULL;
+	return 0;
+}
+
+static int
+np_shmtrans_send(Npfcall *fc, void *a)
+{
+	return np_shmtrans_sendv(&fc, 1, a);
+}
+
+/* N.B. Rreads are not spliced into the rings (trans->splice is only set
+ * for a client that fell back to the socket), so every fcall is in pkt.
+ */
+static int
+np_shmtrans_sendv(Npfcall **fcs, int n, void *a)
+{
+	Shmtrans *st = (Shmtrans *)a;
+	int i, total = 0;
+
+	if (st->fdtrans)
+		return np_trans_sendv(st->fdtrans, fcs, n);
+	for (i = 0; i < n; i++) {
+		if (_ring_write(st, &st->tx, fcs[i]->pkt, fcs[i]->size) < 0)
+			return -1;
+		total += fcs[i]->size;
+	}
+	return total;
+}
+
+#else /* HAVE_MEMFD_CREATE */
+
+Nptrans *
+np_shmtrans_create(int fd)
+{
+	np_uerror(ENOSYS);
+	return NULL;
+}
+
+Nptrans *
+np_shmtrans_connect(int fd, u32 ringsize)
+{
+	np_uerror(ENOSYS);
+	return NULL;
+}
+
+#endif
@@ -0,0 +1,233 @@
+/*************************************************************\
+ * Copyright (C) 2010 by Lawrence Livermore National Security, LLC.
+ *
+ * This file is part of npfs, a framework for 9P synthetic file systems.
+ * For details see https://sourceforge.net/projects/npfs.
+ *
+ * SPDX-License-Identifier: MIT
+ *************************************************************/
+
+/* splice.c - zero-copy Rread payloads
+ *
+ * Instead of reading file data into the Rread, the worker splices it into
+ * a pipe, which travels with the Rread on the connection's send queue.
+ * The transport writes the 11 byte header, then splices the pipe into the
+ * socket, so the data never enters user space.
+ *
+ * The data is in the pipe before the header is built, so the count sent
+ * is always what was read: short reads at EOF work as with pread().
+ *
+ * N.B. splicing a file into a pipe takes references to its page cache
+ * pages rather than copying them.  A write to the file before the pipe
+ * is drained into the socket changes data that was already "read", so a
+ * client may see bytes newer than the read itself, even from a write it
+ * issued after the read returned to the server.  Callers should only
+ * splice files where that is acceptable (diod's "splice" export option).  If
+ * the file can't be spliced, nothing was read, or no pipe is available,
+ * np_create_rread_splice() returns NULL and the caller reads normally.
+ *
+ * Pipes are kept on a process-wide free list, like fcalls, and the number
+ * in use is capped to bound file descriptor use.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "npfs.h"
+#include "xpthread.h"
+#include "npfsimpl.h"
+
+#define PIPEPOOL_MAXIDLE	32
+#define PIPEPOOL_MAXBUSY	256
+#define PIPEPOOL_PIPESIZE	(1024*1024)
+
+typedef struct {
+	pthread_mutex_t	lock;
+	Nppipe		*free;
+	int		nidle;
+	int		nbusy;
+	u64		reads;
+	u64		bytes;
+	u64		fallbacks;
+} Pipepool;
+
+static Pipepool pipepool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+#ifdef HAVE_SPLICE
+static void
+np_pipe_destroy(Nppipe *p)
+{
+	(void)close(p->fd[0]);
+	(void)close(p->fd[1]);
+	free(p);
+}
+
+/* Create a pipe, as large as the system allows up to PIPEPOOL_PIPESIZE.
+ */
+static Nppipe *
+np_pipe_create(void)
+{
+	Nppipe *p;
+	int size;
+
+	if (!(p = malloc(sizeof(*p))))
+		return NULL;
+	if (pipe2(p->fd, O_NONBLOCK | O_CLOEXEC) < 0) {
+		free(p);
+		return NULL;
+	}
+	for (size = PIPEPOOL_PIPESIZE; size > 0; size /= 2) {
+		if (fcntl(p->fd[1], F_SETPIPE_SZ, size) >= 0)
+			break;
+	}
+	if ((size = fcntl(p->fd[1], F_GETPIPE_SZ)) < 0) {
+		np_pipe_destroy(p);
+		return NULL;
+	}
+	p->size = size;
+	p->len = 0;
+	p->next = NULL;
+	return p;
+}
+
+static Nppipe *
+np_pipe_get(void)
+{
+	Nppipe *p = NULL;
+
+	xpthread_mutex_lock(&pipepool.lock);
+	if (pipepool.nbusy < PIPEPOOL_MAXBUSY) {
+		if ((p = pipepool.free)) {
+			pipepool.free = p->next;
+			pipepool.nidle--;
+		}
+		pipepool.nbusy++;
+	}
+	xpthread_mutex_unlock(&pipepool.lock);
+	if (!p && !(p = np_pipe_create())) {
+		xpthread_mutex_lock(&pipepool.lock);
+		pipepool.nbusy--;
+		xpthread_mutex_unlock(&pipepool.lock);
+	}
+	return p;
+}
+#endif
+
+/* Return a pipe to the pool.  A pipe with data left in it after an
+ * error is closed rather than reused.
+ */
+void
+np_pipe_put(Nppipe *p)
+{
+#ifdef HAVE_SPLICE
+	xpthread_mutex_lock(&pipepool.lock);
+	pipepool.nbusy--;
+	if (p->len == 0 && pipepool.nidle < PIPEPOOL_MAXIDLE) {
+		p->next = pipepool.free;
+		pipepool.free = p;
+		pipepool.nidle++;
+		p = NULL;
+	}
+	xpthread_mutex_unlock(&pipepool.lock);
+	if (p)
+		np_pipe_destroy(p);
+#endif
+}
+
+/* Create a Rread for up to 'count' bytes of 'fd' at 'offset', with the
+ * payload spliced into a pipe.  Returns NULL if the caller should fall
+ * back to reading the data itself.
+ */
+Npfcall *
+np_create_rread_splice(Npconn *conn, int fd, u64 offset, u32 count)
+{
+#ifdef HAVE_SPLICE
+	Nppipe *p = NULL;
+	Npfcall *fc;
+	loff_t off = offset;
+	ssize_t n;
+
+	if (!conn->trans->splice || count == 0)
+		return NULL;
+	if (!(p = np_pipe_get()) || count > p->size)
+		goto fallback;
+	while (p->len < count) {
+		n = splice(fd, &off, p->fd[1], NULL, count - p->len,
+			   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && p->len == 0)
+			goto fallback;
+		if (n <= 0)
+			break;
+		p->len += n;
+	}
+	if (p->len == 0 || !(fc = np_alloc_rread_header(p->len)))
+		goto fallback;
+	fc->pipe = p;
+	__atomic_add_fetch(&pipepool.reads, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&pipepool.bytes, p->len, __ATOMIC_RELAXED);
+	return fc;
+fallback:
+	if (p)
+		np_pipe_put(p);
+	__atomic_add_fetch(&pipepool.fallbacks, 1, __ATOMIC_RELAXED);
+#endif
+	return NULL;
+}
+
+/* Close idle pipes.
+ */
+void
+np_splice_flush(void)
+{
+#ifdef HAVE_SPLICE
+	Nppipe *p, *next;
+
+	xpthread_mutex_lock(&pipepool.lock);
+	p = pipepool.free;
+	pipepool.free = NULL;
+	pipepool.nidle = 0;
+	xpthread_mutex_unlock(&pipepool.lock);
+	for (; p != NULL; p = next) {
+		next = p->next;
+		np_pipe_destroy(p);
+	}
+#endif
+}
+
+/* ctl "splice" file:
+ *   reads bytes fallbacks idle-pipes busy-pipes
+ */
+char *
+np_splice_ctl_get(char *name, void *a)
+{
+	char *s = NULL;
+	int len = 0;
+	int nidle, nbusy;
+
+	xpthread_mutex_lock(&pipepool.lock);
+	nidle = pipepool.nidle;
+	nbusy = pipepool.nbusy;
+	xpthread_mutex_unlock(&pipepool.lock);
+	if (aspf(&s, &len, "%"PRIu64" %"PRIu64" %"PRIu64" %d %d\n",
+		 __atomic_load_n(&pipepool.reads, __ATOMIC_RELAXED),
+		 __atomic_load_n(&pipepool.bytes, __ATOMIC_RELAXED),
+		 __atomic_load_n(&pipepool.fallbacks, __ATOMIC_RELAXED),
+		 nidle, nbusy) < 0)
+		np_uerror(ENOMEM);
+	return s;
+}
@@ -19,23 +19,37 @@
 #include <pthread.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <time.h>
 #include <signal.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <inttypes.h>
+#if HAVE_SCHED_GETCPU
+#include <sched.h>
+#endif
 
 #include "npfs.h"
 #include "xpthread.h"
 #include "npfsimpl.h"
 
 static Nptpool *np_tpool_create(Npsrv *srv, char *name);
+static int np_tpool_stats_init (Nptpool *tp);
 static void np_tpool_cleanup (Npsrv *srv);
 static void *np_wthread_proc(void *a);
+static int np_wthread_create(Npwpool *wp);
+static int np_wpool_create(Npsrv *srv, int nwthread);
+static void np_wpool_destroy(Npsrv *srv);
+static void np_tpool_ready(Nptpool *tp);
 static void np_srv_remove_workreq(Nptpool *tp, Npreq *req);
 static void np_srv_add_workreq(Nptpool *tp, Npreq *req);
 
 static char *_ctl_get_conns (char *name, void *a);
 static char *_ctl_get_tpools (char *name, void *a);
+static char *_ctl_get_wthreads (char *name, void *a);
+static char *_ctl_get_sched (char *name, void *a);
+static char *_ctl_get_credit (char *name, void *a);
+static char *_ctl_get_sendq (char *name, void *a);
 
 /* Ugly hack so NP_ASSERT can get to registsered srv->logmsg */
 static Npsrv *np_assert_srv = NULL;
@@ -53,6 +67,8 @@ np_srv_create(int nwthread, int flags)
 	memset (srv, 0, sizeof (*srv));
 	pthread_mutex_init(&srv->lock, NULL);
 	pthread_cond_init(&srv->conncountcond, NULL);
+	pthread_mutex_init(&srv->fclock, NULL);
+	pthread_cond_init(&srv->fccond, NULL);
 
 	srv->msize = 8216;
 	srv->flags = flags;
@@ -63,9 +79,25 @@ np_srv_create(int nwthread, int flags)
 		goto error;
 	if (!np_ctl_addfile (srv->ctlroot, "tpools", _ctl_get_tpools, srv, 0))
 		goto error;
+	if (!np_ctl_addfile (srv->ctlroot, "wthreads", _ctl_get_wthreads,
+			     srv, 0))
+		goto error;
+	if (!np_ctl_addfile (srv->ctlroot, "sched", _ctl_get_sched, srv, 0))
+		goto error;
+	if (!np_ctl_addfile (srv->ctlroot, "credit", _ctl_get_credit, srv, 0))
+		goto error;
+	if (!np_ctl_addfile (srv->ctlroot, "sendq", _ctl_get_sendq, srv, 0))
+		goto error;
+	if (!np_ctl_addfile (srv->ctlroot, "fcallpool", np_fcallpool_ctl_get,
+			     NULL, 0))
+		goto error;
+	if (!np_ctl_addfile (srv->ctlroot, "splice", np_splice_ctl_get,
+			     NULL, 0))
+		goto error;
 	if (np_usercache_create (srv) < 0)
 		goto error;
-	srv->nwthread = nwthread;
+	if (np_wpool_create (srv, nwthread) < 0)
+		goto error;
 	if (!(srv->tpool = np_tpool_create (srv, "default")))
 		goto error;
 	np_tpool_incref (srv->tpool);
@@ -89,10 +121,17 @@ np_srv_shutdown(Npsrv *srv)
 {
 	Npconn *cc;
 
-	/* Shut down all connections */
+	/* Shut down all connections.  Reactor-driven connections have
+	 * no reader thread to cancel, so shut down the socket instead and
+	 * let the reactor tear them down on EOF.
+	 */
 	xpthread_mutex_lock(&srv->lock);
-	for (cc = srv->conns; cc != NULL; cc = cc->next)
-		pthread_cancel(cc->rthread);
+	for (cc = srv->conns; cc != NULL; cc = cc->next) {
+		if (cc->reactor)
+			(void)shutdown(cc->trans->pollfd, SHUT_RDWR);
+		else
+			pthread_cancel(cc->rthread);
+	}
 
 	/* Wait for all connections to shutdown... */
 	while (srv->conncount > 0)
@@ -103,13 +142,19 @@ np_srv_shutdown(Npsrv *srv)
 void
 np_srv_destroy(Npsrv *srv)
 {
+	np_reactor_destroy (srv);
+	np_wpool_destroy (srv);
 	np_tpool_decref (srv->tpool);
 	np_tpool_cleanup (srv);
 	np_usercache_destroy (srv);
 	np_ctl_finalize (srv);
 	np_assert_srv = NULL;
 	free (srv->tracebuf);
+	pthread_mutex_destroy (&srv->fclock);
+	pthread_cond_destroy (&srv->fccond);
 	free (srv);
+	np_fcallpool_flush ();
+	np_splice_flush ();
 }
 
 int
@@ -172,43 +217,265 @@ np_srv_wait_conncount(Npsrv *srv, int count)
 	xpthread_mutex_unlock(&srv->lock);
 }
 
-void
+static u64
+_now_usec (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Data transfer requests go in the bulk lane, all others in metadata.
+ */
+static int
+np_req_lane(u8 type)
+{
+	switch (type) {
+		case Tread:
+		case Twrite:
+		case Treaddir:
+		case Tfsync:
+			return NP_LANE_BULK;
+		default:
+			return NP_LANE_META;
+	}
+}
+
+/* Requests are queued on their tpool's request queue until a worker
+ * picks them up, then they move to the tpool's in-flight (workreqs) list
+ * until the response has been sent.  Each list has its own lock, so
+ * enqueue and dequeue don't contend with in-flight bookkeeping or with
+ * other tpools.  A tpool with queued requests is put on the shared
+ * worker pool's ready list (see np_wthread_proc).
+ * The queue is split into a metadata and a bulk lane so that small
+ * requests are not stuck behind large reads and writes (see
+ * np_tpool_next_req).
+ * N.B. lock ordering:
+ * 1) srv->lock (if walking the tpool list)
+ * 2) tp->reqlock
+ * 3) tp->worklock, wpool->lock
+ * 4) conn->reqlock
+ */
+static unsigned int
+np_flow_hash(Npconn *conn, u32 uid, int lane)
+{
+	return ((uintptr_t)conn / sizeof (*conn) + uid * 31 + lane)
+		% FLOW_HTABLE_SIZE;
+}
+
+/* Look up the flow for (conn, uid) on a lane, creating it if needed.
+ * New flows are added to the end of the lane's round.
+ */
+static Npflow *
+np_flow_get(Nptpool *tp, Npconn *conn, Npuser *user, int lane)
+{
+	Npsrv *srv = tp->srv;
+	Nplane *lp = &tp->lanes[lane];
+	u32 uid = user ? user->uid : NONUNAME;
+	unsigned int h = np_flow_hash(conn, uid, lane);
+	Npflow *fl;
+
+	/* assert: tp->reqlock held */
+	for (fl = tp->flowtab[h]; fl != NULL; fl = fl->hnext) {
+		if (fl->conn == conn && fl->uid == uid && fl->lane == lane)
+			return fl;
+	}
+	if ((fl = tp->freeflows))
+		tp->freeflows = fl->hnext;
+	else if (!(fl = malloc (sizeof (*fl)))) {
+		np_uerror (ENOMEM);
+		return NULL;
+	}
+	memset (fl, 0, sizeof (*fl));
+	fl->conn = conn;
+	fl->uid = uid;
+	fl->lane = lane;
+	fl->weight = srv->flow_weight ? srv->flow_weight(conn, user) : 1;
+	if (fl->weight < 1)
+		fl->weight = 1;
+	fl->hnext = tp->flowtab[h];
+	tp->flowtab[h] = fl;
+	fl->prev = lp->flows_last;
+	if (lp->flows_last)
+		lp->flows_last->next = fl;
+	lp->flows_last = fl;
+	if (!lp->flows_first)
+		lp->flows_first = fl;
+	lp->nflows++;
+	return fl;
+}
+
+static void
+np_flow_put(Nptpool *tp, Npflow *fl)
+{
+	Nplane *lp = &tp->lanes[fl->lane];
+	unsigned int h = np_flow_hash(fl->conn, fl->uid, fl->lane);
+	Npflow **flp;
+
+	/* assert: tp->reqlock held */
+	for (flp = &tp->flowtab[h]; *flp != fl; flp = &(*flp)->hnext)
+		;
+	*flp = fl->hnext;
+	if (fl->prev)
+		fl->prev->next = fl->next;
+	if (fl->next)
+		fl->next->prev = fl->prev;
+	if (fl == lp->flows_first)
+		lp->flows_first = fl->next;
+	if (fl == lp->flows_last)
+		lp->flows_last = fl->prev;
+	lp->nflows--;
+	fl->hnext = tp->freeflows;
+	tp->freeflows = fl;
+}
+
+/* Move a flow that has used up its deficit to the end of the round.
+ */
+static void
+np_flow_rotate(Nplane *lp, Npflow *fl)
+{
+	if (fl == lp->flows_last)
+		return;
+	if (fl->prev)
+		fl->prev->next = fl->next;
+	else
+		lp->flows_first = fl->next;
+	fl->next->prev = fl->prev;
+	fl->next = NULL;
+	fl->prev = lp->flows_last;
+	lp->flows_last->next = fl;
+	lp->flows_last = fl;
+}
+
+int
 np_srv_add_req(Npsrv *srv, Npreq *req)
 {
 	Nptpool *tp = NULL;
+	Nplane *lp;
+	Npflow *fl;
 
-	/* assert: srv->lock held */
 	if (req->fid)
 		tp = req->fid->tpool;
 	if (!tp)
 		tp = srv->tpool;
-	req->prev = tp->reqs_last;
-	if (tp->reqs_last)
-		tp->reqs_last->next = req;
-	tp->reqs_last = req;
-	if (!tp->reqs_first)
-		tp->reqs_first = req;
-	xpthread_cond_signal(&tp->reqcond);
+	req->lane = np_req_lane(req->tcall->type);
+	lp = &tp->lanes[req->lane];
+	xpthread_mutex_lock(&tp->reqlock);
+	req->qtime = _now_usec();
+	fl = np_flow_get(tp, req->conn, req->fid ? req->fid->user : NULL,
+			 req->lane);
+	if (!fl) {
+		xpthread_mutex_unlock(&tp->reqlock);
+		return -1;
+	}
+	req->flow = fl;
+	req->tpool = tp;
+	req->prev = fl->reqs_last;
+	if (fl->reqs_last)
+		fl->reqs_last->next = req;
+	fl->reqs_last = req;
+	if (!fl->reqs_first)
+		fl->reqs_first = req;
+	req->lprev = lp->newest;
+	if (lp->newest)
+		lp->newest->lnext = req;
+	lp->newest = req;
+	if (!lp->oldest)
+		lp->oldest = req;
+	lp->depth++;
+	tp->nqueued++;
+	if (!tp->ready && tp->nactive < srv->wpool->tpool_max)
+		np_tpool_ready(tp);
+	np_conn_add_req(req->conn, req);
+	xpthread_mutex_unlock(&tp->reqlock);
+	return 0;
 }
 
 void
 np_srv_remove_req(Nptpool *tp, Npreq *req)
 {
-	/* assert: srv->lock held */
+	Npflow *fl = req->flow;
+	Nplane *lp = &tp->lanes[req->lane];
+
+	/* assert: tp->reqlock held */
 	if (req->prev)
 		req->prev->next = req->next;
 	if (req->next)
 		req->next->prev = req->prev;
-	if (req == tp->reqs_first)
-		tp->reqs_first = req->next;
-	if (req == tp->reqs_last)
-		tp->reqs_last = req->prev;
+	if (req == fl->reqs_first)
+		fl->reqs_first = req->next;
+	if (req == fl->reqs_last)
+		fl->reqs_last = req->prev;
+	req->next = req->prev = NULL;
+	req->flow = NULL;
+	if (!fl->reqs_first)
+		np_flow_put(tp, fl);
+	if (req->lprev)
+		req->lprev->lnext = req->lnext;
+	if (req->lnext)
+		req->lnext->lprev = req->lprev;
+	if (req == lp->oldest)
+		lp->oldest = req->lnext;
+	if (req == lp->newest)
+		lp->newest = req->lprev;
+	req->lnext = req->lprev = NULL;
+	lp->depth--;
+	tp->nqueued--;
+}
+
+/* Choose the next request to work on.  Metadata requests are served
+ * meta_weight to one ahead of bulk requests, except that once any bulk
+ * request has waited bulk_aging msec the bulk lane goes next.  Within a
+ * lane, the flow at the head of the round is served until its deficit is
+ * used up.
+ */
+static Npreq *
+np_tpool_next_req(Nptpool *tp)
+{
+	Npwpool *wp = tp->srv->wpool;
+	Nplane *meta = &tp->lanes[NP_LANE_META];
+	Nplane *bulk = &tp->lanes[NP_LANE_BULK];
+	Nplane *lp;
+	Npflow *fl;
+	Npreq *req;
+	u64 now, wait;
+
+	/* assert: tp->reqlock held */
+	now = _now_usec();
+	if (!bulk->flows_first)
+		lp = meta;
+	else if (!meta->flows_first)
+		lp = bulk;
+	else if (now - bulk->oldest->qtime >= wp->bulk_aging * 1000ULL)
+		lp = bulk;
+	else if (tp->meta_credit > 0) {
+		lp = meta;
+		tp->meta_credit--;
+	} else
+		lp = bulk;
+	if (!(fl = lp->flows_first))
+		return NULL;
+	if (lp == bulk)
+		tp->meta_credit = wp->meta_weight;
+	if (fl->deficit <= 0)
+		fl->deficit = fl->weight;
+	req = fl->reqs_first;
+	if (--fl->deficit == 0 && fl->reqs_first != fl->reqs_last)
+		np_flow_rotate(lp, fl);
+	np_srv_remove_req(tp, req);
+	wait = now > req->qtime ? now - req->qtime : 0;
+	lp->nreqs++;
+	lp->wait_usec += wait;
+	if (wait > lp->wait_max_usec)
+		lp->wait_max_usec = wait;
+	return req;
 }
 
 static void
 np_srv_add_workreq(Nptpool *tp, Npreq *req)
 {
-	/* assert: srv->lock held */
+	/* assert: tp->worklock held */
 	if (tp->workreqs)
 		tp->workreqs->prev = req;
 	req->next = tp->workreqs;
@@ -219,7 +486,7 @@ np_srv_add_workreq(Nptpool *tp, Npreq *req)
 static void
 np_srv_remove_workreq(Nptpool *tp, Npreq *req)
 {
-	/* assert: srv->lock held */
+	/* assert: tp->worklock held */
 	if (req->prev)
 		req->prev->next = req->next;
 	else
@@ -228,62 +495,214 @@ np_srv_remove_workreq(Nptpool *tp, Npreq *req)
 		req->next->prev = req->prev;
 }
 
+/* Put tp on the tail of the ready list so a worker will pick up its next
+ * request.  The ready list holds a tpool reference.  Start another worker
+ * if there are more ready tpools than idle workers.
+ */
+static void
+np_tpool_ready(Nptpool *tp)
+{
+	Npwpool *wp = tp->srv->wpool;
+
+	/* assert: tp->reqlock held */
+	tp->ready = 1;
+	np_tpool_incref (tp);
+	xpthread_mutex_lock(&wp->lock);
+	tp->ready_next = NULL;
+	if (wp->ready_last)
+		wp->ready_last->ready_next = tp;
+	else
+		wp->ready_first = tp;
+	wp->ready_last = tp;
+	wp->nready++;
+	if (wp->nidle > 0)
+		xpthread_cond_signal(&wp->cond);
+	if (wp->nready > wp->nidle) {
+		wp->nexit = 0;
+		if (wp->nwthread < wp->max && !wp->shutdown
+					   && np_wthread_create(wp) < 0)
+			np_logerr (tp->srv, "failed to start worker thread");
+	}
+	xpthread_mutex_unlock(&wp->lock);
+}
+
 static int
-np_wthread_create(Nptpool *tp)
+np_wthread_create(Npwpool *wp)
 {
 	int err;
 	Npwthread *wt;
 
-	/* assert srv->lock held */
+	/* assert: wp->lock held */
 	if (!(wt = malloc(sizeof(*wt)))) {
 		np_uerror (ENOMEM);
 		goto error;
 	}
 	memset (wt, 0, sizeof (*wt));
-	wt->tpool = tp;
-	wt->shutdown = 0;
+	wt->wpool = wp;
 	wt->fsuid = geteuid ();
 	wt->fsgid = getegid ();
 	wt->privcap = (wt->fsuid == 0 ? 1 : 0);
 	if ((err = pthread_create(&wt->thread, NULL, np_wthread_proc, wt))) {
+		free (wt);
 		np_uerror (err);
 		goto error;
 	}
-	wt->next = tp->wthreads;
-	tp->wthreads = wt;
+	wt->next = wp->wthreads;
+	wp->wthreads = wt;
+	wp->nwthread++;
 	return 0;
 error:
 	return -1;
 }
 
 static void
-np_tpool_destroy(Nptpool *tp)
+np_wthread_remove(Npwpool *wp, Npwthread *wt)
 {
-	Npsrv *srv = tp->srv;
-	Npwthread *wt, *next;
-	void *retval;
-	int err, i;
-
-	for(wt = tp->wthreads; wt != NULL; wt = wt->next) {
-		wt->shutdown = 1;
-	}
-	xpthread_cond_broadcast(&tp->reqcond);
-	for (i = 0, wt = tp->wthreads; wt != NULL; wt = next, i++) {
-		next = wt->next;
-		if ((err = pthread_join (wt->thread, &retval))) {
-			np_uerror (err);
-			np_logerr(srv, "%s: join thread %d", tp->name, i);
-		} else if (retval == PTHREAD_CANCELED) {
-			np_logmsg(srv, "%s: join thread %d: cancelled",
-					tp->name, i);
-		} else if (retval != NULL) {
-			np_logmsg(srv, "%s: join thread %d: non-NULL return",
-					tp->name, i);
+	Npwthread **wtp;
+
+	/* assert: wp->lock held */
+	for (wtp = &wp->wthreads; *wtp != NULL; wtp = &(*wtp)->next) {
+		if (*wtp == wt) {
+			*wtp = wt->next;
+			break;
 		}
-		free (wt);
 	}
-	pthread_cond_destroy (&tp->reqcond);
+	wp->nwthread--;
+	xpthread_cond_broadcast(&wp->exitcond);
+}
+
+#define WPOOL_DFLT_MAXMULT	4	/* default max = nwthread * this */
+#define WPOOL_DFLT_IDLE		30	/* seconds */
+#define WPOOL_DFLT_META_WEIGHT	4
+#define WPOOL_DFLT_BULK_AGING	100	/* msec */
+
+/* Start the shared worker pool with 'nwthread' workers.  By default the
+ * pool grows to WPOOL_DFLT_MAXMULT times that under load, and any one
+ * tpool is limited to 'nwthread' concurrent requests.
+ */
+static int
+np_wpool_create(Npsrv *srv, int nwthread)
+{
+	Npwpool *wp;
+
+	if (nwthread < 1) {
+		np_uerror (EINVAL);
+		return -1;
+	}
+	if (!(wp = malloc (sizeof (*wp)))) {
+		np_uerror (ENOMEM);
+		return -1;
+	}
+	memset (wp, 0, sizeof (*wp));
+	pthread_mutex_init(&wp->lock, NULL);
+	pthread_cond_init(&wp->cond, NULL);
+	pthread_cond_init(&wp->exitcond, NULL);
+	wp->min = nwthread;
+	wp->max = nwthread * WPOOL_DFLT_MAXMULT;
+	wp->tpool_max = nwthread;
+	wp->idle_timeout = WPOOL_DFLT_IDLE;
+	wp->meta_weight = WPOOL_DFLT_META_WEIGHT;
+	wp->bulk_aging = WPOOL_DFLT_BULK_AGING;
+	srv->wpool = wp;
+
+	xpthread_mutex_lock(&wp->lock);
+	while (wp->nwthread < wp->min) {
+		if (np_wthread_create(wp) < 0)
+			break;
+	}
+	xpthread_mutex_unlock(&wp->lock);
+	if (wp->nwthread < wp->min)
+		return -1;
+	return 0;
+}
+
+static void
+np_wpool_destroy(Npsrv *srv)
+{
+	Npwpool *wp = srv->wpool;
+
+	if (!wp)
+		return;
+	xpthread_mutex_lock(&wp->lock);
+	wp->shutdown = 1;
+	xpthread_cond_broadcast(&wp->cond);
+	while (wp->nwthread > 0)
+		xpthread_cond_wait(&wp->exitcond, &wp->lock);
+	xpthread_mutex_unlock(&wp->lock);
+	NP_ASSERT (wp->ready_first == NULL);
+	pthread_cond_destroy (&wp->cond);
+	pthread_cond_destroy (&wp->exitcond);
+	pthread_mutex_destroy (&wp->lock);
+	free (wp);
+	srv->wpool = NULL;
+}
+
+/* Adjust worker pool limits.  Arguments <= 0 leave a limit unchanged.
+ */
+int
+np_srv_set_wthreads(Npsrv *srv, int min, int max, int tpool_max,
+		    int idle_timeout)
+{
+	Npwpool *wp = srv->wpool;
+	int ret = -1;
+
+	xpthread_mutex_lock(&wp->lock);
+	if (min <= 0)
+		min = wp->min;
+	if (max <= 0)
+		max = wp->max < min ? min : wp->max;
+	if (max < min) {
+		np_uerror (EINVAL);
+		goto done;
+	}
+	wp->min = min;
+	wp->max = max;
+	if (tpool_max > 0)
+		wp->tpool_max = tpool_max;
+	if (idle_timeout > 0)
+		wp->idle_timeout = idle_timeout;
+	while (wp->nwthread < wp->min) {
+		if (np_wthread_create(wp) < 0)
+			goto done;
+	}
+	/* let idle workers above the new minimum time out */
+	xpthread_cond_broadcast(&wp->cond);
+	ret = 0;
+done:
+	xpthread_mutex_unlock(&wp->lock);
+	return ret;
+}
+
+/* Set flow control limits on outstanding requests and their tcall bytes,
+ * per connection and for the server as a whole.  Zero means unlimited.
+ * Set these before accepting connections.
+ */
+void
+np_srv_set_credit(Npsrv *srv, int conn_maxreqs, u64 conn_maxbytes,
+		  int maxreqs, u64 maxbytes)
+{
+	srv->conn_maxreqs = conn_maxreqs;
+	srv->conn_maxbytes = conn_maxbytes;
+	srv->maxreqs = maxreqs;
+	srv->maxbytes = maxbytes;
+}
+
+static void
+np_tpool_destroy(Nptpool *tp)
+{
+	Npflow *fl;
+
+	NP_ASSERT (tp->ready == 0);
+	NP_ASSERT (tp->nqueued == 0 && tp->workreqs == NULL);
+	while ((fl = tp->freeflows)) {
+		tp->freeflows = fl->hnext;
+		free (fl);
+	}
+	pthread_mutex_destroy (&tp->reqlock);
+	pthread_mutex_destroy (&tp->worklock);
 	pthread_mutex_destroy (&tp->lock);
+	if (tp->shards)
+		free (tp->shards);
 	if (tp->name)
 		free (tp->name);
 	free (tp);
@@ -300,18 +719,18 @@ np_tpool_create(Npsrv *srv, char *name)
 		goto error;
 	}
 	memset (tp, 0, sizeof (*tp));
+	pthread_mutex_init(&tp->lock, NULL);
+	pthread_mutex_init(&tp->reqlock, NULL);
+	pthread_mutex_init(&tp->worklock, NULL);
 	if (!(tp->name = strdup (name))) {
 		np_uerror (ENOMEM);
 		goto error;
 	}
 	tp->srv = srv;
 	tp->refcount = 0;
-	pthread_mutex_init(&tp->lock, NULL);
-	pthread_cond_init(&tp->reqcond, NULL);
-	for(tp->nwthread = 0; tp->nwthread < srv->nwthread; tp->nwthread++) {
-		if (np_wthread_create(tp) < 0)
-			goto error;
-	}
+	tp->meta_credit = srv->wpool->meta_weight;
+	if (np_tpool_stats_init (tp) < 0)
+		goto error;
 	return tp;
 error:
 	if (tp)
@@ -329,6 +748,31 @@ np_tpool_incref (Nptpool *tp)
 	xpthread_mutex_unlock (&tp->lock);
 }
 
+/* Fids' references are also counted in nfids, since requests hold
+ * references too and the tpools ctl file reports the number of fids.
+ */
+void
+np_tpool_incref_fid (Nptpool *tp)
+{
+	if (!tp)
+		return;
+	xpthread_mutex_lock (&tp->lock);
+	tp->refcount++;
+	tp->nfids++;
+	xpthread_mutex_unlock (&tp->lock);
+}
+
+void
+np_tpool_decref_fid (Nptpool *tp)
+{
+	if (!tp)
+		return;
+	xpthread_mutex_lock (&tp->lock);
+	tp->refcount--;
+	tp->nfids--;
+	xpthread_mutex_unlock (&tp->lock);
+}
+
 void
 np_tpool_select (Npreq *req)
 {
@@ -360,7 +804,7 @@ np_tpool_select (Npreq *req)
 			np_logerr (srv, "np_tpool_create %s", req->fid->aname);
 	}
 	if (tp) {
-		np_tpool_incref (tp);
+		np_tpool_incref_fid (tp);
 		req->fid->tpool = tp;
 	}
 	xpthread_mutex_unlock (&srv->lock);
@@ -549,12 +993,108 @@ _hbin (u64 val)
 	return j < NPSTATS_RWCOUNT_BINS ? j : NPSTATS_RWCOUNT_BINS - 1;
 }
 
+/* Request statistics are counted in per-CPU shards with relaxed atomic
+ * adds, so the hot path takes no lock and rarely shares a cache line with
+ * another CPU.  Shards are only summed when the tpools ctl file is read.
+ */
+#define STATS_MAXSHARDS	64
+
+static int
+np_tpool_stats_init (Nptpool *tp)
+{
+	long ncpu = sysconf (_SC_NPROCESSORS_CONF);
+	size_t size;
+	void *p;
+
+	tp->nshards = ncpu < 1 ? 1 : ncpu > STATS_MAXSHARDS ? STATS_MAXSHARDS
+							     : ncpu;
+	size = tp->nshards * sizeof (Npstatshard);
+	if (posix_memalign (&p, __alignof__ (Npstatshard), size) != 0) {
+		np_uerror (ENOMEM);
+		return -1;
+	}
+	memset (p, 0, size);
+	tp->shards = p;
+	return 0;
+}
+
+static inline Npstats *
+_stats_shard (Nptpool *tp)
+{
+#if HAVE_SCHED_GETCPU
+	int cpu = sched_getcpu ();
+
+	if (cpu >= 0)
+		return &tp->shards[cpu % tp->nshards].s;
+#endif
+	return &tp->shards[((uintptr_t)pthread_self () >> 6) % tp->nshards].s;
+}
+
+void
+np_tpool_stats_count (Nptpool *tp, u8 type, u64 rbytes, u64 wbytes)
+{
+	Npstats *sp = _stats_shard (tp);
+
+	if (rbytes > 0) {
+		__atomic_fetch_add (&sp->rcount[_hbin(rbytes)], 1,
+				    __ATOMIC_RELAXED);
+		__atomic_fetch_add (&sp->rbytes, rbytes, __ATOMIC_RELAXED);
+	}
+	if (wbytes > 0) {
+		__atomic_fetch_add (&sp->wcount[_hbin(wbytes)], 1,
+				    __ATOMIC_RELAXED);
+		__atomic_fetch_add (&sp->wbytes, wbytes, __ATOMIC_RELAXED);
+	}
+	__atomic_fetch_add (&sp->nreqs[type], 1, __ATOMIC_RELAXED);
+}
+
+static void
+np_tpool_stats_sum (Nptpool *tp)
+{
+	Npstats *sp;
+	int i, j;
+
+	memset (tp->stats.nreqs, 0, sizeof (tp->stats.nreqs));
+	memset (tp->stats.rcount, 0, sizeof (tp->stats.rcount));
+	memset (tp->stats.wcount, 0, sizeof (tp->stats.wcount));
+	tp->stats.rbytes = tp->stats.wbytes = 0;
+	for (i = 0; i < tp->nshards; i++) {
+		sp = &tp->shards[i].s;
+		for (j = 0; j <= Rwstat; j++)
+			tp->stats.nreqs[j] += __atomic_load_n (&sp->nreqs[j],
+							__ATOMIC_RELAXED);
+		for (j = 0; j < NPSTATS_RWCOUNT_BINS; j++) {
+			tp->stats.rcount[j] += __atomic_load_n (&sp->rcount[j],
+							__ATOMIC_RELAXED);
+			tp->stats.wcount[j] += __atomic_load_n (&sp->wcount[j],
+							__ATOMIC_RELAXED);
+		}
+		tp->stats.rbytes += __atomic_load_n (&sp->rbytes,
+						     __ATOMIC_RELAXED);
+		tp->stats.wbytes += __atomic_load_n (&sp->wbytes,
+						     __ATOMIC_RELAXED);
+	}
+}
+
+/* Count a request in tp's stats, with the bytes moved by a read or write.
+ */
+static void
+np_tpool_stats_count_req(Nptpool *tp, Npfcall *tc, Npfcall *rc)
+{
+	u64 rbytes = 0, wbytes = 0;
+
+	if (rc && tc->type == Tread)
+		rbytes = rc->u.rread.count;
+	else if (rc && tc->type == Twrite)
+		wbytes = rc->u.rwrite.count;
+	np_tpool_stats_count (tp, tc->type, rbytes, wbytes);
+}
+
 static Npfcall*
 np_process_request(Npreq *req, Nptpool *tp)
 {
 	Npfcall *rc = NULL;
 	Npfcall *tc = req->tcall;
-	u64 rbytes = 0, wbytes = 0;
 
 	np_uerror(0);
 	switch (tc->type) {
@@ -632,13 +1172,9 @@ np_process_request(Npreq *req, Nptpool *tp)
 			break;
 		case Tread:
 			rc = np_read(req, tc);
-			if (rc)
-				rbytes = rc->u.rread.count;
 			break;
 		case Twrite:
 			rc = np_write(req, tc);
-			if (rc)
-				wbytes = rc->u.rwrite.count;
 			break;
 		case Tclunk:
 			rc = np_clunk(req, tc);
@@ -651,18 +1187,9 @@ np_process_request(Npreq *req, Nptpool *tp)
 			break;
 	}
 
-	/* update stats */
-	xpthread_mutex_lock (&tp->srv->lock);
-	if (rbytes > 0) {
-		tp->stats.rcount[_hbin(rbytes)]++;
-		tp->stats.rbytes += rbytes;
-	}
-	if (wbytes > 0) {
-		tp->stats.wcount[_hbin(wbytes)]++;
-		tp->stats.wbytes += wbytes;
-	}
-	tp->stats.nreqs[tc->type]++;
-	xpthread_mutex_unlock (&tp->srv->lock);
+	/* a deferred request is counted when it completes */
+	if (!req->deferred)
+		np_tpool_stats_count_req (tp, tc, rc);
 
 	return rc;
 }
@@ -702,11 +1229,12 @@ np_postprocess_request(Npreq *req, Npfcall *rc)
 		np_fid_decref (&req->fid);
 		req->fid = NULL;
 	}
-	/* Send the response.
+	/* Send the response.  From here on the client may reuse the tag.
 	 */
+	__atomic_store_n(&req->responded, 1, __ATOMIC_RELEASE);
 	if (ecode) {
 		if (rc)
-			free(rc);
+			np_free_fcall(rc);
 		np_req_respond_error(req, ecode);
 	} else
 		np_req_respond(req, rc);
@@ -728,43 +1256,155 @@ np_postprocess_flush (Npreq *req)
 	}
 }
 
-static void *
-np_wthread_proc(void *a)
+/* Take the next request from tp and work on it.
+ */
+static void
+np_wthread_work(Npwthread *wt, Nptpool *tp)
 {
-	Npwthread *wt = (Npwthread *)a;
-	Nptpool *tp = wt->tpool;
-	Npreq *req = NULL;
+	Npwpool *wp = wt->wpool;
+	Npreq *req;
 	Npfcall *rc;
+	int deferred;
 
-	xpthread_mutex_lock(&tp->srv->lock);
-	while (!wt->shutdown) {
-		req = tp->reqs_first;
-		if (!req) {
-			xpthread_cond_wait(&tp->reqcond, &tp->srv->lock);
-			continue;
-		}
-		np_srv_remove_req(tp, req);
+	xpthread_mutex_lock(&tp->reqlock);
+	if ((req = np_tpool_next_req(tp))) {
+		xpthread_mutex_lock(&tp->worklock);
 		np_srv_add_workreq(tp, req);
 		req->wthread = wt;
-		xpthread_mutex_unlock(&tp->srv->lock);
+		xpthread_mutex_unlock(&tp->worklock);
+		tp->nactive++;
+	}
+	/* go to the back of the line if there is more work */
+	if (tp->nqueued > 0 && tp->nactive < wp->tpool_max)
+		np_tpool_ready(tp);
+	else
+		tp->ready = 0;
+	xpthread_mutex_unlock(&tp->reqlock);
+	/* N.B. keep the ready list reference until done with tp, since
+	 * a Tclunk may drop the last fid reference while in progress.
+	 */
+	if (!req)
+		goto done;
 
-		rc = np_process_request(req, tp);
+	rc = np_process_request(req, tp);
+	/* A deferred request stays in workreqs until np_req_complete(),
+	 * but no longer occupies this thread.
+	 */
+	deferred = req->deferred;
+	xpthread_mutex_lock(&tp->worklock);
+	if (deferred)
+		req->wthread = NULL;
+	xpthread_mutex_unlock(&tp->worklock);
+	if (!deferred) {
 		np_postprocess_request (req, rc);
 
-		xpthread_mutex_lock(&tp->srv->lock);
+		xpthread_mutex_lock(&tp->worklock);
 		np_srv_remove_workreq(tp, req);
-		xpthread_mutex_unlock(&tp->srv->lock);
+		np_conn_remove_req(req->conn, req);
+		xpthread_mutex_unlock(&tp->worklock);
+	}
+
+	xpthread_mutex_lock(&tp->reqlock);
+	tp->nactive--;
+	if (!tp->ready && tp->nqueued > 0)
+		np_tpool_ready(tp);
+	xpthread_mutex_unlock(&tp->reqlock);
 
+	if (!deferred)
 		np_postprocess_flush (req);
-		np_req_unref(req);
+	np_req_unref(req);
+done:
+	np_tpool_decref (tp);
+}
+
+/* Every idle_timeout seconds, ask as many workers to exit as were idle
+ * for that whole period, keeping at least min.  Going by the fewest idle
+ * workers over the period rather than by how long each worker waited
+ * means a light load that wakes idle workers in turn still lets the
+ * pool shrink.
+ */
+static void
+_shrink_check (Npwpool *wp)
+{
+	time_t now = time (NULL);
+	int n;
 
-		xpthread_mutex_lock(&tp->srv->lock);
+	/* assert: wp->lock held */
+	if (wp->nidle < wp->idle_lwm)
+		wp->idle_lwm = wp->nidle;
+	if (now < wp->shrink_time)
+		return;
+	n = wp->nwthread - wp->min;
+	if (n > wp->idle_lwm)
+		n = wp->idle_lwm;
+	if (n > 0) {
+		wp->nexit = n;
+		xpthread_cond_broadcast(&wp->cond);
 	}
-	xpthread_mutex_unlock (&tp->srv->lock);
+	wp->idle_lwm = wp->nidle;
+	wp->shrink_time = now + wp->idle_timeout;
+}
+
+static void
+_idle_wait (Npwpool *wp)
+{
+	struct timespec ts;
+	int err;
+
+	/* assert: wp->lock held */
+	clock_gettime (CLOCK_REALTIME, &ts);
+	ts.tv_sec += wp->idle_timeout;
+	wp->nidle++;
+	err = pthread_cond_timedwait(&wp->cond, &wp->lock, &ts);
+	wp->nidle--;
+	NP_ASSERT (err == 0 || err == ETIMEDOUT);
+	_shrink_check (wp);
+}
+
+/* Workers serve ready tpools round-robin, one request per turn.
+ * A worker that has just been started or woken may find the ready list
+ * already emptied by another worker; it just goes back to waiting.
+ */
+static void *
+np_wthread_proc(void *a)
+{
+	Npwthread *wt = (Npwthread *)a;
+	Npwpool *wp = wt->wpool;
+	Nptpool *tp;
+
+	pthread_detach(pthread_self());
+	xpthread_mutex_lock(&wp->lock);
+	/* N.B. on shutdown, drain the ready list to drop its references */
+	while (!wp->shutdown || wp->ready_first) {
+		if (!(tp = wp->ready_first)) {
+			if (wp->nexit > 0 && wp->nwthread > wp->min) {
+				wp->nexit--;
+				break;
+			}
+			_idle_wait (wp);
+			continue;
+		}
+		wp->ready_first = tp->ready_next;
+		if (!wp->ready_first)
+			wp->ready_last = NULL;
+		tp->ready_next = NULL;
+		wp->nready--;
+		xpthread_mutex_unlock(&wp->lock);
+
+		np_wthread_work(wt, tp);
+
+		xpthread_mutex_lock(&wp->lock);
+	}
+	np_wthread_remove(wp, wt);
+	xpthread_mutex_unlock (&wp->lock);
+	free (wt);
 
 	return NULL;
 }
 
+/* Send rc, which is handed over to the connection's send queue.
+ * If the request is not to be answered, rc is freed with the request.
+ */
 void
 np_req_respond(Npreq *req, Npfcall *rc)
 {
@@ -779,36 +1419,96 @@ np_req_respond(Npreq *req, Npfcall *rc)
 	xpthread_mutex_unlock(&req->lock);
 }
 
+/* Send rc, which is in a stack buffer, without queueing it.
+ */
+static void
+np_req_respond_static(Npreq *req, Npfcall *rc)
+{
+	xpthread_mutex_lock(&req->lock);
+	if (req->state == REQ_NORMAL) {
+		np_set_tag(rc, req->tag);
+		np_conn_respond_now(req->conn, rc);
+	}
+	xpthread_mutex_unlock(&req->lock);
+}
+
+/* N.B. error and flush responses fall back to a stack buffer so they
+ * can be sent when out of memory.
+ */
 void
 np_req_respond_error(Npreq *req, int ecode)
 {
 	char buf[STATIC_RLERROR_SIZE];
-	Npfcall *rc = np_create_rlerror_static(ecode, buf, sizeof(buf));
+	Npfcall *rc;
 
-	np_req_respond (req, rc);
-	req->rcall = NULL;
+	if ((rc = np_create_rlerror(ecode)))
+		np_req_respond (req, rc);
+	else
+		np_req_respond_static (req, np_create_rlerror_static(ecode, buf,
+								sizeof(buf)));
 }
 
 void
 np_req_respond_flush(Npreq *req)
 {
 	char buf[STATIC_RFLUSH_SIZE];
-	Npfcall *rc = np_create_rflush_static(buf, sizeof(buf));
+	Npfcall *rc;
 
-	np_req_respond (req, rc);
-	req->rcall = NULL;
+	if ((rc = np_create_rflush()))
+		np_req_respond (req, rc);
+	else
+		np_req_respond_static (req, np_create_rflush_static(buf,
+								sizeof(buf)));
+}
+
+/* A request handler that will finish the request later, e.g. when
+ * asynchronous I/O completes, calls np_req_defer() and returns NULL
+ * without setting an error.  The worker thread then moves on to other
+ * requests.  Some thread must eventually call np_req_complete() with the
+ * response or an error code, which is handled as if the handler had
+ * returned it.  A deferred request can't be interrupted by a flush
+ * signal; its Rflush, if any, follows the response as usual.
+ */
+void
+np_req_defer(Npreq *req)
+{
+	NP_ASSERT (req->tpool != NULL && !req->deferred);
+	np_req_ref(req);
+	np_tpool_incref(req->tpool);
+	req->deferred = 1;
+}
+
+void
+np_req_complete(Npreq *req, Npfcall *rc, int ecode)
+{
+	Nptpool *tp = req->tpool;
+
+	NP_ASSERT (req->deferred);
+	np_uerror(ecode);
+	np_tpool_stats_count_req (tp, req->tcall, ecode ? NULL : rc);
+	np_postprocess_request (req, rc);
+
+	xpthread_mutex_lock(&tp->worklock);
+	np_srv_remove_workreq(tp, req);
+	np_conn_remove_req(req->conn, req);
+	xpthread_mutex_unlock(&tp->worklock);
+
+	np_postprocess_flush (req);
+	np_req_unref(req);
+	np_tpool_decref (tp);
 }
 
 Npreq *
 np_req_alloc(Npconn *conn, Npfcall *tc) {
 	Npreq *req;
 
-	req = malloc(sizeof(*req));
-	if (!req)
-		return NULL;
-
-	np_conn_incref(conn);
-	pthread_mutex_init(&req->lock, NULL);
+	if (!(req = np_conn_req_add(conn, tc->size))) {
+		if (!(req = malloc(sizeof(*req)))) {
+			np_conn_req_done(conn, tc->size, NULL);
+			return NULL;
+		}
+		pthread_mutex_init(&req->lock, NULL);
+	}
 	req->refcount = 1;
 	req->conn = conn;
 	req->tag = tc->tag;
@@ -819,6 +1519,12 @@ np_req_alloc(Npconn *conn, Npfcall *tc) {
 	req->next = NULL;
 	req->prev = NULL;
 	req->wthread = NULL;
+	req->tpool = NULL;
+	req->deferred = 0;
+	req->tnext = req->tprev = NULL;
+	req->lnext = req->lprev = NULL;
+	req->indexed = 0;
+	req->responded = 0;
 	req->fid = NULL;
 	req->birth = time (NULL);
 
@@ -830,46 +1536,41 @@ np_req_alloc(Npconn *conn, Npfcall *tc) {
 Npreq *
 np_req_ref(Npreq *req)
 {
-	xpthread_mutex_lock(&req->lock);
-	req->refcount++;
-	xpthread_mutex_unlock(&req->lock);
+	__atomic_add_fetch(&req->refcount, 1, __ATOMIC_RELAXED);
 	return req;
 }
 
+/* N.B. the last reference hands req back to its connection for reuse.
+ */
 void
 np_req_unref(Npreq *req)
 {
-	xpthread_mutex_lock(&req->lock);
-	NP_ASSERT (req->refcount > 0);
-	req->refcount--;
-	if (req->refcount) {
-		xpthread_mutex_unlock(&req->lock);
+	Npconn *conn = req->conn;
+	u32 bytes = req->tcall->size;
+	int n;
+
+	n = __atomic_sub_fetch(&req->refcount, 1, __ATOMIC_ACQ_REL);
+	NP_ASSERT (n >= 0);
+	if (n > 0)
 		return;
-	}
-	xpthread_mutex_unlock(&req->lock);
 
+	NP_ASSERT (!req->indexed);
 	if (req->fid) {
 		np_fid_decref (&req->fid);
 		req->fid = NULL;
 	}
-	if (req->flushreq)
+	if (req->flushreq) {
 		np_req_unref(req->flushreq);
-	if (req->conn) {
-		np_conn_decref(req->conn);
-		req->conn = NULL;
-	}
-	if (req->tcall) {
-		free (req->tcall);
-		req->tcall = NULL;
+		req->flushreq = NULL;
 	}
 	if (req->rcall) {
-		free (req->rcall);
+		np_free_fcall (req->rcall);
 		req->rcall = NULL;
 	}
-	pthread_mutex_destroy (&req->lock);
-
-	if (req)
-		free(req);
+	np_free_fcall (req->tcall);
+	req->tcall = NULL;
+	req->conn = NULL;
+	np_conn_req_done(conn, bytes, req);
 }
 
 void
@@ -956,6 +1657,106 @@ error_unlock:
 	return NULL;
 }
 
+/* ctl "wthreads" file:
+ *   nwthread nidle min max tpool_max
+ */
+static char *
+_ctl_get_wthreads (char *name, void *a)
+{
+	Npsrv *srv = (Npsrv *)a;
+	Npwpool *wp = srv->wpool;
+	char *s = NULL;
+	int len = 0;
+
+	xpthread_mutex_lock(&wp->lock);
+	if (aspf (&s, &len, "%d %d %d %d %d\n", wp->nwthread, wp->nidle,
+		  wp->min, wp->max, wp->tpool_max) < 0)
+		np_uerror (ENOMEM);
+	xpthread_mutex_unlock(&wp->lock);
+	return s;
+}
+
+/* ctl "sched" file, one line per tpool lane:
+ *   tpool lane depth nreqs wait_usec wait_max_usec nflows
+ * where nreqs and wait_usec are cumulative over dequeued requests.
+ */
+static char *
+_ctl_get_sched (char *name, void *a)
+{
+	static const char *lane_names[NP_NLANES] = { "meta", "bulk" };
+	Npsrv *srv = (Npsrv *)a;
+	Nptpool *tp;
+	Nplane *lp;
+	char *s = NULL;
+	int i, len = 0;
+
+	xpthread_mutex_lock(&srv->lock);
+	for (tp = srv->tpool; tp != NULL; tp = tp->next) {
+		xpthread_mutex_lock (&tp->reqlock);
+		for (i = 0; i < NP_NLANES; i++) {
+			lp = &tp->lanes[i];
+			if (aspf (&s, &len, "%s %s %d %"PRIu64" %"PRIu64
+				  " %"PRIu64" %d\n", tp->name, lane_names[i],
+				  lp->depth, lp->nreqs, lp->wait_usec,
+				  lp->wait_max_usec, lp->nflows) < 0) {
+				xpthread_mutex_unlock (&tp->reqlock);
+				np_uerror (ENOMEM);
+				goto error_unlock;
+			}
+		}
+		xpthread_mutex_unlock (&tp->reqlock);
+	}
+	xpthread_mutex_unlock(&srv->lock);
+	return s;
+error_unlock:
+	xpthread_mutex_unlock(&srv->lock);
+	if (s)
+		free(s);
+	return NULL;
+}
+
+/* ctl "credit" file:
+ *   nreqs reqbytes maxreqs maxbytes conn_maxreqs conn_maxbytes
+ *   conn_throttles srv_throttles
+ */
+static char *
+_ctl_get_credit (char *name, void *a)
+{
+	Npsrv *srv = (Npsrv *)a;
+	char *s = NULL;
+	int len = 0;
+
+	xpthread_mutex_lock(&srv->fclock);
+	if (aspf (&s, &len, "%d %"PRIu64" %d %"PRIu64" %d %"PRIu64
+		  " %"PRIu64" %"PRIu64"\n",
+		  __atomic_load_n(&srv->nreqs, __ATOMIC_RELAXED),
+		  __atomic_load_n(&srv->reqbytes, __ATOMIC_RELAXED),
+		  srv->maxreqs, srv->maxbytes,
+		  srv->conn_maxreqs, srv->conn_maxbytes,
+		  __atomic_load_n(&srv->conn_throttles, __ATOMIC_RELAXED),
+		  srv->srv_throttles) < 0)
+		np_uerror (ENOMEM);
+	xpthread_mutex_unlock(&srv->fclock);
+	return s;
+}
+
+/* ctl "sendq" file: transport sends, responses sent, largest batch
+ */
+static char *
+_ctl_get_sendq (char *name, void *a)
+{
+	Npsrv *srv = (Npsrv *)a;
+	char *s = NULL;
+	int len = 0;
+
+	if (aspf (&s, &len, "%"PRIu64" %"PRIu64" %"PRIu64"\n",
+		  __atomic_load_n(&srv->sendq_batches, __ATOMIC_RELAXED),
+		  __atomic_load_n(&srv->sendq_fcalls, __ATOMIC_RELAXED),
+		  __atomic_load_n(&srv->sendq_maxbatch, __ATOMIC_RELAXED)) < 0)
+		np_uerror (ENOMEM);
+	return s;
+}
+
 static char *
 _ctl_get_tpools (char *name, void *a)
 {
@@ -969,13 +1770,17 @@ _ctl_get_tpools (char *name, void *a)
 	for (tp = srv->tpool; tp != NULL; tp = tp->next) {
 		tp->stats.name = tp->name;
 		xpthread_mutex_lock (&tp->lock);
-		tp->stats.numfids = tp->refcount;
+		tp->stats.numfids = tp->nfids;
 		xpthread_mutex_unlock (&tp->lock);
 		tp->stats.numreqs = 0;
-		for (req = tp->reqs_first; req != NULL; req = req->next)
-			tp->stats.numreqs++;
+		xpthread_mutex_lock (&tp->reqlock);
+		tp->stats.numreqs += tp->nqueued;
+		xpthread_mutex_unlock (&tp->reqlock);
+		xpthread_mutex_lock (&tp->worklock);
 		for (req = tp->workreqs; req != NULL; req = req->next)
 			tp->stats.numreqs++;
+		xpthread_mutex_unlock (&tp->worklock);
+		np_tpool_stats_sum (tp);
 		n = np_encode_tpools_str (&s, &len, &tp->stats);
 		if (n < 0) {
 			np_uerror (ENOMEM);
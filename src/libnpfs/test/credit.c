@@ -0,0 +1,178 @@
+/*************************************************************\
+ * Copyright (C) 2010 by Lawrence Livermore National Security, LLC.
+ *
+ * This file is part of npfs, a framework for 9P synthetic file systems.
+ * For details see https://sourceforge.net/projects/npfs.
+ *
+ * SPDX-License-Identifier: MIT
+ *************************************************************/
+
+/* flow control: limits on outstanding requests per connection and server
+ *
+ * Clients write a batch of Tattach requests, which block in the server's
+ * attach hook until released, and the number that the server has read
+ * off the wire and started is compared with the configured limits.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include "npfs.h"
+#include "npfsimpl.h"
+
+#include "src/libtap/tap.h"
+#include "src/libtest/conn.h"
+
+#define TEST_MSIZE  8192
+#define MAXCONNS    4
+
+/* Wait for 'want' attaches to be active, then give the server a chance
+ * to read more than it should.
+ */
+static int wait_active (int want)
+{
+    int n;
+
+    (void)test_attach_wait (want);
+    usleep (200000);
+    n = test_attach_active ();
+    if (n != want)
+        diag ("%d attaches active, expected %d", n, want);
+    return n;
+}
+
+static int get_throttles (Npsrv *srv, uint64_t *conn_throttles,
+                          uint64_t *srv_throttles)
+{
+    char *s = test_get_ctl (srv, "credit");
+    int n = 0;
+
+    if (s)
+        n = sscanf (s, "%*d %*u %*d %*u %*d %*u %"SCNu64" %"SCNu64,
+                    conn_throttles, srv_throttles);
+    free (s);
+    return n == 2 ? 0 : -1;
+}
+
+static u32 attach_size (void)
+{
+    Npfcall *tc;
+    u32 size;
+
+    if (!(tc = np_create_tattach (1, NOFID, NULL, "/", 0)))
+        BAIL_OUT ("out of memory");
+    size = tc->size;
+    np_free_fcall (tc);
+    return size;
+}
+
+/* Start a server with the given limits, send 'nreqs' Tattach requests
+ * on each of 'nconns' connections, and return how many the server
+ * started before it stopped reading.  All requests are then released and
+ * their responses checked.
+ */
+static int run (int nrthread, int conn_maxreqs, u64 conn_maxbytes,
+                int maxreqs, int nconns, int nreqs,
+                uint64_t *conn_throttles, uint64_t *srv_throttles)
+{
+    Npsrv *srv;
+    Nptrans *client[MAXCONNS];
+    Npfcall *tc, *rc;
+    int i, j, n, errors = 0;
+
+    test_attach_hold ();
+
+    if (!(srv = np_srv_create (nconns * nreqs, 0)))
+        BAIL_OUT ("np_srv_create: %s", strerror (np_rerror ()));
+    srv->logmsg = NULL;
+    srv->attach = test_attach;
+    srv->clunk = test_clunk;
+    if (nrthread > 0 && np_reactor_create (srv, nrthread) < 0)
+        BAIL_OUT ("np_reactor_create: %s", strerror (np_rerror ()));
+    np_srv_set_credit (srv, conn_maxreqs, conn_maxbytes, maxreqs, 0);
+
+    for (i = 0; i < nconns; i++)
+        client[i] = test_connect_client (srv, "credit-test-client",
+                                         TEST_MSIZE, NULL);
+    for (i = 0; i < nconns; i++) {
+        for (j = 0; j < nreqs; j++) {
+            if (!(tc = np_create_tattach (j + 1, NOFID, NULL, "/", 0)))
+                BAIL_OUT ("out of memory");
+            np_set_tag (tc, j + 1);
+            if (np_trans_send (client[i], tc) < 0)
+                BAIL_OUT ("send: %s", strerror (np_rerror ()));
+            np_free_fcall (tc);
+        }
+    }
+    n = wait_active (conn_maxreqs > 0 ? nconns * conn_maxreqs
+                   : maxreqs > 0 ? maxreqs
+                   : conn_maxbytes > 0 ? conn_maxbytes / attach_size () * nconns
+                   : nconns * nreqs);
+    if (get_throttles (srv, conn_throttles, srv_throttles) < 0)
+        BAIL_OUT ("could not read credit ctl file");
+
+    test_attach_release ();
+    for (i = 0; i < nconns; i++) {
+        for (j = 0; j < nreqs; j++) {
+            rc = NULL;
+            if (np_trans_recv (client[i], &rc, TEST_MSIZE) < 0 || !rc
+                                                || rc->type != Rattach)
+                errors++;
+            np_free_fcall (rc);
+        }
+        np_trans_destroy (client[i]); /* closes fd */
+    }
+    if (errors > 0)
+        diag ("%d requests did not get a Rattach", errors);
+    np_srv_wait_conncount (srv, nconns);
+    np_srv_destroy (srv);
+    return errors > 0 ? -1 : n;
+}
+
+int main (int argc, char *argv[])
+{
+    uint64_t ct, st;
+    int reactor = 1;
+    Npsrv *srv;
+
+    plan (NO_PLAN);
+
+    if (!(srv = np_srv_create (1, 0)))
+        BAIL_OUT ("np_srv_create: %s", strerror (np_rerror ()));
+    if (np_reactor_create (srv, 1) < 0) {
+        if (np_rerror () != ENOSYS)
+            BAIL_OUT ("np_reactor_create: %s", strerror (np_rerror ()));
+        reactor = 0;
+    }
+    np_srv_destroy (srv);
+
+    ok (run (0, 0, 0, 0, 1, 8, &ct, &st) == 8 && ct == 0 && st == 0,
+        "without limits, all 8 requests are started");
+    ok (run (0, 4, 0, 0, 2, 8, &ct, &st) == 8 && ct > 0 && st == 0,
+        "thread reader: 4 requests per connection are started");
+    ok (run (0, 0, 2 * attach_size (), 0, 2, 8, &ct, &st) == 4 && ct > 0,
+        "thread reader: 2 requests' worth of bytes per connection");
+    skip (!reactor, 3, "reactor is not supported on this platform");
+    ok (run (1, 4, 0, 0, 2, 8, &ct, &st) == 8 && ct > 0 && st == 0,
+        "reactor: 4 requests per connection are started");
+    ok (run (1, 0, 2 * attach_size (), 0, 2, 8, &ct, &st) == 4 && ct > 0,
+        "reactor: 2 requests' worth of bytes per connection");
+    ok (run (1, 0, 0, 3, 3, 4, &ct, &st) == 3 && ct == 0 && st > 0,
+        "reactor: 3 requests are started for the whole server");
+    end_skip;
+
+    done_testing ();
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
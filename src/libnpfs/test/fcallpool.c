@@ -0,0 +1,173 @@
+/*************************************************************\
+ * Copyright (C) 2010 by Lawrence Livermore National Security, LLC.
+ *
+ * This file is part of npfs, a framework for 9P synthetic file systems.
+ * For details see https://sourceforge.net/projects/npfs.
+ *
+ * SPDX-License-Identifier: MIT
+ *************************************************************/
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include "npfs.h"
+#include "npfsimpl.h"
+
+#include "src/libtap/tap.h"
+
+/* Look up hits and misses for the class of the given size in
+ * the fcallpool ctl file content.
+ */
+static int get_class_stats (const char *s, u32 size, uint64_t *hits,
+                            uint64_t *misses)
+{
+    const char *p = s;
+    unsigned int csize;
+    int count;
+
+    while (p && *p) {
+        if (sscanf (p, "%u %d %"SCNu64" %"SCNu64,
+                    &csize, &count, hits, misses) != 4)
+            return -1;
+        if (csize == size)
+            return 0;
+        if ((p = strchr (p, '\n')))
+            p++;
+    }
+    return -1;
+}
+
+static int is_aligned (void *p)
+{
+    return (uintptr_t)p % sysconf (_SC_PAGESIZE) == 0;
+}
+
+/* Send a Twrite over a socketpair and check that fdtrans receives its
+ * payload page aligned.
+ */
+static void test_twrite_recv (void)
+{
+    u8 data[65536];
+    Nptrans *t[2];
+    Npfcall *tc, *rc = NULL;
+    int i, s[2];
+
+    for (i = 0; i < sizeof (data); i++)
+        data[i] = i;
+    if (socketpair (AF_LOCAL, SOCK_STREAM, 0, s) < 0)
+        BAIL_OUT ("socketpair: %s", strerror (errno));
+    if (!(t[0] = np_fdtrans_create (s[0], s[0]))
+            || !(t[1] = np_fdtrans_create (s[1], s[1])))
+        BAIL_OUT ("np_fdtrans_create: %s", strerror (np_rerror ()));
+    if (!(tc = np_create_twrite (1, 0, sizeof (data), data)))
+        BAIL_OUT ("out of memory");
+    np_set_tag (tc, 1);
+    ok (np_trans_send (t[0], tc) == tc->size
+        && np_trans_recv (t[1], &rc, 2*1048576) == 0 && rc != NULL,
+        "sent and received a 64K Twrite");
+    ok (rc && rc->type == Twrite && rc->u.twrite.count == sizeof (data)
+           && memcmp (rc->u.twrite.data, data, sizeof (data)) == 0,
+        "received Twrite is intact");
+    ok (rc && is_aligned (rc->u.twrite.data),
+        "received Twrite payload is page aligned");
+    np_free_fcall (tc);
+    np_free_fcall (rc);
+    np_trans_destroy (t[0]);
+    np_trans_destroy (t[1]);
+}
+
+int main (int argc, char *argv[])
+{
+    Npfcall *fc, *fc2, *big;
+    Npfcall *rc;
+    uint64_t hits, misses, hits2, misses2;
+    char *s;
+
+    plan (NO_PLAN);
+
+    np_fcallpool_flush ();
+
+    s = np_fcallpool_ctl_get ("fcallpool", NULL);
+    ok (s != NULL, "np_fcallpool_ctl_get works");
+    ok (get_class_stats (s, 1024, &hits, &misses) == 0,
+        "ctl output has a 1K class");
+    ok (get_class_stats (s, 1048576, &hits, &misses) == 0,
+        "ctl output has a 1M class");
+    ok (get_class_stats (s, 2048, &hits, &misses) == 0,
+        "ctl output has a 2K class");
+    free (s);
+
+    fc = np_alloc_fcall (1500);
+    ok (fc != NULL && fc->size == 1500 && fc->pool >= 0,
+        "np_alloc_fcall 1500 returns a pooled fcall");
+    memset (fc->pkt, 0xff, 2048);
+    np_free_fcall (fc);
+
+    fc2 = np_alloc_fcall (2000);
+    ok (fc2 == fc, "np_alloc_fcall 2000 reuses the freed 2K buffer");
+    ok (fc2->pkt == (u8 *)fc2 + sizeof (*fc2), "recycled pkt is reset");
+
+    s = np_fcallpool_ctl_get ("fcallpool", NULL);
+    ok (s && get_class_stats (s, 2048, &hits2, &misses2) == 0,
+        "read 2K class counters");
+    ok (hits2 == hits + 1 && misses2 == misses + 1,
+        "2K class counted one miss and one hit");
+    free (s);
+    np_free_fcall (fc2);
+
+    big = np_alloc_fcall (2*1048576);
+    ok (big != NULL && big->pool == -1,
+        "np_alloc_fcall larger than largest class is not pooled");
+    np_free_fcall (big);
+
+    rc = np_create_rclunk ();
+    ok (rc != NULL && rc->size == 7 && rc->pool == 0,
+        "np_create_rclunk allocates from the smallest class");
+    np_free_fcall (rc);
+
+    rc = np_alloc_rread (65536);
+    ok (rc != NULL && rc->pool >= 0 && rc->u.rread.count == 65536,
+        "np_alloc_rread 64K allocates from the pool");
+    np_free_fcall (rc);
+
+    fc = malloc (STATIC_RLERROR_SIZE);
+    if (!fc)
+        BAIL_OUT ("out of memory");
+    rc = np_create_rlerror_static (1, fc, STATIC_RLERROR_SIZE);
+    ok (rc != NULL && rc->pool == -1, "static rlerror is not pooled");
+    np_free_fcall (rc); /* frees fc */
+
+    np_free_fcall (NULL);
+    ok (1, "np_free_fcall NULL is a no-op");
+
+    fc = np_alloc_fcall_aligned (65536 + 23, 23);
+    ok (fc != NULL && fc->size == 65536 + 23 && fc->pool >= 0
+                   && is_aligned (fc->pkt + 23),
+        "np_alloc_fcall_aligned returns a pooled fcall with aligned payload");
+    memset (fc->pkt, 0xff, 65536 + 23);
+    np_free_fcall (fc);
+    fc2 = np_alloc_fcall_aligned (40000 + 11, 11);
+    ok (fc2 == fc && is_aligned (fc2->pkt + 11),
+        "np_alloc_fcall_aligned reuses the freed buffer, realigned");
+    np_free_fcall (fc2);
+    big = np_alloc_fcall_aligned (2*1048576, 23);
+    ok (big != NULL && big->pool == -1 && is_aligned (big->pkt + 23),
+        "np_alloc_fcall_aligned larger than largest class is not pooled");
+    np_free_fcall (big);
+
+    test_twrite_recv ();
+
+    np_fcallpool_flush ();
+
+    done_testing ();
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -11,6 +11,7 @@
 #include "config.h"
 #endif
 #include <string.h>
+#include <pthread.h>
 #include "npfs.h"
 
 #include "src/libtap/tap.h"
@@ -23,6 +24,35 @@ void diag_logger (const char *buf)
     fputc ('\n', stderr);
 }
 
+#define NTHREADS    4
+#define NLOOKUPS    100000
+
+typedef struct {
+    Npconn *conn;
+    unsigned long nfids;
+    int errors;
+} Looker;
+
+/* Find a fid and drop the reference, over and over, as workers do.
+ */
+static void *lookup_proc (void *a)
+{
+    Looker *l = a;
+    Npfid *f;
+    int i;
+
+    for (i = 0; i < NLOOKUPS; i++) {
+        if (!(f = np_fid_find (l->conn, i % l->nfids))) {
+            l->errors++;
+            continue;
+        }
+        np_fid_incref (f);
+        np_fid_decref (&f);
+        np_fid_decref (&f);
+    }
+    return NULL;
+}
+
 
 int main (int argc, char *argv[])
 {
@@ -30,6 +60,8 @@ int main (int argc, char *argv[])
     Npconn conn;
     Npfid **fid;
     unsigned long nfids = 1000;
+    Looker l[NTHREADS];
+    pthread_t t[NTHREADS];
     int i, n;
 
     plan (NO_PLAN);
@@ -75,6 +107,16 @@ int main (int argc, char *argv[])
     ok (np_fidpool_count (conn.fidpool) == nfids,
         "np_fidpool_count returns %d", nfids);
 
+    errors = 0;
+    for (i = 0; i < nfids; i++) {
+        Npfid *f = np_fid_find (&conn, i);
+        if (f != fid[i])
+            errors++;
+        if (f)
+            np_fid_decref (&f);
+    }
+    ok (errors == 0, "np_fid_find finds all %d fids", nfids);
+
     for (i = 0; i < nfids; i++) {
         np_fid_decref (&fid[i]);
         np_fid_decref (&fid[i]);
@@ -84,6 +126,31 @@ int main (int argc, char *argv[])
     ok (np_fidpool_count (conn.fidpool) == 0,
         "np_fidpool_count returns 0");
 
+    for (i = 0; i < nfids; i++)
+        fid[i] = np_fid_create (&conn, i);
+    for (i = 0; i < NTHREADS; i++) {
+        l[i].conn = &conn;
+        l[i].nfids = nfids;
+        l[i].errors = 0;
+        if (pthread_create (&t[i], NULL, lookup_proc, &l[i]) != 0)
+            BAIL_OUT ("pthread_create failed");
+    }
+    errors = 0;
+    for (i = 0; i < NTHREADS; i++) {
+        pthread_join (t[i], NULL);
+        errors += l[i].errors;
+    }
+    for (i = 0; i < nfids; i++) {
+        if (fid[i]->refcount != 1)
+            errors++;
+    }
+    ok (errors == 0, "%d threads found and released fids %d times each",
+        NTHREADS, NLOOKUPS);
+    for (i = 0; i < nfids; i++)
+        np_fid_decref (&fid[i]);
+    ok (np_fidpool_count (conn.fidpool) == 0,
+        "np_fidpool_count returns 0");
+
     n = np_fidpool_destroy (conn.fidpool);
     ok (n == 0,
         "np_fidpool_destroy returned 0 (meaning 0 unclunked)", n);
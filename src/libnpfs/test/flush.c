@@ -0,0 +1,178 @@
+/*************************************************************\
+ * Copyright (C) 2010 by Lawrence Livermore National Security, LLC.
+ *
+ * This file is part of npfs, a framework for 9P synthetic file systems.
+ * For details see https://sourceforge.net/projects/npfs.
+ *
+ * SPDX-License-Identifier: MIT
+ *************************************************************/
+
+/* Tflush and connection teardown
+ *
+ * The server runs one request at a time, and Tattach requests block in
+ * the server's attach hook until released, so a test can have one
+ * request in progress and others queued behind it when it sends a Tflush
+ * or hangs up.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include "npfs.h"
+#include "npfsimpl.h"
+
+#include "src/libtap/tap.h"
+#include "src/libtest/conn.h"
+
+#define TEST_MSIZE  8192
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int duptags;
+
+static void test_logmsg (const char *buf)
+{
+    if (strstr (buf, "duplicate tag")) {
+        pthread_mutex_lock (&lock);
+        duptags++;
+        pthread_mutex_unlock (&lock);
+    }
+}
+
+static void send_attach (Nptrans *t, u16 tag, u32 fid)
+{
+    Npfcall *tc;
+
+    if (!(tc = np_create_tattach (fid, NOFID, NULL, "/", 0)))
+        BAIL_OUT ("out of memory");
+    np_set_tag (tc, tag);
+    if (np_trans_send (t, tc) < 0)
+        BAIL_OUT ("send: %s", strerror (np_rerror ()));
+    np_free_fcall (tc);
+}
+
+static void send_flush (Nptrans *t, u16 tag, u16 oldtag)
+{
+    Npfcall *tc;
+
+    if (!(tc = np_create_tflush (oldtag)))
+        BAIL_OUT ("out of memory");
+    np_set_tag (tc, tag);
+    if (np_trans_send (t, tc) < 0)
+        BAIL_OUT ("send: %s", strerror (np_rerror ()));
+    np_free_fcall (tc);
+}
+
+/* Sum the fids counted by the tpools ctl file, one line per tpool.
+ */
+static int get_numfids (Npsrv *srv)
+{
+    char *s, *line, *saveptr;
+    int numreqs, numfids, n = 0;
+
+    if (!(s = test_get_ctl (srv, "tpools")))
+        return -1;
+    for (line = strtok_r (s, "\n", &saveptr); line != NULL;
+            line = strtok_r (NULL, "\n", &saveptr)) {
+        if (sscanf (line, "%*s %d %d", &numreqs, &numfids) != 2) {
+            n = -1;
+            break;
+        }
+        n += numfids;
+    }
+    free (s);
+    return n;
+}
+
+static int recv_type (Nptrans *t, u16 tag)
+{
+    Npfcall *rc = NULL;
+    int type = -1;
+
+    if (np_trans_recv (t, &rc, TEST_MSIZE) == 0 && rc) {
+        if (rc->tag == tag)
+            type = rc->type;
+        else
+            diag ("got tag %d, expected %d", rc->tag, tag);
+        np_free_fcall (rc);
+    }
+    return type;
+}
+
+static int readable (int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+    return poll (&pfd, 1, 200);
+}
+
+int main (int argc, char *argv[])
+{
+    Npsrv *srv;
+    Nptrans *t;
+    int fd;
+
+    plan (NO_PLAN);
+
+    if (!(srv = np_srv_create (1, 0)))
+        BAIL_OUT ("np_srv_create: %s", strerror (np_rerror ()));
+    if (np_srv_set_wthreads (srv, 1, 1, 1, 0) < 0)
+        BAIL_OUT ("np_srv_set_wthreads: %s", strerror (np_rerror ()));
+    srv->logmsg = test_logmsg;
+    srv->attach = test_attach;
+    srv->clunk = test_clunk;
+
+    t = test_connect_client (srv, "flush-test-client", TEST_MSIZE, &fd);
+    test_attach_hold ();
+    send_attach (t, 1, 1);
+    test_attach_wait (1);
+    send_attach (t, 2, 2);
+    send_flush (t, 3, 2);
+    ok (recv_type (t, 3) == Rflush,
+        "flush of a queued request is answered right away");
+    send_flush (t, 4, 99);
+    ok (recv_type (t, 4) == Rflush,
+        "flush of an unknown tag is answered right away");
+    send_flush (t, 5, 1);
+    ok (readable (fd) == 0,
+        "flush of a request in progress waits for the request");
+    ok (get_numfids (srv) == 1,
+        "tpools ctl file counts the fid, not the requests using it");
+    test_attach_release ();
+    ok (recv_type (t, 1) == Rattach, "request in progress responds");
+    ok (recv_type (t, 5) == Rflush, "then its flush responds");
+    ok (test_attach_count () == 1, "flushed request was never started");
+    ok (duptags == 0, "no duplicate tags were logged");
+
+    test_attach_hold ();
+    send_attach (t, 6, 6);
+    test_attach_wait (1);
+    send_attach (t, 6, 7);
+    send_attach (t, 8, 8);
+    usleep (100000);
+    ok (duptags == 1, "tag reused while in progress is logged as duplicate");
+
+    /* hang up with one request in progress and two queued */
+    np_trans_destroy (t); /* closes fd */
+    usleep (100000);
+    test_attach_release ();
+    np_srv_wait_conncount (srv, 1);
+    ok (test_attach_count () == 2,
+        "queued requests were dropped when the connection closed");
+
+    np_srv_destroy (srv);
+
+    done_testing ();
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,216 @@
+/*************************************************************\
+ * Copyright (C) 2010 by Lawrence Livermore National Security, LLC.
+ *
+ * This file is part of npfs, a framework for 9P synthetic file systems.
+ * For details see https://sourceforge.net/projects/npfs.
+ *
+ * SPDX-License-Identifier: MIT
+ *************************************************************/
+
+/* qbench - measure request queue hand-off throughput
+ *
+ * Producer threads, each with its own connection on a null transport,
+ * enqueue cheap requests (Tgetattr on an unknown fid) directly on the
+ * server's tpool queue, and worker threads dequeue, process, and "send"
+ * the error response.  Throughput is reported for an increasing number
+ * of producers and workers, up to the number of online CPUs, unless
+ * -p and -w are given.
+ *
+ * Usage: qbench [-p producers] [-w workers] [-n requests-per-producer]
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/time.h>
+#include "npfs.h"
+#include "npfsimpl.h"
+
+#define DFLT_NREQS  100000
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int shutdown;
+    long completed;
+    long expected;
+} Bench;
+
+typedef struct {
+    Npsrv *srv;
+    Npconn *conn;
+    int nreqs;
+    pthread_t t;
+} Producer;
+
+static void die (const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start (ap, fmt);
+    vfprintf (stderr, fmt, ap);
+    va_end (ap);
+    fputc ('\n', stderr);
+    exit (1);
+}
+
+/* The connection reader blocks here until the benchmark is over.
+ */
+static int null_recv (Npfcall **fcp, u32 msize, void *a)
+{
+    Bench *b = a;
+
+    pthread_mutex_lock (&b->lock);
+    while (!b->shutdown)
+        pthread_cond_wait (&b->cond, &b->lock);
+    pthread_mutex_unlock (&b->lock);
+    *fcp = NULL;
+    return 0;
+}
+
+static int null_send (Npfcall *fc, void *a)
+{
+    Bench *b = a;
+
+    pthread_mutex_lock (&b->lock);
+    if (++b->completed == b->expected)
+        pthread_cond_broadcast (&b->cond);
+    pthread_mutex_unlock (&b->lock);
+    return fc->size;
+}
+
+static void *producer (void *a)
+{
+    Producer *p = a;
+    Npfcall *tc;
+    Npreq *req;
+    int i;
+
+    for (i = 0; i < p->nreqs; i++) {
+        if (!(tc = np_create_tgetattr (1, Gabasic)))
+            die ("out of memory");
+        np_set_tag (tc, i & 0xfffe);
+        if (!(req = np_req_alloc (p->conn, tc)))
+            die ("out of memory");
+        if (np_srv_add_req (p->srv, req) < 0)
+            die ("out of memory");
+    }
+    return NULL;
+}
+
+static double now (void)
+{
+    struct timeval tv;
+
+    gettimeofday (&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1E-6;
+}
+
+static double run (int nprod, int nworkers, int nreqs)
+{
+    Bench b;
+    Producer *p;
+    Nptrans *trans;
+    Npsrv *srv;
+    double t0, t1;
+    int i;
+
+    memset (&b, 0, sizeof (b));
+    pthread_mutex_init (&b.lock, NULL);
+    pthread_cond_init (&b.cond, NULL);
+    b.expected = (long)nprod * nreqs;
+
+    if (!(srv = np_srv_create (nworkers, 0)))
+        die ("np_srv_create: %s", strerror (np_rerror ()));
+    srv->logmsg = NULL; /* each request fails with "invalid fid" */
+    if (!(p = calloc (nprod, sizeof (p[0]))))
+        die ("out of memory");
+    for (i = 0; i < nprod; i++) {
+        if (!(trans = np_trans_create (&b, null_recv, null_send, NULL)))
+            die ("np_trans_create: %s", strerror (np_rerror ()));
+        if (!(p[i].conn = np_conn_create (srv, trans, "qbench", 0)))
+            die ("np_conn_create: %s", strerror (np_rerror ()));
+        p[i].srv = srv;
+        p[i].nreqs = nreqs;
+    }
+
+    t0 = now ();
+    for (i = 0; i < nprod; i++) {
+        if ((errno = pthread_create (&p[i].t, NULL, producer, &p[i])))
+            die ("pthread_create: %s", strerror (errno));
+    }
+    for (i = 0; i < nprod; i++)
+        pthread_join (p[i].t, NULL);
+    pthread_mutex_lock (&b.lock);
+    while (b.completed < b.expected)
+        pthread_cond_wait (&b.cond, &b.lock);
+    pthread_mutex_unlock (&b.lock);
+    t1 = now ();
+
+    pthread_mutex_lock (&b.lock);
+    b.shutdown = 1;
+    pthread_cond_broadcast (&b.cond);
+    pthread_mutex_unlock (&b.lock);
+    np_srv_wait_conncount (srv, nprod);
+    np_srv_destroy (srv);
+    free (p);
+
+    return b.expected / (t1 - t0);
+}
+
+int main (int argc, char *argv[])
+{
+    int nprod = 0, nworkers = 0, nreqs = DFLT_NREQS;
+    int ncpu, n, c;
+
+    while ((c = getopt (argc, argv, "p:w:n:")) != -1) {
+        switch (c) {
+            case 'p':
+                nprod = strtoul (optarg, NULL, 10);
+                break;
+            case 'w':
+                nworkers = strtoul (optarg, NULL, 10);
+                break;
+            case 'n':
+                nreqs = strtoul (optarg, NULL, 10);
+                break;
+            default:
+                die ("Usage: qbench [-p producers] [-w workers] [-n reqs]");
+        }
+    }
+    if (nreqs < 1)
+        die ("-n must be at least 1");
+    if ((ncpu = sysconf (_SC_NPROCESSORS_ONLN)) < 1)
+        ncpu = 1;
+
+    printf ("%-10s %-10s %s\n", "producers", "workers", "req/s");
+    if (nprod > 0 || nworkers > 0) {
+        if (nprod < 1)
+            nprod = 1;
+        if (nworkers < 1)
+            nworkers = 1;
+        printf ("%-10d %-10d %.0f\n", nprod, nworkers,
+                run (nprod, nworkers, nreqs));
+    } else {
+        for (n = 1; ; n *= 2) {
+            if (n > ncpu)
+                n = ncpu;
+            printf ("%-10d %-10d %.0f\n", n, n, run (n, n, nreqs));
+            if (n == ncpu)
+                break;
+        }
+    }
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
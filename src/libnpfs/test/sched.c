@@ -0,0 +1,261 @@
+/*************************************************************\
+ * Copyright (C) 2010 by Lawrence Livermore National Security, LLC.
+ *
+ * This file is part of npfs, a framework for 9P synthetic file systems.
+ * For details see https://sourceforge.net/projects/npfs.
+ *
+ * SPDX-License-Identifier: MIT
+ *************************************************************/
+
+/* request scheduling: metadata/bulk lanes, aging, fair sharing
+ * among connections, and ctl stats
+ *
+ * Requests are queued directly on a server with a single worker while
+ * the worker is held up sending the response to a "blocker" request,
+ * then the order in which responses are sent is checked.  Requests fail
+ * with "invalid fid", which is fine since only the tags matter here.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <errno.h>
+#include "npfs.h"
+#include "npfsimpl.h"
+
+#include "src/libtap/tap.h"
+#include "src/libtest/conn.h"
+
+#define BLOCKER_TAG 1
+#define MAXSENT     16
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int blocked;
+static int released;
+static u16 sent[MAXSENT];
+static int nsent;
+
+/* Record response tags in order.  The blocker's response is held
+ * until released so other requests pile up in the queue.
+ */
+static int null_send (Npfcall *fc, void *a)
+{
+    pthread_mutex_lock (&lock);
+    if (fc->tag == BLOCKER_TAG) {
+        blocked = 1;
+        pthread_cond_broadcast (&cond);
+        while (!released)
+            pthread_cond_wait (&cond, &lock);
+    } else if (nsent < MAXSENT)
+        sent[nsent++] = fc->tag;
+    pthread_cond_broadcast (&cond);
+    pthread_mutex_unlock (&lock);
+    return fc->size;
+}
+
+static void add_meta (Npsrv *srv, Npconn *conn, u16 tag)
+{
+    test_add_req (srv, conn, np_create_tgetattr (1, Gabasic), tag);
+}
+
+static void add_bulk (Npsrv *srv, Npconn *conn, u16 tag)
+{
+    test_add_req (srv, conn, np_create_tread (1, 0, 4096), tag);
+}
+
+/* Queue a blocker request and wait for the worker to be stuck on it.
+ */
+static void block_worker (Npsrv *srv, Npconn *conn)
+{
+    pthread_mutex_lock (&lock);
+    blocked = released = 0;
+    nsent = 0;
+    pthread_mutex_unlock (&lock);
+    add_meta (srv, conn, BLOCKER_TAG);
+    pthread_mutex_lock (&lock);
+    while (!blocked)
+        pthread_cond_wait (&cond, &lock);
+    pthread_mutex_unlock (&lock);
+}
+
+/* Release the worker and wait for 'n' more responses.
+ */
+static void release_worker (int n)
+{
+    pthread_mutex_lock (&lock);
+    released = 1;
+    pthread_cond_broadcast (&cond);
+    while (nsent < n)
+        pthread_cond_wait (&cond, &lock);
+    pthread_mutex_unlock (&lock);
+}
+
+static int check_order (const u16 *want, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (sent[i] != want[i]) {
+            diag ("response %d: tag %d, expected %d", i, sent[i], want[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Connections named "heavy" get twice the share of others.
+ */
+static int flow_weight (Npconn *conn, Npuser *user)
+{
+    return strcmp (conn->client_id, "heavy") == 0 ? 2 : 1;
+}
+
+static Npconn *create_conn (Npsrv *srv, char *name)
+{
+    Nptrans *trans;
+    Npconn *conn;
+
+    trans = test_null_trans (null_send, NULL);
+    if (!(conn = np_conn_create (srv, trans, name, 0)))
+        BAIL_OUT ("np_conn_create: %s", strerror (np_rerror ()));
+    return conn;
+}
+
+/* Look up depth, nreqs, and nflows of the named lane of the default
+ * tpool in the sched ctl file content.
+ */
+static int get_lane (const char *s, const char *lane, int *depth, int *nreqs,
+                     int *nflows)
+{
+    const char *p = s;
+    char tname[64], lname[64];
+
+    while (p && *p) {
+        if (sscanf (p, "%63s %63s %d %d %*u %*u %d",
+                    tname, lname, depth, nreqs, nflows) != 5)
+            return -1;
+        if (!strcmp (tname, "default") && !strcmp (lname, lane))
+            return 0;
+        if ((p = strchr (p, '\n')))
+            p++;
+    }
+    return -1;
+}
+
+int main (int argc, char *argv[])
+{
+    Npsrv *srv;
+    Npconn *conn, *heavy;
+    int depth, nreqs, nflows;
+    char *s;
+
+    plan (NO_PLAN);
+
+    if (!(srv = np_srv_create (1, 0)))
+        BAIL_OUT ("np_srv_create: %s", strerror (np_rerror ()));
+    srv->logmsg = NULL; /* each request fails with "invalid fid" */
+    if (np_srv_set_wthreads (srv, 1, 1, 1, 0) < 0)
+        BAIL_OUT ("np_srv_set_wthreads: %s", strerror (np_rerror ()));
+    srv->flow_weight = flow_weight;
+    conn = create_conn (srv, "light");
+    heavy = create_conn (srv, "heavy");
+
+    /* metadata goes ahead of bulk, up to meta_weight (4) in a row */
+    srv->wpool->bulk_aging = 60000;
+    block_worker (srv, conn);
+    add_bulk (srv, conn, 100);
+    add_bulk (srv, conn, 101);
+    add_bulk (srv, conn, 102);
+    add_meta (srv, conn, 200);
+    add_meta (srv, conn, 201);
+    add_meta (srv, conn, 202);
+    add_meta (srv, conn, 203);
+    add_meta (srv, conn, 204);
+
+    s = test_get_ctl (srv, "sched");
+    ok (s && get_lane (s, "meta", &depth, &nreqs, &nflows) == 0 && depth == 5,
+        "sched ctl file shows 5 queued metadata requests");
+    ok (s && get_lane (s, "bulk", &depth, &nreqs, &nflows) == 0 && depth == 3
+          && nreqs == 0,
+        "sched ctl file shows 3 queued bulk requests");
+    free (s);
+
+    release_worker (8);
+    {
+        u16 want[] = { 200, 201, 202, 203, 100, 204, 101, 102 };
+        ok (check_order (want, 8) == 0,
+            "metadata requests are served 4:1 ahead of bulk");
+    }
+
+    s = test_get_ctl (srv, "sched");
+    ok (s && get_lane (s, "meta", &depth, &nreqs, &nflows) == 0 && depth == 0
+          && nreqs == 6,
+        "sched ctl file counts 6 dequeued metadata requests");
+    ok (s && get_lane (s, "bulk", &depth, &nreqs, &nflows) == 0 && depth == 0
+          && nreqs == 3,
+        "sched ctl file counts 3 dequeued bulk requests");
+    free (s);
+
+    /* a bulk request that has waited bulk_aging msec goes first */
+    srv->wpool->bulk_aging = 1;
+    block_worker (srv, conn);
+    add_bulk (srv, conn, 100);
+    usleep (10000);
+    add_meta (srv, conn, 200);
+    add_meta (srv, conn, 201);
+    release_worker (3);
+    {
+        u16 want[] = { 100, 200, 201 };
+        ok (check_order (want, 3) == 0,
+            "aged bulk request is not starved by metadata");
+    }
+
+    /* connections share workers in proportion to their weight */
+    srv->wpool->bulk_aging = 60000;
+    block_worker (srv, conn);
+    add_meta (srv, heavy, 300);
+    add_meta (srv, heavy, 301);
+    add_meta (srv, heavy, 302);
+    add_meta (srv, heavy, 303);
+    add_meta (srv, heavy, 304);
+    add_meta (srv, heavy, 305);
+    add_meta (srv, conn, 400);
+    add_meta (srv, conn, 401);
+    add_meta (srv, conn, 402);
+
+    s = test_get_ctl (srv, "sched");
+    ok (s && get_lane (s, "meta", &depth, &nreqs, &nflows) == 0 && depth == 9
+          && nflows == 2,
+        "sched ctl file shows 9 metadata requests queued on 2 flows");
+    free (s);
+
+    release_worker (9);
+    {
+        u16 want[] = { 300, 301, 400, 302, 303, 401, 304, 305, 402 };
+        ok (check_order (want, 9) == 0,
+            "a connection with weight 2 gets twice the share of weight 1");
+    }
+
+    s = test_get_ctl (srv, "sched");
+    ok (s && get_lane (s, "meta", &depth, &nreqs, &nflows) == 0 && depth == 0
+          && nflows == 0,
+        "flows are released when their queues drain");
+    free (s);
+
+    test_null_shutdown ();
+    np_srv_wait_conncount (srv, 2);
+    np_srv_destroy (srv);
+
+    done_testing ();
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
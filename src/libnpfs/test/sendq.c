@@ -0,0 +1,196 @@
+/*************************************************************\
+ * Copyright (C) 2010 by Lawrence Livermore National Security, LLC.
+ *
+ * This file is part of npfs, a framework for 9P synthetic file systems.
+ * For details see https://sourceforge.net/projects/npfs.
+ *
+ * SPDX-License-Identifier: MIT
+ *************************************************************/
+
+/* send queue: responses are batched per connection, and workers don't
+ * wait for a connection that is busy sending
+ *
+ * Two workers serve one connection whose transport blocks while sending
+ * the response to a "blocker" request.  Requests that complete meanwhile
+ * should be queued, leaving the other worker free, and then go out in
+ * one batch.  Requests fail with "invalid fid", which is fine since only
+ * the tags matter here.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <errno.h>
+#include <inttypes.h>
+#include "npfs.h"
+#include "npfsimpl.h"
+
+#include "src/libtap/tap.h"
+#include "src/libtest/conn.h"
+
+#define BLOCKER_TAG 1
+#define NREQS       8
+#define MAXBATCH    16
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int blocked;
+static int released;
+static int batch[MAXBATCH];
+static int nbatch;
+static u16 sent[NREQS + 1];
+static int nsent;
+
+static int null_send (Npfcall *fc, void *a)
+{
+    BAIL_OUT ("responses should be sent with sendv");
+    return -1;
+}
+
+/* Record batch sizes and response tags.  A batch containing the
+ * blocker is held until released.
+ */
+static int null_sendv (Npfcall **fcs, int n, void *a)
+{
+    int i, len = 0;
+
+    pthread_mutex_lock (&lock);
+    if (nbatch < MAXBATCH)
+        batch[nbatch++] = n;
+    for (i = 0; i < n; i++) {
+        if (fcs[i]->tag == BLOCKER_TAG) {
+            blocked = 1;
+            pthread_cond_broadcast (&cond);
+            while (!released)
+                pthread_cond_wait (&cond, &lock);
+        }
+        if (nsent < NREQS + 1)
+            sent[nsent++] = fcs[i]->tag;
+        len += fcs[i]->size;
+    }
+    pthread_cond_broadcast (&cond);
+    pthread_mutex_unlock (&lock);
+    return len;
+}
+
+/* Wait up to a second for 'want' responses on the connection's send queue.
+ */
+static int wait_queued (Npconn *conn, int want)
+{
+    Npfcall *fc;
+    int i, n = 0;
+
+    for (i = 0; i < 100; i++) {
+        pthread_mutex_lock (&conn->wlock);
+        for (n = 0, fc = conn->sendq_first; fc != NULL; fc = fc->next)
+            n++;
+        pthread_mutex_unlock (&conn->wlock);
+        if (n == want)
+            return 0;
+        usleep (10000);
+    }
+    diag ("waited for %d queued responses, have %d", want, n);
+    return -1;
+}
+
+/* Wait up to a second for 'want' idle workers.
+ */
+static int wait_idle (Npsrv *srv, int want)
+{
+    char *s;
+    int i, nwthread, nidle = -1;
+
+    for (i = 0; i < 100; i++) {
+        if ((s = test_get_ctl (srv, "wthreads"))) {
+            if (sscanf (s, "%d %d", &nwthread, &nidle) != 2)
+                nidle = -1;
+            free (s);
+        }
+        if (nidle == want)
+            return 0;
+        usleep (10000);
+    }
+    diag ("waited for %d idle workers, have %d", want, nidle);
+    return -1;
+}
+
+int main (int argc, char *argv[])
+{
+    Npsrv *srv;
+    Nptrans *trans;
+    Npconn *conn;
+    uint64_t batches, fcalls, maxbatch;
+    char *s;
+    int i, errors;
+
+    plan (NO_PLAN);
+
+    if (!(srv = np_srv_create (2, 0)))
+        BAIL_OUT ("np_srv_create: %s", strerror (np_rerror ()));
+    srv->logmsg = NULL; /* each request fails with "invalid fid" */
+    if (np_srv_set_wthreads (srv, 2, 2, 2, 0) < 0)
+        BAIL_OUT ("np_srv_set_wthreads: %s", strerror (np_rerror ()));
+    trans = test_null_trans (null_send, NULL);
+    trans->sendv = null_sendv;
+    if (!(conn = np_conn_create (srv, trans, "sendq-test-client", 0)))
+        BAIL_OUT ("np_conn_create: %s", strerror (np_rerror ()));
+
+    test_add_req (srv, conn, np_create_tgetattr (1, Gabasic), BLOCKER_TAG);
+    pthread_mutex_lock (&lock);
+    while (!blocked)
+        pthread_cond_wait (&cond, &lock);
+    pthread_mutex_unlock (&lock);
+    for (i = 0; i < NREQS; i++)
+        test_add_req (srv, conn, np_create_tgetattr (1, Gabasic), 100 + i);
+
+    ok (wait_queued (conn, NREQS) == 0,
+        "responses are queued while a worker is blocked sending");
+    ok (wait_idle (srv, 1) == 0,
+        "a worker is free while another is blocked sending");
+    pthread_mutex_lock (&lock);
+    ok (nsent == 0 && nbatch == 1,
+        "responses wait in the queue behind the blocked send");
+    released = 1;
+    pthread_cond_broadcast (&cond);
+    while (nsent < NREQS + 1)
+        pthread_cond_wait (&cond, &lock);
+    pthread_mutex_unlock (&lock);
+
+    ok (nbatch == 2 && batch[0] == 1 && batch[1] == NREQS,
+        "queued responses are sent in one batch");
+    for (i = 0, errors = 0; i < NREQS; i++) {
+        if (sent[i + 1] != 100 + i)
+            errors++;
+    }
+    ok (sent[0] == BLOCKER_TAG && errors == 0,
+        "responses are sent in the order they were queued");
+
+    /* stats are updated after sendv returns */
+    pthread_mutex_lock (&conn->wlock);
+    while (conn->sending)
+        pthread_cond_wait (&conn->sendcond, &conn->wlock);
+    pthread_mutex_unlock (&conn->wlock);
+
+    s = test_get_ctl (srv, "sendq");
+    ok (s && sscanf (s, "%"SCNu64" %"SCNu64" %"SCNu64,
+                     &batches, &fcalls, &maxbatch) == 3
+          && batches == 2 && fcalls == NREQS + 1 && maxbatch == NREQS,
+        "sendq ctl file shows 2 batches, %d responses", NREQS + 1);
+    free (s);
+
+    test_null_shutdown ();
+    np_srv_wait_conncount (srv, 1);
+    np_srv_destroy (srv);
+
+    done_testing ();
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
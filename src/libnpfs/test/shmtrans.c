@@ -0,0 +1,285 @@
+/*************************************************************\
+ * Copyright (C) 2010 by Lawrence Livermore National Security, LLC.
+ *
+ * This file is part of npfs, a framework for 9P synthetic file systems.
+ * For details see https://sourceforge.net/projects/npfs.
+ *
+ * SPDX-License-Identifier: MIT
+ *************************************************************/
+
+/* shared memory ring transport
+ *
+ * The server end of a socketpair uses shmtrans and the client end
+ * connects to it with small rings, so messages larger than a ring are
+ * streamed.  Fallback to the socket for an ordinary client, a bad hello,
+ * a server that does not speak shmtrans, and EOF are checked.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include "npfs.h"
+#include "npfsimpl.h"
+
+#include "src/libtap/tap.h"
+#include "src/libtest/conn.h"
+#include "src/libtest/thread.h"
+
+#define TEST_MSIZE  (2*1024*1024)
+#define RINGSIZE    4096
+#define NRESP       200
+#define BIGSIZE     (1024*1024)
+#define READSIZE    (512*1024)
+
+static u8 data[BIGSIZE];
+
+typedef struct {
+    Nptrans *trans;
+    Npfcall *fc[NRESP + 1];
+    int n;
+    int errors;
+} Peer;
+
+static void *recv_proc (void *a)
+{
+    Peer *p = a;
+    int i;
+
+    for (i = 0; i < p->n; i++) {
+        if (np_trans_recv (p->trans, &p->fc[i], TEST_MSIZE) < 0
+                                                        || !p->fc[i]) {
+            p->errors++;
+            break;
+        }
+    }
+    return NULL;
+}
+
+/* An fdtrans server reads the hello as a request that is too large,
+ * then hangs up.
+ */
+static void *reject_proc (void *a)
+{
+    Nptrans *t = a;
+    Npfcall *fc = NULL;
+
+    (void)np_trans_recv (t, &fc, TEST_MSIZE);
+    np_trans_destroy (t);
+    return NULL;
+}
+
+static void pair (int s[2])
+{
+    if (socketpair (AF_LOCAL, SOCK_STREAM, 0, s) < 0)
+        BAIL_OUT ("socketpair: %s", strerror (errno));
+}
+
+/* The client connects with rings smaller than some requests, then sends
+ * small requests and Twrites of 64K and 1M.  The server's first recv
+ * accepts the hello.
+ */
+static Nptrans *test_recv (Nptrans *t, int fd)
+{
+    Peer p = { .trans = t, .n = 5 };
+    Nptrans *ct;
+    Npfcall *fc[5];
+    pthread_t thd;
+    int i, errors = 0;
+
+    fc[0] = np_create_tgetattr (1, Gabasic);
+    fc[1] = np_create_tgetattr (1, Gabasic);
+    fc[2] = np_create_twrite (1, 0, 65536, data);
+    fc[3] = np_create_twrite (1, 0, BIGSIZE, data);
+    fc[4] = np_create_tgetattr (1, Gabasic);
+    for (i = 0; i < p.n; i++) {
+        if (!fc[i])
+            BAIL_OUT ("out of memory");
+        np_set_tag (fc[i], i + 1);
+    }
+    test_thread_create (&thd, recv_proc, &p);
+    if (!(ct = np_shmtrans_connect (fd, RINGSIZE)))
+        BAIL_OUT ("np_shmtrans_connect: %s", strerror (np_rerror ()));
+    ok (1, "client connected with %dK rings", RINGSIZE / 1024);
+    for (i = 0; i < p.n; i++) {
+        if (np_trans_send (ct, fc[i]) != fc[i]->size)
+            errors++;
+    }
+    test_thread_join (thd, NULL);
+    for (i = 0; i < p.n; i++) {
+        if (!p.fc[i] || p.fc[i]->tag != i + 1)
+            errors++;
+    }
+    ok (p.errors == 0 && errors == 0,
+        "received %d pipelined requests in order", p.n);
+    ok (p.fc[2] && p.fc[2]->type == Twrite
+                && p.fc[2]->u.twrite.count == 65536
+                && memcmp (p.fc[2]->u.twrite.data, data, 65536) == 0
+                && test_page_aligned (p.fc[2]->u.twrite.data),
+        "64K Twrite is intact and its payload is page aligned");
+    ok (p.fc[3] && p.fc[3]->type == Twrite
+                && p.fc[3]->u.twrite.count == BIGSIZE
+                && memcmp (p.fc[3]->u.twrite.data, data, BIGSIZE) == 0,
+        "1M Twrite is intact");
+    for (i = 0; i < p.n; i++) {
+        np_free_fcall (fc[i]);
+        np_free_fcall (p.fc[i]);
+    }
+    return ct;
+}
+
+/* The server sends one batch of responses with a large Rread in the middle.
+ */
+static void test_sendv (Nptrans *t, Nptrans *ct)
+{
+    Peer p = { .trans = ct, .n = NRESP + 1 };
+    Npfcall *fc[NRESP + 1];
+    pthread_t thd;
+    int i, errors = 0;
+
+    for (i = 0; i < NRESP + 1; i++) {
+        fc[i] = i == NRESP / 2 ? np_create_rread (READSIZE, data)
+                               : np_create_rlerror (EIO);
+        if (!fc[i])
+            BAIL_OUT ("out of memory");
+        np_set_tag (fc[i], i);
+    }
+    test_thread_create (&thd, recv_proc, &p);
+    ok (np_trans_sendv (t, fc, NRESP + 1) > READSIZE,
+        "sent a batch of %d responses", NRESP + 1);
+    test_thread_join (thd, NULL);
+    for (i = 0; i < NRESP + 1; i++) {
+        if (!p.fc[i] || p.fc[i]->tag != i)
+            errors++;
+    }
+    ok (p.errors == 0 && errors == 0,
+        "client received all responses in order");
+    ok (p.fc[NRESP / 2] && p.fc[NRESP / 2]->type == Rread
+            && p.fc[NRESP / 2]->u.rread.count == READSIZE
+            && memcmp (p.fc[NRESP / 2]->u.rread.data, data, READSIZE) == 0,
+        "512K Rread in the batch is intact");
+    for (i = 0; i < NRESP + 1; i++) {
+        np_free_fcall (fc[i]);
+        np_free_fcall (p.fc[i]);
+    }
+}
+
+/* An ordinary client talks 9P over the socket.
+ */
+static void test_fallback (void)
+{
+    Nptrans *t, *ct;
+    Npfcall *tc, *rc, *fc = NULL, *fc2 = NULL;
+    int s[2];
+
+    pair (s);
+    if (!(t = np_shmtrans_create (s[1])))
+        BAIL_OUT ("np_shmtrans_create: %s", strerror (np_rerror ()));
+    if (!(ct = np_fdtrans_create (s[0], s[0])))
+        BAIL_OUT ("np_fdtrans_create: %s", strerror (np_rerror ()));
+    if (!(tc = np_create_tversion (TEST_MSIZE, "9P2000.L"))
+            || !(rc = np_create_rversion (TEST_MSIZE, "9P2000.L")))
+        BAIL_OUT ("out of memory");
+    ok (np_trans_send (ct, tc) == tc->size
+            && np_trans_recv (t, &fc, TEST_MSIZE) == 0
+            && fc && fc->type == Tversion,
+        "server receives Tversion from a client without rings");
+    ok (np_trans_send (t, rc) == rc->size
+            && np_trans_recv (ct, &fc2, TEST_MSIZE) == 0
+            && fc2 && fc2->type == Rversion,
+        "client receives Rversion over the socket");
+    np_free_fcall (tc);
+    np_free_fcall (rc);
+    np_free_fcall (fc);
+    np_free_fcall (fc2);
+    np_trans_destroy (ct);
+    np_trans_destroy (t);
+}
+
+/* A hello without fds is refused.
+ */
+static void test_badhello (void)
+{
+    char hello[16] = "NPSHM01";
+    Nptrans *t;
+    Npfcall *fc = NULL;
+    int s[2];
+
+    pair (s);
+    if (!(t = np_shmtrans_create (s[1])))
+        BAIL_OUT ("np_shmtrans_create: %s", strerror (np_rerror ()));
+    if (write (s[0], hello, sizeof (hello)) != sizeof (hello))
+        BAIL_OUT ("write: %s", strerror (errno));
+    ok (np_trans_recv (t, &fc, TEST_MSIZE) < 0 && np_rerror () == EPROTO,
+        "server refuses a hello without fds");
+    close (s[0]);
+    np_trans_destroy (t);
+}
+
+/* A server that only speaks 9P over the socket drops the connection.
+ */
+static void test_noshm (void)
+{
+    Nptrans *t;
+    pthread_t thd;
+    int s[2];
+
+    pair (s);
+    if (!(t = np_fdtrans_create (s[1], s[1])))
+        BAIL_OUT ("np_fdtrans_create: %s", strerror (np_rerror ()));
+    test_thread_create (&thd, reject_proc, t);
+    ok (np_shmtrans_connect (s[0], RINGSIZE) == NULL
+            && np_rerror () == EPROTONOSUPPORT,
+        "connect fails with EPROTONOSUPPORT if the server lacks shmtrans");
+    test_thread_join (thd, NULL);
+    close (s[0]);
+}
+
+int main (int argc, char *argv[])
+{
+    Nptrans *t, *ct;
+    Npfcall *fc;
+    int i, s[2];
+
+    for (i = 0; i < BIGSIZE; i++)
+        data[i] = i * 7;
+    pair (s);
+    if (!(t = np_shmtrans_create (s[1]))) {
+        if (np_rerror () != ENOSYS)
+            BAIL_OUT ("np_shmtrans_create: %s", strerror (np_rerror ()));
+        plan (SKIP_ALL, "shared memory transport is not available");
+        return 0;
+    }
+    plan (NO_PLAN);
+    ok (t->pollfd == -1, "shm transport is not polled by the reactor");
+    ok (np_shmtrans_connect (s[0], RINGSIZE + 1) == NULL
+            && np_rerror () == EINVAL,
+        "connect fails with EINVAL if ring size is not a power of two");
+
+    ct = test_recv (t, s[0]);
+    test_sendv (t, ct);
+
+    np_trans_destroy (ct); /* closes s[0] */
+    fc = (Npfcall *)1;
+    ok (np_trans_recv (t, &fc, TEST_MSIZE) == 0 && fc == NULL,
+        "recv returns EOF when the client closes");
+    np_trans_destroy (t); /* closes s[1] */
+
+    test_fallback ();
+    test_badhello ();
+    test_noshm ();
+
+    done_testing ();
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,195 @@
+/*************************************************************\
+ * Copyright (C) 2010 by Lawrence Livermore National Security, LLC.
+ *
+ * This file is part of npfs, a framework for 9P synthetic file systems.
+ * For details see https://sourceforge.net/projects/npfs.
+ *
+ * SPDX-License-Identifier: MIT
+ *************************************************************/
+
+/* zero-copy Rread: file data spliced from a pipe into the socket
+ *
+ * Rread responses are created from a temporary file on a server
+ * connection over a socketpair, sent with the connection's transport,
+ * and received and checked on the client end.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include "npfs.h"
+#include "npfsimpl.h"
+
+#include "src/libtap/tap.h"
+#include "src/libtest/conn.h"
+
+#define TEST_MSIZE  (256*1024)
+#define FILE_SIZE   (100*1024)
+
+static u8 data[FILE_SIZE];
+
+static int create_file (void)
+{
+    char path[] = "/tmp/splice.XXXXXX";
+    int i, fd;
+
+    if ((fd = mkstemp (path)) < 0)
+        BAIL_OUT ("mkstemp: %s", strerror (errno));
+    (void)unlink (path);
+    for (i = 0; i < FILE_SIZE; i++)
+        data[i] = i * 7;
+    if (write (fd, data, FILE_SIZE) != FILE_SIZE)
+        BAIL_OUT ("write: %s", strerror (errno));
+    return fd;
+}
+
+static int get_stats (Npsrv *srv, uint64_t *reads, uint64_t *bytes,
+                      uint64_t *fallbacks)
+{
+    char *s = test_get_ctl (srv, "splice");
+    int n = 0;
+
+    if (s)
+        n = sscanf (s, "%"SCNu64" %"SCNu64" %"SCNu64, reads, bytes, fallbacks);
+    free (s);
+    return n == 3 ? 0 : -1;
+}
+
+/* Receive a Rread and check that it holds 'count' bytes of the file
+ * from 'offset'.
+ */
+static int check_rread (Nptrans *ctrans, u16 tag, u64 offset, u32 count)
+{
+    Npfcall *rc = NULL;
+    int rv = -1;
+
+    if (np_trans_recv (ctrans, &rc, TEST_MSIZE) < 0 || !rc) {
+        diag ("recv failed");
+        goto done;
+    }
+    if (rc->type != Rread || rc->tag != tag) {
+        diag ("received type %d tag %d", rc->type, rc->tag);
+        goto done;
+    }
+    if (rc->u.rread.count != count) {
+        diag ("received count %"PRIu32", expected %"PRIu32,
+              rc->u.rread.count, count);
+        goto done;
+    }
+    if (memcmp (rc->u.rread.data, data + offset, count) != 0) {
+        diag ("received data does not match file");
+        goto done;
+    }
+    rv = 0;
+done:
+    np_free_fcall (rc);
+    return rv;
+}
+
+static int check_rlerror (Nptrans *ctrans, u16 tag)
+{
+    Npfcall *rc = NULL;
+    int rv = -1;
+
+    if (np_trans_recv (ctrans, &rc, TEST_MSIZE) == 0 && rc
+            && rc->type == Rlerror && rc->tag == tag)
+        rv = 0;
+    np_free_fcall (rc);
+    return rv;
+}
+
+int main (int argc, char *argv[])
+{
+    Npsrv *srv;
+    Npconn *conn;
+    Nptrans *trans, *ctrans, *ntrans;
+    Npfcall *fc[3];
+    uint64_t reads, bytes, fallbacks;
+    int s[2], fd, nullfd;
+
+    plan (NO_PLAN);
+
+    if (!(srv = np_srv_create (1, 0)))
+        BAIL_OUT ("np_srv_create: %s", strerror (np_rerror ()));
+    srv->msize = TEST_MSIZE;
+    if (socketpair (AF_LOCAL, SOCK_STREAM, 0, s) < 0)
+        BAIL_OUT ("socketpair: %s", strerror (errno));
+    if (!(trans = np_fdtrans_create (s[1], s[1])))
+        BAIL_OUT ("np_fdtrans_create: %s", strerror (np_rerror ()));
+    if (!(conn = np_conn_create (srv, trans, "splice-test-client", 0)))
+        BAIL_OUT ("np_conn_create: %s", strerror (np_rerror ()));
+    if (!(ctrans = np_fdtrans_create (s[0], s[0])))
+        BAIL_OUT ("np_fdtrans_create: %s", strerror (np_rerror ()));
+    fd = create_file ();
+
+    fc[0] = np_create_rread_splice (conn, fd, 0, 4096);
+    if (!fc[0] && !trans->splice) {
+        skip (1, 7, "splice is not supported on this platform");
+        end_skip;
+        goto done;
+    }
+    ok (fc[0] != NULL && fc[0]->pipe != NULL,
+        "np_create_rread_splice works on a socket connection");
+    if (!fc[0])
+        BAIL_OUT ("cannot continue");
+    np_set_tag (fc[0], 1);
+    ok (np_trans_sendv (trans, fc, 1) > 0 && check_rread (ctrans, 1, 0, 4096)
+                                                                        == 0,
+        "spliced Rread is received intact");
+    np_free_fcall (fc[0]);
+
+    /* short read at EOF, between two ordinary responses */
+    fc[0] = np_create_rlerror (EIO);
+    fc[1] = np_create_rread_splice (conn, fd, FILE_SIZE - 100, 4096);
+    fc[2] = np_create_rlerror (EIO);
+    if (!fc[0] || !fc[1] || !fc[2])
+        BAIL_OUT ("could not create responses");
+    np_set_tag (fc[0], 2);
+    np_set_tag (fc[1], 3);
+    np_set_tag (fc[2], 4);
+    ok (np_trans_sendv (trans, fc, 3) > 0
+        && check_rlerror (ctrans, 2) == 0
+        && check_rread (ctrans, 3, FILE_SIZE - 100, 100) == 0
+        && check_rlerror (ctrans, 4) == 0,
+        "spliced Rread with a short read is framed correctly in a batch");
+    np_free_fcall (fc[0]);
+    np_free_fcall (fc[1]);
+    np_free_fcall (fc[2]);
+
+    ok (np_create_rread_splice (conn, fd, FILE_SIZE, 4096) == NULL,
+        "reading at EOF falls back");
+    ok (np_create_rread_splice (conn, s[0], 0, 4096) == NULL,
+        "a file that can't be spliced falls back");
+
+    if ((nullfd = open ("/dev/null", O_WRONLY)) < 0)
+        BAIL_OUT ("open /dev/null: %s", strerror (errno));
+    if (!(ntrans = np_fdtrans_create (nullfd, nullfd)))
+        BAIL_OUT ("np_fdtrans_create: %s", strerror (np_rerror ()));
+    ok (ntrans->splice == 0, "a non-socket transport does not splice");
+    np_trans_destroy (ntrans); /* closes nullfd */
+
+    ok (get_stats (srv, &reads, &bytes, &fallbacks) == 0
+        && reads == 2 && bytes == 4096 + 100 && fallbacks == 2,
+        "splice ctl file counts 2 reads, %d bytes, 2 fallbacks", 4096 + 100);
+done:
+    close (fd);
+    np_trans_destroy (ctrans); /* closes s[0] */
+    np_srv_wait_conncount (srv, 1);
+    np_srv_destroy (srv);
+
+    done_testing ();
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,242 @@
+/*************************************************************\
+ * Copyright (C) 2010 by Lawrence Livermore National Security, LLC.
+ *
+ * This file is part of npfs, a framework for 9P synthetic file systems.
+ * For details see https://sourceforge.net/projects/npfs.
+ *
+ * SPDX-License-Identifier: MIT
+ *************************************************************/
+
+/* tbench - compare server transports by RPC throughput
+ *
+ * A client keeps a fixed number of cheap requests (Tgetattr on an
+ * unknown fid, or Twrite with -s) outstanding on one connection to a
+ * server, over a Unix domain socketpair and over loopback TCP, with
+ * fdtrans and then uringtrans on the server end, with the client using
+ * fdtrans.  Over the socketpair the client also sets up shmtrans rings,
+ * which leaves only the server core.  Throughput is reported for each
+ * combination.
+ *
+ * Usage: tbench [-n requests] [-d depth] [-s write-size] [-w workers]
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "npfs.h"
+#include "npfsimpl.h"
+
+#define DFLT_NREQS  100000
+#define DFLT_DEPTH  16
+#define TEST_MSIZE  (1024*1024 + 4096)
+
+static void die (const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start (ap, fmt);
+    vfprintf (stderr, fmt, ap);
+    va_end (ap);
+    fputc ('\n', stderr);
+    exit (1);
+}
+
+static double now (void)
+{
+    struct timeval tv;
+
+    gettimeofday (&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1E-6;
+}
+
+static void unix_pair (int s[2])
+{
+    if (socketpair (AF_LOCAL, SOCK_STREAM, 0, s) < 0)
+        die ("socketpair: %s", strerror (errno));
+}
+
+static void tcp_pair (int s[2])
+{
+    struct sockaddr_in in;
+    socklen_t len = sizeof (in);
+    int fd, one = 1;
+
+    memset (&in, 0, sizeof (in));
+    in.sin_family = AF_INET;
+    in.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+    if ((fd = socket (AF_INET, SOCK_STREAM, 0)) < 0
+            || bind (fd, (struct sockaddr *)&in, sizeof (in)) < 0
+            || listen (fd, 1) < 0
+            || getsockname (fd, (struct sockaddr *)&in, &len) < 0)
+        die ("listen: %s", strerror (errno));
+    if ((s[0] = socket (AF_INET, SOCK_STREAM, 0)) < 0
+            || connect (s[0], (struct sockaddr *)&in, sizeof (in)) < 0)
+        die ("connect: %s", strerror (errno));
+    if ((s[1] = accept (fd, NULL, NULL)) < 0)
+        die ("accept: %s", strerror (errno));
+    (void)setsockopt (s[0], IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+    (void)setsockopt (s[1], IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+    close (fd);
+}
+
+static Npfcall *create_req (int size, u8 *data)
+{
+    Npfcall *tc;
+
+    if (size > 0)
+        tc = np_create_twrite (1, 0, size, data);
+    else
+        tc = np_create_tgetattr (1, Gabasic);
+    if (!tc)
+        die ("out of memory");
+    return tc;
+}
+
+enum { TRANS_FD, TRANS_URING, TRANS_SHM };
+
+/* Returns req/s, or 0 if the transport is unavailable.
+ */
+static double run (void (*pair)(int *), int type, int nworkers, int nreqs,
+                   int depth, int size)
+{
+    Npsrv *srv;
+    Nptrans *trans, *ctrans;
+    Npfcall *tc, *rc;
+    u8 *data;
+    double t0, t1;
+    int s[2], sent = 0, recvd = 0;
+
+    if (!(data = calloc (1, size > 0 ? size : 1)))
+        die ("out of memory");
+    if (!(srv = np_srv_create (nworkers, 0)))
+        die ("np_srv_create: %s", strerror (np_rerror ()));
+    srv->logmsg = NULL; /* each request fails with "invalid fid" */
+    srv->msize = TEST_MSIZE;
+    pair (s);
+    if (type == TRANS_URING)
+        trans = np_uringtrans_create (s[1]);
+    else if (type == TRANS_SHM)
+        trans = np_shmtrans_create (s[1]);
+    else
+        trans = np_fdtrans_create (s[1], s[1]);
+    if (!trans) {
+        if (np_rerror () != ENOSYS)
+            die ("create transport: %s", strerror (np_rerror ()));
+        close (s[0]);
+        close (s[1]);
+        np_srv_destroy (srv);
+        free (data);
+        return 0;
+    }
+    if (!np_conn_create (srv, trans, "tbench", 0))
+        die ("np_conn_create: %s", strerror (np_rerror ()));
+    /* N.B. the connection's reader thread answers the shmtrans hello */
+    if (type == TRANS_SHM)
+        ctrans = np_shmtrans_connect (s[0], 0);
+    else
+        ctrans = np_fdtrans_create (s[0], s[0]);
+    if (!ctrans)
+        die ("create client transport: %s", strerror (np_rerror ()));
+    if (!(tc = np_create_tversion (TEST_MSIZE, "9P2000.L")))
+        die ("out of memory");
+    if (np_trans_send (ctrans, tc) < 0
+            || np_trans_recv (ctrans, &rc, TEST_MSIZE) < 0 || !rc)
+        die ("version handshake failed");
+    np_free_fcall (tc);
+    np_free_fcall (rc);
+
+    tc = create_req (size, data);
+    t0 = now ();
+    while (recvd < nreqs) {
+        while (sent < nreqs && sent - recvd < depth) {
+            np_set_tag (tc, sent & 0xfffe);
+            if (np_trans_send (ctrans, tc) < 0)
+                die ("send: %s", strerror (np_rerror ()));
+            sent++;
+        }
+        if (np_trans_recv (ctrans, &rc, TEST_MSIZE) < 0 || !rc)
+            die ("recv failed");
+        np_free_fcall (rc);
+        recvd++;
+    }
+    t1 = now ();
+    np_free_fcall (tc);
+
+    np_trans_destroy (ctrans); /* closes s[0] */
+    np_srv_wait_conncount (srv, 1);
+    np_srv_destroy (srv);
+    free (data);
+
+    return nreqs / (t1 - t0);
+}
+
+int main (int argc, char *argv[])
+{
+    int nreqs = DFLT_NREQS, depth = DFLT_DEPTH, size = 0, nworkers = 1;
+    int c;
+    struct {
+        char *name;
+        void (*pair)(int *);
+        int type;
+        char *tname;
+    } *r, runs[] = {
+        { "unix",   unix_pair,  TRANS_FD,       "fd" },
+        { "unix",   unix_pair,  TRANS_URING,    "uring" },
+        { "unix",   unix_pair,  TRANS_SHM,      "shm" },
+        { "tcp",    tcp_pair,   TRANS_FD,       "fd" },
+        { "tcp",    tcp_pair,   TRANS_URING,    "uring" },
+        { NULL, NULL, 0, NULL },
+    };
+    double rate;
+
+    while ((c = getopt (argc, argv, "n:d:s:w:")) != -1) {
+        switch (c) {
+            case 'n':
+                nreqs = strtoul (optarg, NULL, 10);
+                break;
+            case 'd':
+                depth = strtoul (optarg, NULL, 10);
+                break;
+            case 's':
+                size = strtoul (optarg, NULL, 10);
+                break;
+            case 'w':
+                nworkers = strtoul (optarg, NULL, 10);
+                break;
+            default:
+                die ("Usage: tbench [-n reqs] [-d depth] [-s size] "
+                     "[-w workers]");
+        }
+    }
+    if (nreqs < 1 || depth < 1 || nworkers < 1)
+        die ("-n, -d, and -w must be at least 1");
+    if (size > TEST_MSIZE - 4096)
+        die ("-s may be at most %d", TEST_MSIZE - 4096);
+
+    printf ("%-8s %-10s %s\n", "socket", "transport", "req/s");
+    for (r = &runs[0]; r->name != NULL; r++) {
+        rate = run (r->pair, r->type, nworkers, nreqs, depth, size);
+        if (rate > 0)
+            printf ("%-8s %-10s %.0f\n", r->name, r->tname, rate);
+        else
+            printf ("%-8s %-10s %s\n", r->name, r->tname, "unavailable");
+    }
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
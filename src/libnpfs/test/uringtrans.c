@@ -0,0 +1,261 @@
+/*************************************************************\
+ * Copyright (C) 2010 by Lawrence Livermore National Security, LLC.
+ *
+ * This file is part of npfs, a framework for 9P synthetic file systems.
+ * For details see https://sourceforge.net/projects/npfs.
+ *
+ * SPDX-License-Identifier: MIT
+ *************************************************************/
+
+/* io_uring transport
+ *
+ * The server end of a socketpair uses uringtrans and the client end
+ * fdtrans.  Requests larger than the receive buffers, long batches of
+ * responses, spliced Rreads, cancellation, and EOF are checked.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include "npfs.h"
+#include "npfsimpl.h"
+
+#include "src/libtap/tap.h"
+#include "src/libtest/conn.h"
+#include "src/libtest/thread.h"
+
+#define TEST_MSIZE  (2*1024*1024)
+#define NRESP       200
+#define BIGSIZE     (1024*1024)
+#define READSIZE    (512*1024)
+
+static u8 data[BIGSIZE];
+
+typedef struct {
+    Nptrans *trans;
+    Npfcall *fc[NRESP + 1];
+    int n;
+    int errors;
+} Peer;
+
+static void *send_proc (void *a)
+{
+    Peer *p = a;
+    int i;
+
+    for (i = 0; i < p->n; i++) {
+        if (np_trans_send (p->trans, p->fc[i]) != p->fc[i]->size)
+            p->errors++;
+    }
+    return NULL;
+}
+
+static void *recv_proc (void *a)
+{
+    Peer *p = a;
+    int i;
+
+    for (i = 0; i < p->n; i++) {
+        if (np_trans_recv (p->trans, &p->fc[i], TEST_MSIZE) < 0
+                                                        || !p->fc[i]) {
+            p->errors++;
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void *block_proc (void *a)
+{
+    Npfcall *fc = NULL;
+
+    (void)np_trans_recv ((Nptrans *)a, &fc, TEST_MSIZE);
+    np_free_fcall (fc);
+    return NULL;
+}
+
+/* The client sends small requests and Twrites of 64K and 1M, the
+ * latter larger than all receive buffers together.
+ */
+static void test_recv (Nptrans *t, Nptrans *ct)
+{
+    Peer p = { .trans = ct };
+    Npfcall *fc[6];
+    pthread_t thd;
+    int i, errors = 0;
+
+    p.fc[p.n++] = np_create_tgetattr (1, Gabasic);
+    p.fc[p.n++] = np_create_tgetattr (1, Gabasic);
+    p.fc[p.n++] = np_create_twrite (1, 0, 65536, data);
+    p.fc[p.n++] = np_create_twrite (1, 0, BIGSIZE, data);
+    p.fc[p.n++] = np_create_tgetattr (1, Gabasic);
+    for (i = 0; i < p.n; i++) {
+        if (!p.fc[i])
+            BAIL_OUT ("out of memory");
+        np_set_tag (p.fc[i], i + 1);
+    }
+    test_thread_create (&thd, send_proc, &p);
+    for (i = 0; i < p.n; i++) {
+        fc[i] = NULL;
+        if (np_trans_recv (t, &fc[i], TEST_MSIZE) < 0 || !fc[i]
+                                            || fc[i]->tag != i + 1)
+            errors++;
+    }
+    test_thread_join (thd, NULL);
+    ok (p.errors == 0 && errors == 0,
+        "received %d pipelined requests in order", p.n);
+    ok (fc[2] && fc[2]->type == Twrite && fc[2]->u.twrite.count == 65536
+              && memcmp (fc[2]->u.twrite.data, data, 65536) == 0
+              && test_page_aligned (fc[2]->u.twrite.data),
+        "64K Twrite is intact and its payload is page aligned");
+    ok (fc[3] && fc[3]->type == Twrite && fc[3]->u.twrite.count == BIGSIZE
+              && memcmp (fc[3]->u.twrite.data, data, BIGSIZE) == 0,
+        "1M Twrite larger than the receive buffers is intact");
+    for (i = 0; i < p.n; i++) {
+        np_free_fcall (p.fc[i]);
+        np_free_fcall (fc[i]);
+    }
+}
+
+/* The server sends one batch of more responses than fit in a chain,
+ * with a large Rread in the middle.
+ */
+static void test_sendv (Nptrans *t, Nptrans *ct)
+{
+    Peer p = { .trans = ct, .n = NRESP + 1 };
+    Npfcall *fc[NRESP + 1];
+    pthread_t thd;
+    int i, errors = 0;
+
+    for (i = 0; i < NRESP + 1; i++) {
+        fc[i] = i == NRESP / 2 ? np_create_rread (READSIZE, data)
+                               : np_create_rlerror (EIO);
+        if (!fc[i])
+            BAIL_OUT ("out of memory");
+        np_set_tag (fc[i], i);
+    }
+    test_thread_create (&thd, recv_proc, &p);
+    ok (np_trans_sendv (t, fc, NRESP + 1) > READSIZE,
+        "sent a batch of %d responses", NRESP + 1);
+    test_thread_join (thd, NULL);
+    for (i = 0; i < NRESP + 1; i++) {
+        if (!p.fc[i] || p.fc[i]->tag != i)
+            errors++;
+    }
+    ok (p.errors == 0 && errors == 0,
+        "client received all responses in order");
+    ok (p.fc[NRESP / 2] && p.fc[NRESP / 2]->type == Rread
+            && p.fc[NRESP / 2]->u.rread.count == READSIZE
+            && memcmp (p.fc[NRESP / 2]->u.rread.data, data, READSIZE) == 0,
+        "512K Rread in the batch is intact");
+    for (i = 0; i < NRESP + 1; i++) {
+        np_free_fcall (fc[i]);
+        np_free_fcall (p.fc[i]);
+    }
+}
+
+/* Spliced Rreads are created on a connection with a null transport
+ * that claims to splice, then sent between two ordinary responses.
+ */
+static void test_splice (Nptrans *t, Nptrans *ct)
+{
+    char path[] = "/tmp/uringtrans.XXXXXX";
+    Peer p = { .trans = ct, .n = 3 };
+    Npsrv *srv;
+    Nptrans *nt;
+    Npconn *conn;
+    Npfcall *fc[3];
+    pthread_t thd;
+    int i, fd;
+
+    if ((fd = mkstemp (path)) < 0)
+        BAIL_OUT ("mkstemp: %s", strerror (errno));
+    (void)unlink (path);
+    if (write (fd, data, READSIZE) != READSIZE)
+        BAIL_OUT ("write: %s", strerror (errno));
+    if (!(srv = np_srv_create (1, 0)))
+        BAIL_OUT ("np_srv_create: %s", strerror (np_rerror ()));
+    nt = test_null_trans (NULL, NULL);
+    nt->splice = t->splice;
+    if (!(conn = np_conn_create (srv, nt, "uringtrans-test-client", 0)))
+        BAIL_OUT ("np_conn_create: %s", strerror (np_rerror ()));
+
+    fc[0] = np_create_rlerror (EIO);
+    fc[1] = np_create_rread_splice (conn, fd, 0, READSIZE);
+    fc[2] = np_create_rlerror (EIO);
+    skip (!fc[1], 2, "splice is not supported on this platform");
+    for (i = 0; i < 3; i++)
+        np_set_tag (fc[i], i);
+    test_thread_create (&thd, recv_proc, &p);
+    ok (np_trans_sendv (t, fc, 3) > READSIZE,
+        "sent a spliced Rread between two responses");
+    test_thread_join (thd, NULL);
+    ok (p.errors == 0 && p.fc[0]->tag == 0 && p.fc[2]->tag == 2
+            && p.fc[1]->type == Rread && p.fc[1]->u.rread.count == READSIZE
+            && memcmp (p.fc[1]->u.rread.data, data, READSIZE) == 0,
+        "spliced Rread is received intact");
+    end_skip;
+    for (i = 0; i < 3; i++) {
+        np_free_fcall (fc[i]);
+        np_free_fcall (p.fc[i]);
+    }
+
+    close (fd);
+    test_null_shutdown ();
+    np_srv_wait_conncount (srv, 1);
+    np_srv_destroy (srv);
+}
+
+int main (int argc, char *argv[])
+{
+    Nptrans *t, *ct;
+    Npfcall *fc;
+    pthread_t thd;
+    int i, s[2];
+
+    for (i = 0; i < BIGSIZE; i++)
+        data[i] = i * 7;
+    if (socketpair (AF_LOCAL, SOCK_STREAM, 0, s) < 0)
+        BAIL_OUT ("socketpair: %s", strerror (errno));
+    if (!(t = np_uringtrans_create (s[1]))) {
+        if (np_rerror () != ENOSYS)
+            BAIL_OUT ("np_uringtrans_create: %s", strerror (np_rerror ()));
+        plan (SKIP_ALL, "io_uring is not available");
+        return 0;
+    }
+    plan (NO_PLAN);
+    if (!(ct = np_fdtrans_create (s[0], s[0])))
+        BAIL_OUT ("np_fdtrans_create: %s", strerror (np_rerror ()));
+    ok (t->pollfd == -1, "io_uring transport is not polled by the reactor");
+
+    test_recv (t, ct);
+    test_sendv (t, ct);
+    test_splice (t, ct);
+
+    test_thread_create (&thd, block_proc, t);
+    usleep (100000);
+    pthread_cancel (thd);
+    test_thread_join (thd, NULL);
+    ok (1, "a reader blocked in recv can be cancelled");
+
+    np_trans_destroy (ct); /* closes s[0] */
+    fc = (Npfcall *)1;
+    ok (np_trans_recv (t, &fc, TEST_MSIZE) == 0 && fc == NULL,
+        "recv returns EOF when the client closes");
+    np_trans_destroy (t); /* closes s[1] */
+
+    done_testing ();
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -35,8 +35,11 @@ np_trans_create(void *aux,
 	}
 
 	trans->aux = aux;
+	trans->pollfd = -1;
 	trans->recv = recv;
 	trans->send = send;
+	trans->sendv = NULL;
+	trans->splice = 0;
 	trans->destroy = destroy;
 
 	return trans;
@@ -56,6 +59,24 @@ np_trans_send (Nptrans *trans, Npfcall *fc)
 	return trans->send(fc, trans->aux);
 }
 
+/* Send 'n' fcalls in order, in one go if the transport supports it.
+ * Returns the number of bytes sent, or -1 on error.
+ */
+int
+np_trans_sendv (Nptrans *trans, Npfcall **fcs, int n)
+{
+	int i, len, total = 0;
+
+	if (trans->sendv)
+		return trans->sendv(fcs, n, trans->aux);
+	for (i = 0; i < n; i++) {
+		if ((len = trans->send(fcs[i], trans->aux)) < 0)
+			return -1;
+		total += len;
+	}
+	return total;
+}
+
 int
 np_trans_recv (Nptrans *trans, Npfcall **fcp, u32 msize)
 {
@@ -64,7 +85,7 @@ np_trans_recv (Nptrans *trans, Npfcall **fcp, u32 msize)
 	if (trans->recv (&fc, msize, trans->aux) < 0)
 		return -1;
 	if (fc && !np_deserialize(fc)) {
-		free (fc);
+		np_free_fcall (fc);
 		np_uerror (EPROTO);
 		return -1;
 	}
@@ -0,0 +1,182 @@
+/*************************************************************\
+ * Copyright (C) 2010 by Lawrence Livermore National Security, LLC.
+ *
+ * This file is part of npfs, a framework for 9P synthetic file systems.
+ * For details see https://sourceforge.net/projects/npfs.
+ *
+ * SPDX-License-Identifier: MIT
+ *************************************************************/
+
+/* uring.c - minimal io_uring support (see uring.h)
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include "npfs.h"
+#include "uring.h"
+
+#if HAVE_NP_URING
+#include <sys/mman.h>
+
+int
+np_uring_init(Npuring *u, unsigned entries, unsigned cq_entries)
+{
+	struct io_uring_params p;
+
+	memset(u, 0, sizeof(*u));
+	memset(&p, 0, sizeof(p));
+	if (cq_entries > 0) {
+		p.flags |= IORING_SETUP_CQSIZE;
+		p.cq_entries = cq_entries;
+	}
+	u->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (u->fd < 0) {
+		np_uerror(errno == EPERM || errno == EINVAL ? ENOSYS : errno);
+		return -1;
+	}
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_size = p.cq_off.cqes
+			  + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ((p.features & IORING_FEAT_SINGLE_MMAP)) {
+		if (u->cq_ring_size > u->sq_ring_size)
+			u->sq_ring_size = u->cq_ring_size;
+		u->cq_ring_size = 0;
+	}
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED)
+		goto error;
+	if (u->cq_ring_size > 0) {
+		u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, u->fd,
+				  IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED)
+			goto error;
+	} else
+		u->cq_ring = u->sq_ring;
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto error;
+
+	u->sq_head = (unsigned *)((u8 *)u->sq_ring + p.sq_off.head);
+	u->sq_tail = (unsigned *)((u8 *)u->sq_ring + p.sq_off.tail);
+	u->sq_array = (unsigned *)((u8 *)u->sq_ring + p.sq_off.array);
+	u->sq_mask = *(unsigned *)((u8 *)u->sq_ring + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->sq_local_tail = *u->sq_tail;
+	u->cq_head = (unsigned *)((u8 *)u->cq_ring + p.cq_off.head);
+	u->cq_tail = (unsigned *)((u8 *)u->cq_ring + p.cq_off.tail);
+	u->cq_mask = *(unsigned *)((u8 *)u->cq_ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((u8 *)u->cq_ring + p.cq_off.cqes);
+	return 0;
+error:
+	np_uerror(errno);
+	if (u->sq_ring && u->sq_ring != MAP_FAILED)
+		(void)munmap(u->sq_ring, u->sq_ring_size);
+	if (u->cq_ring_size > 0 && u->cq_ring && u->cq_ring != MAP_FAILED)
+		(void)munmap(u->cq_ring, u->cq_ring_size);
+	(void)close(u->fd);
+	u->fd = -1;
+	return -1;
+}
+
+void
+np_uring_fini(Npuring *u)
+{
+	if (u->fd < 0)
+		return;
+	(void)munmap(u->sqes, u->sqes_size);
+	if (u->cq_ring_size > 0)
+		(void)munmap(u->cq_ring, u->cq_ring_size);
+	(void)munmap(u->sq_ring, u->sq_ring_size);
+	(void)close(u->fd);
+	u->fd = -1;
+}
+
+struct io_uring_sqe *
+np_uring_get_sqe(Npuring *u)
+{
+	struct io_uring_sqe *sqe;
+	unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	unsigned idx;
+
+	if (u->sq_local_tail - head >= u->sq_entries)
+		return NULL;
+	idx = u->sq_local_tail & u->sq_mask;
+	sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[idx] = idx;
+	u->sq_local_tail++;
+	return sqe;
+}
+
+/* Queue prepared sqes and submit them, optionally waiting for
+ * 'wait' completions.  Returns 0 or -1 on error.
+ */
+int
+np_uring_enter(Npuring *u, unsigned wait)
+{
+	unsigned pending;
+	int rc;
+
+	__atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+	do {
+		pending = u->sq_local_tail
+			  - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+		rc = syscall(__NR_io_uring_enter, u->fd, pending, wait,
+			     wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (rc < 0 && errno == EINTR);
+	if (rc < 0) {
+		np_uerror(errno);
+		return -1;
+	}
+	return 0;
+}
+
+struct io_uring_cqe *
+np_uring_peek_cqe(Npuring *u)
+{
+	unsigned head = *u->cq_head;
+
+	if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &u->cqes[head & u->cq_mask];
+}
+
+void
+np_uring_cqe_seen(Npuring *u)
+{
+	__atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int
+np_uring_probe(Npuring *u, int op)
+{
+#ifdef IO_URING_OP_SUPPORTED
+	struct io_uring_probe *p;
+	size_t len = sizeof(*p) + 256 * sizeof(struct io_uring_probe_op);
+	int ok = 0;
+
+	if (!(p = calloc(1, len)))
+		return 0;
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PROBE,
+		    p, 256) == 0 && op <= p->last_op
+		    && (p->ops[op].flags & IO_URING_OP_SUPPORTED))
+		ok = 1;
+	free(p);
+	return ok;
+#else
+	return 0;
+#endif
+}
+
+#endif
@@ -0,0 +1,71 @@
+/*************************************************************\
+ * Copyright (C) 2010 by Lawrence Livermore National Security, LLC.
+ *
+ * This file is part of npfs, a framework for 9P synthetic file systems.
+ * For details see https://sourceforge.net/projects/npfs.
+ *
+ * SPDX-License-Identifier: MIT
+ *************************************************************/
+
+#ifndef LIBNPFS_URING_H
+#define LIBNPFS_URING_H
+
+/* Bare io_uring rings, set up and driven with raw syscalls, for
+ * uringtrans.c and diod's asynchronous file I/O.  A ring is not locked:
+ * each is used by one thread at a time.
+ *
+ * HAVE_NP_URING is defined if the system headers support io_uring.
+ */
+
+#if HAVE_LINUX_IO_URING_H
+#include <stddef.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#if defined(__NR_io_uring_setup)
+#define HAVE_NP_URING 1
+
+typedef struct {
+	int			fd;
+	void			*sq_ring;
+	size_t			sq_ring_size;
+	void			*cq_ring;
+	size_t			cq_ring_size;
+	struct io_uring_sqe	*sqes;
+	size_t			sqes_size;
+	unsigned		*sq_head;
+	unsigned		*sq_tail;
+	unsigned		*sq_array;
+	unsigned		sq_mask;
+	unsigned		sq_entries;
+	unsigned		sq_local_tail; /* sqes prepared, not yet queued */
+	unsigned		*cq_head;
+	unsigned		*cq_tail;
+	unsigned		cq_mask;
+	struct io_uring_cqe	*cqes;
+} Npuring;
+
+/* Returns 0, or -1 with np_rerror() set (ENOSYS if io_uring is
+ * unavailable or not permitted).  cq_entries may be 0 for the default.
+ */
+int np_uring_init(Npuring *u, unsigned entries, unsigned cq_entries);
+void np_uring_fini(Npuring *u);
+
+/* Returns a zeroed sqe, or NULL if the submission queue is full.
+ */
+struct io_uring_sqe *np_uring_get_sqe(Npuring *u);
+
+/* Submit prepared sqes, waiting for 'wait' completions.
+ */
+int np_uring_enter(Npuring *u, unsigned wait);
+struct io_uring_cqe *np_uring_peek_cqe(Npuring *u);
+void np_uring_cqe_seen(Npuring *u);
+
+/* Returns 1 if the kernel supports opcode 'op', else 0.
+ */
+int np_uring_probe(Npuring *u, int op);
+
+#endif
+#endif
+
+#endif
@@ -0,0 +1,588 @@
+/*************************************************************\
+ * Copyright (C) 2010 by Lawrence Livermore National Security, LLC.
+ *
+ * This file is part of npfs, a framework for 9P synthetic file systems.
+ * For details see https://sourceforge.net/projects/npfs.
+ *
+ * SPDX-License-Identifier: MIT
+ *************************************************************/
+
+/* uringtrans.c - socket transport driven by io_uring
+ *
+ * Each connection has two rings, so that its reader thread and the
+ * worker sending responses never share a submission queue.
+ *
+ * Receive: a single multishot recv picks buffers from a ring of
+ * UT_NBUFS provided buffers and posts one completion per chunk
+ * received, with no syscall per chunk.  Requests are framed as in
+ * fdtrans.c: each is copied out of the chunks into a right-sized fcall,
+ * a large Twrite into one with a page aligned payload, and buffers are
+ * handed back to the kernel as soon as they are consumed.  The reader
+ * waits for completions in poll(), so it can be cancelled by
+ * np_srv_shutdown() like any other reader thread.
+ *
+ * Send: a batch of responses is submitted as a chain of linked sends,
+ * with the payload of a spliced Rread (see splice.c) moved from its
+ * pipe by a linked splice, and the worker waits for the whole chain
+ * with one io_uring_enter().  If a link comes up short, the rest of the
+ * batch is finished with plain send() and splice().
+ *
+ * Connections on this transport are not multiplexed by the reactor
+ * (trans->pollfd is -1).  np_uringtrans_create() fails with ENOSYS if
+ * io_uring, multishot recv, or provided buffer rings are unavailable,
+ * and the caller should fall back to np_fdtrans_create().
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include "npfs.h"
+#include "npfsimpl.h"
+#include "uring.h"
+
+#if HAVE_NP_URING && defined(IORING_RECV_MULTISHOT)
+
+/* Provided receive buffers (a power of two) and their size.
+ */
+#define UT_NBUFS	16
+#define UT_BUFSIZE	16384
+
+/* Submission queue size of the send ring, i.e. the longest chain.
+ */
+#define UT_TXENTRIES	128
+
+#define UT_RECV		1
+#define UT_CANCEL	2
+
+typedef struct {
+	u16		bid;
+	u32		off;
+	u32		len;
+} Utchunk;
+
+typedef struct {
+	int		fd;
+	Npuring		rx;
+	Npuring		tx;
+	struct io_uring_buf_ring *br;
+	u8		*bufs;
+	u16		br_tail;
+	Utchunk		chunk[UT_NBUFS]; /* received, not yet consumed */
+	int		chead;
+	int		ccount;
+	u32		avail;	 /* bytes in chunk[] */
+	int		armed;	 /* multishot recv is active */
+	int		eof;
+	int		err;
+	Npfcall		*fc;	 /* partially received request, if any */
+	u32		fc_len;  /* used bytes in fc */
+} Uringtrans;
+
+typedef struct {
+	Npfcall		*fc;
+	int		pipe;	 /* op moves fc->pipe, not fc->pkt */
+	u32		len;
+} Utop;
+
+static int np_uringtrans_recv(Npfcall **fcp, u32 msize, void *a);
+static int np_uringtrans_send(Npfcall *fc, void *a);
+static int np_uringtrans_sendv(Npfcall **fcs, int n, void *a);
+static void np_uringtrans_destroy(void *a);
+
+/* Hand a receive buffer back to the kernel.
+ */
+static void
+_recv_recycle(Uringtrans *ut, u16 bid)
+{
+	struct io_uring_buf *b = &ut->br->bufs[ut->br_tail & (UT_NBUFS - 1)];
+
+	b->addr = (uintptr_t)(ut->bufs + bid * UT_BUFSIZE);
+	b->len = UT_BUFSIZE;
+	b->bid = bid;
+	ut->br_tail++;
+	__atomic_store_n(&ut->br->tail, ut->br_tail, __ATOMIC_RELEASE);
+}
+
+static int
+_recv_arm(Uringtrans *ut)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!(sqe = np_uring_get_sqe(&ut->rx))) {
+		np_uerror(EBUSY);
+		return -1;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = ut->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = UT_RECV;
+	if (np_uring_enter(&ut->rx, 0) < 0)
+		return -1;
+	ut->armed = 1;
+	return 0;
+}
+
+static void
+_recv_cqe(Uringtrans *ut, struct io_uring_cqe *cqe)
+{
+	Utchunk *ch;
+
+	if (cqe->user_data != UT_RECV)
+		return;
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		ut->armed = 0;
+	if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+		ch = &ut->chunk[(ut->chead + ut->ccount) % UT_NBUFS];
+		ch->bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		ch->off = 0;
+		ch->len = cqe->res;
+		ut->ccount++;
+		ut->avail += cqe->res;
+	} else if (cqe->res == 0)
+		ut->eof = 1;
+	else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED)
+		ut->err = -cqe->res;
+	/* N.B. on ENOBUFS, the recv is re-armed when more data is needed */
+}
+
+/* Wait for the next receive completion, or EOF or error.
+ */
+static int
+_recv_wait(Uringtrans *ut)
+{
+	struct io_uring_cqe *cqe;
+	struct pollfd pfd;
+	int got = 0;
+
+	for (;;) {
+		while ((cqe = np_uring_peek_cqe(&ut->rx))) {
+			_recv_cqe(ut, cqe);
+			np_uring_cqe_seen(&ut->rx);
+			got = 1;
+		}
+		if (got || ut->eof || ut->err)
+			return 0;
+		if (!ut->armed && _recv_arm(ut) < 0)
+			return -1;
+		pfd.fd = ut->rx.fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+			np_uerror(errno);
+			return -1;
+		}
+	}
+}
+
+/* Copy up to len received bytes to dst, consuming them if 'consume'
+ * is set.  Returns the number of bytes copied.
+ */
+static u32
+_recv_copy(Uringtrans *ut, u8 *dst, u32 len, int consume)
+{
+	int i = ut->chead, c = ut->ccount;
+	u32 n, total = 0;
+	Utchunk *ch;
+
+	while (total < len && c > 0) {
+		ch = &ut->chunk[i];
+		n = ch->len;
+		if (n > len - total)
+			n = len - total;
+		memcpy(dst + total, ut->bufs + ch->bid * UT_BUFSIZE + ch->off, n);
+		total += n;
+		if (!consume) {
+			i = (i + 1) % UT_NBUFS;
+			c--;
+			continue;
+		}
+		ch->off += n;
+		ch->len -= n;
+		ut->avail -= n;
+		if (ch->len == 0) {
+			_recv_recycle(ut, ch->bid);
+			ut->chead = i = (i + 1) % UT_NBUFS;
+			ut->ccount = --c;
+		}
+	}
+	return total;
+}
+
+Nptrans *
+np_uringtrans_create(int fd)
+{
+	Nptrans *npt;
+	Uringtrans *ut;
+	struct io_uring_buf_reg reg;
+	int i;
+
+	if (!(ut = malloc(sizeof(*ut)))) {
+		np_uerror(ENOMEM);
+		return NULL;
+	}
+	memset(ut, 0, sizeof(*ut));
+	ut->fd = fd;
+	ut->rx.fd = ut->tx.fd = -1;
+	/* N.B. room for a completion per receive buffer */
+	if (np_uring_init(&ut->rx, 4, 2 * UT_NBUFS) < 0
+			|| np_uring_init(&ut->tx, UT_TXENTRIES, 0) < 0)
+		goto error;
+	if ((i = posix_memalign((void **)&ut->br, sysconf(_SC_PAGESIZE),
+				UT_NBUFS * sizeof(struct io_uring_buf)))) {
+		ut->br = NULL;
+		np_uerror(i);
+		goto error;
+	}
+	memset(ut->br, 0, UT_NBUFS * sizeof(struct io_uring_buf));
+	if (!(ut->bufs = malloc(UT_NBUFS * UT_BUFSIZE))) {
+		np_uerror(ENOMEM);
+		goto error;
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)ut->br;
+	reg.ring_entries = UT_NBUFS;
+	reg.bgid = 0;
+	if (syscall(__NR_io_uring_register, ut->rx.fd,
+		    IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		np_uerror(errno == EINVAL ? ENOSYS : errno);
+		goto error;
+	}
+	for (i = 0; i < UT_NBUFS; i++)
+		_recv_recycle(ut, i);
+
+	npt = np_trans_create(ut, np_uringtrans_recv,
+				  np_uringtrans_send,
+				  np_uringtrans_destroy);
+	if (!npt)
+		goto error;
+	npt->sendv = np_uringtrans_sendv;
+#ifdef HAVE_SPLICE
+	npt->splice = 1;
+#endif
+	/* N.B. the multishot recv is armed by the first np_trans_recv(),
+	 * so its completions are run by the reader thread.
+	 */
+	return npt;
+error:
+	ut->fd = -1; /* caller still owns fd */
+	np_uringtrans_destroy(ut);
+	return NULL;
+}
+
+/* Cancel the multishot recv and wait for it to finish, so the kernel
+ * is done with the receive buffers before they are freed.
+ * Returns 0 on success, -1 if it did not finish.
+ */
+static int
+_recv_cancel(Uringtrans *ut)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct pollfd pfd;
+	int tries = 0;
+
+	if (!ut->armed)
+		return 0;
+	if ((sqe = np_uring_get_sqe(&ut->rx))) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = UT_RECV;
+		sqe->user_data = UT_CANCEL;
+		(void)np_uring_enter(&ut->rx, 0);
+	}
+	while (ut->armed && tries < 10) {
+		while ((cqe = np_uring_peek_cqe(&ut->rx))) {
+			if (cqe->user_data == UT_RECV
+					&& !(cqe->flags & IORING_CQE_F_MORE))
+				ut->armed = 0;
+			np_uring_cqe_seen(&ut->rx);
+		}
+		if (!ut->armed)
+			break;
+		pfd.fd = ut->rx.fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 100) == 0)
+			tries++;
+	}
+	return ut->armed ? -1 : 0;
+}
+
+static void
+np_uringtrans_destroy(void *a)
+{
+	Uringtrans *ut = (Uringtrans *)a;
+	int leak = 0;
+
+	if (ut->rx.fd >= 0)
+		leak = (_recv_cancel(ut) < 0);
+	np_uring_fini(&ut->rx);
+	np_uring_fini(&ut->tx);
+	if (ut->fd >= 0)
+		(void)close(ut->fd);
+	/* N.B. if the recv could not be stopped, leave the buffers be */
+	if (!leak) {
+		free(ut->br);
+		free(ut->bufs);
+	}
+	if (ut->fc)
+		np_free_fcall(ut->fc);
+	free(ut);
+}
+
+/* Return one request or EOF/error, as fdtrans.c::np_fdtrans_recv() does.
+ */
+static int
+np_uringtrans_recv(Npfcall **fcp, u32 msize, void *a)
+{
+	Uringtrans *ut = (Uringtrans *)a;
+	u8 hdr[5];
+	u32 size;
+
+	if (ut->fc)
+		goto readrest;
+	/* N.B. peek at size[4] and type[1] */
+	while (ut->avail < 5) {
+		if (ut->err) {
+			np_uerror(ut->err);
+			return -1;
+		}
+		if (ut->eof)
+			goto eof;
+		if (_recv_wait(ut) < 0)
+			return -1;
+	}
+	(void)_recv_copy(ut, hdr, 5, 0);
+	size = np_peek_size(hdr, 4);
+	if (size > msize || size < 7) {
+		np_uerror(EPROTO);
+		return -1;
+	}
+	if (size >= TWRITE_HDRSIZE + TWRITE_ALIGN_MIN && hdr[4] == Twrite)
+		ut->fc = np_alloc_fcall_aligned(size, TWRITE_HDRSIZE);
+	else
+		ut->fc = np_alloc_fcall(size);
+	if (!ut->fc)
+		return -1;
+	ut->fc_len = 0;
+readrest:
+	size = ut->fc->size;
+	for (;;) {
+		ut->fc_len += _recv_copy(ut, ut->fc->pkt + ut->fc_len,
+					 size - ut->fc_len, 1);
+		if (ut->fc_len == size)
+			break;
+		if (ut->err) {
+			np_uerror(ut->err);
+			goto error;
+		}
+		if (ut->eof)
+			goto eof;
+		if (_recv_wait(ut) < 0)
+			goto error;
+	}
+	*fcp = ut->fc;
+	ut->fc = NULL;
+	return 0;
+eof:
+	if (ut->fc) {
+		np_free_fcall(ut->fc);
+		ut->fc = NULL;
+	}
+	*fcp = NULL;
+	return 0;
+error:
+	np_free_fcall(ut->fc);
+	ut->fc = NULL;
+	return -1;
+}
+
+/* Write all of buf, waiting if the socket is full.
+ */
+static int
+_send_all(int fd, u8 *buf, u32 len)
+{
+	u32 done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = send(fd, buf + done, len - done, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+
+			(void)poll(&pfd, 1, -1);
+			continue;
+		}
+		if (n < 0) {
+			np_uerror(errno);
+			return -1;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+/* Move what is left in a spliced Rread's pipe to fd.
+ */
+static int
+_splice_all(Nppipe *p, int fd)
+{
+#ifdef HAVE_SPLICE
+	ssize_t n;
+
+	while (p->len > 0) {
+		n = splice(p->fd[0], NULL, fd, NULL, p->len, SPLICE_F_MOVE);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+
+			(void)poll(&pfd, 1, -1);
+			continue;
+		}
+		if (n <= 0) {
+			np_uerror(n < 0 ? errno : EIO);
+			return -1;
+		}
+		p->len -= n;
+	}
+	return 0;
+#else
+	np_uerror(ENOSYS);
+	return -1;
+#endif
+}
+
+/* Submit ops[0..n-1] as one linked chain and wait for all of it.
+ * Whatever a short or cancelled link left unsent is sent synchronously.
+ * Returns bytes sent or -1 on error.
+ */
+static int
+_send_chain(Uringtrans *ut, Utop *ops, int n)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int res[UT_TXENTRIES];
+	int i, ndone = 0, total = 0;
+	u32 done;
+
+	for (i = 0; i < n; i++) {
+		sqe = np_uring_get_sqe(&ut->tx); /* N.B. n <= UT_TXENTRIES */
+		if (ops[i].pipe) {
+#ifdef HAVE_SPLICE
+			sqe->opcode = IORING_OP_SPLICE;
+			sqe->splice_fd_in = ops[i].fc->pipe->fd[0];
+			sqe->splice_off_in = (u64)-1;
+			sqe->off = (u64)-1;
+			sqe->splice_flags = SPLICE_F_MOVE;
+#endif
+		} else {
+			sqe->opcode = IORING_OP_SEND;
+			sqe->addr = (uintptr_t)ops[i].fc->pkt;
+			sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+		}
+		sqe->fd = ut->fd;
+		sqe->len = ops[i].len;
+		sqe->user_data = i;
+		if (i < n - 1)
+			sqe->flags = IOSQE_IO_LINK;
+		res[i] = -ECANCELED;
+	}
+	if (np_uring_enter(&ut->tx, n) < 0)
+		return -1;
+	while (ndone < n) {
+		while ((cqe = np_uring_peek_cqe(&ut->tx))) {
+			if (cqe->user_data < n)
+				res[cqe->user_data] = cqe->res;
+			np_uring_cqe_seen(&ut->tx);
+			ndone++;
+		}
+		if (ndone < n && np_uring_enter(&ut->tx, 1) < 0)
+			return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (res[i] < 0 && res[i] != -ECANCELED && res[i] != -EAGAIN
+			       && res[i] != -EINTR) {
+			np_uerror(-res[i]);
+			return -1;
+		}
+		done = res[i] > 0 ? res[i] : 0;
+		if (ops[i].pipe)
+			ops[i].fc->pipe->len -= done;
+		if (done < ops[i].len) {
+			if (ops[i].pipe) {
+				if (_splice_all(ops[i].fc->pipe, ut->fd) < 0)
+					return -1;
+			} else if (_send_all(ut->fd, ops[i].fc->pkt + done,
+					     ops[i].len - done) < 0)
+				return -1;
+		}
+		total += ops[i].len;
+	}
+	return total;
+}
+
+static int
+np_uringtrans_sendv(Npfcall **fcs, int n, void *a)
+{
+	Uringtrans *ut = (Uringtrans *)a;
+	Utop ops[UT_TXENTRIES];
+	int i, len, nops = 0, total = 0;
+
+	for (i = 0; i < n; i++) {
+		if (nops + 2 > UT_TXENTRIES) {
+			if ((len = _send_chain(ut, ops, nops)) < 0)
+				return -1;
+			total += len;
+			nops = 0;
+		}
+		ops[nops].fc = fcs[i];
+		ops[nops].pipe = 0;
+		ops[nops].len = fcs[i]->size;
+		if (fcs[i]->pipe) {
+			ops[nops].len -= fcs[i]->pipe->len;
+			nops++;
+			ops[nops].fc = fcs[i];
+			ops[nops].pipe = 1;
+			ops[nops].len = fcs[i]->pipe->len;
+		}
+		nops++;
+	}
+	if (nops > 0) {
+		if ((len = _send_chain(ut, ops, nops)) < 0)
+			return -1;
+		total += len;
+	}
+	return total;
+}
+
+static int
+np_uringtrans_send(Npfcall *fc, void *a)
+{
+	return np_uringtrans_sendv(&fc, 1, a);
+}
+
+#else
+
+Nptrans *
+np_uringtrans_create(int fd)
+{
+	np_uerror(ENOSYS);
+	return NULL;
+}
+
+#endif
@@ -168,7 +168,6 @@ _free_user (Npuser *u)
 		free (u->uname);
 	if (u->sg)
 		free (u->sg);
-	pthread_mutex_destroy(&u->lock);
 	free (u);
 }
 
@@ -178,9 +177,7 @@ np_user_incref(Npuser *u)
 	if (!u)
 		return;
 
-	xpthread_mutex_lock (&u->lock);
-	u->refcount++;
-	xpthread_mutex_unlock (&u->lock);
+	__atomic_add_fetch (&u->refcount, 1, __ATOMIC_RELAXED);
 }
 
 void
@@ -191,9 +188,8 @@ np_user_decref(Npuser *u)
 	if (!u)
 		return;
 
-	xpthread_mutex_lock (&u->lock);
-	n = --u->refcount;
-	xpthread_mutex_unlock (&u->lock);
+	n = __atomic_sub_fetch (&u->refcount, 1, __ATOMIC_ACQ_REL);
+	NP_ASSERT (n >= 0);
 	if (n > 0)
 		return;
 	_free_user (u);
@@ -254,7 +250,6 @@ _alloc_user (Npsrv *srv, struct passwd *pwd)
 	u->gid = pwd->pw_gid;
 	if (u->uid != 0 && _getgrouplist(srv, u) < 0)
 		goto error;
-	pthread_mutex_init (&u->lock, NULL);
 	u->refcount = 0;
 	u->t = time (NULL);
 	u->next = NULL;
@@ -306,7 +301,6 @@ _alloc_nouserdb (Npsrv *srv, uid_t uid, char *name)
 		goto error;
 	}
 	u->sg[0] = u->gid;
-	pthread_mutex_init (&u->lock, NULL);
 	if (srv->flags & SRV_FLAGS_DEBUG_USER)
 		np_logmsg (srv, "user lookup: %d", u->uid);
 	u->refcount = 0;
@@ -412,9 +406,9 @@ np_uname2user (Npsrv *srv, char *uname)
 	if (!(u = _usercache_lookup (srv, uname, NONUNAME)))
 		if ((u = _real_lookup_byname (srv, uname)))
 			_usercache_add (srv, u);
-	xpthread_mutex_unlock (&uc->lock);
 	if (u)
 		np_user_incref (u);
+	xpthread_mutex_unlock (&uc->lock);
 	return u;
 }
 
@@ -428,9 +422,9 @@ np_uid2user (Npsrv *srv, uid_t uid)
 	if (!(u = _usercache_lookup (srv, NULL, uid)))
 		if ((u = _real_lookup_byuid (srv, uid)))
 			_usercache_add (srv, u);
-	xpthread_mutex_unlock (&uc->lock);
 	if (u)
 		np_user_incref (u);
+	xpthread_mutex_unlock (&uc->lock);
 	return u;
 }
 
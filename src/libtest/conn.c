@@ -0,0 +1,202 @@
+/************************************************************\
+ * Copyright 2025 Lawrence Livermore National Security, LLC
+ * (c.f. AUTHORS, NOTICE.LLNS, COPYING)
+ *
+ * This file is part of the diod 9P server project.
+ * For details, see https://github.com/chaos/diod.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+\************************************************************/
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <sys/socket.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "src/libnpfs/npfs.h"
+#include "src/libnpfs/npfsimpl.h"
+#include "src/libtap/tap.h"
+
+#include "thread.h"
+#include "conn.h"
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int held;
+static int active;
+static int attaches;
+static int shutdown_null;
+
+Npfcall *test_attach (Npfid *fid, Npfid *afid, Npstr *aname)
+{
+    Npqid qid = { .type = Qtdir, .version = 0, .path = 1 };
+
+    test_lock (&lock);
+    attaches++;
+    active++;
+    pthread_cond_broadcast (&cond);
+    while (held)
+        test_condwait (&cond, &lock);
+    active--;
+    test_unlock (&lock);
+
+    return np_create_rattach (&qid);
+}
+
+Npfcall *test_clunk (Npfid *fid)
+{
+    return np_create_rclunk ();
+}
+
+void test_attach_hold (void)
+{
+    test_lock (&lock);
+    held = 1;
+    test_unlock (&lock);
+}
+
+void test_attach_release (void)
+{
+    test_lock (&lock);
+    held = 0;
+    pthread_cond_broadcast (&cond);
+    test_unlock (&lock);
+}
+
+int test_attach_wait (int want)
+{
+    struct timespec ts;
+    int n;
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_sec += 5;
+    test_lock (&lock);
+    while (active < want) {
+        if (pthread_cond_timedwait (&cond, &lock, &ts) == ETIMEDOUT)
+            break;
+    }
+    n = active;
+    test_unlock (&lock);
+    return n;
+}
+
+int test_attach_active (void)
+{
+    int n;
+
+    test_lock (&lock);
+    n = active;
+    test_unlock (&lock);
+    return n;
+}
+
+int test_attach_count (void)
+{
+    int n;
+
+    test_lock (&lock);
+    n = attaches;
+    test_unlock (&lock);
+    return n;
+}
+
+char *test_get_ctl (Npsrv *srv, char *name)
+{
+    Npfile *f;
+
+    for (f = srv->ctlroot->child; f != NULL; f = f->next) {
+        if (!strcmp (f->name, name))
+            return f->getf (f->name, f->getf_arg);
+    }
+    return NULL;
+}
+
+Nptrans *test_connect_client (Npsrv *srv, char *name, u32 msize, int *fdp)
+{
+    int s[2];
+    Nptrans *trans, *ctrans;
+    Npfcall *tc, *rc = NULL;
+
+    if (socketpair (AF_LOCAL, SOCK_STREAM, 0, s) < 0)
+        BAIL_OUT ("socketpair: %s", strerror (errno));
+    if (!(trans = np_fdtrans_create (s[1], s[1])))
+        BAIL_OUT ("np_fdtrans_create: %s", strerror (np_rerror ()));
+    /* N.B. trans is destroyed in np_conn_create on failure */
+    if (!np_conn_create (srv, trans, name, 0))
+        BAIL_OUT ("np_conn_create: %s", strerror (np_rerror ()));
+    if (!(ctrans = np_fdtrans_create (s[0], s[0])))
+        BAIL_OUT ("np_fdtrans_create: %s", strerror (np_rerror ()));
+    if (!(tc = np_create_tversion (msize, "9P2000.L")))
+        BAIL_OUT ("out of memory");
+    np_set_tag (tc, 0);
+    if (np_trans_send (ctrans, tc) < 0
+            || np_trans_recv (ctrans, &rc, msize) < 0
+            || !rc || rc->type != Rversion)
+        BAIL_OUT ("version handshake failed");
+    np_free_fcall (tc);
+    np_free_fcall (rc);
+    if (fdp)
+        *fdp = s[0];
+    return ctrans;
+}
+
+static int null_recv (Npfcall **fcp, u32 msize, void *a)
+{
+    test_lock (&lock);
+    while (!shutdown_null)
+        test_condwait (&cond, &lock);
+    test_unlock (&lock);
+    *fcp = NULL;
+    return 0;
+}
+
+static int null_send (Npfcall *fc, void *a)
+{
+    return fc->size;
+}
+
+Nptrans *test_null_trans (int (*send)(Npfcall *, void *), void *arg)
+{
+    Nptrans *trans;
+
+    if (!(trans = np_trans_create (arg, null_recv, send ? send : null_send,
+                                   NULL)))
+        BAIL_OUT ("np_trans_create: %s", strerror (np_rerror ()));
+    return trans;
+}
+
+void test_null_shutdown (void)
+{
+    test_lock (&lock);
+    shutdown_null = 1;
+    pthread_cond_broadcast (&cond);
+    test_unlock (&lock);
+}
+
+void test_add_req (Npsrv *srv, Npconn *conn, Npfcall *tc, u16 tag)
+{
+    Npreq *req;
+
+    if (!tc)
+        BAIL_OUT ("out of memory");
+    np_set_tag (tc, tag);
+    if (!(req = np_req_alloc (conn, tc)))
+        BAIL_OUT ("out of memory");
+    if (np_srv_add_req (srv, req) < 0)
+        BAIL_OUT ("np_srv_add_req: %s", strerror (np_rerror ()));
+}
+
+int test_page_aligned (void *p)
+{
+    return (uintptr_t)p % sysconf (_SC_PAGESIZE) == 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,66 @@
+/************************************************************\
+ * Copyright 2025 Lawrence Livermore National Security, LLC
+ * (c.f. AUTHORS, NOTICE.LLNS, COPYING)
+ *
+ * This file is part of the diod 9P server project.
+ * For details, see https://github.com/chaos/diod.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+\************************************************************/
+
+#ifndef LIBTEST_CONN_H
+#define LIBTEST_CONN_H
+
+#include "src/libnpfs/npfs.h"
+
+/* Helpers for tests that drive a bare libnpfs server (no diod),
+ * which call BAIL_OUT internally on failure.
+ */
+
+/* srv->attach and srv->clunk hooks that succeed.  Between
+ * test_attach_hold () and test_attach_release (), test_attach () blocks.
+ * test_attach_wait () waits up to 5s for 'want' attaches to be in
+ * progress and returns the number that are, as does test_attach_active ()
+ * without waiting.  test_attach_count () returns the number of attaches
+ * started since the program began.
+ */
+Npfcall *test_attach (Npfid *fid, Npfid *afid, Npstr *aname);
+Npfcall *test_clunk (Npfid *fid);
+void test_attach_hold (void);
+void test_attach_release (void);
+int test_attach_wait (int want);
+int test_attach_active (void);
+int test_attach_count (void);
+
+/* Return the contents of ctl file 'name' (caller must free), or NULL.
+ */
+char *test_get_ctl (Npsrv *srv, char *name);
+
+/* Create a connection to 'srv' named 'name' over a socketpair and return
+ * the client's transport after a 9P2000.L version handshake.  If 'fdp'
+ * is non-NULL, it is set to the client's socket.
+ */
+Nptrans *test_connect_client (Npsrv *srv, char *name, u32 msize, int *fdp);
+
+/* Create a transport for a connection whose requests are injected with
+ * test_add_req ().  Its recv blocks until test_null_shutdown (), which
+ * applies to all such transports.  Responses go to 'send' with 'arg',
+ * or are discarded if 'send' is NULL.
+ */
+Nptrans *test_null_trans (int (*send)(Npfcall *, void *), void *arg);
+void test_null_shutdown (void);
+
+/* Queue request 'tc' (BAIL_OUT if NULL) with 'tag' on 'conn'.
+ */
+void test_add_req (Npsrv *srv, Npconn *conn, Npfcall *tc, u16 tag);
+
+/* Return nonzero if 'p' is page aligned, e.g. the data of a Twrite
+ * received by a transport that aligns it for direct I/O.
+ */
+int test_page_aligned (void *p);
+
+#endif
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */